@@ -0,0 +1,112 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "arena.h"
+
+using namespace std;
+
+namespace wg
+{
+	secure_arena::secure_arena() :
+		m_base(NULL),
+		m_size(0),
+		m_classes{
+			{ 0x1000, 32 },
+			{ 0x4000, 16 },
+			{ 0x10000, 8 }, // Pipe message buffer
+			{ 0x40000, 4 },
+		},
+		m_locked(false)
+	{
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		size_t page = si.dwPageSize, locked_size = 0;
+		for (auto& c : m_classes)
+		{
+			c.stride = (c.size + page - 1) / page * page + page;
+			m_size += c.stride * c.count;
+			locked_size += (c.stride - page) * c.count;
+		}
+		m_base = static_cast<unsigned char*>(VirtualAlloc(NULL, m_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+		if (!m_base)
+		{
+			// Everything goes to the heap.
+			m_size = 0;
+			return;
+		}
+
+		// Grow working set so the slots can be locked.
+		SIZE_T ws_min, ws_max;
+		m_locked =
+			GetProcessWorkingSetSize(GetCurrentProcess(), &ws_min, &ws_max) &&
+			SetProcessWorkingSetSize(GetCurrentProcess(), ws_min + locked_size, ws_max + locked_size);
+
+		auto slot = m_base;
+		for (auto& c : m_classes)
+		{
+			c.base = slot;
+			c.free.reserve(c.count);
+			for (size_t i = 0; i < c.count; ++i, slot += c.stride)
+			{
+				DWORD old_protect;
+				VirtualProtect(slot + c.stride - page, page, PAGE_NOACCESS, &old_protect);
+				if (m_locked && !VirtualLock(slot, c.stride - page))
+					m_locked = false;
+				c.free.push_back(slot);
+			}
+		}
+	}
+
+	secure_arena::~secure_arena()
+	{
+		if (m_base)
+			VirtualFree(m_base, 0, MEM_RELEASE);
+	}
+
+	secure_arena& secure_arena::instance()
+	{
+		// Never destroyed: static containers and thread locals may still free into the arena after exit() runs destructors.
+		static secure_arena& arena = *new secure_arena;
+		return arena;
+	}
+
+	void* secure_arena::allocate(_In_ size_t size)
+	{
+		{
+			srwlock::exclusive lock(m_lock);
+			for (auto& c : m_classes)
+				if (size <= c.size && !c.free.empty())
+				{
+					auto p = c.free.back();
+					c.free.pop_back();
+					return p;
+				}
+		}
+		return ::operator new(size);
+	}
+
+	void secure_arena::deallocate(_In_ void* p, _In_ size_t size) noexcept
+	{
+		if (!p)
+			return;
+		SecureZeroMemory(p, size);
+		auto b = static_cast<unsigned char*>(p);
+		if (b < m_base || b >= m_base + m_size)
+		{
+			::operator delete(p);
+			return;
+		}
+		srwlock::exclusive lock(m_lock);
+		for (auto& c : m_classes)
+			if (b < c.base + c.stride * c.count)
+			{
+				c.free.push_back(p);
+				return;
+			}
+	}
+}
@@ -0,0 +1,80 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "srwlock.h"
+#include <Windows.h>
+#include <limits>
+#include <new>
+#include <vector>
+
+namespace wg
+{
+	// Process-wide pool of memory locked against paging for buffers carrying key material
+	//
+	// Slots of a few size classes are allocated once and reused. Each slot is followed by a no-access guard page.
+	// Slots are wiped once on release. Requests that do not fit a free slot fall back to the heap and are wiped on release too.
+	class secure_arena
+	{
+	private:
+		struct size_class
+		{
+			size_t size;               // Slot size in bytes
+			size_t count;              // Number of slots
+			unsigned char* base;       // First slot
+			size_t stride;             // Slot size including its guard page
+			std::vector<void*> free;   // Free slots
+		};
+
+		srwlock m_lock;
+		unsigned char* m_base;
+		size_t m_size;
+		size_class m_classes[4];
+		bool m_locked;
+
+		secure_arena();
+		~secure_arena();
+		secure_arena(const secure_arena&) = delete;
+		secure_arena& operator=(const secure_arena&) = delete;
+
+	public:
+		static secure_arena& instance();
+
+		void* allocate(_In_ size_t size);
+		void deallocate(_In_ void* p, _In_ size_t size) noexcept;
+
+		// Returns true when slots are locked in memory.
+		bool locked() const noexcept { return m_locked; }
+	};
+
+	// STL allocator on secure_arena
+	template <class T>
+	class secure_allocator
+	{
+	public:
+		typedef T value_type;
+
+		secure_allocator() noexcept {}
+		template <class U> secure_allocator(const secure_allocator<U>&) noexcept {}
+
+		T* allocate(_In_ size_t n)
+		{
+			if (n > (std::numeric_limits<size_t>::max)() / sizeof(T))
+				throw std::bad_alloc();
+			return static_cast<T*>(secure_arena::instance().allocate(n * sizeof(T)));
+		}
+
+		void deallocate(_In_ T* p, _In_ size_t n) noexcept
+		{
+			secure_arena::instance().deallocate(p, n * sizeof(T));
+		}
+
+		template <class U> bool operator==(const secure_allocator<U>&) const noexcept { return true; }
+		template <class U> bool operator!=(const secure_allocator<U>&) const noexcept { return false; }
+	};
+}
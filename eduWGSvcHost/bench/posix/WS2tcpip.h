@@ -0,0 +1,116 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+// The part of WS2tcpip.h the portable sources use, for building the benchmarks in this folder on POSIX.
+
+#pragma once
+
+#include <Windows.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+typedef int SOCKET;
+typedef sockaddr SOCKADDR;
+typedef uint16_t ADDRESS_FAMILY;
+typedef in_addr IN_ADDR;
+typedef in6_addr IN6_ADDR;
+
+// Winsock layout, where ai_addrlen is a size_t.
+typedef struct addrinfoW
+{
+	int ai_flags, ai_family, ai_socktype, ai_protocol;
+	size_t ai_addrlen;
+	wchar_t* ai_canonname;
+	sockaddr* ai_addr;
+	addrinfoW* ai_next;
+} ADDRINFOW, *PADDRINFOW;
+
+typedef union
+{
+	sockaddr_in Ipv4;
+	sockaddr_in6 Ipv6;
+	ADDRESS_FAMILY si_family;
+} SOCKADDR_INET;
+
+#define WSAAPI
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define WSAECONNRESET ECONNREFUSED
+#define WSAHOST_NOT_FOUND 11001
+
+inline int WSAGetLastError() { return errno; }
+inline int closesocket(SOCKET s) { return close(s); }
+inline int InetPtonA(int family, const char* str, void* addr) { return inet_pton(family, str, addr); }
+inline const char* InetNtopA(int family, const void* addr, char* str, size_t size) { return inet_ntop(family, addr, str, (socklen_t)size); }
+
+// Winsock takes int lengths and ignores the first argument of select().
+
+inline int recvfrom(SOCKET s, char* buf, int len, int flags, SOCKADDR* from, int* from_len)
+{
+	socklen_t n = (socklen_t)*from_len;
+	int r = (int)::recvfrom(s, buf, (size_t)len, flags, from, &n);
+	*from_len = (int)n;
+	return r;
+}
+
+inline int getsockname(SOCKET s, SOCKADDR* name, int* name_len)
+{
+	socklen_t n = (socklen_t)*name_len;
+	int r = ::getsockname(s, name, &n);
+	*name_len = (int)n;
+	return r;
+}
+
+inline int posix_select(int, fd_set* read_fds, fd_set* write_fds, fd_set* except_fds, const timeval* timeout)
+{
+	timeval t = *timeout;
+	return ::select(FD_SETSIZE, read_fds, write_fds, except_fds, &t);
+}
+#define select posix_select
+
+inline int GetAddrInfoW(const wchar_t* host, const wchar_t*, const ADDRINFOW* hints, PADDRINFOW* result)
+{
+	std::string name;
+	for (; *host; ++host)
+		name += (char)*host;
+	addrinfo h = {}, *list;
+	if (hints)
+	{
+		h.ai_flags = hints->ai_flags;
+		h.ai_family = hints->ai_family;
+		h.ai_socktype = hints->ai_socktype;
+		h.ai_protocol = hints->ai_protocol;
+	}
+	if (getaddrinfo(name.c_str(), NULL, &h, &list))
+		return WSAHOST_NOT_FOUND;
+	PADDRINFOW* tail = result;
+	for (auto ai = list; ai; ai = ai->ai_next)
+	{
+		auto w = new ADDRINFOW{ ai->ai_flags, ai->ai_family, ai->ai_socktype, ai->ai_protocol, ai->ai_addrlen, NULL, (sockaddr*)new sockaddr_storage{}, NULL };
+		memcpy(w->ai_addr, ai->ai_addr, ai->ai_addrlen);
+		*tail = w;
+		tail = &w->ai_next;
+	}
+	*tail = NULL;
+	freeaddrinfo(list);
+	return 0;
+}
+
+inline void FreeAddrInfoW(PADDRINFOW ai)
+{
+	while (ai)
+	{
+		auto next = ai->ai_next;
+		delete (sockaddr_storage*)ai->ai_addr;
+		delete ai;
+		ai = next;
+	}
+}
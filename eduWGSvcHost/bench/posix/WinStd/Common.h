@@ -0,0 +1,110 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+// The part of WinStd the portable sources use, for building the benchmarks in this folder on POSIX.
+
+#pragma once
+
+#include <Windows.h>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace winstd
+{
+	inline std::string string_printf(_In_z_ const char* format, ...)
+	{
+		va_list args, args_copy;
+		va_start(args, format);
+		va_copy(args_copy, args);
+		int len = vsnprintf(NULL, 0, format, args);
+		va_end(args);
+		std::string str(len > 0 ? (size_t)len : 0, 0);
+		if (len > 0)
+			vsnprintf(&str[0], (size_t)len + 1, format, args_copy);
+		va_end(args_copy);
+		return str;
+	}
+
+	class win_runtime_error : public std::runtime_error
+	{
+	private:
+		DWORD m_num;
+
+	public:
+		win_runtime_error(_In_ DWORD num, _In_z_ const char* msg) : std::runtime_error(msg), m_num(num) {}
+		win_runtime_error(_In_z_ const char* msg) : std::runtime_error(msg), m_num(GetLastError()) {}
+
+		DWORD number() const noexcept { return m_num; }
+	};
+
+	template <class T>
+	class sanitizing_allocator : public std::allocator<T>
+	{
+	public:
+		template <class U> struct rebind { typedef sanitizing_allocator<U> other; };
+
+		sanitizing_allocator() noexcept {}
+		template <class U> sanitizing_allocator(const sanitizing_allocator<U>&) noexcept {}
+
+		void deallocate(_In_ T* p, _In_ size_t n)
+		{
+			SecureZeroMemory(p, n * sizeof(T));
+			std::allocator<T>::deallocate(p, n);
+		}
+	};
+
+	// Handle closed by free_internal(). INVAL is an integer, as GCC's NULL does not convert to a pointer template argument.
+	template <class T, intptr_t INVAL>
+	class handle
+	{
+	public:
+		typedef T handle_type;
+		static const T invalid;
+
+	protected:
+		handle_type m_h;
+
+	public:
+		handle() noexcept : m_h(invalid) {}
+		handle(_In_opt_ handle_type h) noexcept : m_h(h) {}
+		handle(_Inout_ handle&& h) noexcept : m_h(h.m_h) { h.m_h = invalid; }
+		virtual ~handle() {}
+
+		handle(const handle&) = delete;
+		handle& operator=(const handle&) = delete;
+
+		operator handle_type() const { return m_h; }
+		bool operator!() const { return m_h == invalid; }
+
+		void free()
+		{
+			if (m_h != invalid)
+			{
+				free_internal();
+				m_h = invalid;
+			}
+		}
+
+	protected:
+		virtual void free_internal() noexcept = 0;
+	};
+
+	template <class T, intptr_t INVAL>
+	const T handle<T, INVAL>::invalid = (T)INVAL;
+}
+
+#define WINSTD_HANDLE_IMPL(C, T, INVAL) \
+public: \
+	C() noexcept {} \
+	C(_In_opt_ T h) noexcept : handle<T, INVAL>(h) {} \
+	C(_Inout_ C&& h) noexcept : handle<T, INVAL>(std::move(h)) {} \
+	C& operator=(_In_opt_ T h) noexcept { this->free(); this->m_h = h; return *this; } \
+	C& operator=(_Inout_ C&& h) noexcept { if (this != &h) { this->free(); this->m_h = h.m_h; h.m_h = (T)INVAL; } return *this; }
@@ -0,0 +1,76 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+// The part of WinStd the portable sources use, for building the benchmarks in this folder on POSIX.
+
+#pragma once
+
+#include "Common.h"
+
+inline HMODULE LoadLibraryExW(_In_z_ LPCWSTR, HANDLE, DWORD) { errno = ENOENT; return NULL; }
+inline FARPROC GetProcAddress(HMODULE, _In_z_ const char*) { return NULL; }
+
+// Converts UTF-8 to wide string one code unit per byte. Host names the benchmarks resolve are ASCII.
+template <class _Traits, class _Ax>
+inline int MultiByteToWideChar(_In_ unsigned int, _In_ DWORD, _In_z_ const char* str, _In_ int len, _Out_ std::basic_string<wchar_t, _Traits, _Ax>& out)
+{
+	out.assign(str, str + (len < 0 ? strlen(str) : (size_t)len));
+	return (int)out.size();
+}
+
+namespace winstd
+{
+	class library : public handle<HMODULE, NULL>
+	{
+		WINSTD_HANDLE_IMPL(library, HMODULE, NULL)
+
+	public:
+		virtual ~library() {}
+
+	protected:
+		void free_internal() noexcept override {}
+	};
+
+	// Thread handle. WaitForSingleObject() joins and releases the thread; there is nothing left to close.
+	class thread : public handle<HANDLE, NULL>
+	{
+		WINSTD_HANDLE_IMPL(thread, HANDLE, NULL)
+
+	public:
+		virtual ~thread() {}
+
+	protected:
+		void free_internal() noexcept override {}
+	};
+
+	class file : public handle<HANDLE, -1>
+	{
+		WINSTD_HANDLE_IMPL(file, HANDLE, -1)
+
+	public:
+		virtual ~file() { if (m_h != invalid) free_internal(); }
+
+	protected:
+		void free_internal() noexcept override { CloseHandle(m_h); }
+	};
+
+	class file_mapping : public handle<HANDLE, NULL>
+	{
+		WINSTD_HANDLE_IMPL(file_mapping, HANDLE, NULL)
+
+	public:
+		virtual ~file_mapping() { if (m_h != invalid) free_internal(); }
+
+	protected:
+		void free_internal() noexcept override { delete reinterpret_cast<posix_mapping*>(m_h); }
+	};
+
+	struct UnmapViewOfFile_delete
+	{
+		void operator()(_In_ void* view) const { UnmapViewOfFile(view); }
+	};
+}
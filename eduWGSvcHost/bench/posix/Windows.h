@@ -0,0 +1,282 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+// The part of Windows.h the portable sources use, for building the benchmarks in this folder on POSIX.
+
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <strings.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// GCC's NULL is an integer, which the handle templates take as their invalid value.
+#pragma GCC diagnostic ignored "-Wconversion-null"
+
+typedef unsigned char BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t DWORD64;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef unsigned short USHORT;
+typedef int BOOL;
+typedef wchar_t WCHAR;
+typedef const wchar_t* LPCWSTR;
+typedef const wchar_t* LPCTSTR;
+typedef void VOID;
+typedef void* LPVOID;
+typedef void* HANDLE;
+typedef void* HMODULE;
+typedef long NTSTATUS;
+typedef unsigned char* PUCHAR;
+typedef int (*FARPROC)() __attribute__((__may_alias__)); // Entry points are assigned through FARPROC*
+typedef struct { DWORD Data1; WORD Data2, Data3; BYTE Data4[8]; } GUID;
+typedef union { ULONGLONG Value; } NET_LUID;
+typedef union { struct { DWORD LowPart; LONG HighPart; }; LONGLONG QuadPart; } LARGE_INTEGER;
+typedef struct { DWORD dwLowDateTime, dwHighDateTime; } FILETIME;
+
+#define TRUE 1
+#define FALSE 0
+#define WINAPI
+#define CALLBACK
+#define INFINITE 0xffffffff
+#define WAIT_OBJECT_0 0
+#define ERROR_SUCCESS 0
+#define ERROR_MORE_DATA 234
+#define CP_UTF8 65001
+#define LOAD_LIBRARY_SEARCH_APPLICATION_DIR 0x200
+#define LOAD_LIBRARY_SEARCH_SYSTEM32 0x800
+#define UNREFERENCED_PARAMETER(p) (void)(p)
+
+#define _In_
+#define _In_z_
+#define _In_opt_
+#define _In_opt_z_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _In_count_(x)
+#define _In_reads_(x)
+#define _In_reads_bytes_(x)
+#define _In_reads_bytes_opt_(x)
+#define _Out_writes_(x)
+#define _Out_writes_bytes_(x)
+#define _Out_writes_bytes_opt_(x)
+#define _Out_writes_bytes_all_(x)
+#define _Inout_updates_(x)
+#define _Inout_updates_bytes_(x)
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+
+#define DEFINE_ENUM_FLAG_OPERATORS(T) \
+	inline T operator|(T a, T b) { return (T)((int)a | (int)b); } \
+	inline T& operator|=(T& a, T b) { return a = a | b; } \
+	inline T operator&(T a, T b) { return (T)((int)a & (int)b); } \
+	inline T& operator&=(T& a, T b) { return a = a & b; } \
+	inline T operator~(T a) { return (T)~(int)a; }
+
+inline void SecureZeroMemory(_Out_writes_bytes_(size) void* ptr, _In_ size_t size)
+{
+	volatile BYTE* p = (volatile BYTE*)ptr;
+	while (size--)
+		*p++ = 0;
+}
+
+inline DWORD GetLastError() { return (DWORD)errno; }
+inline int _stricmp(const char* a, const char* b) { return strcasecmp(a, b); }
+inline LONG InterlockedIncrement(volatile LONG* addend) { return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST); }
+inline LONGLONG InterlockedExchange64(volatile LONGLONG* target, LONGLONG value) { return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST); }
+inline void MemoryBarrier() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+// Time
+
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency)
+{
+	frequency->QuadPart = 1000000000;
+	return TRUE;
+}
+
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER* counter)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	counter->QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return TRUE;
+}
+
+inline void GetSystemTimeAsFileTime(FILETIME* ft)
+{
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ULONGLONG t = (ULONGLONG)ts.tv_sec * 10000000 + (ULONGLONG)ts.tv_nsec / 100 + 116444736000000000ull;
+	ft->dwLowDateTime = (DWORD)t;
+	ft->dwHighDateTime = (DWORD)(t >> 32);
+}
+
+// Slim reader/writer locks
+
+typedef pthread_rwlock_t SRWLOCK;
+inline void InitializeSRWLock(SRWLOCK* lock) { pthread_rwlock_init(lock, NULL); }
+inline void AcquireSRWLockExclusive(SRWLOCK* lock) { pthread_rwlock_wrlock(lock); }
+inline void ReleaseSRWLockExclusive(SRWLOCK* lock) { pthread_rwlock_unlock(lock); }
+inline void AcquireSRWLockShared(SRWLOCK* lock) { pthread_rwlock_rdlock(lock); }
+inline void ReleaseSRWLockShared(SRWLOCK* lock) { pthread_rwlock_unlock(lock); }
+
+// Threads. Handles are joined once by WaitForSingleObject and not closed otherwise.
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+
+struct posix_thread {
+	pthread_t thread;
+	LPTHREAD_START_ROUTINE start;
+	LPVOID param;
+};
+
+inline void* posix_thread_start(void* param)
+{
+	auto t = reinterpret_cast<posix_thread*>(param);
+	t->start(t->param);
+	return NULL;
+}
+
+inline HANDLE CreateThread(void*, size_t, LPTHREAD_START_ROUTINE start, LPVOID param, DWORD, DWORD*)
+{
+	auto t = new posix_thread{ {}, start, param };
+	if (pthread_create(&t->thread, NULL, posix_thread_start, t))
+	{
+		delete t;
+		return NULL;
+	}
+	return t;
+}
+
+inline DWORD WaitForSingleObject(HANDLE h, DWORD)
+{
+	auto t = reinterpret_cast<posix_thread*>(h);
+	pthread_join(t->thread, NULL);
+	delete t;
+	return WAIT_OBJECT_0;
+}
+
+// Virtual memory
+
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_RELEASE 0x8000
+#define PAGE_NOACCESS 0x01
+#define PAGE_READWRITE 0x04
+
+typedef struct { DWORD dwPageSize; } SYSTEM_INFO;
+
+inline void GetSystemInfo(SYSTEM_INFO* info) { info->dwPageSize = (DWORD)sysconf(_SC_PAGESIZE); }
+inline HANDLE GetCurrentProcess() { return (HANDLE)-1; }
+inline BOOL GetProcessWorkingSetSize(HANDLE, SIZE_T* min, SIZE_T* max) { *min = *max = 0; return TRUE; }
+inline BOOL SetProcessWorkingSetSize(HANDLE, SIZE_T, SIZE_T) { return TRUE; }
+
+inline LPVOID VirtualAlloc(LPVOID, SIZE_T size, DWORD, DWORD protect)
+{
+	void* p = mmap(NULL, size, protect == PAGE_READWRITE ? PROT_READ | PROT_WRITE : PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+inline BOOL VirtualProtect(LPVOID address, SIZE_T size, DWORD protect, DWORD* old_protect)
+{
+	*old_protect = PAGE_READWRITE;
+	return mprotect(address, size, protect == PAGE_READWRITE ? PROT_READ | PROT_WRITE : PROT_NONE) == 0;
+}
+
+inline BOOL VirtualLock(LPVOID address, SIZE_T size) { return mlock(address, size) == 0; }
+inline BOOL VirtualFree(LPVOID, SIZE_T, DWORD) { return TRUE; }
+
+// Files and file mappings. File handles are descriptors; mappings remember the descriptor and views their size.
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define INVALID_SET_FILE_POINTER ((DWORD)-1)
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x1
+#define FILE_SHARE_WRITE 0x2
+#define FILE_SHARE_DELETE 0x4
+#define OPEN_ALWAYS 4
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define FILE_BEGIN SEEK_SET
+#define FILE_MAP_ALL_ACCESS 0xf001f
+
+inline HANDLE CreateFile(LPCTSTR filename, DWORD, DWORD, void*, DWORD, DWORD, HANDLE)
+{
+	std::string name;
+	for (; *filename; ++filename)
+		name += (char)*filename;
+	int fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+	return fd < 0 ? INVALID_HANDLE_VALUE : (HANDLE)(intptr_t)fd;
+}
+
+inline DWORD SetFilePointer(HANDLE file, LONG distance, LONG*, DWORD method)
+{
+	off_t r = lseek((int)(intptr_t)file, distance, (int)method);
+	return r < 0 ? INVALID_SET_FILE_POINTER : (DWORD)r;
+}
+
+inline BOOL SetEndOfFile(HANDLE file)
+{
+	int fd = (int)(intptr_t)file;
+	return ftruncate(fd, lseek(fd, 0, SEEK_CUR)) == 0;
+}
+
+inline BOOL CloseHandle(HANDLE h) { return close((int)(intptr_t)h) == 0; }
+
+struct posix_mapping {
+	int fd;
+};
+
+inline HANDLE CreateFileMapping(HANDLE file, void*, DWORD, DWORD, DWORD, LPCTSTR)
+{
+	return new posix_mapping{ (int)(intptr_t)file };
+}
+
+inline std::map<void*, size_t>& posix_views(std::unique_lock<std::mutex>& lock)
+{
+	static std::mutex mutex;
+	static std::map<void*, size_t> views;
+	lock = std::unique_lock<std::mutex>(mutex);
+	return views;
+}
+
+inline LPVOID MapViewOfFile(HANDLE mapping, DWORD, DWORD, DWORD, SIZE_T size)
+{
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, reinterpret_cast<posix_mapping*>(mapping)->fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	std::unique_lock<std::mutex> lock;
+	posix_views(lock)[p] = size;
+	return p;
+}
+
+inline BOOL UnmapViewOfFile(const void* address)
+{
+	std::unique_lock<std::mutex> lock;
+	auto& views = posix_views(lock);
+	auto v = views.find(const_cast<void*>(address));
+	if (v == views.end())
+		return FALSE;
+	munmap(v->first, v->second);
+	views.erase(v);
+	return TRUE;
+}
@@ -0,0 +1,28 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+// The part of bcrypt.h the portable sources use, for building the benchmarks in this folder on POSIX.
+
+#pragma once
+
+#include <Windows.h>
+#include <fcntl.h>
+
+#define BCRYPT_USE_SYSTEM_PREFERRED_RNG 0x00000002
+#define BCRYPT_SUCCESS(status) ((status) >= 0)
+
+inline NTSTATUS BCryptGenRandom(void*, PUCHAR buffer, ULONG size, ULONG)
+{
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ssize_t r = read(fd, buffer, size);
+	close(fd);
+	return r == (ssize_t)size ? 0 : -1;
+}
+
+inline DWORD RtlNtStatusToDosError(NTSTATUS status) { return (DWORD)status; }
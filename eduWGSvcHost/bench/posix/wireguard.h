@@ -0,0 +1,104 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+// The part of wireguard.h the portable sources use, for building the benchmarks in this folder on POSIX. Layout follows
+// wireguard-nt.
+
+#pragma once
+
+#include <WS2tcpip.h>
+
+#define WIREGUARD_KEY_LENGTH 32
+
+typedef struct _WIREGUARD_ADAPTER* WIREGUARD_ADAPTER_HANDLE;
+
+typedef enum
+{
+	WIREGUARD_LOG_INFO,
+	WIREGUARD_LOG_WARN,
+	WIREGUARD_LOG_ERR
+} WIREGUARD_LOGGER_LEVEL;
+
+typedef enum
+{
+	WIREGUARD_ADAPTER_LOG_OFF,
+	WIREGUARD_ADAPTER_LOG_ON,
+	WIREGUARD_ADAPTER_LOG_ON_WITH_PREFIX
+} WIREGUARD_ADAPTER_LOG_STATE;
+
+typedef enum
+{
+	WIREGUARD_ADAPTER_STATE_DOWN,
+	WIREGUARD_ADAPTER_STATE_UP
+} WIREGUARD_ADAPTER_STATE;
+
+typedef struct alignas(8)
+{
+	union
+	{
+		IN_ADDR V4;
+		IN6_ADDR V6;
+	} Address;
+	ADDRESS_FAMILY AddressFamily;
+	BYTE Cidr;
+} WIREGUARD_ALLOWED_IP;
+
+typedef enum
+{
+	WIREGUARD_PEER_HAS_PUBLIC_KEY = 1 << 0,
+	WIREGUARD_PEER_HAS_PRESHARED_KEY = 1 << 1,
+	WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE = 1 << 2,
+	WIREGUARD_PEER_HAS_ENDPOINT = 1 << 3,
+	WIREGUARD_PEER_REPLACE_ALLOWED_IPS = 1 << 5,
+	WIREGUARD_PEER_REMOVE = 1 << 6,
+	WIREGUARD_PEER_UPDATE = 1 << 7
+} WIREGUARD_PEER_FLAG;
+
+typedef struct alignas(8)
+{
+	WIREGUARD_PEER_FLAG Flags;
+	DWORD Reserved;
+	BYTE PublicKey[WIREGUARD_KEY_LENGTH];
+	BYTE PresharedKey[WIREGUARD_KEY_LENGTH];
+	WORD PersistentKeepalive;
+	SOCKADDR_INET Endpoint;
+	DWORD64 TxBytes;
+	DWORD64 RxBytes;
+	DWORD64 LastHandshake;
+	DWORD AllowedIPsCount;
+} WIREGUARD_PEER;
+
+typedef enum
+{
+	WIREGUARD_INTERFACE_HAS_PUBLIC_KEY = 1 << 0,
+	WIREGUARD_INTERFACE_HAS_PRIVATE_KEY = 1 << 1,
+	WIREGUARD_INTERFACE_HAS_LISTEN_PORT = 1 << 2,
+	WIREGUARD_INTERFACE_REPLACE_PEERS = 1 << 3
+} WIREGUARD_INTERFACE_FLAG;
+
+typedef struct alignas(8)
+{
+	WIREGUARD_INTERFACE_FLAG Flags;
+	WORD ListenPort;
+	BYTE PrivateKey[WIREGUARD_KEY_LENGTH];
+	BYTE PublicKey[WIREGUARD_KEY_LENGTH];
+	DWORD PeersCount;
+} WIREGUARD_INTERFACE;
+
+typedef VOID(CALLBACK* WIREGUARD_LOGGER_CALLBACK)(WIREGUARD_LOGGER_LEVEL Level, DWORD64 Timestamp, LPCWSTR Message);
+typedef WIREGUARD_ADAPTER_HANDLE(WINAPI WIREGUARD_CREATE_ADAPTER_FUNC)(LPCWSTR Name, LPCWSTR TunnelType, const GUID* RequestedGUID);
+typedef WIREGUARD_ADAPTER_HANDLE(WINAPI WIREGUARD_OPEN_ADAPTER_FUNC)(LPCWSTR Name);
+typedef VOID(WINAPI WIREGUARD_CLOSE_ADAPTER_FUNC)(WIREGUARD_ADAPTER_HANDLE Adapter);
+typedef VOID(WINAPI WIREGUARD_GET_ADAPTER_LUID_FUNC)(WIREGUARD_ADAPTER_HANDLE Adapter, NET_LUID* Luid);
+typedef DWORD(WINAPI WIREGUARD_GET_RUNNING_DRIVER_VERSION_FUNC)(VOID);
+typedef BOOL(WINAPI WIREGUARD_DELETE_DRIVER_FUNC)(VOID);
+typedef VOID(WINAPI WIREGUARD_SET_LOGGER_FUNC)(WIREGUARD_LOGGER_CALLBACK NewLogger);
+typedef BOOL(WINAPI WIREGUARD_SET_ADAPTER_LOGGING_FUNC)(WIREGUARD_ADAPTER_HANDLE Adapter, WIREGUARD_ADAPTER_LOG_STATE LogState);
+typedef BOOL(WINAPI WIREGUARD_GET_ADAPTER_STATE_FUNC)(WIREGUARD_ADAPTER_HANDLE Adapter, WIREGUARD_ADAPTER_STATE* State);
+typedef BOOL(WINAPI WIREGUARD_SET_ADAPTER_STATE_FUNC)(WIREGUARD_ADAPTER_HANDLE Adapter, WIREGUARD_ADAPTER_STATE State);
+typedef BOOL(WINAPI WIREGUARD_GET_CONFIGURATION_FUNC)(WIREGUARD_ADAPTER_HANDLE Adapter, WIREGUARD_INTERFACE* Config, DWORD* Bytes);
+typedef BOOL(WINAPI WIREGUARD_SET_CONFIGURATION_FUNC)(WIREGUARD_ADAPTER_HANDLE Adapter, const WIREGUARD_INTERFACE* Config, DWORD Bytes);
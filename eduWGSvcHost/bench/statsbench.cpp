@@ -0,0 +1,92 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+// Benchmark of the peer history ring that tunnel processes write and "eduWGSvcHost.exe <client> History" queries. Build and run
+// from eduWGSvcHost folder:
+//
+//     g++ -std=c++17 -O2 -Ibench/posix bench/statsbench.cpp -lpthread -o statsbench && ./statsbench 1000000 4 /tmp/stats.bin
+//
+// Writers append samples of their own tunnel concurrently while a reader keeps querying the ring, as the History verb does while
+// tunnels run. Every sample is derived from its time, so a point mixing columns of two samples is caught. Prints nanoseconds per
+// write, the number of queries made during writing, torn points found, and milliseconds per query of the full ring.
+
+#include "../statsring.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace wg;
+
+template <class F>
+static double time_us(_In_ F f)
+{
+	auto start = chrono::steady_clock::now();
+	f();
+	return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+static size_t torn_points(_In_ const vector<stats_ring::point>& points)
+{
+	size_t torn = 0;
+	for (auto& p : points)
+		if (p.tunnel != p.peer >> 32 || p.rx_bytes != p.time * 3 || p.tx_bytes != (p.time ^ p.peer))
+			++torn;
+	return torn;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t samples = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	unsigned int writers = argc > 2 ? max(strtoul(argv[2], NULL, 10), 1ul) : 4;
+	string path = argc > 3 ? argv[3] : "stats.bin";
+	stats_ring ring(wstring(path.begin(), path.end()).c_str());
+
+	static const ULONGLONG step = 0x100;
+	atomic<bool> writing(true);
+	unsigned int queries = 0;
+	size_t torn = 0;
+	thread reader([&] {
+		vector<stats_ring::point> points;
+		while (writing)
+		{
+			points.clear();
+			ring.query(1, ~0ull, step, points);
+			torn += torn_points(points);
+			++queries;
+		}
+	});
+
+	double write_time = time_us([&] {
+		vector<thread> threads;
+		for (unsigned int w = 0; w < writers; ++w)
+			threads.emplace_back([&, w] {
+				ULONGLONG tunnel = w;
+				for (size_t k = w; k < samples; k += writers)
+				{
+					ULONGLONG time = k + 1, peer = tunnel << 32 | k % 251;
+					ring.write(time, (const BYTE*)&tunnel, (const BYTE*)&peer, time * 3, time ^ peer, (DWORD)(time % 180));
+				}
+			});
+		for (auto& t : threads)
+			t.join();
+	});
+	writing = false;
+	reader.join();
+
+	vector<stats_ring::point> points;
+	double query_time = time_us([&] { ring.query(1, ~0ull, step, points); });
+	torn += torn_points(points);
+
+	printf("stats samples=%zu writers=%u write_ns=%.1f queries=%u torn=%zu query=%.3f points=%zu\n",
+		samples, writers, 1000.0 * write_time / (double)samples, queries, torn, query_time / 1000.0, points.size());
+	return torn ? 1 : 0;
+}
@@ -0,0 +1,36 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+// Portable counterpart of "eduWGSvcHost.exe <client> Verify" for the configuration transforms. Build and run from eduWGSvcHost
+// folder:
+//
+//     g++ -std=c++17 -O2 -Ibench/posix bench/verify.cpp selftest.cpp conf.cpp arena.cpp prefixset.cpp lpm.cpp
+//         crypto.cpp keys.cpp race.cpp -lpthread -o verify && ./verify 10000 100000
+//
+// Checks compact encoding of a random driver configuration of 10000 peers with 100000 allowed IPs among them, and prints encode
+// and decode milliseconds. Then aggregates 100000 random allowed IPs and prints aggregation milliseconds, and builds the lookup
+// table of the same allowed IPs and prints build milliseconds and nanoseconds per lookup.
+
+#include "../selftest.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+using namespace std;
+using namespace wg;
+
+int main(int argc, char* argv[])
+{
+	unsigned int peers = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+	unsigned int prefixes = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+	string report;
+	bool success = check_compact_config(peers, prefixes, report);
+	success = check_aggregation(prefixes, report) && success;
+	success = check_lpm(prefixes, report) && success;
+	fputs(report.c_str(), stdout);
+	return success ? 0 : 1;
+}
@@ -0,0 +1,655 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "conf.h"
+#include "crypto.h"
+#include "keys.h"
+#include <WS2tcpip.h>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+using namespace std;
+using namespace winstd;
+
+namespace wg
+{
+	static inline bool is_space(_In_ char c) noexcept
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+	}
+
+	static void trim(_Inout_ const char*& begin, _Inout_ const char*& end) noexcept
+	{
+		while (begin < end && is_space(*begin)) ++begin;
+		while (begin < end && is_space(end[-1])) --end;
+	}
+
+	static string to_lower(_In_ const char* begin, _In_ const char* end)
+	{
+		string str(begin, end);
+		for (auto& c : str)
+			if ('A' <= c && c <= 'Z')
+				c += 'a' - 'A';
+		return str;
+	}
+
+	static unsigned long parse_uint(_In_ const char* begin, _In_ const char* end, _In_ unsigned long max, _In_z_ const char* what)
+	{
+		if (begin == end)
+			throw invalid_argument(string_printf("Invalid %s: empty", what));
+		unsigned long value = 0;
+		for (auto p = begin; p < end; ++p)
+		{
+			if (*p < '0' || '9' < *p)
+				throw invalid_argument(string_printf("Invalid %s: %.*s", what, (int)(end - begin), begin));
+			value = value * 10 + (*p - '0');
+			if (value > max)
+				throw invalid_argument(string_printf("Invalid %s: %.*s", what, (int)(end - begin), begin));
+		}
+		return value;
+	}
+
+	void parse_allowed_ip(_In_count_(str_len) const char* str, _In_ size_t str_len, _Out_ WIREGUARD_ALLOWED_IP& allowed_ip)
+	{
+		memset(&allowed_ip, 0, sizeof(allowed_ip));
+		auto end = str + str_len;
+		auto slash = (const char*)memchr(str, '/', str_len);
+		string address(str, slash ? slash : end);
+		BYTE max_cidr;
+		if (address.find(':') != string::npos)
+		{
+			allowed_ip.AddressFamily = AF_INET6;
+			max_cidr = 128;
+			if (InetPtonA(AF_INET6, address.c_str(), &allowed_ip.Address.V6) != 1)
+				throw invalid_argument(string_printf("Invalid IP address: %.*s", (int)str_len, str));
+		}
+		else
+		{
+			allowed_ip.AddressFamily = AF_INET;
+			max_cidr = 32;
+			if (InetPtonA(AF_INET, address.c_str(), &allowed_ip.Address.V4) != 1)
+				throw invalid_argument(string_printf("Invalid IP address: %.*s", (int)str_len, str));
+		}
+		allowed_ip.Cidr = slash ? (BYTE)parse_uint(slash + 1, end, max_cidr, "network prefix length") : max_cidr;
+
+		// Clear host bits.
+		auto bytes = reinterpret_cast<BYTE*>(&allowed_ip.Address);
+		for (unsigned int bit = allowed_ip.Cidr; bit < max_cidr; bit = (bit + 8) & ~7)
+			bytes[bit / 8] &= (BYTE)(0xff00 >> (bit % 8));
+	}
+
+	static void parse_endpoint(_In_ const char* begin, _In_ const char* end, _Out_ string& host, _Out_ WORD& port)
+	{
+		auto colon = end;
+		while (colon > begin && colon[-1] != ':') --colon;
+		if (colon == begin)
+			throw invalid_argument(string_printf("Missing port from endpoint: %.*s", (int)(end - begin), begin));
+		port = (WORD)parse_uint(colon, end, 65535, "endpoint port");
+		host.assign(begin, colon - 1);
+		if (host.empty())
+			throw invalid_argument(string_printf("Invalid endpoint host: %.*s", (int)(end - begin), begin));
+		if (host.front() == '[' || host.back() == ']' || host.find(':') != string::npos)
+		{
+			if (host.size() <= 3 || host.front() != '[' || host.back() != ']' || host.find(':') == string::npos)
+				throw invalid_argument(string_printf("Brackets must contain an IPv6 address: %s", host.c_str()));
+			host = host.substr(1, host.size() - 2);
+		}
+	}
+
+	template <class _Func>
+	static void split_list(_In_ const char* begin, _In_ const char* end, _In_ _Func f)
+	{
+		for (auto item = begin;;)
+		{
+			auto item_end = (const char*)memchr(item, ',', end - item);
+			if (!item_end)
+				item_end = end;
+			auto b = item, e = item_end;
+			trim(b, e);
+			if (b == e)
+				throw invalid_argument(string_printf("Two commas in a row: %.*s", (int)(end - begin), begin));
+			f(b, e);
+			if (item_end == end)
+				break;
+			item = item_end + 1;
+		}
+	}
+
+	peer_config::peer_config() noexcept :
+		has_preshared_key(false),
+		persistent_keepalive(0),
+		endpoint_port(0)
+	{
+		memset(public_key, 0, sizeof(public_key));
+		memset(preshared_key, 0, sizeof(preshared_key));
+	}
+
+	peer_config::~peer_config()
+	{
+		SecureZeroMemory(preshared_key, sizeof(preshared_key));
+	}
+
+	void peer_config::resolve_endpoint(_Out_ SOCKADDR_INET& endpoint) const
+	{
+		vector<SOCKADDR_INET> candidates;
+		resolve_endpoint_candidates(candidates);
+		endpoint = candidates.front();
+	}
+
+	void peer_config::resolve_endpoint_candidates(_Out_ vector<SOCKADDR_INET>& candidates) const
+	{
+		candidates.clear();
+		wstring host;
+		MultiByteToWideChar(CP_UTF8, 0, endpoint_host.c_str(), (int)endpoint_host.size(), host);
+		ADDRINFOW hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_protocol = IPPROTO_UDP;
+		PADDRINFOW result;
+		int err = GetAddrInfoW(host.c_str(), NULL, &hints, &result);
+		if (err)
+			throw win_runtime_error(err, "Failed to resolve endpoint");
+		unique_ptr<ADDRINFOW, void(WSAAPI*)(PADDRINFOW)> result_guard(result, FreeAddrInfoW);
+		vector<SOCKADDR_INET> by_family[2]; // IPv4, IPv6
+		for (auto ai = result; ai; ai = ai->ai_next)
+		{
+			if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+				continue;
+			SOCKADDR_INET endpoint = {};
+			memcpy(&endpoint, ai->ai_addr, min(ai->ai_addrlen, sizeof(endpoint)));
+			if (endpoint.si_family == AF_INET)
+				endpoint.Ipv4.sin_port = htons(endpoint_port);
+			else
+				endpoint.Ipv6.sin6_port = htons(endpoint_port);
+			auto& list = by_family[endpoint.si_family == AF_INET ? 0 : 1];
+			if (find_if(list.cbegin(), list.cend(), [&endpoint](const SOCKADDR_INET& e) { return memcmp(&e, &endpoint, sizeof(e)) == 0; }) == list.cend())
+				list.push_back(endpoint);
+		}
+		for (size_t i = 0; i < by_family[0].size() || i < by_family[1].size(); ++i)
+			for (auto& list : by_family)
+				if (i < list.size())
+					candidates.push_back(list[i]);
+		if (candidates.empty())
+			throw win_runtime_error(WSAHOST_NOT_FOUND, "Failed to resolve endpoint");
+	}
+
+	interface_config::interface_config() noexcept :
+		listen_port(0)
+	{
+		memset(private_key, 0, sizeof(private_key));
+		memset(public_key, 0, sizeof(public_key));
+	}
+
+	interface_config::~interface_config()
+	{
+		SecureZeroMemory(private_key, sizeof(private_key));
+	}
+
+	void interface_config::parse(_In_count_(config_len) const char* config, _In_ size_t config_len)
+	{
+		enum class section_t { none, interface, peer } section = section_t::none;
+		bool has_private_key = false, has_public_key = false;
+		listen_port = 0;
+		other.clear();
+		peers.clear();
+		auto config_end = config + config_len;
+		unsigned int line_no = 0;
+		for (auto line = config; line < config_end;)
+		{
+			auto line_end = (const char*)memchr(line, '\n', config_end - line);
+			if (!line_end)
+				line_end = config_end;
+			auto b = line, e = line_end;
+			line = line_end + 1;
+			++line_no;
+			auto comment = (const char*)memchr(b, '#', e - b);
+			if (comment)
+				e = comment;
+			trim(b, e);
+			if (b == e)
+				continue;
+
+			try
+			{
+				if (*b == '[')
+				{
+					auto name = to_lower(b, e);
+					if (name == "[interface]")
+						section = section_t::interface;
+					else if (name == "[peer]")
+					{
+						if (!peers.empty() && !has_public_key)
+							throw invalid_argument("All peers must have public keys");
+						peers.emplace_back();
+						has_public_key = false;
+						section = section_t::peer;
+					}
+					else
+						throw invalid_argument(string_printf("Invalid section: %.*s", (int)(e - b), b));
+					continue;
+				}
+				if (section == section_t::none)
+					throw invalid_argument(string_printf("Line must occur in a section: %.*s", (int)(e - b), b));
+
+				auto eq = (const char*)memchr(b, '=', e - b);
+				if (!eq)
+					throw invalid_argument(string_printf("Config key is missing an equals separator: %.*s", (int)(e - b), b));
+				auto key_b = b, key_e = eq, val_b = eq + 1, val_e = e;
+				trim(key_b, key_e);
+				trim(val_b, val_e);
+				auto key = to_lower(key_b, key_e);
+				if (val_b == val_e)
+					throw invalid_argument(string_printf("Key must have a value: %s", key.c_str()));
+
+				if (section == section_t::interface)
+				{
+					if (key == "privatekey")
+					{
+						decode_key(val_b, val_e - val_b, private_key);
+						has_private_key = true;
+						continue;
+					}
+					else if (key == "listenport")
+					{
+						listen_port = (WORD)parse_uint(val_b, val_e, 65535, "port");
+						continue;
+					}
+					else if (key == "address")
+						split_list(val_b, val_e, [](const char* b, const char* e)
+						{
+							WIREGUARD_ALLOWED_IP address;
+							parse_allowed_ip(b, e - b, address);
+						});
+					else if (key == "dns")
+						split_list(val_b, val_e, [](const char*, const char*)
+						{
+							// tunnel.dll takes any entry that is not an IP address as a search domain.
+						});
+					else if (key == "mtu")
+					{
+						if (parse_uint(val_b, val_e, 65535, "MTU") < 576)
+							throw invalid_argument(string_printf("Invalid MTU: %.*s", (int)(val_e - val_b), val_b));
+					}
+					else if (key == "table")
+					{
+						auto value = to_lower(val_b, val_e);
+						if (value != "off" && value != "auto" && value != "main")
+							parse_uint(val_b, val_e, 0xffffffff, "table");
+					}
+					else if (key != "preup" && key != "postup" && key != "predown" && key != "postdown")
+						throw invalid_argument(string_printf("Invalid key for [Interface] section: %s", key.c_str()));
+					other.push_back(key + "=" + string(val_b, val_e));
+				}
+				else
+				{
+					auto& peer = peers.back();
+					if (key == "publickey")
+					{
+						decode_key(val_b, val_e - val_b, peer.public_key);
+						if (!validate_public_key(peer.public_key))
+							throw invalid_argument("Public key is not a valid Curve25519 point");
+						has_public_key = true;
+					}
+					else if (key == "presharedkey")
+					{
+						decode_key(val_b, val_e - val_b, peer.preshared_key);
+						peer.has_preshared_key = true;
+					}
+					else if (key == "allowedips")
+						split_list(val_b, val_e, [&peer](const char* b, const char* e)
+						{
+							WIREGUARD_ALLOWED_IP allowed_ip;
+							parse_allowed_ip(b, e - b, allowed_ip);
+							peer.allowed_ips.push_back(allowed_ip);
+						});
+					else if (key == "endpoint")
+						parse_endpoint(val_b, val_e, peer.endpoint_host, peer.endpoint_port);
+					else if (key == "persistentkeepalive")
+						peer.persistent_keepalive = val_e - val_b == 3 && memcmp(val_b, "off", 3) == 0 ? 0 : (WORD)parse_uint(val_b, val_e, 65535, "persistent keepalive");
+					else if (key == "proxyendpoint")
+						peer.other.push_back(key + "=" + string(val_b, val_e));
+					else
+						throw invalid_argument(string_printf("Invalid key for [Peer] section: %s", key.c_str()));
+				}
+			}
+			catch (const invalid_argument& e)
+			{
+				throw invalid_argument(string_printf("Line %u: %s", line_no, e.what()));
+			}
+		}
+		if (!has_private_key)
+			throw invalid_argument("An interface must have a private key");
+		if (!peers.empty() && !has_public_key)
+			throw invalid_argument("All peers must have public keys");
+		x25519_base(public_key, private_key);
+		for (auto& peer : peers)
+		{
+			if (memcmp(peer.public_key, public_key, sizeof(public_key)) == 0)
+				throw invalid_argument("Peer public key must differ from the interface public key");
+			sort(peer.allowed_ips.begin(), peer.allowed_ips.end());
+			peer.allowed_ips.erase(unique(peer.allowed_ips.begin(), peer.allowed_ips.end()), peer.allowed_ips.end());
+		}
+	}
+
+	void interface_config::rewrite_allowed_ips(_In_count_(config_len) const char* config, _In_ size_t config_len, _Out_ vector<char, secure_allocator<char>>& out) const
+	{
+		out.clear();
+		out.reserve(config_len);
+		bool in_peer = false, written = false;
+		size_t peer = (size_t)-1;
+		auto config_end = config + config_len;
+		for (auto line = config; line < config_end;)
+		{
+			auto line_end = (const char*)memchr(line, '\n', config_end - line);
+			line_end = line_end ? line_end + 1 : config_end;
+			auto b = line, e = line_end;
+			trim(b, e);
+			if (b < e && *b == '[')
+			{
+				auto section_end = (const char*)memchr(b, ']', e - b);
+				in_peer = section_end && to_lower(b, section_end + 1) == "[peer]";
+				if (in_peer)
+				{
+					++peer;
+					written = false;
+				}
+			}
+			else if (in_peer && peer < peers.size())
+			{
+				auto key_e = (const char*)memchr(b, '=', e - b);
+				if (key_e)
+				{
+					trim(b, key_e);
+					if (to_lower(b, key_e) == "allowedips")
+					{
+						// Replace all AllowedIPs lines of the peer with one line at the position of the first.
+						if (!written && !peers[peer].allowed_ips.empty())
+						{
+							static const char key[] = "AllowedIPs = ";
+							out.insert(out.cend(), key, key + _countof(key) - 1);
+							for (auto a = peers[peer].allowed_ips.cbegin(); a != peers[peer].allowed_ips.cend(); ++a)
+							{
+								char address[INET6_ADDRSTRLEN];
+								InetNtopA(a->AddressFamily, &a->Address, address, _countof(address));
+								auto item = string_printf(a == peers[peer].allowed_ips.cbegin() ? "%s/%u" : ", %s/%u", address, a->Cidr);
+								out.insert(out.cend(), item.cbegin(), item.cend());
+							}
+							out.push_back('\n');
+							written = true;
+						}
+						line = line_end;
+						continue;
+					}
+				}
+			}
+			out.insert(out.cend(), line, line_end);
+			line = line_end;
+		}
+	}
+
+	void sanitize_config(_In_count_(config_len) const char* config, _In_ size_t config_len, _Out_ vector<char>& out)
+	{
+		static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		out.clear();
+		out.reserve(config_len);
+		auto config_end = config + config_len;
+		for (auto line = config; line < config_end;)
+		{
+			auto line_end = (const char*)memchr(line, '\n', config_end - line);
+			line_end = line_end ? line_end + 1 : config_end;
+			auto b = line, e = line_end;
+			trim(b, e);
+			if (b < e && *b == '#')
+			{
+				line = line_end;
+				continue;
+			}
+			auto key_e = (const char*)memchr(b, '=', e - b);
+			if (key_e)
+			{
+				auto key_b = b, value_b = key_e + 1, value_e = e;
+				trim(key_b, key_e);
+				trim(value_b, value_e);
+				auto key = to_lower(key_b, key_e);
+				string value;
+				if (key == "privatekey" || key == "presharedkey")
+				{
+					// Same key maps to the same replacement, so traces keep tunnel identity.
+					BYTE hash[WIREGUARD_KEY_LENGTH];
+					blake2s h(sizeof(hash));
+					h.update(value_b, value_e - value_b);
+					h.final(hash);
+					for (size_t i = 0; i < sizeof(hash); i += 3)
+					{
+						DWORD v = ((DWORD)hash[i] << 16) | (i + 1 < sizeof(hash) ? (DWORD)hash[i + 1] << 8 : 0) | (i + 2 < sizeof(hash) ? hash[i + 2] : 0);
+						value += base64[(v >> 18) & 0x3f];
+						value += base64[(v >> 12) & 0x3f];
+						value += i + 1 < sizeof(hash) ? base64[(v >> 6) & 0x3f] : '=';
+						value += i + 2 < sizeof(hash) ? base64[v & 0x3f] : '=';
+					}
+					SecureZeroMemory(hash, sizeof(hash));
+				}
+				else if (key == "endpoint")
+				{
+					string host;
+					WORD port;
+					try { parse_endpoint(value_b, value_e, host, port); }
+					catch (const invalid_argument&) { port = 0; }
+					value = string_printf("192.0.2.1:%u", port);
+				}
+				if (!value.empty())
+				{
+					out.insert(out.cend(), key_b, key_e);
+					out.insert(out.cend(), { ' ', '=', ' ' });
+					out.insert(out.cend(), value.cbegin(), value.cend());
+					out.push_back('\n');
+					line = line_end;
+					continue;
+				}
+			}
+			out.insert(out.cend(), line, line_end);
+			line = line_end;
+		}
+	}
+
+	bool interface_config::has_routes() const noexcept
+	{
+		for (auto& o : other)
+			if (_stricmp(o.c_str(), "table=off") == 0)
+				return false;
+		return true;
+	}
+
+	template <class T>
+	static void append(_Inout_ vector<unsigned char, sanitizing_allocator<unsigned char>>& data, _In_ const T& value)
+	{
+		data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&value), reinterpret_cast<const unsigned char*>(&value + 1));
+	}
+
+	// Appends complete peer configuration.
+	static void append_peer(_Inout_ vector<unsigned char, sanitizing_allocator<unsigned char>>& data, _In_ const peer_config& p)
+	{
+		WIREGUARD_PEER peer = {};
+		peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE | WIREGUARD_PEER_REPLACE_ALLOWED_IPS;
+		memcpy(peer.PublicKey, p.public_key, sizeof(peer.PublicKey));
+		if (p.has_preshared_key)
+		{
+			peer.Flags |= WIREGUARD_PEER_HAS_PRESHARED_KEY;
+			memcpy(peer.PresharedKey, p.preshared_key, sizeof(peer.PresharedKey));
+		}
+		peer.PersistentKeepalive = p.persistent_keepalive;
+		if (p.has_endpoint())
+		{
+			peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+			p.resolve_endpoint(peer.Endpoint);
+		}
+		peer.AllowedIPsCount = (DWORD)p.allowed_ips.size();
+		append(data, peer);
+		SecureZeroMemory(&peer, sizeof(peer));
+		for (auto& a : p.allowed_ips)
+			append(data, a);
+	}
+
+	void interface_config::compile(_Out_ vector<unsigned char, sanitizing_allocator<unsigned char>>& data) const
+	{
+		data.clear();
+		WIREGUARD_INTERFACE iface = {};
+		iface.Flags = WIREGUARD_INTERFACE_HAS_PRIVATE_KEY | WIREGUARD_INTERFACE_REPLACE_PEERS;
+		memcpy(iface.PrivateKey, private_key, sizeof(iface.PrivateKey));
+		if (listen_port)
+		{
+			iface.Flags |= WIREGUARD_INTERFACE_HAS_LISTEN_PORT;
+			iface.ListenPort = listen_port;
+		}
+		iface.PeersCount = (DWORD)peers.size();
+		append(data, iface);
+		SecureZeroMemory(&iface, sizeof(iface));
+		for (auto& p : peers)
+			append_peer(data, p);
+	}
+
+	static vector<WIREGUARD_ALLOWED_IP> all_allowed_ips(_In_ const interface_config& config)
+	{
+		vector<WIREGUARD_ALLOWED_IP> allowed_ips;
+		for (auto& peer : config.peers)
+			allowed_ips.insert(allowed_ips.cend(), peer.allowed_ips.cbegin(), peer.allowed_ips.cend());
+		sort(allowed_ips.begin(), allowed_ips.end());
+		allowed_ips.erase(unique(allowed_ips.begin(), allowed_ips.end()), allowed_ips.end());
+		return allowed_ips;
+	}
+
+	bool make_configuration_update(
+		_In_ const interface_config& running,
+		_In_ const interface_config& updated,
+		_Out_ vector<unsigned char, sanitizing_allocator<unsigned char>>& data,
+		_Out_ vector<WIREGUARD_ALLOWED_IP>& routes_added,
+		_Out_ vector<WIREGUARD_ALLOWED_IP>& routes_removed)
+	{
+		data.clear();
+		routes_added.clear();
+		routes_removed.clear();
+
+		// Addresses, DNS, MTU, scripts etc. are set up by the tunnel service on start.
+		if (running.other != updated.other)
+			return false;
+
+		// Default route changes toggle the tunnel service firewall.
+		auto running_ips = all_allowed_ips(running), updated_ips = all_allowed_ips(updated);
+		set_difference(updated_ips.cbegin(), updated_ips.cend(), running_ips.cbegin(), running_ips.cend(), back_inserter(routes_added));
+		set_difference(running_ips.cbegin(), running_ips.cend(), updated_ips.cbegin(), updated_ips.cend(), back_inserter(routes_removed));
+		for (auto& r : routes_added)
+			if (!r.Cidr)
+				return false;
+		for (auto& r : routes_removed)
+			if (!r.Cidr)
+				return false;
+
+		WIREGUARD_INTERFACE iface = {};
+		if (memcmp(running.private_key, updated.private_key, sizeof(updated.private_key)) != 0)
+		{
+			iface.Flags |= WIREGUARD_INTERFACE_HAS_PRIVATE_KEY;
+			memcpy(iface.PrivateKey, updated.private_key, sizeof(iface.PrivateKey));
+		}
+		if (running.listen_port != updated.listen_port)
+		{
+			iface.Flags |= WIREGUARD_INTERFACE_HAS_LISTEN_PORT;
+			iface.ListenPort = updated.listen_port;
+		}
+		append(data, iface);
+
+		for (auto& r : running.peers)
+		{
+			if (find_if(updated.peers.cbegin(), updated.peers.cend(), [&r](const peer_config& u) { return memcmp(r.public_key, u.public_key, sizeof(u.public_key)) == 0; }) != updated.peers.cend())
+				continue;
+			WIREGUARD_PEER peer = {};
+			peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_REMOVE;
+			memcpy(peer.PublicKey, r.public_key, sizeof(peer.PublicKey));
+			append(data, peer);
+			++iface.PeersCount;
+		}
+
+		for (auto& u : updated.peers)
+		{
+			auto r = find_if(running.peers.cbegin(), running.peers.cend(), [&u](const peer_config& r) { return memcmp(r.public_key, u.public_key, sizeof(u.public_key)) == 0; });
+			if (r == running.peers.cend())
+			{
+				append_peer(data, u);
+				++iface.PeersCount;
+				continue;
+			}
+			if (r->other != u.other)
+				return false;
+			if (r->has_endpoint() && !u.has_endpoint())
+			{
+				// The driver cannot clear an endpoint. Remove the peer and add it again.
+				WIREGUARD_PEER peer = {};
+				peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_REMOVE;
+				memcpy(peer.PublicKey, u.public_key, sizeof(peer.PublicKey));
+				append(data, peer);
+				append_peer(data, u);
+				iface.PeersCount += 2;
+				continue;
+			}
+			WIREGUARD_PEER peer = {};
+			memcpy(peer.PublicKey, u.public_key, sizeof(peer.PublicKey));
+			peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_UPDATE;
+			if (r->has_preshared_key != u.has_preshared_key || memcmp(r->preshared_key, u.preshared_key, sizeof(u.preshared_key)) != 0)
+			{
+				peer.Flags |= WIREGUARD_PEER_HAS_PRESHARED_KEY;
+				memcpy(peer.PresharedKey, u.preshared_key, sizeof(peer.PresharedKey));
+			}
+			if (r->persistent_keepalive != u.persistent_keepalive)
+			{
+				peer.Flags |= WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE;
+				peer.PersistentKeepalive = u.persistent_keepalive;
+			}
+			if (u.has_endpoint() && (r->endpoint_host != u.endpoint_host || r->endpoint_port != u.endpoint_port))
+			{
+				peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+				u.resolve_endpoint(peer.Endpoint);
+			}
+			bool replace_allowed_ips = r->allowed_ips != u.allowed_ips;
+			if (replace_allowed_ips)
+			{
+				peer.Flags |= WIREGUARD_PEER_REPLACE_ALLOWED_IPS;
+				peer.AllowedIPsCount = (DWORD)u.allowed_ips.size();
+			}
+			else if (peer.Flags == (WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_UPDATE))
+				continue; // Peer did not change.
+			append(data, peer);
+			SecureZeroMemory(&peer, sizeof(peer));
+			if (replace_allowed_ips)
+				for (auto& a : u.allowed_ips)
+					append(data, a);
+			++iface.PeersCount;
+		}
+
+		memcpy(data.data(), &iface, sizeof(iface));
+		SecureZeroMemory(&iface, sizeof(iface));
+		return true;
+	}
+}
+
+bool operator<(_In_ const WIREGUARD_ALLOWED_IP& a, _In_ const WIREGUARD_ALLOWED_IP& b) noexcept
+{
+	if (a.AddressFamily != b.AddressFamily)
+		return a.AddressFamily < b.AddressFamily;
+	int r = memcmp(&a.Address, &b.Address, a.AddressFamily == AF_INET6 ? sizeof(IN6_ADDR) : sizeof(IN_ADDR));
+	if (r)
+		return r < 0;
+	return a.Cidr < b.Cidr;
+}
+
+bool operator==(_In_ const WIREGUARD_ALLOWED_IP& a, _In_ const WIREGUARD_ALLOWED_IP& b) noexcept
+{
+	return
+		a.AddressFamily == b.AddressFamily &&
+		a.Cidr == b.Cidr &&
+		memcmp(&a.Address, &b.Address, a.AddressFamily == AF_INET6 ? sizeof(IN6_ADDR) : sizeof(IN_ADDR)) == 0;
+}
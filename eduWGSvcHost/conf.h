@@ -0,0 +1,89 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "arena.h"
+#include "driver.h"
+#include <string>
+#include <vector>
+
+namespace wg
+{
+	// [Peer] section of wg-quick configuration
+	struct peer_config
+	{
+		BYTE public_key[WIREGUARD_KEY_LENGTH];
+		bool has_preshared_key;
+		BYTE preshared_key[WIREGUARD_KEY_LENGTH];
+		WORD persistent_keepalive;
+		std::string endpoint_host;
+		WORD endpoint_port;
+		std::vector<WIREGUARD_ALLOWED_IP> allowed_ips; // Sorted and masked
+		std::vector<std::string> other;                // Settings not handled by the driver
+
+		peer_config() noexcept;
+		virtual ~peer_config();
+
+		bool has_endpoint() const noexcept
+		{
+			return !endpoint_host.empty();
+		}
+
+		// Resolves endpoint host. Prefers IPv4 address when host resolves to both.
+		void resolve_endpoint(_Out_ SOCKADDR_INET& endpoint) const;
+
+		// Resolves all endpoint host addresses. The address resolve_endpoint() returns comes first, then families alternate.
+		void resolve_endpoint_candidates(_Out_ std::vector<SOCKADDR_INET>& candidates) const;
+	};
+
+	// wg-quick configuration
+	struct interface_config
+	{
+		BYTE private_key[WIREGUARD_KEY_LENGTH];
+		BYTE public_key[WIREGUARD_KEY_LENGTH]; // Derived from private key
+		WORD listen_port;
+		std::vector<std::string> other; // Validated [Interface] settings not handled by the driver
+		std::vector<peer_config> peers;
+
+		interface_config() noexcept;
+		virtual ~interface_config();
+
+		// Parses and validates wg-quick configuration. Errors are reported as invalid_argument with the line number.
+		void parse(_In_count_(config_len) const char* config, _In_ size_t config_len);
+
+		// Compiles configuration to driver format. Endpoints are resolved.
+		void compile(_Out_ std::vector<unsigned char, winstd::sanitizing_allocator<unsigned char>>& data) const;
+
+		// Copies wg-quick configuration replacing AllowedIPs lines of each peer with the allowed IPs of this configuration.
+		void rewrite_allowed_ips(_In_count_(config_len) const char* config, _In_ size_t config_len, _Out_ std::vector<char, secure_allocator<char>>& out) const;
+
+		// Returns false when routing table is not managed by the tunnel (Table = off).
+		bool has_routes() const noexcept;
+	};
+
+	// Copies wg-quick configuration for diagnostic traces. Values of PrivateKey and PresharedKey are replaced with their one-way hash,
+	// Endpoint hosts with a documentation address and comments are dropped. The copy still parses.
+	void sanitize_config(_In_count_(config_len) const char* config, _In_ size_t config_len, _Out_ std::vector<char>& out);
+
+	// Parses IP address with optional CIDR. The host bits are cleared.
+	void parse_allowed_ip(_In_count_(str_len) const char* str, _In_ size_t str_len, _Out_ WIREGUARD_ALLOWED_IP& allowed_ip);
+
+	// Builds driver configuration that changes running configuration to the new one in place. Only changed peers are included.
+	// A peer that lost its endpoint is removed and added again, which drops its session.
+	// Returns false when the change cannot be applied without restarting the tunnel.
+	bool make_configuration_update(
+		_In_ const interface_config& running,
+		_In_ const interface_config& updated,
+		_Out_ std::vector<unsigned char, winstd::sanitizing_allocator<unsigned char>>& data,
+		_Out_ std::vector<WIREGUARD_ALLOWED_IP>& routes_added,
+		_Out_ std::vector<WIREGUARD_ALLOWED_IP>& routes_removed);
+}
+
+// In the global namespace with WIREGUARD_ALLOWED_IP, so argument-dependent lookup finds them from std algorithms.
+bool operator<(_In_ const WIREGUARD_ALLOWED_IP& a, _In_ const WIREGUARD_ALLOWED_IP& b) noexcept;
+bool operator==(_In_ const WIREGUARD_ALLOWED_IP& a, _In_ const WIREGUARD_ALLOWED_IP& b) noexcept;
@@ -0,0 +1,569 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "crypto.h"
+#include <vector>
+
+namespace wg
+{
+	static inline DWORD rotr32(_In_ DWORD x, _In_ int n) noexcept
+	{
+		return (x >> n) | (x << (32 - n));
+	}
+
+	static inline DWORD rotl32(_In_ DWORD x, _In_ int n) noexcept
+	{
+		return (x << n) | (x >> (32 - n));
+	}
+
+	static inline DWORD load32(_In_reads_bytes_(4) const BYTE* p) noexcept
+	{
+		return (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+	}
+
+	static inline void store32(_Out_writes_bytes_(4) BYTE* p, _In_ DWORD x) noexcept
+	{
+		p[0] = (BYTE)x;
+		p[1] = (BYTE)(x >> 8);
+		p[2] = (BYTE)(x >> 16);
+		p[3] = (BYTE)(x >> 24);
+	}
+
+	static const DWORD blake2s_iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	static const BYTE blake2s_sigma[10][16] = {
+		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+		{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+		{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+		{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+		{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+		{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+		{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+		{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+		{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+		{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+	};
+
+	blake2s::blake2s(_In_ size_t out_len, _In_reads_bytes_opt_(key_len) const void* key, _In_ size_t key_len) noexcept :
+		m_t{ 0, 0 },
+		m_buf_len(0),
+		m_out_len(out_len)
+	{
+		memcpy(m_h, blake2s_iv, sizeof(m_h));
+		m_h[0] ^= 0x01010000 ^ ((DWORD)key_len << 8) ^ (DWORD)out_len;
+		if (key_len)
+		{
+			memset(m_buf, 0, sizeof(m_buf));
+			memcpy(m_buf, key, key_len);
+			m_buf_len = block_size;
+		}
+	}
+
+	blake2s::~blake2s()
+	{
+		SecureZeroMemory(m_h, sizeof(m_h));
+		SecureZeroMemory(m_buf, sizeof(m_buf));
+	}
+
+	void blake2s::compress(_In_ bool last) noexcept
+	{
+		DWORD m[16], v[16];
+		for (size_t i = 0; i < 16; ++i)
+			m[i] = load32(m_buf + i * 4);
+		memcpy(v, m_h, sizeof(m_h));
+		memcpy(v + 8, blake2s_iv, sizeof(blake2s_iv));
+		v[12] ^= m_t[0];
+		v[13] ^= m_t[1];
+		if (last)
+			v[14] = ~v[14];
+#define G(a, b, c, d, x, y) \
+			v[a] += v[b] + (x); v[d] = rotr32(v[d] ^ v[a], 16); \
+			v[c] += v[d];       v[b] = rotr32(v[b] ^ v[c], 12); \
+			v[a] += v[b] + (y); v[d] = rotr32(v[d] ^ v[a], 8); \
+			v[c] += v[d];       v[b] = rotr32(v[b] ^ v[c], 7);
+		for (size_t r = 0; r < 10; ++r)
+		{
+			auto s = blake2s_sigma[r];
+			G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+			G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+			G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+			G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+			G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+			G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+			G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+			G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+#undef G
+		for (size_t i = 0; i < 8; ++i)
+			m_h[i] ^= v[i] ^ v[i + 8];
+		SecureZeroMemory(m, sizeof(m));
+		SecureZeroMemory(v, sizeof(v));
+	}
+
+	void blake2s::update(_In_reads_bytes_(size) const void* data, _In_ size_t size) noexcept
+	{
+		auto p = static_cast<const BYTE*>(data);
+		while (size)
+		{
+			if (m_buf_len == block_size)
+			{
+				// Compress full block only when more data follows. The last block is compressed by final().
+				m_t[0] += block_size;
+				if (m_t[0] < block_size)
+					++m_t[1];
+				compress(false);
+				m_buf_len = 0;
+			}
+			size_t n = block_size - m_buf_len;
+			if (n > size)
+				n = size;
+			memcpy(m_buf + m_buf_len, p, n);
+			m_buf_len += n;
+			p += n;
+			size -= n;
+		}
+	}
+
+	void blake2s::final(_Out_writes_bytes_(m_out_len) BYTE* out) noexcept
+	{
+		m_t[0] += (DWORD)m_buf_len;
+		if (m_t[0] < m_buf_len)
+			++m_t[1];
+		memset(m_buf + m_buf_len, 0, block_size - m_buf_len);
+		compress(true);
+		BYTE digest[hash_size];
+		for (size_t i = 0; i < 8; ++i)
+			store32(digest + i * 4, m_h[i]);
+		memcpy(out, digest, m_out_len);
+		SecureZeroMemory(digest, sizeof(digest));
+	}
+
+	void hmac_blake2s(
+		_In_reads_bytes_(key_len) const void* key, _In_ size_t key_len,
+		_In_reads_bytes_(size) const void* data, _In_ size_t size,
+		_Out_writes_bytes_(blake2s::hash_size) BYTE* out) noexcept
+	{
+		BYTE k[blake2s::block_size] = {}, pad[blake2s::block_size], inner[blake2s::hash_size];
+		if (key_len > blake2s::block_size)
+		{
+			blake2s h;
+			h.update(key, key_len);
+			h.final(k);
+		}
+		else
+			memcpy(k, key, key_len);
+
+		for (size_t i = 0; i < blake2s::block_size; ++i)
+			pad[i] = k[i] ^ 0x36;
+		{
+			blake2s h;
+			h.update(pad, sizeof(pad));
+			h.update(data, size);
+			h.final(inner);
+		}
+		for (size_t i = 0; i < blake2s::block_size; ++i)
+			pad[i] = k[i] ^ 0x5c;
+		{
+			blake2s h;
+			h.update(pad, sizeof(pad));
+			h.update(inner, sizeof(inner));
+			h.final(out);
+		}
+		SecureZeroMemory(k, sizeof(k));
+		SecureZeroMemory(pad, sizeof(pad));
+		SecureZeroMemory(inner, sizeof(inner));
+	}
+
+	static void chacha20_block(_In_reads_(16) const DWORD* input, _Out_writes_bytes_(64) BYTE* out) noexcept
+	{
+		DWORD x[16];
+		memcpy(x, input, sizeof(x));
+#define QR(a, b, c, d) \
+			x[a] += x[b]; x[d] = rotl32(x[d] ^ x[a], 16); \
+			x[c] += x[d]; x[b] = rotl32(x[b] ^ x[c], 12); \
+			x[a] += x[b]; x[d] = rotl32(x[d] ^ x[a], 8); \
+			x[c] += x[d]; x[b] = rotl32(x[b] ^ x[c], 7);
+		for (int i = 0; i < 10; ++i)
+		{
+			QR(0, 4, 8, 12);
+			QR(1, 5, 9, 13);
+			QR(2, 6, 10, 14);
+			QR(3, 7, 11, 15);
+			QR(0, 5, 10, 15);
+			QR(1, 6, 11, 12);
+			QR(2, 7, 8, 13);
+			QR(3, 4, 9, 14);
+		}
+#undef QR
+		for (size_t i = 0; i < 16; ++i)
+			store32(out + i * 4, x[i] + input[i]);
+		SecureZeroMemory(x, sizeof(x));
+	}
+
+	// Poly1305 over whole 16-byte blocks
+	class poly1305
+	{
+	private:
+		DWORD r[5], h[5], pad[4];
+
+	public:
+		poly1305(_In_reads_bytes_(32) const BYTE* key) noexcept
+		{
+			r[0] = (load32(key + 0)) & 0x3ffffff;
+			r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+			r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+			r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+			r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+			memset(h, 0, sizeof(h));
+			for (size_t i = 0; i < 4; ++i)
+				pad[i] = load32(key + 16 + i * 4);
+		}
+
+		~poly1305()
+		{
+			SecureZeroMemory(r, sizeof(r));
+			SecureZeroMemory(h, sizeof(h));
+			SecureZeroMemory(pad, sizeof(pad));
+		}
+
+		void blocks(_In_reads_bytes_(size) const BYTE* m, _In_ size_t size) noexcept
+		{
+			const DWORD s1 = r[1] * 5, s2 = r[2] * 5, s3 = r[3] * 5, s4 = r[4] * 5;
+			DWORD h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3], h4 = h[4];
+			for (; size >= 16; m += 16, size -= 16)
+			{
+				h0 += (load32(m + 0)) & 0x3ffffff;
+				h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+				h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+				h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+				h4 += (load32(m + 12) >> 8) | (1 << 24);
+
+				ULONGLONG d0 = (ULONGLONG)h0 * r[0] + (ULONGLONG)h1 * s4 + (ULONGLONG)h2 * s3 + (ULONGLONG)h3 * s2 + (ULONGLONG)h4 * s1;
+				ULONGLONG d1 = (ULONGLONG)h0 * r[1] + (ULONGLONG)h1 * r[0] + (ULONGLONG)h2 * s4 + (ULONGLONG)h3 * s3 + (ULONGLONG)h4 * s2;
+				ULONGLONG d2 = (ULONGLONG)h0 * r[2] + (ULONGLONG)h1 * r[1] + (ULONGLONG)h2 * r[0] + (ULONGLONG)h3 * s4 + (ULONGLONG)h4 * s3;
+				ULONGLONG d3 = (ULONGLONG)h0 * r[3] + (ULONGLONG)h1 * r[2] + (ULONGLONG)h2 * r[1] + (ULONGLONG)h3 * r[0] + (ULONGLONG)h4 * s4;
+				ULONGLONG d4 = (ULONGLONG)h0 * r[4] + (ULONGLONG)h1 * r[3] + (ULONGLONG)h2 * r[2] + (ULONGLONG)h3 * r[1] + (ULONGLONG)h4 * r[0];
+
+				DWORD c;
+				c = (DWORD)(d0 >> 26); h0 = (DWORD)d0 & 0x3ffffff;
+				d1 += c; c = (DWORD)(d1 >> 26); h1 = (DWORD)d1 & 0x3ffffff;
+				d2 += c; c = (DWORD)(d2 >> 26); h2 = (DWORD)d2 & 0x3ffffff;
+				d3 += c; c = (DWORD)(d3 >> 26); h3 = (DWORD)d3 & 0x3ffffff;
+				d4 += c; c = (DWORD)(d4 >> 26); h4 = (DWORD)d4 & 0x3ffffff;
+				h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+				h1 += c;
+			}
+			h[0] = h0; h[1] = h1; h[2] = h2; h[3] = h3; h[4] = h4;
+		}
+
+		void final(_Out_writes_bytes_(16) BYTE* mac) noexcept
+		{
+			DWORD h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3], h4 = h[4], c;
+			c = h1 >> 26; h1 &= 0x3ffffff;
+			h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+			h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+			h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+			h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+			h1 += c;
+
+			// Compute h - p and select it when it does not underflow.
+			DWORD g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+			DWORD g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+			DWORD g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+			DWORD g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+			DWORD g4 = h4 + c - (1 << 26);
+			DWORD mask = (g4 >> 31) - 1;
+			g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+			mask = ~mask;
+			h0 = (h0 & mask) | g0;
+			h1 = (h1 & mask) | g1;
+			h2 = (h2 & mask) | g2;
+			h3 = (h3 & mask) | g3;
+			h4 = (h4 & mask) | g4;
+
+			h0 = h0 | (h1 << 26);
+			h1 = (h1 >> 6) | (h2 << 20);
+			h2 = (h2 >> 12) | (h3 << 14);
+			h3 = (h3 >> 18) | (h4 << 8);
+
+			ULONGLONG f;
+			f = (ULONGLONG)h0 + pad[0];             store32(mac + 0, (DWORD)f);
+			f = (ULONGLONG)h1 + pad[1] + (f >> 32); store32(mac + 4, (DWORD)f);
+			f = (ULONGLONG)h2 + pad[2] + (f >> 32); store32(mac + 8, (DWORD)f);
+			f = (ULONGLONG)h3 + pad[3] + (f >> 32); store32(mac + 12, (DWORD)f);
+		}
+	};
+
+	void chacha20poly1305_seal_with_nonce(
+		_In_reads_bytes_(32) const BYTE* key, _In_reads_bytes_(12) const BYTE* nonce,
+		_In_reads_bytes_(size) const void* data, _In_ size_t size,
+		_In_reads_bytes_(ad_len) const void* ad, _In_ size_t ad_len,
+		_Out_writes_bytes_(size + 16) BYTE* out) noexcept
+	{
+		DWORD state[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+		for (size_t i = 0; i < 8; ++i)
+			state[4 + i] = load32(key + i * 4);
+		state[12] = 0;
+		for (size_t i = 0; i < 3; ++i)
+			state[13 + i] = load32(nonce + i * 4);
+
+		BYTE block[64];
+		chacha20_block(state, block);
+		poly1305 mac(block);
+
+		auto in = static_cast<const BYTE*>(data);
+		for (size_t offset = 0; offset < size; offset += sizeof(block))
+		{
+			++state[12];
+			chacha20_block(state, block);
+			for (size_t i = 0; i < sizeof(block) && offset + i < size; ++i)
+				out[offset + i] = in[offset + i] ^ block[i];
+		}
+
+		auto authenticate = [&mac](_In_reads_bytes_(n) const BYTE* p, _In_ size_t n)
+		{
+			mac.blocks(p, n & ~(size_t)15);
+			if (n & 15)
+			{
+				BYTE last[16] = {};
+				memcpy(last, p + (n & ~(size_t)15), n & 15);
+				mac.blocks(last, sizeof(last));
+			}
+		};
+		authenticate(static_cast<const BYTE*>(ad), ad_len);
+		authenticate(out, size);
+		BYTE lengths[16];
+		store32(lengths + 0, (DWORD)ad_len);
+		store32(lengths + 4, (DWORD)((ULONGLONG)ad_len >> 32));
+		store32(lengths + 8, (DWORD)size);
+		store32(lengths + 12, (DWORD)((ULONGLONG)size >> 32));
+		mac.blocks(lengths, sizeof(lengths));
+		mac.final(out + size);
+		SecureZeroMemory(block, sizeof(block));
+		SecureZeroMemory(state, sizeof(state));
+	}
+
+	void chacha20poly1305_seal(
+		_In_reads_bytes_(32) const BYTE* key, _In_ ULONGLONG counter,
+		_In_reads_bytes_(size) const void* data, _In_ size_t size,
+		_In_reads_bytes_(ad_len) const void* ad, _In_ size_t ad_len,
+		_Out_writes_bytes_(size + 16) BYTE* out) noexcept
+	{
+		BYTE nonce[12] = {};
+		store32(nonce + 4, (DWORD)counter);
+		store32(nonce + 8, (DWORD)(counter >> 32));
+		chacha20poly1305_seal_with_nonce(key, nonce, data, size, ad, ad_len, out);
+	}
+
+	// Field element of GF(2^255-19) in 16 limbs of 16 bits
+	typedef LONGLONG fe[16];
+
+	static void fe_carry(_Inout_ fe o) noexcept
+	{
+		for (size_t i = 0; i < 16; ++i)
+		{
+			o[i] += (LONGLONG)1 << 16;
+			LONGLONG c = o[i] >> 16;
+			if (i < 15)
+				o[i + 1] += c - 1;
+			else
+				o[0] += 38 * (c - 1);
+			o[i] -= c * ((LONGLONG)1 << 16);
+		}
+	}
+
+	// Swaps p and q when b is 1, in constant time.
+	static void fe_cswap(_Inout_ fe p, _Inout_ fe q, _In_ int b) noexcept
+	{
+		LONGLONG c = ~((LONGLONG)b - 1);
+		for (size_t i = 0; i < 16; ++i)
+		{
+			LONGLONG t = c & (p[i] ^ q[i]);
+			p[i] ^= t;
+			q[i] ^= t;
+		}
+	}
+
+	static void fe_pack(_Out_writes_bytes_(32) BYTE* o, _In_ const fe n) noexcept
+	{
+		fe m, t;
+		memcpy(t, n, sizeof(t));
+		fe_carry(t);
+		fe_carry(t);
+		fe_carry(t);
+		for (int j = 0; j < 2; ++j)
+		{
+			m[0] = t[0] - 0xffed;
+			for (size_t i = 1; i < 15; ++i)
+			{
+				m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+				m[i - 1] &= 0xffff;
+			}
+			m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+			int b = (int)((m[15] >> 16) & 1);
+			m[14] &= 0xffff;
+			fe_cswap(t, m, 1 - b);
+		}
+		for (size_t i = 0; i < 16; ++i)
+		{
+			o[2 * i] = (BYTE)(t[i] & 0xff);
+			o[2 * i + 1] = (BYTE)(t[i] >> 8);
+		}
+	}
+
+	static void fe_unpack(_Out_ fe o, _In_reads_bytes_(32) const BYTE* n) noexcept
+	{
+		for (size_t i = 0; i < 16; ++i)
+			o[i] = n[2 * i] + ((LONGLONG)n[2 * i + 1] << 8);
+		o[15] &= 0x7fff;
+	}
+
+	static void fe_add(_Out_ fe o, _In_ const fe a, _In_ const fe b) noexcept
+	{
+		for (size_t i = 0; i < 16; ++i)
+			o[i] = a[i] + b[i];
+	}
+
+	static void fe_sub(_Out_ fe o, _In_ const fe a, _In_ const fe b) noexcept
+	{
+		for (size_t i = 0; i < 16; ++i)
+			o[i] = a[i] - b[i];
+	}
+
+	static void fe_mul(_Out_ fe o, _In_ const fe a, _In_ const fe b) noexcept
+	{
+		LONGLONG t[31] = {};
+		for (size_t i = 0; i < 16; ++i)
+			for (size_t j = 0; j < 16; ++j)
+				t[i + j] += a[i] * b[j];
+		for (size_t i = 0; i < 15; ++i)
+			t[i] += 38 * t[i + 16];
+		memcpy(o, t, sizeof(fe));
+		fe_carry(o);
+		fe_carry(o);
+	}
+
+	static void fe_inv(_Out_ fe o, _In_ const fe i) noexcept
+	{
+		fe c;
+		memcpy(c, i, sizeof(c));
+		for (int a = 253; a >= 0; --a)
+		{
+			fe_mul(c, c, c);
+			if (a != 2 && a != 4)
+				fe_mul(c, c, i);
+		}
+		memcpy(o, c, sizeof(c));
+	}
+
+	// Montgomery ladder. Returns projective x-coordinate x_out / z_out of scalar * point.
+	static void x25519_ladder(_Out_ fe x_out, _Out_ fe z_out, _In_reads_bytes_(32) const BYTE* scalar, _In_reads_bytes_(32) const BYTE* point) noexcept
+	{
+		static const fe a24 = { 0xdb41, 1 };
+		BYTE z[32];
+		memcpy(z, scalar, sizeof(z));
+		z[31] = (z[31] & 127) | 64;
+		z[0] &= 248;
+		fe x, a = { 1 }, b, c = {}, d = { 1 }, e, f;
+		fe_unpack(x, point);
+		memcpy(b, x, sizeof(b));
+		for (int i = 254; i >= 0; --i)
+		{
+			int r = (z[i >> 3] >> (i & 7)) & 1;
+			fe_cswap(a, b, r);
+			fe_cswap(c, d, r);
+			fe_add(e, a, c);
+			fe_sub(a, a, c);
+			fe_add(c, b, d);
+			fe_sub(b, b, d);
+			fe_mul(d, e, e);
+			fe_mul(f, a, a);
+			fe_mul(a, c, a);
+			fe_mul(c, b, e);
+			fe_add(e, a, c);
+			fe_sub(a, a, c);
+			fe_mul(b, a, a);
+			fe_sub(c, d, f);
+			fe_mul(a, c, a24);
+			fe_add(a, a, d);
+			fe_mul(c, c, a);
+			fe_mul(a, d, f);
+			fe_mul(d, b, x);
+			fe_mul(b, e, e);
+			fe_cswap(a, b, r);
+			fe_cswap(c, d, r);
+		}
+		memcpy(x_out, a, sizeof(a));
+		memcpy(z_out, c, sizeof(c));
+		SecureZeroMemory(z, sizeof(z));
+		SecureZeroMemory(a, sizeof(a));
+		SecureZeroMemory(b, sizeof(b));
+		SecureZeroMemory(c, sizeof(c));
+		SecureZeroMemory(d, sizeof(d));
+		SecureZeroMemory(e, sizeof(e));
+		SecureZeroMemory(f, sizeof(f));
+	}
+
+	void x25519(_Out_writes_bytes_(32) BYTE* out, _In_reads_bytes_(32) const BYTE* scalar, _In_reads_bytes_(32) const BYTE* point) noexcept
+	{
+		fe x, z;
+		x25519_ladder(x, z, scalar, point);
+		fe_inv(z, z);
+		fe_mul(x, x, z);
+		fe_pack(out, x);
+		SecureZeroMemory(x, sizeof(x));
+		SecureZeroMemory(z, sizeof(z));
+	}
+
+	static const BYTE x25519_base_point[32] = { 9 };
+
+	void x25519_base(_Out_writes_bytes_(32) BYTE* out, _In_reads_bytes_(32) const BYTE* scalar) noexcept
+	{
+		x25519(out, scalar, x25519_base_point);
+	}
+
+	void x25519_base_batch(_In_ size_t count, _Out_writes_bytes_(count * 32) BYTE* out, _In_reads_bytes_(count * 32) const BYTE* scalars)
+	{
+		if (!count)
+			return;
+
+		// Montgomery's trick: with prefix[i] = z[0] * ... * z[i], one inversion of prefix[count - 1] yields all 1/z[i].
+		// Clamped scalars are never multiples of the base point order, so no z[i] is zero.
+		std::vector<LONGLONG> x(count * 16), z(count * 16), prefix(count * 16);
+		auto at = [](std::vector<LONGLONG>& v, size_t i) { return v.data() + i * 16; };
+		for (size_t i = 0; i < count; ++i)
+		{
+			x25519_ladder(at(x, i), at(z, i), scalars + i * 32, x25519_base_point);
+			if (i)
+				fe_mul(at(prefix, i), at(prefix, i - 1), at(z, i));
+			else
+				memcpy(at(prefix, i), at(z, i), sizeof(fe));
+		}
+		fe inv, z_inv;
+		fe_inv(inv, at(prefix, count - 1));
+		for (size_t i = count; i-- > 0;)
+		{
+			if (i)
+			{
+				fe_mul(z_inv, inv, at(prefix, i - 1));
+				fe_mul(inv, inv, at(z, i));
+			}
+			else
+				memcpy(z_inv, inv, sizeof(fe));
+			fe_mul(z_inv, at(x, i), z_inv);
+			fe_pack(out + i * 32, z_inv);
+		}
+		SecureZeroMemory(x.data(), x.size() * sizeof(LONGLONG));
+		SecureZeroMemory(z.data(), z.size() * sizeof(LONGLONG));
+		SecureZeroMemory(prefix.data(), prefix.size() * sizeof(LONGLONG));
+		SecureZeroMemory(inv, sizeof(inv));
+		SecureZeroMemory(z_inv, sizeof(z_inv));
+	}
+}
@@ -0,0 +1,69 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+
+namespace wg
+{
+	// BLAKE2s hash (RFC 7693)
+	class blake2s
+	{
+	private:
+		DWORD m_h[8];
+		DWORD m_t[2];
+		BYTE m_buf[64];
+		size_t m_buf_len;
+		size_t m_out_len;
+
+		void compress(_In_ bool last) noexcept;
+
+	public:
+		static const size_t hash_size = 32;
+		static const size_t block_size = 64;
+
+		// out_len: Digest size in bytes (1-32)
+		// key: Optional key of up to 32 bytes
+		blake2s(_In_ size_t out_len = hash_size, _In_reads_bytes_opt_(key_len) const void* key = NULL, _In_ size_t key_len = 0) noexcept;
+		~blake2s();
+
+		void update(_In_reads_bytes_(size) const void* data, _In_ size_t size) noexcept;
+		void final(_Out_writes_bytes_(m_out_len) BYTE* out) noexcept;
+	};
+
+	// HMAC-BLAKE2s
+	void hmac_blake2s(
+		_In_reads_bytes_(key_len) const void* key, _In_ size_t key_len,
+		_In_reads_bytes_(size) const void* data, _In_ size_t size,
+		_Out_writes_bytes_(blake2s::hash_size) BYTE* out) noexcept;
+
+	// ChaCha20-Poly1305 AEAD (RFC 8439) with WireGuard nonce: 32 zero bits followed by 64-bit little-endian counter.
+	// out receives size + 16 bytes: ciphertext followed by tag.
+	void chacha20poly1305_seal(
+		_In_reads_bytes_(32) const BYTE* key, _In_ ULONGLONG counter,
+		_In_reads_bytes_(size) const void* data, _In_ size_t size,
+		_In_reads_bytes_(ad_len) const void* ad, _In_ size_t ad_len,
+		_Out_writes_bytes_(size + 16) BYTE* out) noexcept;
+
+	// Same with explicit 96-bit nonce
+	void chacha20poly1305_seal_with_nonce(
+		_In_reads_bytes_(32) const BYTE* key, _In_reads_bytes_(12) const BYTE* nonce,
+		_In_reads_bytes_(size) const void* data, _In_ size_t size,
+		_In_reads_bytes_(ad_len) const void* ad, _In_ size_t ad_len,
+		_Out_writes_bytes_(size + 16) BYTE* out) noexcept;
+
+	// X25519 Diffie-Hellman (RFC 7748). Constant time in scalar.
+	void x25519(_Out_writes_bytes_(32) BYTE* out, _In_reads_bytes_(32) const BYTE* scalar, _In_reads_bytes_(32) const BYTE* point) noexcept;
+
+	// Derives public key of private key.
+	void x25519_base(_Out_writes_bytes_(32) BYTE* out, _In_reads_bytes_(32) const BYTE* scalar) noexcept;
+
+	// Derives public keys of count private keys. Shares one field inversion among all keys: each key takes 2554 field
+	// multiplications instead of 3057, about a sixth fewer. bench/keybench.cpp measures it. Constant time in scalars.
+	void x25519_base_batch(_In_ size_t count, _Out_writes_bytes_(count * 32) BYTE* out, _In_reads_bytes_(count * 32) const BYTE* scalars);
+}
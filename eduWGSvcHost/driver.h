@@ -40,6 +40,8 @@ namespace wg
 
 		static void init()
 		{
+			if (WireGuardOpenAdapter)
+				return; // Already bound, possibly to the fake backend.
 			dll = LoadLibraryExW(L"wireguard.dll", NULL, LOAD_LIBRARY_SEARCH_APPLICATION_DIR | LOAD_LIBRARY_SEARCH_SYSTEM32);
 			if (!dll)
 				throw winstd::win_runtime_error("Failed to load wireguard.dll");
@@ -70,20 +72,33 @@ namespace wg
 			}
 
 		public:
-			void get_configuration(_Inout_ std::vector<unsigned char, winstd::sanitizing_allocator<unsigned char>>& data)
+			template <class _Alloc>
+			void get_configuration(_Inout_ std::vector<unsigned char, _Alloc>& data)
 			{
-				DWORD bytes = (DWORD)data.size();
+				DWORD size_hint = (DWORD)data.size();
+				get_configuration(data, size_hint);
+			}
+
+			// Retrieves configuration starting with a buffer of size_hint bytes. On return, size_hint is updated to the size of configuration.
+			// Configuration is placed at offset, leaving room for a message header in front of it.
+			template <class _Alloc>
+			void get_configuration(_Inout_ std::vector<unsigned char, _Alloc>& data, _Inout_ DWORD& size_hint, _In_ size_t offset = 0)
+			{
+				if (data.size() < offset + size_hint)
+					data.resize(offset + size_hint);
+				DWORD bytes = (DWORD)(data.size() - offset);
 				for (;;)
 				{
-					if (WireGuardGetConfiguration(m_h, reinterpret_cast<WIREGUARD_INTERFACE*>(data.data()), &bytes))
+					if (WireGuardGetConfiguration(m_h, reinterpret_cast<WIREGUARD_INTERFACE*>(data.data() + offset), &bytes))
 					{
-						data.erase(data.cbegin() + bytes, data.cend());
+						data.resize(offset + bytes);
+						size_hint = bytes;
 						break;
 					}
 					DWORD err = GetLastError();
 					if (err != ERROR_MORE_DATA)
 						throw winstd::win_runtime_error(err, "WireGuardGetConfiguration failed");
-					data.insert(data.cend(), bytes - data.size(), 0);
+					data.resize(offset + bytes);
 				}
 			}
 		};
@@ -0,0 +1,210 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "engine.h"
+#include <WS2tcpip.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace winstd;
+
+namespace wg
+{
+	static const ULONG default_mtu = 1420;
+
+	void update_route(_In_ const NET_LUID& luid, _In_ const WIREGUARD_ALLOWED_IP& allowed_ip, _In_ bool add)
+	{
+		MIB_IPFORWARD_ROW2 row;
+		InitializeIpForwardEntry(&row);
+		row.InterfaceLuid = luid;
+		row.DestinationPrefix.Prefix.si_family = allowed_ip.AddressFamily;
+		if (allowed_ip.AddressFamily == AF_INET6)
+		{
+			row.DestinationPrefix.Prefix.Ipv6.sin6_addr = allowed_ip.Address.V6;
+			row.NextHop.si_family = AF_INET6;
+		}
+		else
+		{
+			row.DestinationPrefix.Prefix.Ipv4.sin_addr = allowed_ip.Address.V4;
+			row.NextHop.si_family = AF_INET;
+		}
+		row.DestinationPrefix.PrefixLength = allowed_ip.Cidr;
+		row.Metric = 0;
+		DWORD err = add ? CreateIpForwardEntry2(&row) : DeleteIpForwardEntry2(&row);
+		if (err != NO_ERROR && err != ERROR_OBJECT_ALREADY_EXISTS && err != ERROR_NOT_FOUND)
+			throw win_runtime_error(err, add ? "CreateIpForwardEntry2 failed" : "DeleteIpForwardEntry2 failed");
+	}
+
+	// Returns values of [Interface] setting. Settings were validated by interface_config::parse().
+	static vector<string> setting_values(_In_ const interface_config& config, _In_z_ const char* key)
+	{
+		vector<string> values;
+		size_t key_len = strlen(key);
+		for (auto& o : config.other)
+		{
+			if (o.size() <= key_len || o[key_len] != '=' || _strnicmp(o.c_str(), key, key_len) != 0)
+				continue;
+			for (size_t b = key_len + 1; b < o.size();)
+			{
+				size_t e = o.find(',', b);
+				if (e == string::npos)
+					e = o.size();
+				size_t vb = o.find_first_not_of(" \t", b), ve = o.find_last_not_of(" \t", e - 1);
+				if (vb < e && ve != string::npos && ve >= vb)
+					values.push_back(o.substr(vb, ve - vb + 1));
+				b = e + 1;
+			}
+		}
+		return values;
+	}
+
+	static void set_mtu(_In_ const NET_LUID& luid, _In_ ADDRESS_FAMILY family, _In_ ULONG mtu)
+	{
+		MIB_IPINTERFACE_ROW row;
+		InitializeIpInterfaceEntry(&row);
+		row.Family = family;
+		row.InterfaceLuid = luid;
+		DWORD err = GetIpInterfaceEntry(&row);
+		if (err == ERROR_NOT_FOUND)
+			return; // Protocol is not bound to the adapter.
+		if (err != NO_ERROR)
+			throw win_runtime_error(err, "GetIpInterfaceEntry failed");
+		row.NlMtu = mtu;
+		if (family == AF_INET)
+			row.SitePrefixLength = 0;
+		err = SetIpInterfaceEntry(&row);
+		if (err != NO_ERROR)
+			throw win_runtime_error(err, "SetIpInterfaceEntry failed");
+	}
+
+	static void add_address(_In_ const NET_LUID& luid, _In_ const string& address)
+	{
+		MIB_UNICASTIPADDRESS_ROW row;
+		InitializeUnicastIpAddressEntry(&row);
+		row.InterfaceLuid = luid;
+		auto slash = address.find('/');
+		string host = address.substr(0, slash);
+		if (InetPtonA(AF_INET, host.c_str(), &row.Address.Ipv4.sin_addr) == 1)
+		{
+			row.Address.si_family = AF_INET;
+			row.OnLinkPrefixLength = 32;
+		}
+		else if (InetPtonA(AF_INET6, host.c_str(), &row.Address.Ipv6.sin6_addr) == 1)
+		{
+			row.Address.si_family = AF_INET6;
+			row.OnLinkPrefixLength = 128;
+		}
+		else
+			throw invalid_argument(string_printf("Invalid address: %s", address.c_str()));
+		if (slash != string::npos)
+			row.OnLinkPrefixLength = (UINT8)strtoul(address.c_str() + slash + 1, NULL, 10);
+		row.DadState = IpDadStatePreferred;
+		DWORD err = CreateUnicastIpAddressEntry(&row);
+		if (err != NO_ERROR && err != ERROR_OBJECT_ALREADY_EXISTS)
+			throw win_runtime_error(err, "CreateUnicastIpAddressEntry failed");
+	}
+
+	// Sets DNS servers and search domains in the TCP/IP interface registry keys the DNS client watches. Works on all Windows 10
+	// builds, unlike SetInterfaceDnsSettings().
+	static void set_dns(_In_ const NET_LUID& luid, _In_ const vector<string>& dns)
+	{
+		string servers[2], search_list;
+		for (auto& d : dns)
+		{
+			IN6_ADDR addr;
+			string* list =
+				InetPtonA(AF_INET, d.c_str(), &addr) == 1 ? &servers[0] :
+				InetPtonA(AF_INET6, d.c_str(), &addr) == 1 ? &servers[1] :
+				&search_list;
+			if (!list->empty())
+				*list += ',';
+			*list += d;
+		}
+
+		GUID guid;
+		DWORD err = ConvertInterfaceLuidToGuid(&luid, &guid);
+		if (err != NO_ERROR)
+			throw win_runtime_error(err, "ConvertInterfaceLuidToGuid failed");
+		wstring guid_str = wstring_printf(L"{%08lX-%04hX-%04hX-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+			guid.Data1, guid.Data2, guid.Data3,
+			guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3], guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7]);
+		static const LPCWSTR stacks[] = { L"Tcpip", L"Tcpip6" };
+		for (size_t i = 0; i < _countof(stacks); ++i)
+		{
+			reg_key key;
+			err = RegOpenKeyExW(HKEY_LOCAL_MACHINE, wstring_printf(L"SYSTEM\\CurrentControlSet\\Services\\%s\\Parameters\\Interfaces\\%s", stacks[i], guid_str.c_str()).c_str(), 0, KEY_SET_VALUE, key);
+			if (err == ERROR_FILE_NOT_FOUND)
+				continue; // Protocol is not bound to the adapter.
+			if (err != ERROR_SUCCESS)
+				throw win_runtime_error(err, "RegOpenKeyEx failed");
+			wstring value(servers[i].cbegin(), servers[i].cend());
+			err = RegSetValueExW(key, L"NameServer", 0, REG_SZ, reinterpret_cast<const BYTE*>(value.c_str()), (DWORD)((value.size() + 1) * sizeof(WCHAR)));
+			if (err != ERROR_SUCCESS)
+				throw win_runtime_error(err, "RegSetValueEx failed");
+			value.assign(search_list.cbegin(), search_list.cend());
+			err = RegSetValueExW(key, L"SearchList", 0, REG_SZ, reinterpret_cast<const BYTE*>(value.c_str()), (DWORD)((value.size() + 1) * sizeof(WCHAR)));
+			if (err != ERROR_SUCCESS)
+				throw win_runtime_error(err, "RegSetValueEx failed");
+		}
+	}
+
+	void check_engine_config(_In_ const interface_config& config)
+	{
+		if (!config.has_routes())
+			return;
+		for (auto& p : config.peers)
+			for (auto& a : p.allowed_ips)
+				if (!a.Cidr)
+					throw invalid_argument("Tunnel engine has no firewall to keep traffic from leaking around a default route; disable TunnelEngine to use this configuration");
+	}
+
+	tunnel_engine::tunnel_engine(_In_z_ LPCWSTR name, _In_z_ LPCWSTR tunnel_type, _In_ const interface_config& config)
+	{
+		m_adapter = driver::WireGuardCreateAdapter(name, tunnel_type, NULL);
+		if (!m_adapter)
+			throw win_runtime_error("WireGuardCreateAdapter failed");
+		{
+			vector<unsigned char, sanitizing_allocator<unsigned char>> data;
+			config.compile(data);
+			if (!driver::WireGuardSetConfiguration(m_adapter, reinterpret_cast<const WIREGUARD_INTERFACE*>(data.data()), (DWORD)data.size()))
+				throw win_runtime_error("WireGuardSetConfiguration failed");
+		}
+
+		NET_LUID luid;
+		driver::WireGuardGetAdapterLUID(m_adapter, &luid);
+		auto mtu_values = setting_values(config, "mtu");
+		ULONG mtu = mtu_values.empty() ? default_mtu : strtoul(mtu_values.back().c_str(), NULL, 10);
+		set_mtu(luid, AF_INET, mtu);
+		set_mtu(luid, AF_INET6, mtu);
+		for (auto& a : setting_values(config, "address"))
+			add_address(luid, a);
+		if (config.has_routes())
+			for (auto& p : config.peers)
+				for (auto& a : p.allowed_ips)
+					update_route(luid, a, true);
+		auto dns = setting_values(config, "dns");
+		if (!dns.empty())
+			set_dns(luid, dns);
+
+		if (!driver::WireGuardSetAdapterState(m_adapter, WIREGUARD_ADAPTER_STATE_UP))
+			throw win_runtime_error("WireGuardSetAdapterState failed");
+	}
+
+	tunnel_engine::~tunnel_engine()
+	{
+		driver::WireGuardSetAdapterState(m_adapter, WIREGUARD_ADAPTER_STATE_DOWN);
+	}
+
+	bool tunnel_engine::alive() const noexcept
+	{
+		WIREGUARD_ADAPTER_STATE state;
+		return driver::WireGuardGetAdapterState(m_adapter, &state) && state == WIREGUARD_ADAPTER_STATE_UP;
+	}
+}
@@ -0,0 +1,44 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "conf.h"
+#include "driver.h"
+#include <iphlpapi.h>
+
+namespace wg
+{
+	// Adds or removes route to allowed IP via interface.
+	void update_route(_In_ const NET_LUID& luid, _In_ const WIREGUARD_ALLOWED_IP& allowed_ip, _In_ bool add);
+
+	// Throws when configuration routes a default route (0.0.0.0/0 or ::/0) through the tunnel. tunnel.dll blocks traffic around
+	// such tunnels with firewall rules, which tunnel_engine does not set up, so the engine must refuse them.
+	void check_engine_config(_In_ const interface_config& config);
+
+	// Tunnel the calling process runs on wireguard.dll directly, without a tunnel service and tunnel.dll
+	//
+	// Sets up what tunnel.dll would: adapter with driver configuration, addresses, MTU, DNS, and routes to allowed IPs unless
+	// Table = off. The adapter is removed with everything attached to it when the object is destroyed.
+	// Scripts are not run, and no firewall rules keep traffic from leaking around a tunnel that takes the default route; see
+	// check_engine_config().
+	class tunnel_engine
+	{
+	private:
+		driver::adapter m_adapter;
+
+	public:
+		tunnel_engine(_In_z_ LPCWSTR name, _In_z_ LPCWSTR tunnel_type, _In_ const interface_config& config);
+		~tunnel_engine();
+
+		tunnel_engine(const tunnel_engine&) = delete;
+		tunnel_engine& operator=(const tunnel_engine&) = delete;
+
+		// Returns false once the adapter is gone or down, e.g. after the driver was reloaded.
+		bool alive() const noexcept;
+	};
+}
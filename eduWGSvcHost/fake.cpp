@@ -0,0 +1,668 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "fake.h"
+#include "conf.h"
+#include "driver.h"
+#include "ifaceview.h"
+#include "scm.h"
+#include "srwlock.h"
+#include <map>
+#include <memory>
+
+using namespace std;
+using namespace winstd;
+
+namespace wg
+{
+	static DWORD start_delay;
+	static ULONGLONG handshake_delay; // 100ns intervals
+
+	static ULONGLONG now() noexcept
+	{
+		FILETIME ft;
+		GetSystemTimeAsFileTime(&ft);
+		return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	}
+
+	struct fake_peer
+	{
+		WIREGUARD_PEER peer;
+		ULONGLONG configured; // Time the endpoint was set
+		vector<WIREGUARD_ALLOWED_IP> allowed_ips;
+	};
+
+	struct fake_adapter
+	{
+		NET_LUID luid;
+		WIREGUARD_ADAPTER_STATE state;
+		WIREGUARD_INTERFACE iface;
+		vector<fake_peer> peers;
+		bool removed;
+	};
+
+	struct fake_adapter_handle
+	{
+		wstring name;
+		shared_ptr<fake_adapter> adapter;
+		bool owner; // Closing the handle returned by WireGuardCreateAdapter removes the adapter
+	};
+
+	static srwlock adapters_lock;
+	static map<wstring, shared_ptr<fake_adapter>> adapters;
+	static ULONG64 next_luid = 1;
+
+	static fake_adapter* get_adapter(_In_ WIREGUARD_ADAPTER_HANDLE adapter)
+	{
+		auto a = reinterpret_cast<fake_adapter_handle*>(adapter)->adapter.get();
+		if (a->removed)
+		{
+			SetLastError(ERROR_FILE_NOT_FOUND);
+			return NULL;
+		}
+		return a;
+	}
+
+	static WIREGUARD_ADAPTER_HANDLE WINAPI create_adapter(_In_z_ LPCWSTR name, _In_z_ LPCWSTR tunnel_type, _In_opt_ const GUID* requested_guid)
+	{
+		UNREFERENCED_PARAMETER(tunnel_type);
+		UNREFERENCED_PARAMETER(requested_guid);
+		srwlock::exclusive lock(adapters_lock);
+		if (adapters.find(name) != adapters.end())
+		{
+			SetLastError(ERROR_ALREADY_EXISTS);
+			return NULL;
+		}
+		auto a = make_shared<fake_adapter>();
+		a->luid.Value = next_luid++;
+		a->state = WIREGUARD_ADAPTER_STATE_DOWN;
+		memset(&a->iface, 0, sizeof(a->iface));
+		a->removed = false;
+		adapters[name] = a;
+		return reinterpret_cast<WIREGUARD_ADAPTER_HANDLE>(new fake_adapter_handle{ name, a, true });
+	}
+
+	static WIREGUARD_ADAPTER_HANDLE WINAPI open_adapter(_In_z_ LPCWSTR name)
+	{
+		srwlock::shared lock(adapters_lock);
+		auto a = adapters.find(name);
+		if (a == adapters.end())
+		{
+			SetLastError(ERROR_FILE_NOT_FOUND);
+			return NULL;
+		}
+		return reinterpret_cast<WIREGUARD_ADAPTER_HANDLE>(new fake_adapter_handle{ name, a->second, false });
+	}
+
+	static VOID WINAPI close_adapter(_In_opt_ WIREGUARD_ADAPTER_HANDLE adapter)
+	{
+		unique_ptr<fake_adapter_handle> h(reinterpret_cast<fake_adapter_handle*>(adapter));
+		if (!h || !h->owner)
+			return;
+		srwlock::exclusive lock(adapters_lock);
+		h->adapter->removed = true;
+		auto a = adapters.find(h->name);
+		if (a != adapters.end() && a->second == h->adapter)
+			adapters.erase(a);
+	}
+
+	static VOID WINAPI get_adapter_luid(_In_ WIREGUARD_ADAPTER_HANDLE adapter, _Out_ NET_LUID* luid)
+	{
+		*luid = reinterpret_cast<fake_adapter_handle*>(adapter)->adapter->luid;
+	}
+
+	static DWORD WINAPI get_running_driver_version()
+	{
+		return 0x00010000;
+	}
+
+	static BOOL WINAPI delete_driver()
+	{
+		return TRUE;
+	}
+
+	static VOID WINAPI set_logger(_In_opt_ WIREGUARD_LOGGER_CALLBACK logger)
+	{
+		UNREFERENCED_PARAMETER(logger);
+	}
+
+	static BOOL WINAPI set_adapter_logging(_In_ WIREGUARD_ADAPTER_HANDLE adapter, _In_ WIREGUARD_ADAPTER_LOG_STATE log_state)
+	{
+		UNREFERENCED_PARAMETER(log_state);
+		srwlock::shared lock(adapters_lock);
+		return get_adapter(adapter) != NULL;
+	}
+
+	static BOOL WINAPI get_adapter_state(_In_ WIREGUARD_ADAPTER_HANDLE adapter, _Out_ WIREGUARD_ADAPTER_STATE* state)
+	{
+		srwlock::shared lock(adapters_lock);
+		auto a = get_adapter(adapter);
+		if (!a)
+			return FALSE;
+		*state = a->state;
+		return TRUE;
+	}
+
+	static BOOL WINAPI set_adapter_state(_In_ WIREGUARD_ADAPTER_HANDLE adapter, _In_ WIREGUARD_ADAPTER_STATE state)
+	{
+		srwlock::exclusive lock(adapters_lock);
+		auto a = get_adapter(adapter);
+		if (!a)
+			return FALSE;
+		a->state = state;
+		return TRUE;
+	}
+
+	static BOOL WINAPI get_configuration(_In_ WIREGUARD_ADAPTER_HANDLE adapter, _Out_writes_bytes_all_(*bytes) WIREGUARD_INTERFACE* config, _Inout_ DWORD* bytes)
+	{
+		srwlock::shared lock(adapters_lock);
+		auto a = get_adapter(adapter);
+		if (!a)
+			return FALSE;
+		size_t size = sizeof(WIREGUARD_INTERFACE);
+		for (auto& p : a->peers)
+			size += sizeof(WIREGUARD_PEER) + p.allowed_ips.size() * sizeof(WIREGUARD_ALLOWED_IP);
+		if (*bytes < size)
+		{
+			*bytes = (DWORD)size;
+			SetLastError(ERROR_MORE_DATA);
+			return FALSE;
+		}
+		*bytes = (DWORD)size;
+
+		// Peers with endpoint complete a handshake after handshake_delay and exchange 1 byte per millisecond afterwards.
+		auto t = now();
+		*config = a->iface;
+		config->PeersCount = (DWORD)a->peers.size();
+		auto peer = reinterpret_cast<WIREGUARD_PEER*>(config + 1);
+		for (auto& p : a->peers)
+		{
+			*peer = p.peer;
+			if ((p.peer.Flags & WIREGUARD_PEER_HAS_ENDPOINT) && t >= p.configured + handshake_delay)
+			{
+				peer->LastHandshake = p.configured + handshake_delay;
+				peer->RxBytes = peer->TxBytes = (t - peer->LastHandshake) / 10000;
+			}
+			peer->AllowedIPsCount = (DWORD)p.allowed_ips.size();
+			auto allowed_ip = reinterpret_cast<WIREGUARD_ALLOWED_IP*>(peer + 1);
+			for (auto& ip : p.allowed_ips)
+				*allowed_ip++ = ip;
+			peer = reinterpret_cast<WIREGUARD_PEER*>(allowed_ip);
+		}
+		return TRUE;
+	}
+
+	static BOOL WINAPI set_configuration(_In_ WIREGUARD_ADAPTER_HANDLE adapter, _In_reads_bytes_(bytes) const WIREGUARD_INTERFACE* config, _In_ DWORD bytes)
+	{
+		try
+		{
+			interface_view view(config, bytes);
+			srwlock::exclusive lock(adapters_lock);
+			auto a = get_adapter(adapter);
+			if (!a)
+				return FALSE;
+			if (view->Flags & WIREGUARD_INTERFACE_HAS_PRIVATE_KEY)
+				memcpy(a->iface.PrivateKey, view->PrivateKey, sizeof(a->iface.PrivateKey));
+			if (view->Flags & WIREGUARD_INTERFACE_HAS_LISTEN_PORT)
+				a->iface.ListenPort = view->ListenPort;
+			a->iface.Flags = WIREGUARD_INTERFACE_HAS_PRIVATE_KEY | WIREGUARD_INTERFACE_HAS_LISTEN_PORT;
+			if (view->Flags & WIREGUARD_INTERFACE_REPLACE_PEERS)
+				a->peers.clear();
+			auto t = now();
+			for (auto peer : view)
+			{
+				auto p = a->peers.begin();
+				while (p != a->peers.end() && memcmp(p->peer.PublicKey, peer->PublicKey, WIREGUARD_KEY_LENGTH) != 0)
+					++p;
+				if (peer->Flags & WIREGUARD_PEER_REMOVE)
+				{
+					if (p != a->peers.end())
+						a->peers.erase(p);
+					continue;
+				}
+				if (p == a->peers.end())
+				{
+					if (peer->Flags & WIREGUARD_PEER_UPDATE)
+						continue;
+					fake_peer fp = {};
+					memcpy(fp.peer.PublicKey, peer->PublicKey, WIREGUARD_KEY_LENGTH);
+					fp.peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY;
+					a->peers.push_back(fp);
+					p = a->peers.end() - 1;
+				}
+				if (peer->Flags & WIREGUARD_PEER_HAS_PRESHARED_KEY)
+				{
+					memcpy(p->peer.PresharedKey, peer->PresharedKey, WIREGUARD_KEY_LENGTH);
+					p->peer.Flags |= WIREGUARD_PEER_HAS_PRESHARED_KEY;
+				}
+				if (peer->Flags & WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE)
+				{
+					p->peer.PersistentKeepalive = peer->PersistentKeepalive;
+					p->peer.Flags |= WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE;
+				}
+				if (peer->Flags & WIREGUARD_PEER_HAS_ENDPOINT)
+				{
+					p->peer.Endpoint = peer->Endpoint;
+					p->peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+					p->configured = t;
+				}
+				if (peer->Flags & WIREGUARD_PEER_REPLACE_ALLOWED_IPS)
+					p->allowed_ips.clear();
+				p->allowed_ips.insert(p->allowed_ips.end(), peer.allowed_ips_begin(), peer.allowed_ips_end());
+			}
+			return TRUE;
+		}
+		catch (const invalid_argument&)
+		{
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return FALSE;
+		}
+		catch (const bad_alloc&)
+		{
+			SetLastError(ERROR_OUTOFMEMORY);
+			return FALSE;
+		}
+	}
+
+	struct fake_service
+	{
+		wstring name;
+		wstring binary_path;
+		SERVICE_STATUS status;
+		bool deleted;
+		event stop;
+		thread worker;
+	};
+
+	struct fake_sc_handle
+	{
+		shared_ptr<fake_service> service; // NULL for SCM handle
+	};
+
+	static srwlock services_lock;
+	static map<wstring, shared_ptr<fake_service>> services;
+
+	static fake_service* get_service(_In_ SC_HANDLE service)
+	{
+		auto s = service ? reinterpret_cast<fake_sc_handle*>(service)->service.get() : NULL;
+		if (!s)
+			SetLastError(ERROR_INVALID_HANDLE);
+		return s;
+	}
+
+	static void set_service_state(_Inout_ fake_service& s, _In_ DWORD state, _In_ DWORD exit_code = NO_ERROR)
+	{
+		srwlock::exclusive lock(services_lock);
+		s.status.dwCurrentState = state;
+		s.status.dwWin32ExitCode = exit_code;
+		if (state == SERVICE_STOPPED && s.deleted)
+		{
+			auto i = services.find(s.name);
+			if (i != services.end() && i->second.get() == &s)
+				services.erase(i);
+		}
+	}
+
+	// Reads tunnel config the way tunnel.dll does: from the DPAPI protected file.
+	static void read_config(_In_z_ const wchar_t* tunnel_name, _In_z_ const wchar_t* config_path, _Out_ vector<char, sanitizing_allocator<char>>& config)
+	{
+		file f(CreateFileW(config_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
+		if (!f)
+			throw win_runtime_error("Failed to open config");
+		vector<char, sanitizing_allocator<char>> data;
+		for (;;)
+		{
+			char buf[0x1000];
+			DWORD bytes_read;
+			if (!ReadFile(f, buf, sizeof(buf), &bytes_read, NULL))
+				throw win_runtime_error("Failed to read config");
+			if (!bytes_read)
+				break;
+			data.insert(data.cend(), buf, buf + bytes_read);
+			SecureZeroMemory(buf, sizeof(buf));
+		}
+		DATA_BLOB data_in = { (DWORD)data.size(), reinterpret_cast<BYTE*>(data.data()) }, data_out;
+		LPWSTR description = NULL;
+		if (!CryptUnprotectData(&data_in, &description, NULL, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &data_out))
+			throw win_runtime_error("Failed to decrypt tunnel config");
+		unique_ptr<WCHAR, LocalFree_delete<WCHAR>> description_ptr(description);
+		unique_ptr<BYTE, LocalFree_delete<BYTE>> decrypted(data_out.pbData);
+		config.assign(reinterpret_cast<char*>(data_out.pbData), reinterpret_cast<char*>(data_out.pbData) + data_out.cbData);
+		SecureZeroMemory(data_out.pbData, data_out.cbData);
+		if (!description || wcscmp(description, tunnel_name) != 0)
+			throw runtime_error("Tunnel config description mismatch");
+	}
+
+	// Runs the tunnel service: "<exe>" "<client>" Tunnel "<name>" "<config path>"
+	static DWORD WINAPI service_thread(_In_ LPVOID lpThreadParameter)
+	{
+		unique_ptr<shared_ptr<fake_service>> param(reinterpret_cast<shared_ptr<fake_service>*>(lpThreadParameter));
+		auto& s = **param;
+		DWORD exit_code = NO_ERROR;
+		try
+		{
+			int argc;
+			unique_ptr<LPWSTR[], LocalFree_delete<LPWSTR[]>> argv(CommandLineToArgvW(s.binary_path.c_str(), &argc));
+			if (!argv)
+				throw win_runtime_error("CommandLineToArgvW failed");
+			if (argc < 5)
+				throw invalid_argument("Tunnel service has no config path");
+
+			vector<char, sanitizing_allocator<char>> config;
+			read_config(argv[3], argv[4], config);
+			interface_config cfg;
+			cfg.parse(config.data(), config.size());
+			vector<unsigned char, sanitizing_allocator<unsigned char>> data;
+			cfg.compile(data);
+
+			driver::adapter adapter(driver::WireGuardCreateAdapter(argv[3], L"WireGuard", NULL));
+			if (!adapter)
+				throw win_runtime_error("WireGuardCreateAdapter failed");
+			if (!driver::WireGuardSetConfiguration(adapter, reinterpret_cast<const WIREGUARD_INTERFACE*>(data.data()), (DWORD)data.size()) ||
+				!driver::WireGuardSetAdapterState(adapter, WIREGUARD_ADAPTER_STATE_UP))
+				throw win_runtime_error("Failed to configure adapter");
+			if (WaitForSingleObject(s.stop, start_delay) == WAIT_TIMEOUT)
+			{
+				set_service_state(s, SERVICE_RUNNING);
+				WaitForSingleObject(s.stop, INFINITE);
+			}
+		}
+		catch (const win_runtime_error& e) { exit_code = e.number(); }
+		catch (const exception&) { exit_code = ERROR_PROCESS_ABORTED; }
+		set_service_state(s, SERVICE_STOPPED, exit_code);
+		return exit_code;
+	}
+
+	static SC_HANDLE WINAPI open_sc_manager(_In_opt_ LPCWSTR machine_name, _In_opt_ LPCWSTR database_name, _In_ DWORD desired_access)
+	{
+		UNREFERENCED_PARAMETER(machine_name);
+		UNREFERENCED_PARAMETER(database_name);
+		UNREFERENCED_PARAMETER(desired_access);
+		return reinterpret_cast<SC_HANDLE>(new fake_sc_handle);
+	}
+
+	static BOOL WINAPI close_service_handle(_In_ SC_HANDLE sc_object)
+	{
+		delete reinterpret_cast<fake_sc_handle*>(sc_object);
+		return TRUE;
+	}
+
+	static SC_HANDLE WINAPI create_service(
+		_In_ SC_HANDLE sc_manager, _In_ LPCWSTR service_name, _In_opt_ LPCWSTR display_name, _In_ DWORD desired_access,
+		_In_ DWORD service_type, _In_ DWORD start_type, _In_ DWORD error_control, _In_opt_ LPCWSTR binary_path_name,
+		_In_opt_ LPCWSTR load_order_group, _Out_opt_ LPDWORD tag_id, _In_opt_ LPCWSTR dependencies,
+		_In_opt_ LPCWSTR service_start_name, _In_opt_ LPCWSTR password)
+	{
+		UNREFERENCED_PARAMETER(sc_manager);
+		UNREFERENCED_PARAMETER(display_name);
+		UNREFERENCED_PARAMETER(desired_access);
+		UNREFERENCED_PARAMETER(start_type);
+		UNREFERENCED_PARAMETER(error_control);
+		UNREFERENCED_PARAMETER(load_order_group);
+		UNREFERENCED_PARAMETER(dependencies);
+		UNREFERENCED_PARAMETER(service_start_name);
+		UNREFERENCED_PARAMETER(password);
+		if (tag_id)
+			*tag_id = 0;
+		srwlock::exclusive lock(services_lock);
+		auto i = services.find(service_name);
+		if (i != services.end())
+		{
+			SetLastError(i->second->deleted ? ERROR_SERVICE_MARKED_FOR_DELETE : ERROR_SERVICE_EXISTS);
+			return NULL;
+		}
+		auto s = make_shared<fake_service>();
+		s->name = service_name;
+		if (binary_path_name)
+			s->binary_path = binary_path_name;
+		s->status = { service_type, SERVICE_STOPPED, 0, NO_ERROR, 0, 0, 0 };
+		s->deleted = false;
+		s->stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (!s->stop)
+			return NULL;
+		services[service_name] = s;
+		return reinterpret_cast<SC_HANDLE>(new fake_sc_handle{ s });
+	}
+
+	static SC_HANDLE WINAPI open_service(_In_ SC_HANDLE sc_manager, _In_ LPCWSTR service_name, _In_ DWORD desired_access)
+	{
+		UNREFERENCED_PARAMETER(sc_manager);
+		UNREFERENCED_PARAMETER(desired_access);
+		srwlock::shared lock(services_lock);
+		auto i = services.find(service_name);
+		if (i == services.end())
+		{
+			SetLastError(ERROR_SERVICE_DOES_NOT_EXIST);
+			return NULL;
+		}
+		return reinterpret_cast<SC_HANDLE>(new fake_sc_handle{ i->second });
+	}
+
+	// Lists all matching services in one go. The resume handle is not used.
+	static BOOL WINAPI enum_services_status_ex(
+		_In_ SC_HANDLE sc_manager, _In_ SC_ENUM_TYPE info_level, _In_ DWORD service_type, _In_ DWORD service_state,
+		_Out_writes_bytes_opt_(buf_size) LPBYTE services_buffer, _In_ DWORD buf_size, _Out_ LPDWORD bytes_needed,
+		_Out_ LPDWORD services_returned, _Inout_opt_ LPDWORD resume_handle, _In_opt_ LPCWSTR group_name)
+	{
+		UNREFERENCED_PARAMETER(sc_manager);
+		UNREFERENCED_PARAMETER(service_type);
+		UNREFERENCED_PARAMETER(group_name);
+		*bytes_needed = 0;
+		*services_returned = 0;
+		if (resume_handle)
+			*resume_handle = 0;
+		if (info_level != SC_ENUM_PROCESS_INFO)
+		{
+			SetLastError(ERROR_INVALID_LEVEL);
+			return FALSE;
+		}
+		srwlock::shared lock(services_lock);
+		vector<const fake_service*> matching;
+		for (auto& s : services)
+		{
+			bool active = s.second->status.dwCurrentState != SERVICE_STOPPED;
+			if (active ? (service_state & SERVICE_ACTIVE) : (service_state & SERVICE_INACTIVE))
+			{
+				matching.push_back(s.second.get());
+				*bytes_needed += (DWORD)(sizeof(ENUM_SERVICE_STATUS_PROCESSW) + (s.second->name.size() + 1) * sizeof(WCHAR));
+			}
+		}
+		if (buf_size < *bytes_needed)
+		{
+			SetLastError(ERROR_MORE_DATA);
+			return FALSE;
+		}
+		auto entries = reinterpret_cast<ENUM_SERVICE_STATUS_PROCESSW*>(services_buffer);
+		auto names = reinterpret_cast<LPWSTR>(entries + matching.size());
+		for (auto s : matching)
+		{
+			auto& e = entries[(*services_returned)++];
+			memcpy(names, s->name.c_str(), (s->name.size() + 1) * sizeof(WCHAR));
+			e.lpServiceName = e.lpDisplayName = names;
+			names += s->name.size() + 1;
+			memcpy(&e.ServiceStatusProcess, &s->status, sizeof(s->status));
+			e.ServiceStatusProcess.dwProcessId = s->status.dwCurrentState != SERVICE_STOPPED ? GetCurrentProcessId() : 0;
+			e.ServiceStatusProcess.dwServiceFlags = 0;
+		}
+		return TRUE;
+	}
+
+	static BOOL WINAPI change_service_config(
+		_In_ SC_HANDLE service, _In_ DWORD service_type, _In_ DWORD start_type, _In_ DWORD error_control,
+		_In_opt_ LPCWSTR binary_path_name, _In_opt_ LPCWSTR load_order_group, _Out_opt_ LPDWORD tag_id,
+		_In_opt_ LPCWSTR dependencies, _In_opt_ LPCWSTR service_start_name, _In_opt_ LPCWSTR password, _In_opt_ LPCWSTR display_name)
+	{
+		UNREFERENCED_PARAMETER(service_type);
+		UNREFERENCED_PARAMETER(start_type);
+		UNREFERENCED_PARAMETER(error_control);
+		UNREFERENCED_PARAMETER(load_order_group);
+		UNREFERENCED_PARAMETER(dependencies);
+		UNREFERENCED_PARAMETER(service_start_name);
+		UNREFERENCED_PARAMETER(password);
+		UNREFERENCED_PARAMETER(display_name);
+		if (tag_id)
+			*tag_id = 0;
+		srwlock::exclusive lock(services_lock);
+		auto s = get_service(service);
+		if (!s)
+			return FALSE;
+		if (s->deleted)
+		{
+			SetLastError(ERROR_SERVICE_MARKED_FOR_DELETE);
+			return FALSE;
+		}
+		if (binary_path_name)
+			s->binary_path = binary_path_name;
+		return TRUE;
+	}
+
+	static BOOL WINAPI change_service_config2(_In_ SC_HANDLE service, _In_ DWORD info_level, _In_opt_ LPVOID info)
+	{
+		UNREFERENCED_PARAMETER(info_level);
+		UNREFERENCED_PARAMETER(info);
+		srwlock::shared lock(services_lock);
+		return get_service(service) != NULL;
+	}
+
+	static BOOL WINAPI start_service(_In_ SC_HANDLE service, _In_ DWORD num_service_args, _In_reads_opt_(num_service_args) LPCWSTR* service_arg_vectors)
+	{
+		UNREFERENCED_PARAMETER(num_service_args);
+		UNREFERENCED_PARAMETER(service_arg_vectors);
+		srwlock::exclusive lock(services_lock);
+		auto s = get_service(service);
+		if (!s)
+			return FALSE;
+		if (s->deleted)
+		{
+			SetLastError(ERROR_SERVICE_MARKED_FOR_DELETE);
+			return FALSE;
+		}
+		if (s->status.dwCurrentState != SERVICE_STOPPED)
+		{
+			SetLastError(ERROR_SERVICE_ALREADY_RUNNING);
+			return FALSE;
+		}
+		if (!!s->worker)
+			WaitForSingleObject(s->worker, INFINITE);
+		ResetEvent(s->stop);
+		s->status.dwCurrentState = SERVICE_START_PENDING;
+		s->status.dwWin32ExitCode = NO_ERROR;
+		auto param = new shared_ptr<fake_service>(reinterpret_cast<fake_sc_handle*>(service)->service);
+		s->worker = CreateThread(NULL, 0, service_thread, param, 0, NULL);
+		if (!s->worker)
+		{
+			delete param;
+			s->status.dwCurrentState = SERVICE_STOPPED;
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	static BOOL WINAPI control_service(_In_ SC_HANDLE service, _In_ DWORD control, _Out_ LPSERVICE_STATUS service_status)
+	{
+		srwlock::exclusive lock(services_lock);
+		auto s = get_service(service);
+		if (!s)
+			return FALSE;
+		*service_status = s->status;
+		if (control != SERVICE_CONTROL_STOP)
+			return TRUE;
+		if (s->status.dwCurrentState == SERVICE_STOPPED)
+		{
+			SetLastError(ERROR_SERVICE_NOT_ACTIVE);
+			return FALSE;
+		}
+		s->status.dwCurrentState = SERVICE_STOP_PENDING;
+		SetEvent(s->stop);
+		*service_status = s->status;
+		return TRUE;
+	}
+
+	static BOOL WINAPI query_service_status(_In_ SC_HANDLE service, _Out_ LPSERVICE_STATUS service_status)
+	{
+		srwlock::shared lock(services_lock);
+		auto s = get_service(service);
+		if (!s)
+			return FALSE;
+		*service_status = s->status;
+		return TRUE;
+	}
+
+	static BOOL WINAPI query_service_status_ex(_In_ SC_HANDLE service, _In_ SC_STATUS_TYPE info_level, _Out_writes_bytes_opt_(buf_size) LPBYTE buffer, _In_ DWORD buf_size, _Out_ LPDWORD bytes_needed)
+	{
+		*bytes_needed = sizeof(SERVICE_STATUS_PROCESS);
+		if (info_level != SC_STATUS_PROCESS_INFO)
+		{
+			SetLastError(ERROR_INVALID_LEVEL);
+			return FALSE;
+		}
+		if (buf_size < sizeof(SERVICE_STATUS_PROCESS))
+		{
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return FALSE;
+		}
+		srwlock::shared lock(services_lock);
+		auto s = get_service(service);
+		if (!s)
+			return FALSE;
+		auto status = reinterpret_cast<SERVICE_STATUS_PROCESS*>(buffer);
+		memcpy(status, &s->status, sizeof(s->status));
+		status->dwProcessId = s->status.dwCurrentState != SERVICE_STOPPED ? GetCurrentProcessId() : 0; // Tunnel runs in this process.
+		status->dwServiceFlags = 0;
+		return TRUE;
+	}
+
+	static BOOL WINAPI delete_service(_In_ SC_HANDLE service)
+	{
+		srwlock::exclusive lock(services_lock);
+		auto s = get_service(service);
+		if (!s)
+			return FALSE;
+		if (s->deleted)
+		{
+			SetLastError(ERROR_SERVICE_MARKED_FOR_DELETE);
+			return FALSE;
+		}
+		s->deleted = true;
+		if (s->status.dwCurrentState == SERVICE_STOPPED)
+			services.erase(s->name);
+		return TRUE;
+	}
+
+	void fake_backend::install(_In_ DWORD start_delay_ms, _In_ DWORD handshake_delay_ms)
+	{
+		start_delay = start_delay_ms;
+		handshake_delay = (ULONGLONG)handshake_delay_ms * 10000;
+
+		driver::WireGuardCreateAdapter = create_adapter;
+		driver::WireGuardOpenAdapter = open_adapter;
+		driver::WireGuardCloseAdapter = close_adapter;
+		driver::WireGuardGetAdapterLUID = get_adapter_luid;
+		driver::WireGuardGetRunningDriverVersion = get_running_driver_version;
+		driver::WireGuardDeleteDriver = delete_driver;
+		driver::WireGuardSetLogger = set_logger;
+		driver::WireGuardSetAdapterLogging = set_adapter_logging;
+		driver::WireGuardGetAdapterState = get_adapter_state;
+		driver::WireGuardSetAdapterState = set_adapter_state;
+		driver::WireGuardGetConfiguration = get_configuration;
+		driver::WireGuardSetConfiguration = set_configuration;
+
+		service_manager::OpenSCManagerW = open_sc_manager;
+		service_manager::CloseServiceHandle = close_service_handle;
+		service_manager::CreateServiceW = create_service;
+		service_manager::OpenServiceW = open_service;
+		service_manager::EnumServicesStatusExW = enum_services_status_ex;
+		service_manager::ChangeServiceConfigW = change_service_config;
+		service_manager::ChangeServiceConfig2W = change_service_config2;
+		service_manager::StartServiceW = start_service;
+		service_manager::ControlService = control_service;
+		service_manager::QueryServiceStatus = query_service_status;
+		service_manager::QueryServiceStatusEx = query_service_status_ex;
+		service_manager::DeleteService = delete_service;
+	}
+}
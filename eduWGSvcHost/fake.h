@@ -0,0 +1,23 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+
+namespace wg
+{
+	// In-process stand-in for wireguard.dll and the SCM. Adapters live in memory; tunnel services run on threads.
+	class fake_backend
+	{
+	public:
+		// Rebinds driver and service_manager entries. Call before driver::init().
+		// start_delay_ms: time a tunnel service stays START_PENDING after its adapter is configured
+		// handshake_delay_ms: time from configuring a peer with endpoint to its simulated handshake
+		static void install(_In_ DWORD start_delay_ms, _In_ DWORD handshake_delay_ms);
+	};
+}
@@ -0,0 +1,265 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "driver.h"
+#include "varint.h"
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+namespace wg
+{
+	// Read-only view of driver configuration: WIREGUARD_INTERFACE followed by WIREGUARD_PEERs, each followed by its WIREGUARD_ALLOWED_IPs.
+	// The blob is validated once on construction. Iterators do not check bounds again.
+	class interface_view
+	{
+	public:
+		class peer_view
+		{
+		private:
+			const WIREGUARD_PEER* m_peer;
+
+		public:
+			peer_view(_In_ const WIREGUARD_PEER* peer) noexcept : m_peer(peer) {}
+
+			const WIREGUARD_PEER& operator*() const noexcept { return *m_peer; }
+			const WIREGUARD_PEER* operator->() const noexcept { return m_peer; }
+
+			const WIREGUARD_ALLOWED_IP* allowed_ips_begin() const noexcept
+			{
+				return reinterpret_cast<const WIREGUARD_ALLOWED_IP*>(m_peer + 1);
+			}
+
+			const WIREGUARD_ALLOWED_IP* allowed_ips_end() const noexcept
+			{
+				return allowed_ips_begin() + m_peer->AllowedIPsCount;
+			}
+
+			size_t allowed_ips_size() const noexcept
+			{
+				return m_peer->AllowedIPsCount;
+			}
+		};
+
+		class peer_iterator
+		{
+		private:
+			const WIREGUARD_PEER* m_peer;
+
+		public:
+			typedef std::forward_iterator_tag iterator_category;
+			typedef peer_view value_type;
+			typedef ptrdiff_t difference_type;
+			typedef const peer_view* pointer;
+			typedef peer_view reference;
+
+			peer_iterator(_In_ const WIREGUARD_PEER* peer) noexcept : m_peer(peer) {}
+
+			peer_view operator*() const noexcept { return peer_view(m_peer); }
+
+			peer_iterator& operator++() noexcept
+			{
+				m_peer = reinterpret_cast<const WIREGUARD_PEER*>(reinterpret_cast<const WIREGUARD_ALLOWED_IP*>(m_peer + 1) + m_peer->AllowedIPsCount);
+				return *this;
+			}
+
+			peer_iterator operator++(int) noexcept
+			{
+				peer_iterator i(*this);
+				++*this;
+				return i;
+			}
+
+			bool operator==(_In_ const peer_iterator& other) const noexcept { return m_peer == other.m_peer; }
+			bool operator!=(_In_ const peer_iterator& other) const noexcept { return m_peer != other.m_peer; }
+		};
+
+	private:
+		const WIREGUARD_INTERFACE* m_iface;
+		const WIREGUARD_PEER* m_end;
+		size_t m_allowed_ips_count;
+
+	public:
+		interface_view(_In_reads_bytes_(size) const void* data, _In_ size_t size) : m_allowed_ips_count(0)
+		{
+			auto cursor = reinterpret_cast<const unsigned char*>(data), end = cursor + size;
+			if (size < sizeof(WIREGUARD_INTERFACE))
+				throw std::invalid_argument("Invalid configuration");
+			m_iface = reinterpret_cast<const WIREGUARD_INTERFACE*>(cursor);
+			cursor += sizeof(WIREGUARD_INTERFACE);
+			for (DWORD i = 0; i < m_iface->PeersCount; ++i)
+			{
+				if ((size_t)(end - cursor) < sizeof(WIREGUARD_PEER))
+					throw std::invalid_argument("Invalid configuration");
+				auto peer = reinterpret_cast<const WIREGUARD_PEER*>(cursor);
+				cursor += sizeof(WIREGUARD_PEER);
+				if ((size_t)(end - cursor) / sizeof(WIREGUARD_ALLOWED_IP) < peer->AllowedIPsCount)
+					throw std::invalid_argument("Invalid configuration");
+				cursor += sizeof(WIREGUARD_ALLOWED_IP) * peer->AllowedIPsCount;
+				m_allowed_ips_count += peer->AllowedIPsCount;
+			}
+			m_end = reinterpret_cast<const WIREGUARD_PEER*>(cursor);
+		}
+
+		template <class _Alloc>
+		interface_view(_In_ const std::vector<unsigned char, _Alloc>& data) : interface_view(data.data(), data.size()) {}
+
+		const WIREGUARD_INTERFACE& operator*() const noexcept { return *m_iface; }
+		const WIREGUARD_INTERFACE* operator->() const noexcept { return m_iface; }
+
+		peer_iterator begin() const noexcept { return peer_iterator(reinterpret_cast<const WIREGUARD_PEER*>(m_iface + 1)); }
+		peer_iterator end() const noexcept { return peer_iterator(m_end); }
+		size_t size() const noexcept { return m_iface->PeersCount; }
+
+		// Returns total number of allowed IPs of all peers.
+		size_t allowed_ips_count() const noexcept { return m_allowed_ips_count; }
+
+		// Returns number of bytes the view spans.
+		size_t bytes() const noexcept { return reinterpret_cast<const unsigned char*>(m_end) - reinterpret_cast<const unsigned char*>(m_iface); }
+	};
+
+	// Version of the compact configuration encoding
+	static const unsigned char compact_config_version = 1;
+
+	// Appends configuration in compact encoding:
+	//   version, varint interface flags, varint listen port, [public key], [private key], varint peer count,
+	//   for each peer: varint flags, [public key], [preshared key], varint persistent keepalive,
+	//     [family, port, address], varint tx bytes, varint rx bytes, 8-byte last handshake, varint allowed IP count,
+	//     for each allowed IP: family, cidr, (cidr + 7) / 8 bytes of prefix.
+	// Optional fields are present when the matching flag is set.
+	template <class _Alloc>
+	inline void encode_compact_config(_In_ const interface_view& config, _Inout_ std::vector<unsigned char, _Alloc>& data)
+	{
+		data.push_back(compact_config_version);
+		varint_write(data, (DWORD)config->Flags);
+		varint_write(data, config->ListenPort);
+		if (config->Flags & WIREGUARD_INTERFACE_HAS_PUBLIC_KEY)
+			data.insert(data.cend(), config->PublicKey, config->PublicKey + WIREGUARD_KEY_LENGTH);
+		if (config->Flags & WIREGUARD_INTERFACE_HAS_PRIVATE_KEY)
+			data.insert(data.cend(), config->PrivateKey, config->PrivateKey + WIREGUARD_KEY_LENGTH);
+		varint_write(data, config->PeersCount);
+		for (auto peer : config)
+		{
+			varint_write(data, (DWORD)peer->Flags);
+			if (peer->Flags & WIREGUARD_PEER_HAS_PUBLIC_KEY)
+				data.insert(data.cend(), peer->PublicKey, peer->PublicKey + WIREGUARD_KEY_LENGTH);
+			if (peer->Flags & WIREGUARD_PEER_HAS_PRESHARED_KEY)
+				data.insert(data.cend(), peer->PresharedKey, peer->PresharedKey + WIREGUARD_KEY_LENGTH);
+			varint_write(data, peer->PersistentKeepalive);
+			if (peer->Flags & WIREGUARD_PEER_HAS_ENDPOINT)
+			{
+				if (peer->Endpoint.si_family == AF_INET6)
+				{
+					data.push_back(AF_INET6);
+					auto port = reinterpret_cast<const unsigned char*>(&peer->Endpoint.Ipv6.sin6_port);
+					data.insert(data.cend(), port, port + sizeof(USHORT));
+					auto addr = reinterpret_cast<const unsigned char*>(&peer->Endpoint.Ipv6.sin6_addr);
+					data.insert(data.cend(), addr, addr + sizeof(IN6_ADDR));
+				}
+				else
+				{
+					data.push_back(AF_INET);
+					auto port = reinterpret_cast<const unsigned char*>(&peer->Endpoint.Ipv4.sin_port);
+					data.insert(data.cend(), port, port + sizeof(USHORT));
+					auto addr = reinterpret_cast<const unsigned char*>(&peer->Endpoint.Ipv4.sin_addr);
+					data.insert(data.cend(), addr, addr + sizeof(IN_ADDR));
+				}
+			}
+			varint_write(data, peer->TxBytes);
+			varint_write(data, peer->RxBytes);
+			auto last_handshake = reinterpret_cast<const unsigned char*>(&peer->LastHandshake);
+			data.insert(data.cend(), last_handshake, last_handshake + sizeof(peer->LastHandshake));
+			varint_write(data, peer->AllowedIPsCount);
+			for (auto a = peer.allowed_ips_begin(), a_end = peer.allowed_ips_end(); a != a_end; ++a)
+			{
+				data.push_back((unsigned char)a->AddressFamily);
+				data.push_back(a->Cidr);
+				auto prefix = reinterpret_cast<const unsigned char*>(&a->Address);
+				data.insert(data.cend(), prefix, prefix + ((size_t)a->Cidr + 7) / 8);
+			}
+		}
+	}
+
+	template <class T>
+	inline void compact_read(_Inout_ const unsigned char*& cursor, _In_ const unsigned char* end, _Out_writes_bytes_(size) T* value, _In_ size_t size = sizeof(T))
+	{
+		if ((size_t)(end - cursor) < size)
+			throw std::invalid_argument("Incomplete compact configuration");
+		memcpy(value, cursor, size);
+		cursor += size;
+	}
+
+	// Decodes compact configuration back to driver configuration.
+	template <class _Alloc>
+	inline void decode_compact_config(_Inout_ const unsigned char*& cursor, _In_ const unsigned char* end, _Inout_ std::vector<unsigned char, _Alloc>& data)
+	{
+		unsigned char version;
+		compact_read(cursor, end, &version);
+		if (version != compact_config_version)
+			throw std::invalid_argument("Unsupported compact configuration version");
+		WIREGUARD_INTERFACE iface = {};
+		iface.Flags = (WIREGUARD_INTERFACE_FLAG)varint_read<DWORD>(cursor, end);
+		iface.ListenPort = varint_read<WORD>(cursor, end);
+		if (iface.Flags & WIREGUARD_INTERFACE_HAS_PUBLIC_KEY)
+			compact_read(cursor, end, iface.PublicKey, WIREGUARD_KEY_LENGTH);
+		if (iface.Flags & WIREGUARD_INTERFACE_HAS_PRIVATE_KEY)
+			compact_read(cursor, end, iface.PrivateKey, WIREGUARD_KEY_LENGTH);
+		DWORD peers_count = iface.PeersCount = varint_read<DWORD>(cursor, end);
+		data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&iface), reinterpret_cast<const unsigned char*>(&iface + 1));
+		SecureZeroMemory(&iface, sizeof(iface));
+		for (DWORD i = 0; i < peers_count; ++i)
+		{
+			WIREGUARD_PEER peer = {};
+			peer.Flags = (WIREGUARD_PEER_FLAG)varint_read<DWORD>(cursor, end);
+			if (peer.Flags & WIREGUARD_PEER_HAS_PUBLIC_KEY)
+				compact_read(cursor, end, peer.PublicKey, WIREGUARD_KEY_LENGTH);
+			if (peer.Flags & WIREGUARD_PEER_HAS_PRESHARED_KEY)
+				compact_read(cursor, end, peer.PresharedKey, WIREGUARD_KEY_LENGTH);
+			peer.PersistentKeepalive = varint_read<WORD>(cursor, end);
+			if (peer.Flags & WIREGUARD_PEER_HAS_ENDPOINT)
+			{
+				unsigned char family;
+				compact_read(cursor, end, &family);
+				peer.Endpoint.si_family = family;
+				if (family == AF_INET6)
+				{
+					compact_read(cursor, end, &peer.Endpoint.Ipv6.sin6_port);
+					compact_read(cursor, end, &peer.Endpoint.Ipv6.sin6_addr);
+				}
+				else if (family == AF_INET)
+				{
+					compact_read(cursor, end, &peer.Endpoint.Ipv4.sin_port);
+					compact_read(cursor, end, &peer.Endpoint.Ipv4.sin_addr);
+				}
+				else
+					throw std::invalid_argument("Unknown endpoint address family");
+			}
+			peer.TxBytes = varint_read<DWORD64>(cursor, end);
+			peer.RxBytes = varint_read<DWORD64>(cursor, end);
+			compact_read(cursor, end, &peer.LastHandshake);
+			DWORD allowed_ips_count = peer.AllowedIPsCount = varint_read<DWORD>(cursor, end);
+			if ((size_t)(end - cursor) / 2 < allowed_ips_count)
+				throw std::invalid_argument("Incomplete compact configuration");
+			data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&peer), reinterpret_cast<const unsigned char*>(&peer + 1));
+			SecureZeroMemory(&peer, sizeof(peer));
+			for (DWORD j = 0; j < allowed_ips_count; ++j)
+			{
+				WIREGUARD_ALLOWED_IP a = {};
+				unsigned char family;
+				compact_read(cursor, end, &family);
+				a.AddressFamily = family;
+				compact_read(cursor, end, &a.Cidr);
+				if (family == AF_INET ? a.Cidr > 32 : family == AF_INET6 ? a.Cidr > 128 : true)
+					throw std::invalid_argument("Invalid allowed IP");
+				compact_read(cursor, end, reinterpret_cast<unsigned char*>(&a.Address), ((size_t)a.Cidr + 7) / 8);
+				data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&a), reinterpret_cast<const unsigned char*>(&a + 1));
+			}
+		}
+	}
+}
@@ -0,0 +1,110 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "keys.h"
+#include <stdexcept>
+
+using namespace std;
+
+namespace wg
+{
+	// Returns value of base64 character, or -1. Character ranges are selected with arithmetic masks instead of branches or a
+	// table lookup.
+	static inline int base64_value(_In_ char ch) noexcept
+	{
+		int c = (unsigned char)ch;
+		return -1
+			+ (((('A' - 1 - c) & (c - ('Z' + 1))) >> 8) & (c - 'A' + 1))
+			+ (((('a' - 1 - c) & (c - ('z' + 1))) >> 8) & (c - 'a' + 27))
+			+ (((('0' - 1 - c) & (c - ('9' + 1))) >> 8) & (c - '0' + 53))
+			+ (((('+' - 1 - c) & (c - ('+' + 1))) >> 8) & 63)
+			+ (((('/' - 1 - c) & (c - ('/' + 1))) >> 8) & 64);
+	}
+
+	void decode_key(_In_count_(str_len) const char* str, _In_ size_t str_len, _Out_writes_bytes_(WIREGUARD_KEY_LENGTH) BYTE* key)
+	{
+		// 32 bytes encode as 43 base64 characters and one padding.
+		if (str_len != 44 || str[43] != '=')
+			throw invalid_argument("Keys must decode to exactly 32 bytes");
+
+		// Errors are collected in the sign bit and checked once the whole key is decoded.
+		int error = 0, acc, v;
+		for (size_t i = 0; i < 10; ++i)
+		{
+			acc = 0;
+			for (size_t j = 0; j < 4; ++j)
+			{
+				error |= v = base64_value(str[i * 4 + j]);
+				acc = (acc << 6) | (v & 0x3f);
+			}
+			key[i * 3 + 0] = (BYTE)(acc >> 16);
+			key[i * 3 + 1] = (BYTE)(acc >> 8);
+			key[i * 3 + 2] = (BYTE)(acc);
+		}
+		acc = 0;
+		for (size_t j = 0; j < 3; ++j)
+		{
+			error |= v = base64_value(str[40 + j]);
+			acc = (acc << 6) | (v & 0x3f);
+		}
+		error |= -(acc & 3);
+		key[30] = (BYTE)(acc >> 10);
+		key[31] = (BYTE)(acc >> 2);
+		if (error < 0)
+		{
+			SecureZeroMemory(key, WIREGUARD_KEY_LENGTH);
+			throw invalid_argument("Key is not valid base64");
+		}
+	}
+
+	// Canonical u-coordinates of points of order 1, 2, 4 and 8 on Curve25519 and its twist. Non-canonical encodings of such
+	// points (p, p + 1) are rejected by the range check.
+	static const BYTE low_order_points[][WIREGUARD_KEY_LENGTH] = {
+		{ 0 },
+		{ 1 },
+		{
+			0xe0, 0xeb, 0x7a, 0x7c, 0x3b, 0x41, 0xb8, 0xae, 0x16, 0x56, 0xe3, 0xfa, 0xf1, 0x9f, 0xc4, 0x6a,
+			0xda, 0x09, 0x8d, 0xeb, 0x9c, 0x32, 0xb1, 0xfd, 0x86, 0x62, 0x05, 0x16, 0x5f, 0x49, 0xb8, 0x00,
+		},
+		{
+			0x5f, 0x9c, 0x95, 0xbc, 0xa3, 0x50, 0x8c, 0x24, 0xb1, 0xd0, 0xb1, 0x55, 0x9c, 0x83, 0xef, 0x5b,
+			0x04, 0x44, 0x5c, 0xc4, 0x58, 0x1c, 0x8e, 0x86, 0xd8, 0x22, 0x4e, 0xdd, 0xd0, 0x9f, 0x11, 0x57,
+		},
+		{
+			0xec, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+			0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f,
+		},
+	};
+
+	bool validate_public_key(_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* key) noexcept
+	{
+		// Public keys are not secret; no need for constant time.
+		if (key[31] & 0x80)
+			return false;
+		if (key[31] == 0x7f)
+		{
+			// u >= p = 2^255 - 19?
+			size_t i = 30;
+			while (i > 0 && key[i] == 0xff) --i;
+			if (i == 0 && key[0] >= 0xed)
+				return false;
+		}
+		for (size_t i = 0; i < _countof(low_order_points); ++i)
+			if (memcmp(key, low_order_points[i], WIREGUARD_KEY_LENGTH) == 0)
+				return false;
+		return true;
+	}
+
+	size_t validate_public_keys(_In_ size_t count, _In_reads_bytes_(count * WIREGUARD_KEY_LENGTH) const BYTE* keys) noexcept
+	{
+		for (size_t i = 0; i < count; ++i)
+			if (!validate_public_key(keys + i * WIREGUARD_KEY_LENGTH))
+				return i;
+		return count;
+	}
+}
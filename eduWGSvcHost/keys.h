@@ -0,0 +1,25 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+#include <wireguard.h>
+
+namespace wg
+{
+	// Decodes base64 encoded key. Non-canonical encodings with nonzero padding bits are rejected.
+	// Time and memory access pattern do not depend on the key, so private and preshared keys may be decoded too.
+	void decode_key(_In_count_(str_len) const char* str, _In_ size_t str_len, _Out_writes_bytes_(WIREGUARD_KEY_LENGTH) BYTE* key);
+
+	// Returns false when public key is not a canonical Curve25519 u-coordinate (u < 2^255 - 19) or is of low order.
+	// Handshakes with such a key would yield a shared secret independent of the private key, so WireGuard rejects them.
+	bool validate_public_key(_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* key) noexcept;
+
+	// Validates count consecutive public keys. Returns index of the first invalid key, or count when all are valid.
+	size_t validate_public_keys(_In_ size_t count, _In_reads_bytes_(count * WIREGUARD_KEY_LENGTH) const BYTE* keys) noexcept;
+}
@@ -0,0 +1,119 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "lpm.h"
+
+using namespace std;
+
+namespace wg
+{
+	// POPCNT instruction is not available on all supported CPUs.
+	static inline unsigned int bit_count(_In_ ULONGLONG x) noexcept
+	{
+		x = x - ((x >> 1) & 0x5555555555555555ull);
+		x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+		x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+		return (unsigned int)((x * 0x0101010101010101ull) >> 56);
+	}
+
+	// Returns stride bits of address at offset. Bits past the end of address read as zero.
+	static inline unsigned int chunk(_In_reads_bytes_(length) const BYTE* address, _In_ unsigned int length, _In_ unsigned int offset, _In_ unsigned int stride) noexcept
+	{
+		unsigned int i = offset / 8;
+		unsigned int w =
+			(i < length ? (unsigned int)address[i] << 8 : 0) |
+			(i + 1 < length ? (unsigned int)address[i + 1] : 0);
+		return (w >> (16 - stride - offset % 8)) & ((1u << stride) - 1);
+	}
+
+	void lpm_table::build(_Inout_ family_table& table, _In_ DWORD n, _In_ const vector<prefix_trie::node>& trie, _In_ unsigned int t, _In_ size_t inherited)
+	{
+		struct {
+			unsigned int t;
+			size_t owner;
+		} children[1 << stride];
+		unsigned int children_count = 0;
+		ULONGLONG children_map = 0, leaves_map = 0;
+		auto leaf_base = (DWORD)table.leaves.size();
+		for (unsigned int v = 0; v < (1u << stride); ++v)
+		{
+			// Follow the chunk value through the binary trie, tracking the longest matching prefix.
+			unsigned int c = t;
+			size_t owner = inherited;
+			for (unsigned int i = 0; i < stride; ++i)
+			{
+				c = trie[c].child[(v >> (stride - 1 - i)) & 1];
+				if (!c)
+					break;
+				if (trie[c].owner != prefix_trie::no_owner)
+					owner = trie[c].owner;
+			}
+			if (c && (trie[c].child[0] || trie[c].child[1]))
+			{
+				children_map |= 1ull << v;
+				children[children_count].t = c;
+				children[children_count++].owner = owner;
+				continue;
+			}
+			DWORD peer = owner != prefix_trie::no_owner ? (DWORD)owner : no_peer;
+			if (table.leaves.size() == leaf_base || table.leaves.back() != peer)
+			{
+				leaves_map |= 1ull << v;
+				table.leaves.push_back(peer);
+			}
+		}
+
+		auto child_base = (DWORD)table.nodes.size();
+		table.nodes.resize(table.nodes.size() + children_count);
+		auto& nd = table.nodes[n];
+		nd.children = children_map;
+		nd.leaves = leaves_map;
+		nd.child_base = child_base;
+		nd.leaf_base = leaf_base;
+		for (unsigned int i = 0; i < children_count; ++i)
+			build(table, child_base + i, trie, children[i].t, children[i].owner);
+	}
+
+	void lpm_table::build(_In_ const interface_view& config)
+	{
+		prefix_trie trie;
+		size_t i = 0;
+		for (auto peer : config)
+		{
+			for (auto a = peer.allowed_ips_begin(), a_end = peer.allowed_ips_end(); a != a_end; ++a)
+				trie.insert(*a, i);
+			++i;
+		}
+		for (size_t f = 0; f < _countof(m_tables); ++f)
+		{
+			auto& table = m_tables[f];
+			auto& v = trie.m_nodes[f];
+			table.nodes.clear();
+			table.leaves.clear();
+			table.nodes.push_back(node{});
+			build(table, 0, v, 0, v[0].owner);
+		}
+	}
+
+	DWORD lpm_table::lookup(_In_ ADDRESS_FAMILY family, _In_reads_bytes_(family == AF_INET6 ? 16 : 4) const BYTE* address) const noexcept
+	{
+		auto& table = m_tables[family == AF_INET6 ? 1 : 0];
+		if (table.nodes.empty())
+			return no_peer;
+		unsigned int length = family == AF_INET6 ? 16 : 4;
+		auto nd = &table.nodes[0];
+		for (unsigned int offset = 0;; offset += stride)
+		{
+			ULONGLONG bit = 1ull << chunk(address, length, offset, stride);
+			ULONGLONG mask = (bit << 1) - 1;
+			if (!(nd->children & bit))
+				return table.leaves[nd->leaf_base + bit_count(nd->leaves & mask) - 1];
+			nd = &table.nodes[nd->child_base + bit_count(nd->children & mask) - 1];
+		}
+	}
+}
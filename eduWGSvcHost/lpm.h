@@ -0,0 +1,51 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "ifaceview.h"
+#include "prefixset.h"
+#include <vector>
+
+namespace wg
+{
+	// Longest-prefix-match table of allowed IPs in poptrie layout: 6-bit stride nodes with child and leaf bitmaps
+	class lpm_table
+	{
+	public:
+		static const DWORD no_peer = (DWORD)-1;
+
+	private:
+		static const unsigned int stride = 6;
+
+		struct node
+		{
+			ULONGLONG children; // Bit set for each chunk value with a child node
+			ULONGLONG leaves;   // Bit set for each chunk value where a run of equal leaves starts
+			DWORD child_base;
+			DWORD leaf_base;
+		};
+
+		struct family_table
+		{
+			std::vector<node> nodes; // The first node is the root
+			std::vector<DWORD> leaves;
+		};
+		family_table m_tables[2]; // IPv4, IPv6
+
+		static void build(_Inout_ family_table& table, _In_ DWORD n, _In_ const std::vector<prefix_trie::node>& trie, _In_ unsigned int t, _In_ size_t inherited);
+
+	public:
+		lpm_table() {}
+
+		// Builds table from allowed IPs of driver configuration. Peers are referenced by their index in the configuration.
+		void build(_In_ const interface_view& config);
+
+		// Returns index of the peer that routes the address, or no_peer.
+		DWORD lookup(_In_ ADDRESS_FAMILY family, _In_reads_bytes_(family == AF_INET6 ? 16 : 4) const BYTE* address) const noexcept;
+	};
+}
@@ -7,13 +7,42 @@
 
 #define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
 #include <Windows.h>
+#include "arena.h"
+#include "conf.h"
+#include "crypto.h"
 #include "driver.h"
+#include "engine.h"
+#include "ifaceview.h"
+#include "lpm.h"
+#include "netevents.h"
+#include "metrics.h"
+#include "peerstats.h"
+#include "phasetrace.h"
+#include "prefixset.h"
+#include "probe.h"
+#include "protocol.h"
+#include "race.h"
 #include "resource.h"
+#include "reqtrace.h"
 #include "ringlogger.h"
+#include "scm.h"
+#include "srwlock.h"
+#include "statsring.h"
+#include "svchost.h"
+#include "tools.h"
+#include "watchdog.h"
+#include <iphlpapi.h>
 #include <Messages.h>
+#include <Psapi.h>
 #include <Shlwapi.h>
 #include <WinStd/SDDL.h>
 #include <WinStd/Win.h>
+#include <algorithm>
+#include <array>
+#include <map>
+#include <functional>
+#include <memory>
+#include <set>
 #include <vector>
 
 #pragma warning(disable: 4200) // Nonstandard extensions: This is MSVC-only source code.
@@ -25,17 +54,69 @@ using namespace wg;
 
 static HINSTANCE hInstance;
 static WCHAR module_file_path[MAX_PATH];
-static WCHAR config_folder_path[MAX_PATH];
-static LPCWSTR client_id;
+WCHAR config_folder_path[MAX_PATH];
+LPCWSTR client_id;
 enum class client_type_t { eduvpn, letsconnect, govvpn };
 static client_type_t client_type;
-static event quit;
+event quit;
 static SERVICE_STATUS_HANDLE service_handle;
 static SERVICE_STATUS service_status = { SERVICE_WIN32_OWN_PROCESS, SERVICE_START_PENDING, 0, NO_ERROR, 0, 0, 1000 };
 
 static event_log service_log;
+static unique_ptr<ringlogger> wg_log;
+static unique_ptr<stats_ring> peer_history;
+network_events path_events;
+static unique_ptr<request_trace> request_log;
+
+#define REQUEST_TRACE_MAX_SIZE 0x4000000 // Bytes
 
-static void log(_In_ const exception& e)
+manager_options options;
+
+void load_options()
+{
+	reg_key key;
+	if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, wstring_printf(L"SYSTEM\\CurrentControlSet\\Services\\eduWGManager$%s\\Parameters", client_id).c_str(), 0, KEY_QUERY_VALUE, key) != ERROR_SUCCESS)
+		return;
+	DWORD value, type, size = sizeof(value);
+	if (RegQueryValueExW(key, L"AggregateAllowedIPs", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD)
+		options.aggregate_allowed_ips = value != 0;
+	size = sizeof(value);
+	if (RegQueryValueExW(key, L"WatchdogInterval", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD)
+		options.watchdog_interval = value;
+	size = sizeof(value);
+	if (RegQueryValueExW(key, L"HandshakeTimeout", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD && value)
+		options.handshake_timeout = value;
+	size = sizeof(value);
+	if (RegQueryValueExW(key, L"HistoryInterval", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD)
+		options.history_interval = value;
+	size = sizeof(value);
+	if (RegQueryValueExW(key, L"EndpointRaceTimeout", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD)
+		options.endpoint_race_timeout = value;
+	size = sizeof(value);
+	if (RegQueryValueExW(key, L"ReattachGrace", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD)
+		options.reattach_grace = value;
+	size = sizeof(value);
+	if (RegQueryValueExW(key, L"RefreshPaths", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD)
+		options.refresh_paths = value != 0;
+	size = sizeof(value);
+	if (RegQueryValueExW(key, L"RecordRequests", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD)
+		options.record_requests = value != 0;
+	size = sizeof(value);
+	if (RegQueryValueExW(key, L"TunnelEngine", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD)
+		options.tunnel_engine = value != 0;
+	size = sizeof(value);
+	if (RegQueryValueExW(key, L"ProbeInterval", NULL, &type, reinterpret_cast<LPBYTE>(&value), &size) == ERROR_SUCCESS && type == REG_DWORD && value)
+		options.probe_interval = value;
+	WCHAR address[INET6_ADDRSTRLEN];
+	size = sizeof(address) - sizeof(WCHAR);
+	if (RegQueryValueExW(key, L"ProbeAddress", NULL, &type, reinterpret_cast<LPBYTE>(address), &size) == ERROR_SUCCESS && type == REG_SZ)
+	{
+		address[size / sizeof(WCHAR)] = 0;
+		options.probe_address = address;
+	}
+}
+
+void log(_In_ const exception& e)
 {
 	if (!service_log)
 		return;
@@ -67,14 +148,17 @@ static void module_version(_Out_ version_t& version)
 	HGLOBAL hResData = LoadResource(hInstance, hResInfo);
 	if (!hResData)
 		throw win_runtime_error("Failed to load VS_VERSION_INFO resource");
-	LPVOID pRes = LockResource(hResData);
+	auto pRes = reinterpret_cast<const unsigned char*>(LockResource(hResData));
 	if (!pRes)
 		throw win_runtime_error("Failed to lock VS_VERSION_INFO resource");
-	unique_ptr<unsigned char> pResCopy(new unsigned char[dwSize]);
-	memcpy(pResCopy.get(), pRes, dwSize);
-	VS_FIXEDFILEINFO* lpFfi;
-	UINT uLen;
-	VerQueryValueW(pResCopy.get(), L"\\", (LPVOID*)&lpFfi, &uLen);
+	// VS_VERSIONINFO starts with wLength, wValueLength, wType and L"VS_VERSION_INFO" key. VS_FIXEDFILEINFO follows DWORD aligned.
+	// Read it in place: VerQueryValue would require a writable copy of the whole resource.
+	static const size_t ffi_offset = (3 * sizeof(WORD) + sizeof(L"VS_VERSION_INFO") + 3) & ~3;
+	if (dwSize < ffi_offset + sizeof(VS_FIXEDFILEINFO))
+		throw runtime_error("VS_VERSION_INFO resource too small");
+	auto lpFfi = reinterpret_cast<const VS_FIXEDFILEINFO*>(pRes + ffi_offset);
+	if (lpFfi->dwSignature != VS_FFI_SIGNATURE)
+		throw runtime_error("Invalid VS_VERSION_INFO resource");
 	version[0] = HIWORD(lpFfi->dwFileVersionMS);
 	version[1] = LOWORD(lpFfi->dwFileVersionMS);
 	version[2] = HIWORD(lpFfi->dwFileVersionLS);
@@ -83,7 +167,6 @@ static void module_version(_Out_ version_t& version)
 
 static DWORD WINAPI manager_handler(_In_ DWORD dwControl, _In_opt_ DWORD dwEventType, _In_opt_ LPVOID lpEventData, _In_opt_ LPVOID lpContext)
 {
-	UNREFERENCED_PARAMETER(dwEventType);
 	UNREFERENCED_PARAMETER(lpEventData);
 	UNREFERENCED_PARAMETER(lpContext);
 
@@ -96,15 +179,27 @@ static DWORD WINAPI manager_handler(_In_ DWORD dwControl, _In_opt_ DWORD dwEvent
 	case SERVICE_CONTROL_STOP:
 	case SERVICE_CONTROL_SHUTDOWN:
 		service_status.dwCurrentState = SERVICE_STOP_PENDING;
-		service_status.dwControlsAccepted &= ~(SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_STOP);
+		service_status.dwControlsAccepted &= ~(SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_POWEREVENT);
 		SetServiceStatus(service_handle, &service_status);
 		SetEvent(quit);
 		return NO_ERROR;
+
+	case SERVICE_CONTROL_POWEREVENT:
+		if (dwEventType == PBT_APMRESUMEAUTOMATIC)
+			path_events.post(network_event::resume);
+		return NO_ERROR;
 	}
 
 	return ERROR_CALL_NOT_IMPLEMENTED;
 }
 
+// Writes phase timings to the WireGuard ringlog.
+static void log_trace(_In_z_ const char* operation, _In_z_ const wchar_t* tunnel_name, _In_ const phase_trace& trace)
+{
+	if (wg_log)
+		wg_log->write(string_printf("%s tunnel=%ls %s", operation, tunnel_name, trace.str().c_str()).c_str());
+}
+
 static void validate_tunnel_name(_In_z_ const wchar_t* tunnel_name)
 {
 	if (!tunnel_name[0])
@@ -119,207 +214,1423 @@ static void validate_tunnel_name(_In_z_ const wchar_t* tunnel_name)
 			throw invalid_argument("Tunnel name contains invalid characters");
 }
 
-static void deactivate_tunnel(_In_z_ const wchar_t* tunnel_name, _In_ bool wait_for_stop)
+ULONGLONG system_time() noexcept
 {
-	validate_tunnel_name(tunnel_name);
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
 
-	sc_handle scm(OpenSCManagerW(NULL, NULL, SC_MANAGER_ALL_ACCESS));
-	if (!scm)
-		throw win_runtime_error("Failed to open SCM");
+// Makes the driver send a keepalive to the peer, which starts a handshake when the session expired.
+// Setting the endpoint again drops the cached source address, which is stale after a network change.
+static void force_handshake(_In_ const driver::adapter& adapter, _In_ const WIREGUARD_PEER& peer)
+{
+	struct {
+		WIREGUARD_INTERFACE iface;
+		WIREGUARD_PEER peer;
+	} config = {};
+	config.iface.PeersCount = 1;
+	memcpy(config.peer.PublicKey, peer.PublicKey, sizeof(config.peer.PublicKey));
+	config.peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_UPDATE | WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE;
+	config.peer.PersistentKeepalive = peer.PersistentKeepalive ? peer.PersistentKeepalive : 25;
+	if (peer.Flags & WIREGUARD_PEER_HAS_ENDPOINT)
+	{
+		config.peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+		config.peer.Endpoint = peer.Endpoint;
+	}
+	if (!driver::WireGuardSetConfiguration(adapter, &config.iface, sizeof(config)))
+		throw win_runtime_error("WireGuardSetConfiguration failed");
+	if (!peer.PersistentKeepalive)
+	{
+		// Restore disabled keepalive.
+		config.peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_UPDATE | WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE;
+		config.peer.PersistentKeepalive = 0;
+		if (!driver::WireGuardSetConfiguration(adapter, &config.iface, sizeof(config)))
+			throw win_runtime_error("WireGuardSetConfiguration failed");
+	}
+}
 
-	wstring short_name;
-	sprintf(short_name, L"eduWGTunnel$%s$%s", client_id, tunnel_name);
-	sc_handle service(OpenServiceW(scm, short_name.c_str(), SERVICE_ALL_ACCESS));
-	if (service)
+// Manager-side state of an activated tunnel
+class active_tunnel
+{
+private:
+	srwlock m_lock;
+	driver::adapter m_adapter;
+	DWORD m_config_size;
+	unique_ptr<interface_config> m_config; // Running configuration; NULL when unknown
+	shared_ptr<const lpm_table> m_lpm;     // Allowed IPs lookup table; NULL until first lookup
+	bool m_invalidated;                    // Tunnel was deactivated; the adapter must not be reopened
+
+	// Opens adapter unless open already. Caller must hold m_lock, which invalidate() takes too, so a deactivated tunnel never
+	// caches a handle again.
+	void open_adapter()
 	{
-		// Stop the tunnel service (and wait).
-		SERVICE_STATUS tunnel_service_status;
-		ControlService(service, SERVICE_CONTROL_STOP, &tunnel_service_status);
-		for (int i = 0; wait_for_stop && i < 180 && QueryServiceStatus(service, &tunnel_service_status) && tunnel_service_status.dwCurrentState != SERVICE_STOPPED; ++i)
-			if (WaitForSingleObject(quit, 1000) == WAIT_OBJECT_0)
-				break;
+		if (m_invalidated)
+			throw logic_error("Tunnel is not active");
+		if (!m_adapter)
+		{
+			m_adapter = driver::WireGuardOpenAdapter(name.c_str());
+			if (!m_adapter)
+				throw win_runtime_error("WireGuardOpenAdapter failed");
+		}
+	}
+
+public:
+	const wstring name;
+
+	active_tunnel(_In_z_ const wchar_t* tunnel_name, _Inout_ unique_ptr<interface_config>&& config) :
+		m_config_size(0),
+		m_config(move(config)),
+		m_invalidated(false),
+		name(tunnel_name)
+	{}
+
+	template <class _Alloc>
+	void get_configuration(_Inout_ vector<unsigned char, _Alloc>& data, _In_ size_t offset = 0)
+	{
+		srwlock::exclusive lock(m_lock);
+		open_adapter();
+		try { m_adapter.get_configuration(data, m_config_size, offset); }
+		catch (...)
+		{
+			// Adapter might have been recreated. Reopen on next call.
+			m_adapter.free();
+			throw;
+		}
+	}
+
+	// Returns allowed IPs lookup table of the running configuration.
+	shared_ptr<const lpm_table> get_lpm()
+	{
+		srwlock::exclusive lock(m_lock);
+		if (!m_lpm)
+		{
+			vector<unsigned char, sanitizing_allocator<unsigned char>> data;
+			open_adapter();
+			try { m_adapter.get_configuration(data, m_config_size); }
+			catch (...)
+			{
+				m_adapter.free();
+				throw;
+			}
+			shared_ptr<lpm_table> lpm(new lpm_table);
+			lpm->build(interface_view(data));
+			m_lpm = lpm;
+		}
+		return m_lpm;
+	}
+
+	// Applies new configuration to the running tunnel in place. Returns false when the tunnel needs to be restarted.
+	bool update(_In_count_(config_len) const char* config, _In_ unsigned int config_len)
+	{
+		unique_ptr<interface_config> updated(new interface_config);
+		updated->parse(config, config_len);
+		if (options.aggregate_allowed_ips)
+		{
+			size_t before, after;
+			aggregate_allowed_ips(*updated, before, after);
+		}
+
+		srwlock::exclusive lock(m_lock);
+		vector<unsigned char, sanitizing_allocator<unsigned char>> data;
+		vector<WIREGUARD_ALLOWED_IP> routes_added, routes_removed;
+		if (!m_config || !make_configuration_update(*m_config, *updated, data, routes_added, routes_removed))
+			return false;
+		open_adapter();
+		if (!driver::WireGuardSetConfiguration(m_adapter, reinterpret_cast<const WIREGUARD_INTERFACE*>(data.data()), (DWORD)data.size()))
+		{
+			m_adapter.free();
+			throw win_runtime_error("WireGuardSetConfiguration failed");
+		}
+
+		// The driver runs the updated configuration now. Later updates must diff against it, even if routing fails below.
+		m_config = move(updated);
+		m_lpm.reset();
+		if (m_config->has_routes() && (!routes_added.empty() || !routes_removed.empty()))
+		{
+			NET_LUID luid;
+			driver::WireGuardGetAdapterLUID(m_adapter, &luid);
+			for (auto& r : routes_removed)
+				update_route(luid, r, false);
+			for (auto& r : routes_added)
+				update_route(luid, r, true);
+		}
+		return true;
+	}
+
+	// Re-resolves endpoints and makes every peer with an endpoint handshake again. Returns number of peers refreshed.
+	size_t refresh()
+	{
+		srwlock::exclusive lock(m_lock);
+		vector<unsigned char, sanitizing_allocator<unsigned char>> data;
+		open_adapter();
+		try { m_adapter.get_configuration(data, m_config_size); }
+		catch (...)
+		{
+			m_adapter.free();
+			throw;
+		}
+		size_t count = 0;
+		for (auto peer : interface_view(data))
+		{
+			if (!(peer->Flags & WIREGUARD_PEER_HAS_ENDPOINT))
+				continue;
+			WIREGUARD_PEER p = *peer;
+			if (m_config)
+			{
+				// DNS may answer differently on the new network.
+				for (auto& c : m_config->peers)
+					if (memcmp(c.public_key, p.PublicKey, sizeof(p.PublicKey)) == 0)
+					{
+						if (c.has_endpoint())
+							try { c.resolve_endpoint(p.Endpoint); }
+							catch (...) {}
+						break;
+					}
+			}
+			force_handshake(m_adapter, p);
+			++count;
+		}
+		return count;
+	}
+
+	// Returns time of the latest handshake with any peer in 100ns intervals since 1601-01-01 UTC; 0 when none.
+	ULONGLONG last_handshake()
+	{
+		vector<unsigned char, sanitizing_allocator<unsigned char>> data;
+		get_configuration(data);
+		ULONGLONG last = 0;
+		for (auto peer : interface_view(data))
+			if (peer->LastHandshake > last)
+				last = peer->LastHandshake;
+		return last;
+	}
+
+	void invalidate()
+	{
+		srwlock::exclusive lock(m_lock);
+		m_invalidated = true;
+		m_adapter.free();
+		m_lpm.reset();
+	}
+};
+
+static srwlock tunnels_lock;
+static map<wstring, shared_ptr<active_tunnel>> tunnels;
+
+static shared_ptr<active_tunnel> find_tunnel(_In_z_ const wchar_t* tunnel_name)
+{
+	srwlock::shared lock(tunnels_lock);
+	auto t = tunnels.find(tunnel_name);
+	return t != tunnels.end() ? t->second : nullptr;
+}
+
+static shared_ptr<active_tunnel> get_tunnel(_In_z_ const wchar_t* tunnel_name)
+{
+	auto t = find_tunnel(tunnel_name);
+	if (!t)
+		throw logic_error("Tunnel is not active");
+	return t;
+}
+
+static service_manager::handle scm;
+
+struct tunnel_service {
+	service_manager::handle handle;
+	wstring binary_path;
+};
+
+// Tunnel service registrations. Services are registered once per tunnel name and reused across activations.
+static srwlock tunnel_services_lock;
+static map<wstring, tunnel_service> tunnel_services;
+
+static void create_tunnel_service(_In_z_ const wchar_t* tunnel_name, _Inout_ tunnel_service& s)
+{
+	wstring fmt;
+	LoadStringW(NULL,
+		client_type == client_type_t::eduvpn ? IDS_EDUVPN_TUN_SERVICE_TITLE :
+		client_type == client_type_t::letsconnect ? IDS_LETSCONNECT_TUN_SERVICE_TITLE :
+		client_type == client_type_t::govvpn ? IDS_GOVVPN_TUN_SERVICE_TITLE :
+		throw invalid_argument("Unknown client"),
+		fmt);
+	wstring mgr_short_name;
+	sprintf(mgr_short_name, L"eduWGManager$%s", client_id);
+	const LPCWSTR deps[] = {
+		L"Nsi",
+		L"TcpIp",
+		mgr_short_name.c_str()
+	};
+	vector<WCHAR> dependencies;
+	for (size_t i = 0; i < _countof(deps); ++i)
+		dependencies.insert(dependencies.cend(), deps[i], deps[i] + wcslen(deps[i]) + 1);
+	dependencies.push_back(L'\0');
+	s.handle = service_manager::CreateServiceW(scm,
+		wstring_printf(L"eduWGTunnel$%s$%s", client_id, tunnel_name).c_str(),
+		wstring_printf(fmt.c_str(), tunnel_name).c_str(),
+		SERVICE_ALL_ACCESS,
+		SERVICE_WIN32_OWN_PROCESS,
+		SERVICE_DEMAND_START,
+		SERVICE_ERROR_NORMAL,
+		s.binary_path.c_str(),
+		NULL,
+		NULL,
+		dependencies.data(),
+		NULL,
+		NULL);
+	if (!s.handle)
+		throw win_runtime_error("Failed to create tunnel service");
+
+	try {
+		// Configure the tunnel service.
+		SERVICE_SID_INFO sid_type = { SERVICE_SID_TYPE_UNRESTRICTED };
+		if (!service_manager::ChangeServiceConfig2W(s.handle, SERVICE_CONFIG_SERVICE_SID_INFO, &sid_type))
+			throw win_runtime_error("Failed to set tunnel service SID_INFO");
+		wstring desc;
+		sprintf(desc, L"@%.*s,-%u",
+			MAX_PATH, module_file_path,
+			client_type == client_type_t::eduvpn ? IDS_EDUVPN_TUN_SERVICE_DESCRIPTION :
+			client_type == client_type_t::letsconnect ? IDS_LETSCONNECT_TUN_SERVICE_DESCRIPTION :
+			client_type == client_type_t::govvpn ? IDS_GOVVPN_TUN_SERVICE_DESCRIPTION :
+			throw invalid_argument("Unknown client"));
+		SERVICE_DESCRIPTIONW description = { const_cast<LPWSTR>(desc.c_str()) };
+		service_manager::ChangeServiceConfig2W(s.handle, SERVICE_CONFIG_DESCRIPTION, &description);
+	}
+	catch (const exception& e)
+	{
+		service_manager::DeleteService(s.handle);
+		s.handle.free();
+		throw e;
+	}
+}
+
+static void stop_tunnel_service(_In_ SC_HANDLE service, _In_ bool wait_for_stop)
+{
+	SERVICE_STATUS tunnel_service_status;
+	service_manager::ControlService(service, SERVICE_CONTROL_STOP, &tunnel_service_status);
+	for (int i = 0; wait_for_stop && i < 1800 && service_manager::QueryServiceStatus(service, &tunnel_service_status) && tunnel_service_status.dwCurrentState != SERVICE_STOPPED; ++i)
+		if (WaitForSingleObject(quit, 100) == WAIT_OBJECT_0)
+			break;
+}
+
+// Returns tunnel service registration. Registers the service on first use.
+static SC_HANDLE register_tunnel_service(_In_z_ const wchar_t* tunnel_name, _In_z_ const wchar_t* config_file_path)
+{
+	wstring binary_path = wstring_printf(L"\"%.*s\" \"%s\" Tunnel \"%s\" \"%s\"", MAX_PATH, module_file_path, client_id, tunnel_name, config_file_path);
+	{
+		srwlock::shared lock(tunnel_services_lock);
+		auto s = tunnel_services.find(tunnel_name);
+		if (s != tunnel_services.end() && !!s->second.handle && s->second.binary_path == binary_path)
+			return s->second.handle;
+	}
+
+	srwlock::exclusive lock(tunnel_services_lock);
+	auto& s = tunnel_services[tunnel_name];
+	if (!s.handle)
+	{
+		// Reuse registration left by previous manager instance.
+		s.handle = service_manager::OpenServiceW(scm, wstring_printf(L"eduWGTunnel$%s$%s", client_id, tunnel_name).c_str(), SERVICE_ALL_ACCESS);
+		if (!!s.handle)
+			s.binary_path.clear();
+	}
+	if (!!s.handle && s.binary_path != binary_path)
+	{
+		if (service_manager::ChangeServiceConfigW(s.handle, SERVICE_NO_CHANGE, SERVICE_DEMAND_START, SERVICE_NO_CHANGE, binary_path.c_str(), NULL, NULL, NULL, NULL, NULL, NULL))
+			s.binary_path = binary_path;
+		else if (GetLastError() == ERROR_SERVICE_MARKED_FOR_DELETE)
+		{
+			// Ephemeral service of an earlier version. It goes away once stopped.
+			stop_tunnel_service(s.handle, true);
+			s.handle.free();
+		}
+		else
+			throw win_runtime_error("Failed to configure tunnel service");
+	}
+	if (!s.handle)
+	{
+		s.binary_path = binary_path;
+		create_tunnel_service(tunnel_name, s);
+	}
+	return s.handle;
+}
+
+struct concurrent_task
+{
+	const function<void()>* task;
+	exception_ptr error;
+};
+
+static DWORD WINAPI concurrent_task_thread(_In_ LPVOID lpThreadParameter)
+{
+	auto t = reinterpret_cast<concurrent_task*>(lpThreadParameter);
+	try { (*t->task)(); }
+	catch (...) { t->error = current_exception(); }
+	return 0;
+}
+
+// Runs tasks in parallel and waits for all of them to finish. Rethrows the first failure.
+static void run_concurrently(_In_ const vector<function<void()>>& tasks)
+{
+	vector<concurrent_task> context(tasks.size());
+	vector<thread> threads;
+	threads.reserve(tasks.size());
+	for (size_t i = 0; i < tasks.size(); ++i)
+	{
+		context[i].task = &tasks[i];
+		if (i + 1 < tasks.size())
+		{
+			thread t(CreateThread(NULL, 0, concurrent_task_thread, &context[i], 0, NULL));
+			if (!!t)
+			{
+				threads.push_back(move(t));
+				continue;
+			}
+		}
+		// Run the last task (or the one we failed to spawn a thread for) on the calling thread.
+		concurrent_task_thread(&context[i]);
+	}
+	for (auto& t : threads)
+		WaitForSingleObject(t, INFINITE);
+	for (auto& c : context)
+		if (c.error)
+			rethrow_exception(c.error);
+}
+
+typedef array<BYTE, blake2s::hash_size> config_digest;
+
+static config_digest digest_config(_In_count_(config_len) const char* config, _In_ unsigned int config_len)
+{
+	config_digest digest;
+	blake2s h;
+	h.update(config, config_len);
+	h.final(digest.data());
+	return digest;
+}
+
+static void config_digest_path(_In_z_ const wchar_t* tunnel_name, _Out_writes_z_(MAX_PATH) WCHAR* path)
+{
+	PathCombineW(path, config_folder_path, wstring_printf(L"%s.conf.digest", tunnel_name).c_str());
+}
+
+// Records digest of the configuration the tunnel runs, so the next manager instance can tell whether a client claims it unchanged.
+static void store_config_digest(_In_z_ const wchar_t* tunnel_name, _In_ const config_digest& digest)
+{
+	WCHAR path[MAX_PATH];
+	config_digest_path(tunnel_name, path);
+	file f(CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL));
+	if (!f)
+		throw win_runtime_error("Failed to create config digest file");
+	DWORD bytes_written;
+	if (!WriteFile(f, digest.data(), (DWORD)digest.size(), &bytes_written, NULL) || bytes_written != digest.size())
+		throw win_runtime_error("Failed to write config digest file");
+}
+
+static bool load_config_digest(_In_z_ const wchar_t* tunnel_name, _Out_ config_digest& digest)
+{
+	WCHAR path[MAX_PATH];
+	config_digest_path(tunnel_name, path);
+	file f(CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
+	DWORD bytes_read;
+	return !!f && ReadFile(f, digest.data(), (DWORD)digest.size(), &bytes_read, NULL) && bytes_read == digest.size();
+}
+
+static void probe_window_path(_In_z_ const wchar_t* tunnel_name, _Out_writes_z_(MAX_PATH) WCHAR* path)
+{
+	PathCombineW(path, config_folder_path, wstring_printf(L"%s.probe", tunnel_name).c_str());
+}
+
+#define ENGINE_CHECK_INTERVAL 1000      // Milliseconds between engine tunnel health checks
+#define ENGINE_RESTART_DELAY 1000       // Milliseconds before restarting a failed engine tunnel; doubles with each failure in a row
+#define ENGINE_RESTART_DELAY_MAX 60000
+
+struct engine_tunnel {
+	wstring name;
+	srwlock lock;
+	unique_ptr<interface_config> config; // Configuration to (re)start with
+	event stop;                          // Manual-reset; set to stop the tunnel
+	event started;                       // Manual-reset; set once the first start succeeded or failed
+	exception_ptr error;                 // Failure of the first start
+	thread supervisor;
+};
+
+// Tunnels run by this process in tunnel engine mode
+static srwlock engine_tunnels_lock;
+static map<wstring, shared_ptr<engine_tunnel>> engine_tunnels;
+
+static shared_ptr<engine_tunnel> find_engine_tunnel(_In_z_ const wchar_t* tunnel_name)
+{
+	srwlock::shared lock(engine_tunnels_lock);
+	auto t = engine_tunnels.find(tunnel_name);
+	return t != engine_tunnels.end() ? t->second : nullptr;
+}
+
+// Runs an engine tunnel until stopped. Failures after the first start are contained to the tunnel: it is torn down and restarted
+// with back-off. A failing first start is reported to the activation instead.
+static DWORD WINAPI engine_supervisor(_In_ LPVOID lpThreadParameter)
+{
+	auto t = reinterpret_cast<engine_tunnel*>(lpThreadParameter);
+	DWORD delay = ENGINE_RESTART_DELAY;
+	for (unsigned int restarts = 0;; ++restarts)
+	{
+		try
+		{
+			unique_ptr<tunnel_engine> engine;
+			{
+				srwlock::shared lock(t->lock);
+				engine.reset(new tunnel_engine(t->name.c_str(), client_id, *t->config));
+			}
+			SetEvent(t->started);
+			delay = ENGINE_RESTART_DELAY;
+			while (WaitForSingleObject(t->stop, ENGINE_CHECK_INTERVAL) == WAIT_TIMEOUT)
+				if (!engine->alive())
+					throw runtime_error("Tunnel adapter is gone");
+			return 0;
+		}
+		catch (const exception& e)
+		{
+			if (WaitForSingleObject(t->started, 0) == WAIT_TIMEOUT)
+			{
+				t->error = current_exception();
+				SetEvent(t->started);
+				return 1;
+			}
+			log(e);
+			if (wg_log)
+				wg_log->write(string_printf("engine_restart tunnel=%ls restarts=%u delay=%u error=%s", t->name.c_str(), restarts + 1, delay, e.what()).c_str());
+			metrics::add(metric_counter::engine_restarts);
+		}
+		if (WaitForSingleObject(t->stop, delay) != WAIT_TIMEOUT)
+			return 0;
+		delay = min<DWORD>(delay * 2, ENGINE_RESTART_DELAY_MAX);
+	}
+}
+
+// Starts tunnel on a supervisor thread of this process and waits until it is up.
+static void start_engine_tunnel(_In_z_ const wchar_t* tunnel_name, _In_ const interface_config& config)
+{
+	auto t = make_shared<engine_tunnel>();
+	t->name = tunnel_name;
+	t->config.reset(new interface_config(config));
+	t->stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+	t->started = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (!t->stop || !t->started)
+		throw win_runtime_error("CreateEvent failed");
+	t->supervisor = CreateThread(NULL, 0, engine_supervisor, t.get(), 0, NULL);
+	if (!t->supervisor)
+		throw win_runtime_error("CreateThread failed");
+	WaitForSingleObject(t->started, INFINITE);
+	if (t->error)
+	{
+		WaitForSingleObject(t->supervisor, INFINITE);
+		rethrow_exception(t->error);
+	}
+	srwlock::exclusive lock(engine_tunnels_lock);
+	engine_tunnels[tunnel_name] = t;
+}
+
+// Replaces configuration an engine tunnel restarts with after it was updated in place.
+static void update_engine_tunnel(_In_z_ const wchar_t* tunnel_name, _In_count_(config_len) const char* config, _In_ unsigned int config_len)
+{
+	auto t = find_engine_tunnel(tunnel_name);
+	if (!t)
+		return;
+	unique_ptr<interface_config> updated(new interface_config);
+	updated->parse(config, config_len);
+	if (options.aggregate_allowed_ips)
+	{
+		size_t before, after;
+		aggregate_allowed_ips(*updated, before, after);
+	}
+	srwlock::exclusive lock(t->lock);
+	t->config = move(updated);
+}
+
+// Stops engine tunnel and waits for its adapter to be removed. Returns false when there is no such engine tunnel.
+static bool stop_engine_tunnel(_In_z_ const wchar_t* tunnel_name)
+{
+	shared_ptr<engine_tunnel> t;
+	{
+		srwlock::exclusive lock(engine_tunnels_lock);
+		auto i = engine_tunnels.find(tunnel_name);
+		if (i == engine_tunnels.end())
+			return false;
+		t = i->second;
+		engine_tunnels.erase(i);
+	}
+	SetEvent(t->stop);
+	WaitForSingleObject(t->supervisor, INFINITE);
+	return true;
+}
+
+static void stop_engine_tunnels()
+{
+	vector<wstring> names;
+	{
+		srwlock::shared lock(engine_tunnels_lock);
+		for (auto& t : engine_tunnels)
+			names.push_back(t.first);
+	}
+	for (auto& tunnel_name : names)
+		stop_engine_tunnel(tunnel_name.c_str());
+}
+
+static void deactivate_tunnel(_In_z_ const wchar_t* tunnel_name, _In_ bool wait_for_stop, _Out_opt_ string* timings = NULL)
+{
+	metrics_operation op(metric_counter::deactivations, metric_counter::deactivation_errors, metric_histogram::deactivate_latency);
+	phase_trace trace;
+	validate_tunnel_name(tunnel_name);
+
+	{
+		shared_ptr<active_tunnel> t;
+		{
+			srwlock::exclusive lock(tunnels_lock);
+			auto i = tunnels.find(tunnel_name);
+			if (i != tunnels.end())
+			{
+				t = i->second;
+				tunnels.erase(i);
+			}
+		}
+		if (t)
+			t->invalidate();
+	}
+	trace.mark("invalidate");
 
-		if (!DeleteService(service) && GetLastError() != ERROR_SERVICE_MARKED_FOR_DELETE)
-			throw win_runtime_error("Failed to delete tunnel service");
+	if (stop_engine_tunnel(tunnel_name))
+		trace.mark("stop_engine");
+	else
+	{
+		SC_HANDLE service = NULL;
+		service_manager::handle service_unregistered;
+		{
+			srwlock::shared lock(tunnel_services_lock);
+			auto s = tunnel_services.find(tunnel_name);
+			if (s != tunnel_services.end())
+				service = s->second.handle;
+		}
+		if (!service)
+		{
+			service_unregistered = service_manager::OpenServiceW(scm, wstring_printf(L"eduWGTunnel$%s$%s", client_id, tunnel_name).c_str(), SERVICE_ALL_ACCESS);
+			service = service_unregistered;
+		}
+		if (service)
+			stop_tunnel_service(service, wait_for_stop);
+		trace.mark("stop_service");
 	}
 
 	WCHAR config_file_path[MAX_PATH];
 	PathCombineW(config_file_path, config_folder_path, wstring_printf(L"%s.conf.dpapi", tunnel_name).c_str());
 	DeleteFileW(config_file_path);
+	config_digest_path(tunnel_name, config_file_path);
+	DeleteFileW(config_file_path);
+	probe_window_path(tunnel_name, config_file_path);
+	DeleteFileW(config_file_path);
+	trace.mark("cleanup");
+
+	log_trace("deactivate", tunnel_name, trace);
+	if (timings)
+		*timings = trace.str();
+	op.succeeded();
 }
 
-static void activate_tunnel(_In_z_ const wchar_t* tunnel_name, _In_count_(config_len) const char* config, _In_ unsigned int config_len, _In_ bool wait_for_start)
+static void write_config_file(_In_z_ const wchar_t* tunnel_name, _In_count_(config_len) const char* config, _In_ unsigned int config_len, _In_z_ const wchar_t* config_file_path)
 {
-	validate_tunnel_name(tunnel_name);
+	DATA_BLOB data_in = {
+		config_len,
+		(BYTE*)config
+	}, data_out;
+	if (!CryptProtectData(&data_in, tunnel_name, NULL, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &data_out))
+		throw win_runtime_error("Failed to encrypt tunnel config");
+	unique_ptr<unsigned char, LocalFree_delete<unsigned char>> encrypted_config(data_out.pbData);
+	winstd::security_attributes sa;
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptor(
+		SDDL_OWNER SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
+		SDDL_GROUP SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
+		SDDL_DACL SDDL_DELIMINATOR SDDL_PROTECTED SDDL_AUTO_INHERITED
+		SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_LOCAL_SYSTEM SDDL_ACE_END
+		SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_STANDARD_DELETE SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_BUILTIN_ADMINISTRATORS SDDL_ACE_END,
+		SDDL_REVISION_1, sa, NULL))
+		throw win_runtime_error("ConvertStringSecurityDescriptorToSecurityDescriptor failed");
+	file config_file(CreateFileW(config_file_path, GENERIC_WRITE | DELETE, FILE_SHARE_READ, &sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL));
+	if (!config_file)
+		throw win_runtime_error("Failed to create config file");
+	DWORD bytes_written;
+	if (!WriteFile(config_file, data_out.pbData, data_out.cbData, &bytes_written, NULL))
+		throw win_runtime_error("Failed to write config file");
+	if (bytes_written != data_out.cbData)
+		throw runtime_error("Incomplete write of config file");
+}
 
-	sc_handle scm(OpenSCManagerW(NULL, NULL, SC_MANAGER_ALL_ACCESS));
-	if (!scm)
-		throw win_runtime_error("Failed to open SCM");
+static string endpoint_to_string(_In_ const SOCKADDR_INET& endpoint)
+{
+	char addr[INET6_ADDRSTRLEN];
+	if (endpoint.si_family == AF_INET)
+	{
+		InetNtopA(AF_INET, &endpoint.Ipv4.sin_addr, addr, _countof(addr));
+		return string_printf("%s:%u", addr, ntohs(endpoint.Ipv4.sin_port));
+	}
+	InetNtopA(AF_INET6, &endpoint.Ipv6.sin6_addr, addr, _countof(addr));
+	return string_printf("[%s]:%u", addr, ntohs(endpoint.Ipv6.sin6_port));
+}
+
+#define ENDPOINT_RACE_ATTEMPT_DELAY 250 // Milliseconds; RFC 8305 connection attempt delay
 
-	wstring short_name;
-	sprintf(short_name, L"eduWGTunnel$%s$%s", client_id, tunnel_name);
-	sc_handle service(OpenServiceW(scm, short_name.c_str(), SERVICE_ALL_ACCESS));
-	if (!!service)
+struct endpoint_race {
+	size_t peer;                         // Index of the peer in configuration
+	vector<SOCKADDR_INET> candidates;    // Resolved endpoint addresses; the configured one first
+	vector<double> rtt;                  // Milliseconds; negative when the candidate did not respond
+	size_t winner;                       // Index of the first responder; -1 when none
+};
+
+// Races endpoint candidates of peers. Failures leave the configured endpoint in place.
+static void probe_endpoints(_In_z_ const wchar_t* tunnel_name, _In_ const interface_config& config, _Inout_ vector<endpoint_race>& races)
+{
+	vector<function<void()>> tasks;
+	for (auto& race : races)
+		tasks.push_back([tunnel_name, &config, &race]
+		{
+			race.winner = (size_t)-1;
+			try { race.winner = race_endpoints(config.private_key, config.public_key, config.peers[race.peer].public_key, race.candidates, ENDPOINT_RACE_ATTEMPT_DELAY, options.endpoint_race_timeout, race.rtt); }
+			catch (const exception& e) { log(e); }
+			if (!wg_log)
+				return;
+			string candidates;
+			for (size_t i = 0; i < race.candidates.size(); ++i)
+				candidates += string_printf(i < race.rtt.size() && race.rtt[i] >= 0 ? "%s%s=%.3f" : "%s%s=none",
+					i ? "," : "", endpoint_to_string(race.candidates[i]).c_str(), i < race.rtt.size() ? race.rtt[i] : 0.0);
+			wg_log->write(string_printf("endpoint_race tunnel=%ls peer=%zu candidates=%s winner=%s", tunnel_name, race.peer, candidates.c_str(),
+				race.winner != (size_t)-1 ? endpoint_to_string(race.candidates[race.winner]).c_str() : "none").c_str());
+		});
+	run_concurrently(tasks);
+}
+
+// Sets endpoint of each peer to the race winner.
+static void commit_endpoints(_In_z_ const wchar_t* tunnel_name, _In_ const interface_config& config, _In_ const vector<endpoint_race>& races)
+{
+	vector<unsigned char, sanitizing_allocator<unsigned char>> data(sizeof(WIREGUARD_INTERFACE) + sizeof(WIREGUARD_PEER) * races.size(), 0);
+	auto iface = reinterpret_cast<WIREGUARD_INTERFACE*>(data.data());
+	auto peers = reinterpret_cast<WIREGUARD_PEER*>(iface + 1);
+	for (auto& race : races)
 	{
-		// Deactivate existing tunnel with this name.
-		service.free();
-		deactivate_tunnel(tunnel_name, true);
+		if (race.winner == (size_t)-1 || !race.winner)
+			continue; // Keep the configured endpoint.
+		auto& peer = peers[iface->PeersCount++];
+		memcpy(peer.PublicKey, config.peers[race.peer].public_key, sizeof(peer.PublicKey));
+		peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_UPDATE | WIREGUARD_PEER_HAS_ENDPOINT;
+		peer.Endpoint = race.candidates[race.winner];
 	}
+	if (!iface->PeersCount)
+		return;
+	driver::adapter adapter(driver::WireGuardOpenAdapter(tunnel_name));
+	if (!adapter)
+		throw win_runtime_error("WireGuardOpenAdapter failed");
+	if (!driver::WireGuardSetConfiguration(adapter, iface, (DWORD)(sizeof(WIREGUARD_INTERFACE) + sizeof(WIREGUARD_PEER) * iface->PeersCount)))
+		throw win_runtime_error("WireGuardSetConfiguration failed");
+}
 
-	WCHAR config_file_path[MAX_PATH];
+static void activate_tunnel(_In_z_ const wchar_t* tunnel_name, _In_count_(config_len) const char* config, _In_ unsigned int config_len, _In_ bool wait_for_start, _Out_opt_ string* timings = NULL)
+{
+	metrics_operation op(metric_counter::activations, metric_counter::activation_errors, metric_histogram::activate_latency);
+	phase_trace trace;
+	validate_tunnel_name(tunnel_name);
+	config_digest digest;
+	if (options.reattach_grace && !options.tunnel_engine)
+		digest = digest_config(config, config_len);
+
+	// Reject invalid configuration before touching the SCM. Keep it for in-place updates.
+	unique_ptr<interface_config> running(new interface_config);
+	running->parse(config, config_len);
+	if (options.tunnel_engine)
+		check_engine_config(*running);
+	trace.mark("parse");
+	vector<char, secure_allocator<char>> aggregated_config;
+	if (options.aggregate_allowed_ips)
 	{
-		// Prepare tunnel config file.
-		DATA_BLOB data_in = {
-			config_len,
-			(BYTE*)config
-		}, data_out;
-		if (!CryptProtectData(&data_in, tunnel_name, NULL, NULL, NULL, CRYPTPROTECT_UI_FORBIDDEN, &data_out))
-			throw win_runtime_error("Failed to encrypt tunnel config");
-		unique_ptr<unsigned char, LocalFree_delete<unsigned char>> encrypted_config(data_out.pbData);
-		PathCombineW(config_file_path, config_folder_path, wstring_printf(L"%s.conf.dpapi", tunnel_name).c_str());
-		winstd::security_attributes sa;
-		if (!ConvertStringSecurityDescriptorToSecurityDescriptor(
-			SDDL_OWNER SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
-			SDDL_GROUP SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
-			SDDL_DACL SDDL_DELIMINATOR SDDL_PROTECTED SDDL_AUTO_INHERITED
-			SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_LOCAL_SYSTEM SDDL_ACE_END
-			SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_STANDARD_DELETE SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_BUILTIN_ADMINISTRATORS SDDL_ACE_END,
-			SDDL_REVISION_1, sa, NULL))
-			throw win_runtime_error("ConvertStringSecurityDescriptorToSecurityDescriptor failed");
-		file config_file(CreateFileW(config_file_path, GENERIC_WRITE | DELETE, FILE_SHARE_READ, &sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL));
-		if (!config_file)
-			throw win_runtime_error("Failed to create config file");
-		DWORD bytes_written;
-		if (!WriteFile(config_file, data_out.pbData, data_out.cbData, &bytes_written, NULL))
-			throw win_runtime_error("Failed to write config file");
-		if (bytes_written != data_out.cbData)
-			throw runtime_error("Incomplete write of config file");
+		size_t before, after;
+		aggregate_allowed_ips(*running, before, after);
+		if (after < before)
+		{
+			running->rewrite_allowed_ips(config, config_len, aggregated_config);
+			config = aggregated_config.data();
+			config_len = (unsigned int)aggregated_config.size();
+		}
+		trace.mark("aggregate");
+		if (wg_log)
+			wg_log->write(string_printf("activate tunnel=%ls allowed_ips=%zu aggregated=%zu", tunnel_name, before, after).c_str());
 	}
 
-	try
+	// Peers whose endpoint resolves to several addresses get them raced before the tunnel starts. Probes then leave from outside the
+	// tunnel, ahead of its firewall and routes and of any initiation the driver would send.
+	vector<endpoint_race> races;
+	if (options.endpoint_race_timeout && wait_for_start)
 	{
-		// Create the tunnel service.
-		wstring fmt;
-		LoadStringW(NULL,
-			client_type == client_type_t::eduvpn ? IDS_EDUVPN_TUN_SERVICE_TITLE :
-			client_type == client_type_t::letsconnect ? IDS_LETSCONNECT_TUN_SERVICE_TITLE :
-			client_type == client_type_t::govvpn ? IDS_GOVVPN_TUN_SERVICE_TITLE :
-			throw invalid_argument("Unknown client"),
-			fmt);
-		wstring mgr_short_name;
-		sprintf(mgr_short_name, L"eduWGManager$%s", client_id);
-		const LPCWSTR deps[] = {
-			L"Nsi",
-			L"TcpIp",
-			mgr_short_name.c_str()
-		};
-		vector<WCHAR> dependencies;
-		for (size_t i = 0; i < _countof(deps); ++i)
-			dependencies.insert(dependencies.cend(), deps[i], deps[i] + wcslen(deps[i]) + 1);
-		dependencies.push_back(L'\0');
-		service = CreateServiceW(scm,
-			short_name.c_str(),
-			wstring_printf(fmt.c_str(), tunnel_name).c_str(),
-			SERVICE_ALL_ACCESS,
-			SERVICE_WIN32_OWN_PROCESS,
-			SERVICE_AUTO_START,
-			SERVICE_ERROR_NORMAL,
-			wstring_printf(L"\"%.*s\" \"%s\" Tunnel \"%s\"", MAX_PATH, module_file_path, client_id, tunnel_name).c_str(),
-			NULL,
-			NULL,
-			dependencies.data(),
-			NULL,
-			NULL);
-		if (!service)
-			throw win_runtime_error("Failed to create tunnel service");
-
-		try {
-			// Configure the tunnel service.
-			SERVICE_SID_INFO sid_type = { SERVICE_SID_TYPE_UNRESTRICTED };
-			if (!ChangeServiceConfig2W(service, SERVICE_CONFIG_SERVICE_SID_INFO, &sid_type))
-				throw win_runtime_error("Failed to set tunnel service SID_INFO");
-			wstring desc;
-			sprintf(desc, L"@%.*s,-%u",
-				MAX_PATH, module_file_path,
-				client_type == client_type_t::eduvpn ? IDS_EDUVPN_TUN_SERVICE_DESCRIPTION :
-				client_type == client_type_t::letsconnect ? IDS_LETSCONNECT_TUN_SERVICE_DESCRIPTION :
-				client_type == client_type_t::govvpn ? IDS_GOVVPN_TUN_SERVICE_DESCRIPTION :
-				throw invalid_argument("Unknown client"));
-			SERVICE_DESCRIPTIONW description = { const_cast<LPWSTR>(desc.c_str()) };
-			ChangeServiceConfig2W(service, SERVICE_CONFIG_DESCRIPTION, &description);
-
-			// Start the tunnel service.
-			if (!StartServiceW(service, 0, NULL))
-				throw win_runtime_error("Failed to start tunnel service");
-			DeleteService(service);
-			SERVICE_STATUS tunnel_service_status;
-			for (int i = 0; wait_for_start && i < 180 && QueryServiceStatus(service, &tunnel_service_status) && tunnel_service_status.dwCurrentState == SERVICE_START_PENDING; ++i)
-				if (WaitForSingleObject(quit, 1000) == WAIT_OBJECT_0)
-					break;
+		for (size_t i = 0; i < running->peers.size(); ++i)
+		{
+			if (!running->peers[i].has_endpoint())
+				continue;
+			endpoint_race race;
+			race.peer = i;
+			try { running->peers[i].resolve_endpoint_candidates(race.candidates); }
+			catch (...) { continue; }
+			if (race.candidates.size() > 1)
+				races.push_back(move(race));
+		}
+		trace.mark("resolve_endpoints");
+	}
+
+	auto start_racing = [&](_In_ const function<void()>& start)
+	{
+		if (races.empty())
+			start();
+		else
+		{
+			probe_endpoints(tunnel_name, *running, races);
+			trace.mark("race_endpoints");
+			start();
+			try { commit_endpoints(tunnel_name, *running, races); }
+			catch (const exception& e) { log(e); }
+			trace.mark("commit_endpoints");
+		}
+	};
+
+	if (options.tunnel_engine)
+	{
+		bool previous = !!find_engine_tunnel(tunnel_name);
+		if (!previous)
+		{
+			// Tunnel service the previous manager instance left running
+			srwlock::shared lock(tunnel_services_lock);
+			previous = tunnel_services.find(tunnel_name) != tunnel_services.end();
+		}
+		if (previous)
+		{
+			deactivate_tunnel(tunnel_name, true);
+			trace.mark("deactivate_previous");
+		}
+		start_racing([&] { start_engine_tunnel(tunnel_name, *running); trace.mark("start_engine"); });
+	}
+	else
+	{
+		WCHAR config_file_path[MAX_PATH];
+		PathCombineW(config_file_path, config_folder_path, wstring_printf(L"%s.conf.dpapi", tunnel_name).c_str());
+		SC_HANDLE service = register_tunnel_service(tunnel_name, config_file_path);
+		trace.mark("register_service");
+		SERVICE_STATUS tunnel_service_status;
+		if (service_manager::QueryServiceStatus(service, &tunnel_service_status) && tunnel_service_status.dwCurrentState != SERVICE_STOPPED)
+		{
+			// Deactivate existing tunnel with this name.
+			deactivate_tunnel(tunnel_name, true);
+			trace.mark("deactivate_previous");
+		}
+
+		write_config_file(tunnel_name, config, config_len, config_file_path);
+		trace.mark("write_config_file");
+
+		try
+		{
+			auto start = [&]
+			{
+				// Start the tunnel service.
+				if (!service_manager::StartServiceW(service, 0, NULL))
+					throw win_runtime_error("Failed to start tunnel service");
+				trace.mark("start_service");
+				for (int i = 0; wait_for_start && i < 1800 && service_manager::QueryServiceStatus(service, &tunnel_service_status) && tunnel_service_status.dwCurrentState == SERVICE_START_PENDING; ++i)
+					if (WaitForSingleObject(quit, 100) == WAIT_OBJECT_0)
+						break;
+				if (wait_for_start)
+					trace.mark("start_pending");
+			};
+			start_racing(start);
 		}
 		catch (const exception& e)
 		{
-			DeleteService(service);
+			DeleteFileW(config_file_path);
 			throw e;
 		}
 	}
-	catch (const exception& e)
+
 	{
-		DeleteFileW(config_file_path);
-		throw e;
+		srwlock::exclusive lock(tunnels_lock);
+		tunnels[tunnel_name] = make_shared<active_tunnel>(tunnel_name, move(running));
+	}
+
+	if (options.reattach_grace && !options.tunnel_engine)
+	{
+		try { store_config_digest(tunnel_name, digest); }
+		catch (const exception& e) { log(e); }
+		trace.mark("store_digest");
 	}
+
+	log_trace("activate", tunnel_name, trace);
+	if (timings)
+		*timings = trace.str();
+	op.succeeded();
 }
 
-enum class message_code
+static void update_tunnel(_In_z_ const wchar_t* tunnel_name, _In_count_(config_len) const char* config, _In_ unsigned int config_len, _Out_opt_ string* timings = NULL)
 {
-	status,
-	activate_tunnel,
-	deactivate_tunnel,
-	get_tunnel_config,
-	tunnel_config,
-};
+	phase_trace trace;
+	validate_tunnel_name(tunnel_name);
+	if (options.tunnel_engine)
+	{
+		interface_config updated;
+		updated.parse(config, config_len);
+		check_engine_config(updated);
+	}
+	if (!get_tunnel(tunnel_name)->update(config, config_len))
+	{
+		activate_tunnel(tunnel_name, config, config_len, true, timings);
+		return;
+	}
+	trace.mark("update");
+	if (options.tunnel_engine)
+	{
+		update_engine_tunnel(tunnel_name, config, config_len);
+		trace.mark("update_engine");
+	}
+	if (options.reattach_grace && !options.tunnel_engine)
+	{
+		try { store_config_digest(tunnel_name, digest_config(config, config_len)); }
+		catch (const exception& e) { log(e); }
+		trace.mark("store_digest");
+	}
+	log_trace("update", tunnel_name, trace);
+	if (timings)
+		*timings = trace.str();
+}
 
-struct message {
-	message_code code;
-};
+// Tunnels the previous manager instance left running. Their clients may claim them until the grace period ends.
+static srwlock orphan_tunnels_lock;
+static map<wstring, config_digest> orphan_tunnels;
 
-struct message_status : message {
-	bool success;
-	DWORD win32_error;
-	unsigned int message_len;
-	char message[];
-};
+// Takes over an orphan tunnel when the client activates it with the configuration it runs. Returns false when the tunnel needs to be
+// activated instead.
+static bool claim_tunnel(_In_z_ const wchar_t* tunnel_name, _In_count_(config_len) const char* config, _In_ unsigned int config_len, _Out_opt_ string* timings = NULL)
+{
+	{
+		srwlock::shared lock(orphan_tunnels_lock);
+		if (orphan_tunnels.empty())
+			return false;
+	}
+	phase_trace trace;
+	auto digest = digest_config(config, config_len);
+	bool unchanged;
+	{
+		srwlock::exclusive lock(orphan_tunnels_lock);
+		auto o = orphan_tunnels.find(tunnel_name);
+		if (o == orphan_tunnels.end())
+			return false;
+		unchanged = o->second == digest;
+		orphan_tunnels.erase(o);
+	}
+	trace.mark("digest");
+	if (!unchanged)
+		return false;
 
-#define MAX_WG_TUNNEL_NAME 32
+	SC_HANDLE service = NULL;
+	{
+		srwlock::shared lock(tunnel_services_lock);
+		auto s = tunnel_services.find(tunnel_name);
+		if (s != tunnel_services.end())
+			service = s->second.handle;
+	}
+	SERVICE_STATUS tunnel_service_status;
+	if (!service || !service_manager::QueryServiceStatus(service, &tunnel_service_status) || tunnel_service_status.dwCurrentState != SERVICE_RUNNING)
+		return false;
+	trace.mark("query_service");
+
+	unique_ptr<interface_config> running(new interface_config);
+	running->parse(config, config_len);
+	if (options.aggregate_allowed_ips)
+	{
+		size_t before, after;
+		aggregate_allowed_ips(*running, before, after);
+	}
+	trace.mark("parse");
+	{
+		srwlock::exclusive lock(tunnels_lock);
+		tunnels[tunnel_name] = make_shared<active_tunnel>(tunnel_name, move(running));
+	}
+	log_trace("claim", tunnel_name, trace);
+	if (timings)
+		*timings = trace.str();
+	return true;
+}
 
-struct message_activate_tunnel : message {
-	char tunnel_name[MAX_WG_TUNNEL_NAME];
-	unsigned int config_len;
-	char config[];
-};
+// Calls f with tunnel name and status of each running tunnel service of this client.
+static void enum_tunnel_services(_In_ const function<void(const wstring&, const ENUM_SERVICE_STATUS_PROCESSW&)>& f)
+{
+	wstring prefix = wstring_printf(L"eduWGTunnel$%s$", client_id);
+	vector<unsigned char> buffer;
+	DWORD bytes_needed = 0, count, resume = 0;
+	for (;;)
+	{
+		bool more = !service_manager::EnumServicesStatusExW(scm, SC_ENUM_PROCESS_INFO, SERVICE_WIN32, SERVICE_ACTIVE, buffer.data(), (DWORD)buffer.size(), &bytes_needed, &count, &resume, NULL);
+		if (more && GetLastError() != ERROR_MORE_DATA)
+			throw win_runtime_error("EnumServicesStatusEx failed");
+		auto entries = reinterpret_cast<const ENUM_SERVICE_STATUS_PROCESSW*>(buffer.data());
+		for (DWORD i = 0; i < count; ++i)
+		{
+			if (entries[i].ServiceStatusProcess.dwCurrentState != SERVICE_RUNNING ||
+				_wcsnicmp(entries[i].lpServiceName, prefix.c_str(), prefix.size()) != 0)
+				continue;
+			f(wstring(entries[i].lpServiceName + prefix.size()), entries[i]);
+		}
+		if (!more)
+			break;
+		if (buffer.size() < bytes_needed)
+			buffer.resize(bytes_needed);
+	}
+}
+
+// Adopts running tunnel services of this client left by the previous manager instance.
+static void reattach_tunnels()
+{
+	enum_tunnel_services([](const wstring& tunnel_name, const ENUM_SERVICE_STATUS_PROCESSW& entry)
+	{
+		try
+		{
+			validate_tunnel_name(tunnel_name.c_str());
+			config_digest digest;
+			if (!load_config_digest(tunnel_name.c_str(), digest))
+				digest.fill(0); // Nothing can claim it. Stopped when the grace period ends.
+			{
+				srwlock::exclusive lock(tunnel_services_lock);
+				auto& s = tunnel_services[tunnel_name];
+				if (!s.handle)
+				{
+					s.handle = service_manager::OpenServiceW(scm, entry.lpServiceName, SERVICE_ALL_ACCESS);
+					if (!s.handle)
+						throw win_runtime_error("Failed to open tunnel service");
+					s.binary_path.clear();
+				}
+			}
+			{
+				srwlock::exclusive lock(orphan_tunnels_lock);
+				orphan_tunnels[tunnel_name] = digest;
+			}
+			if (wg_log)
+				wg_log->write(string_printf("reattach tunnel=%ls", tunnel_name.c_str()).c_str());
+		}
+		catch (const exception& e) { log(e); }
+	});
+}
 
-struct message_config : message {
-	unsigned int config_len;
-	char config[];
+// Logs resident memory of this process and of the tunnel service processes, to compare tunnel engine with tunnel services.
+static void log_footprint()
+{
+	if (!wg_log)
+		return;
+	try
+	{
+		PROCESS_MEMORY_COUNTERS pmc = { sizeof(pmc) };
+		SIZE_T manager_working_set = GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.WorkingSetSize : 0;
+		SIZE_T services_working_set = 0;
+		size_t service_count = 0;
+		enum_tunnel_services([&](const wstring& tunnel_name, const ENUM_SERVICE_STATUS_PROCESSW& entry)
+		{
+			UNREFERENCED_PARAMETER(tunnel_name);
+			++service_count;
+			process p(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, entry.ServiceStatusProcess.dwProcessId));
+			PROCESS_MEMORY_COUNTERS counters = { sizeof(counters) };
+			if (!!p && GetProcessMemoryInfo(p, &counters, sizeof(counters)))
+				services_working_set += counters.WorkingSetSize;
+		});
+		size_t engine_count;
+		{
+			srwlock::shared lock(engine_tunnels_lock);
+			engine_count = engine_tunnels.size();
+		}
+		wg_log->write(string_printf("footprint engine_tunnels=%zu tunnel_services=%zu manager_working_set=%zu services_working_set=%zu",
+			engine_count, service_count, manager_working_set, services_working_set).c_str());
+	}
+	catch (const exception& e) { log(e); }
+}
+
+static event footprint_requested; // Auto-reset; set after activations
+
+// Logs footprint after activations, away from their replies: it takes an SCM enumeration and opens every tunnel service process.
+// Activations requested meanwhile are logged once.
+static DWORD WINAPI footprint_logger(_In_opt_ LPVOID lpThreadParameter)
+{
+	UNREFERENCED_PARAMETER(lpThreadParameter);
+	const HANDLE event_handles[] = { quit, footprint_requested };
+	while (WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+		log_footprint();
+	return 0;
+}
+
+// Stops orphan tunnels nobody claimed within the grace period.
+static DWORD WINAPI orphan_reaper(_In_opt_ LPVOID lpThreadParameter)
+{
+	UNREFERENCED_PARAMETER(lpThreadParameter);
+	if (WaitForSingleObject(quit, options.reattach_grace) != WAIT_TIMEOUT)
+		return 0;
+	vector<wstring> names;
+	{
+		srwlock::exclusive lock(orphan_tunnels_lock);
+		for (auto& o : orphan_tunnels)
+			names.push_back(o.first);
+		orphan_tunnels.clear();
+	}
+	vector<function<void()>> tasks;
+	for (auto& tunnel_name : names)
+		tasks.push_back([&tunnel_name] { deactivate_tunnel(tunnel_name.c_str(), false); });
+	try { run_concurrently(tasks); }
+	catch (const exception& e) { log(e); }
+	return 0;
+}
+
+#define PATH_REFRESH_SETTLE 500      // Milliseconds to let address changes settle before refreshing
+#define PATH_REFRESH_TIMEOUT 10000    // Milliseconds to await handshake after refreshing
+#define PATH_REFRESH_POLL 250         // Milliseconds between checks for handshakes after refreshing
+
+// Refreshed tunnel awaiting its next handshake
+struct pending_refresh
+{
+	shared_ptr<active_tunnel> tunnel;
+	ULONGLONG since;     // Time of the network event in 100ns intervals since 1601-01-01 UTC
+	const char* reason;
+	size_t peers;        // Number of peers refreshed; 0 when none
+	double refreshed;    // Milliseconds from the network event to the refresh
 };
 
-#define PIPE_MSG_BUFFER 0x10000
+// Records refresh latency of tunnels that made a handshake since, and gives up on those that timed out. Latency is taken from the
+// handshake time the driver reports, so it does not depend on how often this is called.
+static void check_pending_refreshes(_Inout_ vector<pending_refresh>& pending)
+{
+	auto now = system_time();
+	for (auto p = pending.begin(); p != pending.end();)
+	{
+		try
+		{
+			ULONGLONG handshake = p->tunnel->last_handshake();
+			if (handshake > p->since)
+			{
+				ULONGLONG latency = (handshake - p->since) / 10;
+				metrics::record(metric_histogram::refresh_latency, latency);
+				if (wg_log)
+					wg_log->write(string_printf("refresh tunnel=%ls reason=%s peers=%zu refreshed=%.3f handshake=%.3f", p->tunnel->name.c_str(), p->reason, p->peers, p->refreshed, (double)latency / 1000.0).c_str());
+			}
+			else if (now - p->since >= (ULONGLONG)PATH_REFRESH_TIMEOUT * 10000)
+			{
+				if (wg_log)
+					wg_log->write(string_printf("refresh tunnel=%ls reason=%s peers=%zu refreshed=%.3f handshake=timeout", p->tunnel->name.c_str(), p->reason, p->peers, p->refreshed).c_str());
+			}
+			else
+			{
+				++p;
+				continue;
+			}
+		}
+		catch (const exception& e) { log(e); } // Tunnel is gone.
+		p = pending.erase(p);
+	}
+}
+
+// Refreshes all active tunnels on network events. Handshakes that follow are awaited between events, not before the next one.
+static DWORD WINAPI path_refresher(_In_opt_ LPVOID lpThreadParameter)
+{
+	UNREFERENCED_PARAMETER(lpThreadParameter);
+	const HANDLE event_handles[] = { quit, path_events.posted() };
+	vector<pending_refresh> pending;
+	for (;;)
+	{
+		DWORD wait = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, pending.empty() ? INFINITE : PATH_REFRESH_POLL);
+		if (wait == WAIT_TIMEOUT)
+		{
+			check_pending_refreshes(pending);
+			continue;
+		}
+		if (wait != WAIT_OBJECT_0 + 1)
+			break;
+		auto since = system_time();
+		metrics_stopwatch watch;
+		auto posted = path_events.take();
+		if (!network_events::has(posted, network_event::resume))
+		{
+			// Interfaces add several addresses in a row. Refresh once they are in place.
+			if (WaitForSingleObject(quit, PATH_REFRESH_SETTLE) != WAIT_TIMEOUT)
+				break;
+			posted |= path_events.take();
+		}
+		const char* reason = network_events::has(posted, network_event::resume) ? "resume" : "network_change";
+
+		vector<pending_refresh> refreshed;
+		{
+			srwlock::shared lock(tunnels_lock);
+			for (auto& t : tunnels)
+				refreshed.push_back(pending_refresh{ t.second, since, reason, 0, 0.0 });
+		}
+		vector<function<void()>> tasks;
+		for (auto& r : refreshed)
+			tasks.push_back([&r, &watch]
+			{
+				r.peers = r.tunnel->refresh();
+				metrics::add(metric_counter::path_refreshes);
+				r.refreshed = (double)watch.elapsed() / 1000.0;
+			});
+		try { run_concurrently(tasks); }
+		catch (const exception& e) { log(e); }
+
+		// A new refresh of a tunnel supersedes the one still awaiting its handshake.
+		for (auto& r : refreshed)
+		{
+			if (!r.peers)
+				continue;
+			auto p = find_if(pending.begin(), pending.end(), [&r](const pending_refresh& other) { return other.tunnel == r.tunnel; });
+			if (p != pending.end())
+				*p = move(r);
+			else
+				pending.push_back(move(r));
+		}
+		check_pending_refreshes(pending);
+	}
+	return 0;
+}
+
+static srwlock peer_stats_samplers_lock;
+static map<wstring, weak_ptr<peer_stats_sampler>> peer_stats_samplers;
+
+static shared_ptr<peer_stats_sampler> get_peer_stats_sampler(_In_z_ const wchar_t* tunnel_name)
+{
+	srwlock::exclusive lock(peer_stats_samplers_lock);
+	for (auto i = peer_stats_samplers.begin(); i != peer_stats_samplers.end();)
+		if (i->second.expired())
+			i = peer_stats_samplers.erase(i);
+		else
+			++i;
+	auto sampler = peer_stats_samplers[tunnel_name].lock();
+	if (!sampler)
+	{
+		wstring name(tunnel_name);
+		sampler = make_shared<peer_stats_sampler>(tunnel_name, [name](vector<unsigned char, sanitizing_allocator<unsigned char>>& data) -> bool
+		{
+			auto t = find_tunnel(name.c_str());
+			if (!t)
+				return false;
+			t->get_configuration(data);
+			// Tunnel might have been deactivated and activated again meanwhile. Do not mix samples of both.
+			return find_tunnel(name.c_str()) == t;
+		});
+		peer_stats_samplers[tunnel_name] = sampler;
+	}
+	return sampler;
+}
+
+// Copies payload to a new section and duplicates a read-only handle of it into the pipe client process. The section is backed
+// by the paging file, so payload must not contain key material.
+static unsigned long long share_payload(_In_ HANDLE pipe, _In_reads_bytes_(size) const void* data, _In_ size_t size, _Out_ process& client)
+{
+	ULONG client_pid;
+	if (!GetNamedPipeClientProcessId(pipe, &client_pid))
+		throw win_runtime_error("GetNamedPipeClientProcessId failed");
+	client = OpenProcess(PROCESS_DUP_HANDLE, FALSE, client_pid);
+	if (!client)
+		throw win_runtime_error("OpenProcess failed");
+	file_mapping section(CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((ULONGLONG)size >> 32), (DWORD)size, NULL));
+	if (!section)
+		throw win_runtime_error("CreateFileMapping failed");
+	void* view = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, size);
+	if (!view)
+		throw win_runtime_error("MapViewOfFile failed");
+	memcpy(view, data, size);
+	UnmapViewOfFile(view);
+	HANDLE client_section;
+	if (!DuplicateHandle(GetCurrentProcess(), section, client, &client_section, FILE_MAP_READ, FALSE, 0))
+		throw win_runtime_error("DuplicateHandle failed");
+	return (unsigned long long)(ULONG_PTR)client_section;
+}
+
+// Closes section handle share_payload() duplicated into client process, when the reply carrying it did not reach the client.
+static void revoke_payload(_In_ HANDLE client, _In_ unsigned long long section) noexcept
+{
+	DuplicateHandle(client, (HANDLE)(ULONG_PTR)section, NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+}
+
+// Returns true when any peer of configuration has a preshared key.
+static bool has_preshared_keys(_In_ const interface_view& view) noexcept
+{
+	for (auto peer : view)
+		if (peer->Flags & WIREGUARD_PEER_HAS_PRESHARED_KEY)
+			return true;
+	return false;
+}
+
+// Copies request for the request trace. Keys and endpoints in tunnel configurations are replaced.
+static void sanitize_request(_In_ const vector<unsigned char, secure_allocator<unsigned char>>& msg_in, _Out_ vector<unsigned char>& out)
+{
+	out.clear();
+	vector<char> config;
+	switch (reinterpret_cast<const message*>(msg_in.data())->code)
+	{
+	case message_code::activate_tunnel:
+	case message_code::update_tunnel: {
+		auto* _msg_in = reinterpret_cast<const message_activate_tunnel*>(msg_in.data());
+		if (msg_in.size() < sizeof(message_activate_tunnel) ||
+			msg_in.size() < sizeof(message_activate_tunnel) + _msg_in->config_len)
+			break;
+		sanitize_config(_msg_in->config, _msg_in->config_len, config);
+		out.assign(msg_in.cbegin(), msg_in.cbegin() + sizeof(message_activate_tunnel));
+		reinterpret_cast<message_activate_tunnel*>(out.data())->config_len = (unsigned int)config.size();
+		out.insert(out.cend(), config.cbegin(), config.cend());
+		return;
+	}
+
+	case message_code::activate_tunnels: {
+		auto* _msg_in = reinterpret_cast<const message_activate_tunnels*>(msg_in.data());
+		if (msg_in.size() < sizeof(message_activate_tunnels))
+			break;
+		out.assign(msg_in.cbegin(), msg_in.cbegin() + sizeof(message_activate_tunnels));
+		const unsigned char* cursor = _msg_in->tunnels;
+		const unsigned char* end = msg_in.data() + msg_in.size();
+		for (unsigned int i = 0; i < _msg_in->tunnel_count; ++i)
+		{
+			unsigned int config_len;
+			if ((size_t)(end - cursor) < MAX_WG_TUNNEL_NAME + sizeof(config_len))
+				break;
+			memcpy(&config_len, cursor + MAX_WG_TUNNEL_NAME, sizeof(config_len));
+			if ((size_t)(end - cursor - MAX_WG_TUNNEL_NAME - sizeof(config_len)) < config_len)
+				break;
+			sanitize_config(reinterpret_cast<const char*>(cursor + MAX_WG_TUNNEL_NAME + sizeof(config_len)), config_len, config);
+			out.insert(out.cend(), cursor, cursor + MAX_WG_TUNNEL_NAME);
+			cursor += MAX_WG_TUNNEL_NAME + sizeof(config_len) + config_len;
+			config_len = (unsigned int)config.size();
+			out.insert(out.cend(), reinterpret_cast<const unsigned char*>(&config_len), reinterpret_cast<const unsigned char*>(&config_len + 1));
+			out.insert(out.cend(), config.cbegin(), config.cend());
+		}
+		return;
+	}
+
+	default:
+		out.assign(msg_in.cbegin(), msg_in.cend());
+		return;
+	}
+
+	// Malformed request: keep the code only.
+	out.assign(msg_in.cbegin(), msg_in.cbegin() + sizeof(message));
+}
+
+static wstring tunnel_name_from_message(_In_reads_(MAX_WG_TUNNEL_NAME) const char* name)
+{
+	wstring tunnel_name;
+	size_t name_len = strnlen(name, MAX_WG_TUNNEL_NAME);
+	if (name_len)
+		MultiByteToWideChar(CP_UTF8, 0, name, (int)name_len, tunnel_name);
+	return tunnel_name;
+}
+
+// Returns tunnel name of message_tunnel request. Legacy requests without tunnel name refer to the only tunnel of the client.
+static wstring requested_tunnel_name(_In_ const vector<unsigned char, secure_allocator<unsigned char>>& msg_in, _In_ const set<wstring>& session_tunnels)
+{
+	if (msg_in.size() >= sizeof(message_tunnel))
+	{
+		wstring tunnel_name = tunnel_name_from_message(reinterpret_cast<const message_tunnel*>(msg_in.data())->tunnel_name);
+		if (!tunnel_name.empty())
+		{
+			if (session_tunnels.find(tunnel_name) == session_tunnels.end())
+				throw logic_error("Tunnel is not active");
+			return tunnel_name;
+		}
+	}
+	if (session_tunnels.empty())
+		throw logic_error("Tunnel is not active");
+	if (session_tunnels.size() > 1)
+		throw invalid_argument("Tunnel name is required");
+	return *session_tunnels.begin();
+}
+
+static volatile LONG connection_count;
+
+// Connection that activated each tunnel. A client may not replace or tear down a tunnel of another client.
+static srwlock tunnel_owners_lock;
+static map<wstring, unsigned int> tunnel_owners;
+
+// Makes connection owner of tunnels. Throws and owns none when another connection owns any of them.
+static void own_tunnels(_In_ const vector<wstring>& tunnel_names, _In_ unsigned int connection)
+{
+	srwlock::exclusive lock(tunnel_owners_lock);
+	for (auto& tunnel_name : tunnel_names)
+	{
+		auto o = tunnel_owners.find(tunnel_name);
+		if (o != tunnel_owners.end() && o->second != connection)
+			throw logic_error(string_printf("Tunnel %ls is active for another client", tunnel_name.c_str()));
+	}
+	for (auto& tunnel_name : tunnel_names)
+		tunnel_owners[tunnel_name] = connection;
+}
+
+static void disown_tunnel(_In_ const wstring& tunnel_name, _In_ unsigned int connection) noexcept
+{
+	srwlock::exclusive lock(tunnel_owners_lock);
+	auto o = tunnel_owners.find(tunnel_name);
+	if (o != tunnel_owners.end() && o->second == connection)
+		tunnel_owners.erase(o);
+}
+
+// Settles tunnel whose activation failed. A tunnel the session held before stays with it while the previous instance still runs,
+// for disconnect to tear it down. Otherwise, the session and connection forget it.
+static void forget_failed_activation(_In_ const wstring& tunnel_name, _In_ bool was_in_session, _Inout_ set<wstring>& session_tunnels, _In_ unsigned int connection)
+{
+	if (was_in_session && find_tunnel(tunnel_name.c_str()))
+		return;
+	session_tunnels.erase(tunnel_name);
+	disown_tunnel(tunnel_name, connection);
+}
 
 static DWORD WINAPI client_thread(_In_ LPVOID lpThreadParameter)
 {
 	DWORD ret;
-	wstring tunnel_name;
+	set<wstring> session_tunnels;
+	unsigned int connection = (unsigned int)InterlockedIncrement(&connection_count);
+	metrics::add(metric_counter::client_connections);
+	metrics::add(metric_counter::clients_connected);
 	try {
 		file pipe(lpThreadParameter);
 		event read_complete(CreateEventW(NULL, TRUE, FALSE, NULL));
 		OVERLAPPED overlapped = { 0 };
 		overlapped.hEvent = read_complete;
 		const HANDLE event_handles[] = { read_complete, quit };
-		vector<unsigned char, sanitizing_allocator<unsigned char>> msg_in(PIPE_MSG_BUFFER, 0);
-		vector<unsigned char, sanitizing_allocator<unsigned char>> tunnel_config(1024, 0);
+		event push_complete(CreateEventW(NULL, TRUE, FALSE, NULL));
+		OVERLAPPED push_overlapped = { 0 };
+		push_overlapped.hEvent = push_complete;
+		vector<unsigned char, secure_allocator<unsigned char>> msg_in(PIPE_MSG_BUFFER, 0);
+		vector<unsigned char, secure_allocator<unsigned char>> tunnel_config(1024, 0);
+		vector<unsigned char, secure_allocator<unsigned char>> msg_config;
+		vector<unsigned char> msg_peer_indices;
+		vector<unsigned char> msg_metrics;
 		vector<unsigned char> msg_out;
+		vector<unsigned char> msg_trace;
+		unsigned int capabilities = 0;
 		message_status msg_status;
 		msg_status.code = message_code::status;
+		unique_ptr<peer_stats_subscription> peer_stats;
+		vector<unsigned char> msg_peer_stats;
+
+		// Pushes peer statistics changes to client. Returns false when client disconnected or service is stopping.
+		auto push_peer_stats = [&]() -> bool
+		{
+			message_peer_stats msg_hdr;
+			msg_hdr.code = message_code::peer_stats;
+			msg_peer_stats.assign(reinterpret_cast<unsigned char*>(&msg_hdr), reinterpret_cast<unsigned char*>(&msg_hdr + 1));
+			if (!peer_stats->pull(msg_peer_stats, msg_hdr.record_count))
+				return true;
+			msg_hdr.peer_count = (unsigned int)peer_stats->peer_count();
+			memcpy(msg_peer_stats.data(), &msg_hdr, sizeof(msg_hdr));
+			DWORD err;
+			if (!WriteFile(pipe, msg_peer_stats.data(), (DWORD)msg_peer_stats.size(), NULL, &push_overlapped) && (err = GetLastError()) != ERROR_IO_PENDING)
+			{
+				if (err == ERROR_BROKEN_PIPE || err == ERROR_NO_DATA) // Client disconnected.
+					return false;
+				throw win_runtime_error(err, "Failed to write to pipe");
+			}
+			const HANDLE push_event_handles[] = { push_complete, quit };
+			err = WaitForMultipleObjects(_countof(push_event_handles), push_event_handles, FALSE, INFINITE);
+			if (err == WAIT_OBJECT_0 + 1)
+				return false;
+			else if (err != WAIT_OBJECT_0)
+				throw win_runtime_error(err, "WaitForMultipleObjects returned unexpectedly");
+			return true;
+		};
 
 		for (;;)
 		{
@@ -335,7 +1646,15 @@ static DWORD WINAPI client_thread(_In_ LPVOID lpThreadParameter)
 				err = GetLastError();
 				if (err == ERROR_IO_PENDING)
 				{
-					err = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, INFINITE);
+					for (;;)
+					{
+						const HANDLE read_event_handles[] = { read_complete, quit, peer_stats ? peer_stats->ready() : NULL };
+						err = WaitForMultipleObjects(peer_stats ? 3 : 2, read_event_handles, FALSE, INFINITE);
+						if (err != WAIT_OBJECT_0 + 2)
+							break;
+						if (!push_peer_stats())
+							goto out;
+					}
 					if (err == WAIT_OBJECT_0)
 					{
 						if (GetOverlappedResult(pipe, &overlapped, &bytes_read, FALSE))
@@ -374,51 +1693,320 @@ static DWORD WINAPI client_thread(_In_ LPVOID lpThreadParameter)
 
 			if (msg_in.size() < sizeof(message))
 				throw invalid_argument("Invalid request");
+			string timings; // Phase timings reported back on success
+			auto code = reinterpret_cast<const message*>(msg_in.data())->code;
+			metrics_stopwatch request_watch;
+			ULONGLONG request_time = request_log ? request_log->now() : 0;
+
+			// Accounts the request in metrics and the request trace.
+			auto account = [&](_In_ bool success)
+			{
+				auto latency = request_watch.elapsed();
+				metrics::request((unsigned int)code, latency, success);
+				if (request_log)
+				{
+					sanitize_request(msg_in, msg_trace);
+					request_log->write(request_time, connection, latency, success, msg_trace.data(), msg_trace.size());
+				}
+			};
 			try
 			{
-				switch (reinterpret_cast<const message*>(msg_in.data())->code)
+				switch (code)
 				{
 				case message_code::activate_tunnel: {
-					if (!tunnel_name.empty())
-						throw logic_error("Tunnel is already active");
 					auto* _msg_in = reinterpret_cast<const message_activate_tunnel*>(msg_in.data());
 					if (msg_in.size() < sizeof(message_activate_tunnel) ||
 						msg_in.size() < sizeof(message_activate_tunnel) + _msg_in->config_len)
 						throw invalid_argument("Invalid request");
-					MultiByteToWideChar(CP_UTF8, 0, _msg_in->tunnel_name, MAX_WG_TUNNEL_NAME, tunnel_name);
-					activate_tunnel(tunnel_name.c_str(), _msg_in->config, _msg_in->config_len, true);
+					wstring tunnel_name = tunnel_name_from_message(_msg_in->tunnel_name);
+					own_tunnels(vector<wstring>(1, tunnel_name), connection);
+					bool in_session = session_tunnels.find(tunnel_name) != session_tunnels.end(); // Re-activation replaces the tunnel.
+					try
+					{
+						if (!claim_tunnel(tunnel_name.c_str(), _msg_in->config, _msg_in->config_len, &timings))
+							activate_tunnel(tunnel_name.c_str(), _msg_in->config, _msg_in->config_len, true, &timings);
+					}
+					catch (...)
+					{
+						forget_failed_activation(tunnel_name, in_session, session_tunnels, connection);
+						throw;
+					}
+					session_tunnels.insert(tunnel_name);
+					if (!!footprint_requested)
+						SetEvent(footprint_requested);
+					break;
+				}
+
+				case message_code::update_tunnel: {
+					auto* _msg_in = reinterpret_cast<const message_activate_tunnel*>(msg_in.data());
+					if (msg_in.size() < sizeof(message_activate_tunnel) ||
+						msg_in.size() < sizeof(message_activate_tunnel) + _msg_in->config_len)
+						throw invalid_argument("Invalid request");
+					wstring tunnel_name = tunnel_name_from_message(_msg_in->tunnel_name);
+					if (session_tunnels.find(tunnel_name) == session_tunnels.end())
+						throw logic_error("Tunnel is not active");
+					update_tunnel(tunnel_name.c_str(), _msg_in->config, _msg_in->config_len, &timings);
+					break;
+				}
+
+				case message_code::activate_tunnels: {
+					auto* _msg_in = reinterpret_cast<const message_activate_tunnels*>(msg_in.data());
+					if (msg_in.size() < sizeof(message_activate_tunnels))
+						throw invalid_argument("Invalid request");
+					struct activation {
+						wstring tunnel_name;
+						const char* config;
+						unsigned int config_len;
+						bool in_session;
+						bool activated;
+						string timings;
+					};
+					vector<activation> activations;
+					const unsigned char* cursor = _msg_in->tunnels;
+					const unsigned char* end = msg_in.data() + msg_in.size();
+					for (unsigned int i = 0; i < _msg_in->tunnel_count; ++i)
+					{
+						activation a;
+						if ((size_t)(end - cursor) < MAX_WG_TUNNEL_NAME + sizeof(a.config_len))
+							throw invalid_argument("Invalid request");
+						a.tunnel_name = tunnel_name_from_message(reinterpret_cast<const char*>(cursor));
+						validate_tunnel_name(a.tunnel_name.c_str());
+						for (auto& a2 : activations)
+							if (a2.tunnel_name == a.tunnel_name)
+								throw invalid_argument("Duplicate tunnel name");
+						cursor += MAX_WG_TUNNEL_NAME;
+						memcpy(&a.config_len, cursor, sizeof(a.config_len));
+						cursor += sizeof(a.config_len);
+						if ((size_t)(end - cursor) < a.config_len)
+							throw invalid_argument("Invalid request");
+						a.config = reinterpret_cast<const char*>(cursor);
+						cursor += a.config_len;
+						a.activated = false;
+						activations.push_back(move(a));
+					}
+					{
+						vector<wstring> names;
+						for (auto& a : activations)
+							names.push_back(a.tunnel_name);
+						own_tunnels(names, connection);
+					}
+					vector<function<void()>> tasks;
+					for (auto& a : activations)
+					{
+						a.in_session = session_tunnels.find(a.tunnel_name) != session_tunnels.end();
+						tasks.push_back([&a] {
+							if (!claim_tunnel(a.tunnel_name.c_str(), a.config, a.config_len, &a.timings))
+								activate_tunnel(a.tunnel_name.c_str(), a.config, a.config_len, true, &a.timings);
+							a.activated = true;
+						});
+					}
+					try { run_concurrently(tasks); }
+					catch (...)
+					{
+						for (auto& a : activations)
+							if (a.activated)
+								session_tunnels.insert(a.tunnel_name);
+							else
+								forget_failed_activation(a.tunnel_name, a.in_session, session_tunnels, connection);
+						throw;
+					}
+					for (auto& a : activations)
+					{
+						session_tunnels.insert(a.tunnel_name);
+						timings += string_printf("tunnel=%ls %s\n", a.tunnel_name.c_str(), a.timings.c_str());
+					}
+					if (!!footprint_requested)
+						SetEvent(footprint_requested);
 					break;
 				}
 
 				case message_code::deactivate_tunnel: {
-					if (tunnel_name.empty())
-						throw logic_error("Tunnel is not active");
-					deactivate_tunnel(tunnel_name.c_str(), true);
-					tunnel_name.clear();
+					wstring tunnel_name = requested_tunnel_name(msg_in, session_tunnels);
+					deactivate_tunnel(tunnel_name.c_str(), true, &timings);
+					session_tunnels.erase(tunnel_name);
+					disown_tunnel(tunnel_name, connection);
 					break;
 				}
 
-				case message_code::get_tunnel_config: {
-					if (tunnel_name.empty())
-						throw logic_error("Tunnel is not active");
-					driver::adapter tunnel_adapter(driver::WireGuardOpenAdapter(tunnel_name.c_str()));
-					if (!tunnel_adapter)
-						throw winstd::win_runtime_error("WireGuardOpenAdapter failed");
+				case message_code::deactivate_tunnels: {
+					auto* _msg_in = reinterpret_cast<const message_deactivate_tunnels*>(msg_in.data());
+					if (msg_in.size() < sizeof(message_deactivate_tunnels) ||
+						(msg_in.size() - sizeof(message_deactivate_tunnels)) / MAX_WG_TUNNEL_NAME < _msg_in->tunnel_count)
+						throw invalid_argument("Invalid request");
+					vector<wstring> names;
+					if (_msg_in->tunnel_count)
+					{
+						for (unsigned int i = 0; i < _msg_in->tunnel_count; ++i)
+						{
+							wstring tunnel_name = tunnel_name_from_message(_msg_in->tunnel_names[i]);
+							if (session_tunnels.find(tunnel_name) == session_tunnels.end())
+								throw logic_error("Tunnel is not active");
+							names.push_back(move(tunnel_name));
+						}
+					}
+					else
+						names.assign(session_tunnels.cbegin(), session_tunnels.cend());
+					vector<string> tunnel_timings(names.size());
+					vector<char> deactivated(names.size(), false);
+					vector<function<void()>> tasks;
+					for (size_t i = 0; i < names.size(); ++i)
+						tasks.push_back([&names, &tunnel_timings, &deactivated, i]
+						{
+							deactivate_tunnel(names[i].c_str(), true, &tunnel_timings[i]);
+							deactivated[i] = true;
+						});
+					auto forget_deactivated = [&]
+					{
+						// Tunnels that failed to tear down stay with the session, to be torn down again on disconnect.
+						for (size_t i = 0; i < names.size(); ++i)
+							if (deactivated[i])
+							{
+								session_tunnels.erase(names[i]);
+								disown_tunnel(names[i], connection);
+							}
+					};
+					try { run_concurrently(tasks); }
+					catch (...)
+					{
+						forget_deactivated();
+						throw;
+					}
+					forget_deactivated();
+					for (size_t i = 0; i < names.size(); ++i)
+						timings += string_printf("tunnel=%ls %s\n", names[i].c_str(), tunnel_timings[i].c_str());
+					break;
+				}
+
+				case message_code::negotiate: {
+					if (msg_in.size() < sizeof(message_negotiate))
+						throw invalid_argument("Invalid request");
+					capabilities = reinterpret_cast<const message_negotiate*>(msg_in.data())->capabilities & CAPABILITIES_SUPPORTED;
+					message_negotiate msg_reply;
+					msg_reply.code = message_code::capabilities;
+					msg_reply.capabilities = capabilities;
+					account(true);
+					if (!WriteFile(pipe, &msg_reply, sizeof(msg_reply), NULL, &overlapped) && (err = GetLastError()) != ERROR_IO_PENDING)
+						throw win_runtime_error(err, "Failed to write to pipe");
+					err = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, INFINITE);
+					if (err == WAIT_OBJECT_0 + 1)
+						goto out;
+					else if (err != WAIT_OBJECT_0)
+						throw win_runtime_error(err, "WaitForMultipleObjects returned unexpectedly");
+					continue;
+				}
 
-					tunnel_adapter.get_configuration(tunnel_config);
-					auto* cfg = reinterpret_cast<WIREGUARD_INTERFACE*>(tunnel_config.data());
+				case message_code::get_tunnel_config:
+				case message_code::get_tunnel_config_compact: {
+					// Driver configuration is read right after room for the reply header; no copy is needed to prepend it.
+					get_tunnel(requested_tunnel_name(msg_in, session_tunnels).c_str())->get_configuration(msg_config, sizeof(message_config));
+					interface_view view(msg_config.data() + sizeof(message_config), msg_config.size() - sizeof(message_config));
+					auto* cfg = reinterpret_cast<WIREGUARD_INTERFACE*>(msg_config.data() + sizeof(message_config));
 					if (cfg->Flags & WIREGUARD_INTERFACE_HAS_PRIVATE_KEY)
 					{
 						SecureZeroMemory(&cfg->PrivateKey, sizeof(cfg->PrivateKey));
 						cfg->Flags &= ~WIREGUARD_INTERFACE_HAS_PRIVATE_KEY;
 					}
 
+					bool shareable = !has_preshared_keys(view);
 					message_config msg_cfg;
-					msg_cfg.code = message_code::tunnel_config;
-					msg_cfg.config_len = (DWORD)tunnel_config.size();
-					tunnel_config.insert(tunnel_config.cbegin(), reinterpret_cast<unsigned char*>(&msg_cfg), reinterpret_cast<unsigned char*>(&msg_cfg + 1));
+					auto* reply = &msg_config;
+					if (code == message_code::get_tunnel_config_compact)
+					{
+						msg_cfg.code = message_code::tunnel_config_compact;
+						tunnel_config.resize(sizeof(msg_cfg));
+						encode_compact_config(view, tunnel_config);
+						reply = &tunnel_config;
+					}
+					else
+					{
+						msg_cfg.code = message_code::tunnel_config;
+						msg_config.resize(sizeof(msg_cfg) + view.bytes());
+					}
+					msg_cfg.config_len = (unsigned int)(reply->size() - sizeof(msg_cfg));
+					process client;
+					unsigned long long section = 0;
+					if ((capabilities & CAPABILITY_SHARED_MEMORY) && msg_cfg.config_len > SHARED_MEMORY_THRESHOLD && shareable)
+					{
+						message_config_section msg_section;
+						msg_section.code = message_code::tunnel_config_section;
+						msg_section.payload_code = msg_cfg.code;
+						msg_section.config_len = msg_cfg.config_len;
+						msg_section.section = section = share_payload(pipe, reply->data() + sizeof(msg_cfg), msg_cfg.config_len, client);
+						reply->resize(sizeof(msg_section));
+						memcpy(reply->data(), &msg_section, sizeof(msg_section));
+					}
+					else
+						memcpy(reply->data(), &msg_cfg, sizeof(msg_cfg));
+					account(true);
+
+					if (!WriteFile(pipe, reply->data(), (DWORD)reply->size(), NULL, &overlapped) && (err = GetLastError()) != ERROR_IO_PENDING)
+					{
+						if (section)
+							revoke_payload(client, section);
+						throw win_runtime_error(err, "Failed to write to pipe");
+					}
+					err = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, INFINITE);
+					if (section)
+					{
+						// Unless the reply was written, client never learns of the section handle and cannot close it.
+						DWORD bytes_written;
+						if (err != WAIT_OBJECT_0)
+							CancelIoEx(pipe, &overlapped);
+						if (!GetOverlappedResult(pipe, &overlapped, &bytes_written, TRUE))
+							revoke_payload(client, section);
+					}
+					if (err == WAIT_OBJECT_0 + 1)
+						goto out;
+					else if (err != WAIT_OBJECT_0)
+						throw win_runtime_error(err, "WaitForMultipleObjects returned unexpectedly");
+					continue;
+				}
+
+				case message_code::lookup_peers: {
+					auto* _msg_in = reinterpret_cast<const message_lookup_peers*>(msg_in.data());
+					static const size_t record_size = sizeof(ADDRESS_FAMILY) + sizeof(IN6_ADDR);
+					if (msg_in.size() < sizeof(message_lookup_peers) ||
+						(msg_in.size() - sizeof(message_lookup_peers)) / record_size < _msg_in->address_count)
+						throw invalid_argument("Invalid request");
+					auto lpm = get_tunnel(requested_tunnel_name(msg_in, session_tunnels).c_str())->get_lpm();
+
+					message_peer_indices msg_hdr;
+					msg_hdr.code = message_code::peer_indices;
+					msg_hdr.index_count = _msg_in->address_count;
+					msg_peer_indices.resize(sizeof(msg_hdr) + sizeof(DWORD) * msg_hdr.index_count);
+					memcpy(msg_peer_indices.data(), &msg_hdr, sizeof(msg_hdr));
+					auto indices = reinterpret_cast<DWORD*>(msg_peer_indices.data() + sizeof(msg_hdr));
+					auto record = _msg_in->addresses;
+					for (unsigned int i = 0; i < msg_hdr.index_count; ++i, record += record_size)
+					{
+						ADDRESS_FAMILY family;
+						memcpy(&family, record, sizeof(family));
+						if (family != AF_INET && family != AF_INET6)
+							throw invalid_argument("Unsupported address family");
+						indices[i] = lpm->lookup(family, record + sizeof(family));
+					}
+					account(true);
+
+					if (!WriteFile(pipe, msg_peer_indices.data(), (DWORD)msg_peer_indices.size(), NULL, &overlapped) && (err = GetLastError()) != ERROR_IO_PENDING)
+						throw win_runtime_error(err, "Failed to write to pipe");
+					err = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, INFINITE);
+					if (err == WAIT_OBJECT_0 + 1)
+						goto out;
+					else if (err != WAIT_OBJECT_0)
+						throw win_runtime_error(err, "WaitForMultipleObjects returned unexpectedly");
+					continue;
+				}
+
+				case message_code::get_metrics: {
+					message_metrics msg_hdr;
+					msg_hdr.code = message_code::metrics;
+					msg_metrics.assign(reinterpret_cast<unsigned char*>(&msg_hdr), reinterpret_cast<unsigned char*>(&msg_hdr + 1));
+					account(true); // Count this request in the snapshot.
+					metrics::snapshot(msg_metrics);
+					msg_hdr.snapshot_len = (unsigned int)(msg_metrics.size() - sizeof(msg_hdr));
+					memcpy(msg_metrics.data(), &msg_hdr, sizeof(msg_hdr));
 
-					if (!WriteFile(pipe, tunnel_config.data(), (DWORD)tunnel_config.size(), NULL, &overlapped) && (err = GetLastError()) != ERROR_IO_PENDING)
+					if (!WriteFile(pipe, msg_metrics.data(), (DWORD)msg_metrics.size(), NULL, &overlapped) && (err = GetLastError()) != ERROR_IO_PENDING)
 						throw win_runtime_error(err, "Failed to write to pipe");
 					err = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, INFINITE);
 					if (err == WAIT_OBJECT_0 + 1)
@@ -428,17 +2016,54 @@ static DWORD WINAPI client_thread(_In_ LPVOID lpThreadParameter)
 					continue;
 				}
 
+				case message_code::get_probe_stats: {
+					WCHAR path[MAX_PATH];
+					probe_window_path(requested_tunnel_name(msg_in, session_tunnels).c_str(), path);
+					unique_ptr<probe_window> window;
+					try { window.reset(new probe_window(path, false)); }
+					catch (...) { throw logic_error("Tunnel is not probed"); }
+					message_probe_stats msg_reply;
+					msg_reply.code = message_code::probe_stats;
+					window->stats(msg_reply.stats);
+					account(true);
+
+					if (!WriteFile(pipe, &msg_reply, sizeof(msg_reply), NULL, &overlapped) && (err = GetLastError()) != ERROR_IO_PENDING)
+						throw win_runtime_error(err, "Failed to write to pipe");
+					err = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, INFINITE);
+					if (err == WAIT_OBJECT_0 + 1)
+						goto out;
+					else if (err != WAIT_OBJECT_0)
+						throw win_runtime_error(err, "WaitForMultipleObjects returned unexpectedly");
+					continue;
+				}
+
+				case message_code::subscribe_peer_stats: {
+					auto* _msg_in = reinterpret_cast<const message_subscribe_peer_stats*>(msg_in.data());
+					if (msg_in.size() < sizeof(message_subscribe_peer_stats))
+						throw invalid_argument("Invalid request");
+					peer_stats.reset();
+					if (!_msg_in->interval)
+						break;
+					// Request starts as message_tunnel does. Peers of tunnels of other clients are not theirs to watch.
+					wstring name = requested_tunnel_name(msg_in, session_tunnels);
+					peer_stats.reset(new peer_stats_subscription(get_peer_stats_sampler(name.c_str()), _msg_in->interval));
+					break;
+				}
+
 				default:
 					throw invalid_argument("Unknown message");
 				}
 
+				account(true);
 				msg_status.success = true;
 				msg_status.win32_error = ERROR_SUCCESS;
-				msg_status.message_len = 0;
+				msg_status.message_len = (unsigned int)timings.size();
 				msg_out.assign(reinterpret_cast<unsigned char*>(&msg_status), reinterpret_cast<unsigned char*>(&msg_status + 1));
+				msg_out.insert(msg_out.cend(), timings.cbegin(), timings.cend());
 			}
 			catch (const win_runtime_error& e)
 			{
+				account(false);
 				msg_status.success = false;
 				msg_status.win32_error = e.number();
 				msg_status.message_len = (unsigned int)strlen(e.what());
@@ -447,6 +2072,7 @@ static DWORD WINAPI client_thread(_In_ LPVOID lpThreadParameter)
 			}
 			catch (const exception& e)
 			{
+				account(false);
 				msg_status.success = false;
 				msg_status.win32_error = 0;
 				msg_status.message_len = (unsigned int)strlen(e.what());
@@ -473,12 +2099,154 @@ static DWORD WINAPI client_thread(_In_ LPVOID lpThreadParameter)
 		ret = 1;
 	}
 
-	if (!tunnel_name.empty())
-		deactivate_tunnel(tunnel_name.c_str(), false);
+	if (!session_tunnels.empty() && (!options.reattach_grace || WaitForSingleObject(quit, 0) != WAIT_OBJECT_0))
+	{
+		// Tear down all tunnels of this client. When the manager is stopping, leave them for the next instance to re-attach.
+		vector<function<void()>> tasks;
+		for (auto& tunnel_name : session_tunnels)
+			tasks.push_back([&tunnel_name] { deactivate_tunnel(tunnel_name.c_str(), false); });
+		try { run_concurrently(tasks); }
+		catch (const exception& e) { log(e); }
+	}
+	for (auto& tunnel_name : session_tunnels)
+		disown_tunnel(tunnel_name, connection);
 
+	metrics::add(metric_counter::clients_connected, -1);
 	return ret;
 }
 
+// Serves manager pipe until quit is set.
+void manager_run(_In_z_ const wchar_t* pipe_name)
+{
+	WSADATA wsa_data;
+	int wsa_err = WSAStartup(MAKEWORD(2, 2), &wsa_data);
+	if (wsa_err)
+		throw win_runtime_error(wsa_err, "WSAStartup failed");
+
+	scm = service_manager::OpenSCManagerW(NULL, NULL, SC_MANAGER_ALL_ACCESS);
+	if (!scm)
+		throw win_runtime_error("Failed to open SCM");
+
+	thread refresher;
+	if (options.refresh_paths)
+	{
+		try { path_events.watch(); }
+		catch (const exception& e) { log(e); }
+		refresher = CreateThread(NULL, 0, path_refresher, NULL, 0, NULL);
+		if (!refresher)
+			log(win_runtime_error("CreateThread failed"));
+	}
+
+	thread footprint;
+	if (wg_log)
+	{
+		footprint_requested = CreateEventW(NULL, FALSE, FALSE, NULL);
+		if (!footprint_requested)
+			log(win_runtime_error("CreateEvent failed"));
+		else
+		{
+			footprint = CreateThread(NULL, 0, footprint_logger, NULL, 0, NULL);
+			if (!footprint)
+				log(win_runtime_error("CreateThread failed"));
+		}
+	}
+
+	thread reaper;
+	if (options.reattach_grace)
+	{
+		try { reattach_tunnels(); }
+		catch (const exception& e) { log(e); }
+		if (!orphan_tunnels.empty())
+		{
+			reaper = CreateThread(NULL, 0, orphan_reaper, NULL, 0, NULL);
+			if (!reaper)
+				log(win_runtime_error("CreateThread failed"));
+		}
+	}
+
+	winstd::security_attributes sa;
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptor(
+		SDDL_OWNER SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
+		SDDL_GROUP SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
+		SDDL_DACL SDDL_DELIMINATOR SDDL_PROTECTED SDDL_AUTO_INHERITED
+		SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_LOCAL_SYSTEM SDDL_ACE_END
+		SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_READ SDDL_FILE_WRITE SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_EVERYONE SDDL_ACE_END
+		SDDL_ACE_BEGIN SDDL_ACCESS_DENIED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_ANONYMOUS SDDL_ACE_END,
+		SDDL_REVISION_1, sa, NULL))
+		throw win_runtime_error("ConvertStringSecurityDescriptorToSecurityDescriptor failed");
+	DWORD open_mode = PIPE_ACCESS_DUPLEX | WRITE_DAC | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED;
+	event client_connected(CreateEventW(NULL, TRUE, FALSE, NULL));
+	const HANDLE event_handles[] = { client_connected, quit };
+	for (;;)
+	{
+		// Create named pipe and schedule client connection accept.
+		DWORD err;
+		file pipe(CreateNamedPipeW(
+			pipe_name,
+			open_mode,
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			PIPE_UNLIMITED_INSTANCES,
+			PIPE_MSG_BUFFER, PIPE_MSG_BUFFER,
+			0,
+			&sa));
+		if (!pipe)
+			throw win_runtime_error("Failed to create pipe");
+		OVERLAPPED overlapped = { 0 };
+		overlapped.hEvent = client_connected;
+		if (!ConnectNamedPipe(pipe, &overlapped))
+		{
+			err = GetLastError();
+			if (err != ERROR_PIPE_CONNECTED && err != ERROR_IO_PENDING)
+				throw win_runtime_error(err, "Failed to connect pipe");
+		}
+
+		// Report the service is running. Even if we already did so.
+		service_status.dwCurrentState = SERVICE_RUNNING;
+		service_status.dwControlsAccepted |= SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_STOP | (options.refresh_paths ? SERVICE_ACCEPT_POWEREVENT : 0);
+		SetServiceStatus(service_handle, &service_status);
+
+		err = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, INFINITE);
+		if (err == WAIT_OBJECT_0)
+		{
+			// Client connected.
+			thread t(CreateThread(NULL, 0, client_thread, pipe, 0, NULL));
+			if (!!t)
+				pipe.detach();
+			else
+				log(win_runtime_error("CreateThread failed"));
+		}
+		else if (err == WAIT_OBJECT_0 + 1)
+			break;
+		else
+			throw win_runtime_error(err, "WaitForMultipleObjects returned unexpectedly");
+
+		ResetEvent(client_connected); // ConnectNamedPipe is not documented to reset the overlapped I/O event automatically.
+		open_mode &= ~FILE_FLAG_FIRST_PIPE_INSTANCE;
+	}
+
+	if (!!reaper)
+		WaitForSingleObject(reaper, INFINITE);
+	path_events.unwatch();
+	if (!!refresher)
+		WaitForSingleObject(refresher, INFINITE);
+	if (!!footprint)
+		WaitForSingleObject(footprint, INFINITE);
+
+	// Engine tunnels cannot outlive this process. Remove their adapters orderly.
+	stop_engine_tunnels();
+
+	// Unregister tunnel services. SCM deletes them once they stop. Running ones are kept for the next instance to re-attach.
+	srwlock::shared lock(tunnel_services_lock);
+	for (auto& s : tunnel_services)
+	{
+		SERVICE_STATUS tunnel_service_status;
+		if (!s.second.handle ||
+			options.reattach_grace && service_manager::QueryServiceStatus(s.second.handle, &tunnel_service_status) && tunnel_service_status.dwCurrentState == SERVICE_RUNNING)
+			continue;
+		service_manager::DeleteService(s.second.handle);
+	}
+}
+
 static VOID WINAPI manager_service(_In_ DWORD dwNumServicesArgs, _In_opt_count_(dwNumServicesArgs) LPWSTR* lpServiceArgVectors)
 {
 	try
@@ -499,68 +2267,29 @@ static VOID WINAPI manager_service(_In_ DWORD dwNumServicesArgs, _In_opt_count_(
 	try
 	{
 		driver::init();
+		load_options();
 
-		winstd::security_attributes sa;
-		if (!ConvertStringSecurityDescriptorToSecurityDescriptor(
-			SDDL_OWNER SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
-			SDDL_GROUP SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
-			SDDL_DACL SDDL_DELIMINATOR SDDL_PROTECTED SDDL_AUTO_INHERITED
-			SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_LOCAL_SYSTEM SDDL_ACE_END
-			SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_READ SDDL_FILE_WRITE SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_EVERYONE SDDL_ACE_END
-			SDDL_ACE_BEGIN SDDL_ACCESS_DENIED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_ANONYMOUS SDDL_ACE_END,
-			SDDL_REVISION_1, sa, NULL))
-			throw win_runtime_error("ConvertStringSecurityDescriptorToSecurityDescriptor failed");
-		wstring pipe_name;
-		sprintf(pipe_name, L"\\\\.\\pipe\\eduWGManager$%s", client_id);
-		DWORD open_mode = PIPE_ACCESS_DUPLEX | WRITE_DAC | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED;
-		event client_connected(CreateEventW(NULL, TRUE, FALSE, NULL));
-		const HANDLE event_handles[] = { client_connected, quit };
-		for (;;)
+		try
 		{
-			// Create named pipe and schedule client connection accept.
-			DWORD err;
-			file pipe(CreateNamedPipeW(
-				pipe_name.c_str(),
-				open_mode,
-				PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
-				PIPE_UNLIMITED_INSTANCES,
-				PIPE_MSG_BUFFER, PIPE_MSG_BUFFER,
-				0,
-				&sa));
-			if (!pipe)
-				throw win_runtime_error("Failed to create pipe");
-			OVERLAPPED overlapped = { 0 };
-			overlapped.hEvent = client_connected;
-			if (!ConnectNamedPipe(pipe, &overlapped))
-			{
-				err = GetLastError();
-				if (err != ERROR_PIPE_CONNECTED && err != ERROR_IO_PENDING)
-					throw win_runtime_error(err, "Failed to connect pipe");
-			}
-
-			// Report the service is running. Even if we already did so.
-			service_status.dwCurrentState = SERVICE_RUNNING;
-			service_status.dwControlsAccepted |= SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_STOP;
-			SetServiceStatus(service_handle, &service_status);
+			// Phase timings go to the WireGuard ringlog, next to the tunnel logs.
+			WCHAR wg_log_file_path[MAX_PATH];
+			PathCombineW(wg_log_file_path, config_folder_path, L"log.bin");
+			wg_log.reset(new ringlogger(wg_log_file_path, "Manager"));
+		}
+		catch (const exception& e) { log(e); }
 
-			err = WaitForMultipleObjects(_countof(event_handles), event_handles, FALSE, INFINITE);
-			if (err == WAIT_OBJECT_0)
+		if (options.record_requests)
+		{
+			try
 			{
-				// Client connected.
-				thread t(CreateThread(NULL, 0, client_thread, pipe, 0, NULL));
-				if (!!t)
-					pipe.detach();
-				else
-					log(win_runtime_error("CreateThread failed"));
+				WCHAR request_log_file_path[MAX_PATH];
+				PathCombineW(request_log_file_path, config_folder_path, L"requests.trace");
+				request_log.reset(new request_trace(request_log_file_path, REQUEST_TRACE_MAX_SIZE));
 			}
-			else if (err == WAIT_OBJECT_0 + 1)
-				break;
-			else
-				throw win_runtime_error(err, "WaitForMultipleObjects returned unexpectedly");
-
-			ResetEvent(client_connected); // ConnectNamedPipe is not documented to reset the overlapped I/O event automatically.
-			open_mode &= ~FILE_FLAG_FIRST_PIPE_INSTANCE;
+			catch (const exception& e) { log(e); }
 		}
+
+		manager_run(wstring_printf(L"\\\\.\\pipe\\eduWGManager$%s", client_id).c_str());
 	}
 	catch (const win_runtime_error& e)
 	{
@@ -589,7 +2318,6 @@ static int manager()
 	return 0;
 }
 
-static unique_ptr<ringlogger> wg_log;
 static file tunnel_log;
 
 static DWORD WINAPI wg_log_monitor(_In_opt_ LPVOID lpThreadParameter)
@@ -612,9 +2340,312 @@ static DWORD WINAPI wg_log_monitor(_In_opt_ LPVOID lpThreadParameter)
 	}
 }
 
-static int tunnel(_In_z_ const wchar_t* tunnel_name)
+struct handshake_monitor_context {
+	const wchar_t* tunnel_name;
+	ULONGLONG start; // Tunnel start time in 100ns intervals since 1601-01-01 UTC
+};
+
+// Re-handshakes peers whose handshake is overdue while traffic is being sent to them.
+static void handshake_watchdog_loop(_In_ const handshake_monitor_context* ctx, _Inout_ driver::adapter& adapter, _Inout_ vector<unsigned char, sanitizing_allocator<unsigned char>>& data)
+{
+	handshake_watchdog watchdog((ULONGLONG)options.handshake_timeout * 10000000, ctx->start);
+	vector<pair<size_t, const WIREGUARD_PEER*>> stale;
+	vector<pair<size_t, double>> recovered;
+	while (WaitForSingleObject(quit, options.watchdog_interval) == WAIT_TIMEOUT)
+	{
+		if (!adapter)
+		{
+			adapter = driver::WireGuardOpenAdapter(ctx->tunnel_name);
+			if (!adapter)
+				continue;
+		}
+		try { adapter.get_configuration(data); }
+		catch (...)
+		{
+			adapter.free();
+			continue;
+		}
+		interface_view view(data);
+		watchdog.sample(view, system_time(), stale, recovered);
+		for (auto& peer : recovered)
+			wg_log->write(string_printf("watchdog tunnel=%ls peer=%zu recovered after=%.3f", ctx->tunnel_name, peer.first, peer.second).c_str());
+		for (auto& peer : stale)
+		{
+			try
+			{
+				force_handshake(adapter, *peer.second);
+				wg_log->write(string_printf("watchdog tunnel=%ls peer=%zu handshake overdue, forcing re-handshake", ctx->tunnel_name, peer.first).c_str());
+			}
+			catch (const exception& e) { log(e); }
+		}
+	}
+}
+
+// Logs time from tunnel start to the first handshake with any peer. Then keeps watching handshakes.
+static DWORD WINAPI handshake_monitor(_In_ LPVOID lpThreadParameter)
+{
+	auto ctx = reinterpret_cast<const handshake_monitor_context*>(lpThreadParameter);
+	try
+	{
+		driver::init();
+		driver::adapter adapter;
+		vector<unsigned char, sanitizing_allocator<unsigned char>> data(1024, 0);
+		bool handshake = false;
+		for (int i = 0; !handshake && i < 3000; ++i)
+		{
+			if (WaitForSingleObject(quit, 100) != WAIT_TIMEOUT)
+				return 0;
+			if (!adapter)
+			{
+				adapter = driver::WireGuardOpenAdapter(ctx->tunnel_name);
+				if (!adapter)
+					continue;
+			}
+			try { adapter.get_configuration(data); }
+			catch (...)
+			{
+				adapter.free();
+				continue;
+			}
+			ULONGLONG first_handshake = 0;
+			for (auto peer : interface_view(data))
+				if (peer->LastHandshake && (!first_handshake || peer->LastHandshake < first_handshake))
+					first_handshake = peer->LastHandshake;
+			if (first_handshake)
+			{
+				wg_log->write(string_printf("first_handshake tunnel=%ls after=%.3f", ctx->tunnel_name, (double)(LONGLONG)(first_handshake - ctx->start) / 10000.0).c_str());
+				handshake = true;
+			}
+		}
+		if (!handshake)
+			wg_log->write(string_printf("first_handshake tunnel=%ls after=timeout", ctx->tunnel_name).c_str());
+		if (options.watchdog_interval)
+			handshake_watchdog_loop(ctx, adapter, data);
+		return 0;
+	}
+	catch (const exception& e)
+	{
+		log(e);
+		return 1;
+	}
+}
+
+// Samples peer traffic counters and handshake age into peer history.
+static DWORD WINAPI peer_history_recorder(_In_ LPVOID lpThreadParameter)
+{
+	auto ctx = reinterpret_cast<const handshake_monitor_context*>(lpThreadParameter);
+	try
+	{
+		driver::init();
+		driver::adapter adapter;
+		vector<unsigned char, sanitizing_allocator<unsigned char>> data(1024, 0);
+		while (WaitForSingleObject(quit, options.history_interval) == WAIT_TIMEOUT)
+		{
+			if (!adapter)
+			{
+				adapter = driver::WireGuardOpenAdapter(ctx->tunnel_name);
+				if (!adapter)
+					continue;
+			}
+			try { adapter.get_configuration(data); }
+			catch (...)
+			{
+				adapter.free();
+				continue;
+			}
+			auto now = system_time();
+			interface_view view(data);
+			for (auto peer : view)
+			{
+				DWORD handshake_age =
+					!peer->LastHandshake ? stats_ring::no_handshake :
+					now > peer->LastHandshake ? (DWORD)min<ULONGLONG>((now - peer->LastHandshake) / 10000000, stats_ring::no_handshake - 1) :
+					0;
+				peer_history->write(now, view->PublicKey, peer->PublicKey, peer->RxBytes, peer->TxBytes, handshake_age);
+			}
+		}
+		return 0;
+	}
+	catch (const exception& e)
+	{
+		log(e);
+		return 1;
+	}
+}
+
+// Opens/creates a text file for user readable log.
+static void open_tunnel_log(_In_z_ const wchar_t* tunnel_name)
+{
+	WCHAR tunnel_log_file_path[MAX_PATH];
+	PathCombineW(tunnel_log_file_path, config_folder_path, wstring_printf(L"%s.txt", tunnel_name).c_str());
+	winstd::security_attributes sa;
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptor(
+		SDDL_OWNER SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
+		SDDL_GROUP SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
+		SDDL_DACL SDDL_DELIMINATOR SDDL_PROTECTED SDDL_AUTO_INHERITED
+		SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_LOCAL_SYSTEM SDDL_ACE_END
+		SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_BUILTIN_ADMINISTRATORS SDDL_ACE_END
+		SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_READ SDDL_STANDARD_DELETE SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_BUILTIN_USERS SDDL_ACE_END,
+		SDDL_REVISION_1, sa, NULL))
+		throw win_runtime_error("ConvertStringSecurityDescriptorToSecurityDescriptor failed");
+	tunnel_log = CreateFileW(tunnel_log_file_path, GENERIC_WRITE, FILE_SHARE_DELETE | FILE_SHARE_READ, &sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (!tunnel_log)
+		throw win_runtime_error("Creating log file failed");
+	SetEndOfFile(tunnel_log);
+	DWORD written;
+	static const char utf8_bom[] = { '\xef', '\xbb', '\xbf' };
+	if (!WriteFile(tunnel_log, utf8_bom, sizeof(utf8_bom), &written, NULL))
+		throw win_runtime_error("Failed to write to log file");
+}
+
+#define PROBE_LOG_INTERVAL 60000 // Milliseconds between probe statistics in the ring log
+
+// Probes in-tunnel address and keeps the latest results in the tunnel's probe window for the manager to read. Tunnels whose allowed
+// IPs do not route the address do not probe it.
+static DWORD WINAPI path_prober(_In_ LPVOID lpThreadParameter)
+{
+	auto ctx = reinterpret_cast<const handshake_monitor_context*>(lpThreadParameter);
+	try
+	{
+		SOCKADDR_INET target;
+		if (!parse_probe_address(options.probe_address.c_str(), target))
+			throw invalid_argument("Invalid probe address");
+		auto target_bytes = target.si_family == AF_INET ? (const BYTE*)&target.Ipv4.sin_addr : (const BYTE*)&target.Ipv6.sin6_addr;
+		char target_str[INET6_ADDRSTRLEN];
+		InetNtopA(target.si_family, target_bytes, target_str, _countof(target_str));
+		WCHAR path[MAX_PATH];
+		probe_window_path(ctx->tunnel_name, path);
+		probe_window window(path, true);
+
+		// Tunnel startup is not path loss. Start probing after the first handshake, from the address of the tunnel interface, so
+		// probes take the tunnel rather than whichever route the system prefers.
+		driver::init();
+		driver::adapter adapter;
+		vector<unsigned char, sanitizing_allocator<unsigned char>> data(1024, 0);
+		SOCKADDR_INET source;
+		for (bool ready = false; !ready; )
+		{
+			if (WaitForSingleObject(quit, 100) != WAIT_TIMEOUT)
+				return 0;
+			if (!adapter)
+			{
+				adapter = driver::WireGuardOpenAdapter(ctx->tunnel_name);
+				if (!adapter)
+					continue;
+			}
+			try { adapter.get_configuration(data); }
+			catch (...)
+			{
+				adapter.free();
+				continue;
+			}
+			interface_view view(data);
+			bool handshake = false;
+			for (auto peer : view)
+				if (peer->LastHandshake)
+					handshake = true;
+			if (!handshake)
+				continue;
+			lpm_table lpm;
+			lpm.build(view);
+			if (lpm.lookup(target.si_family, target_bytes) == lpm_table::no_peer)
+			{
+				wg_log->write(string_printf("probe tunnel=%ls target=%s skipped=not_in_allowed_ips", ctx->tunnel_name, target_str).c_str());
+				return 0;
+			}
+			NET_LUID luid;
+			driver::WireGuardGetAdapterLUID(adapter, &luid);
+			ready = find_interface_address(luid, target.si_family, source);
+		}
+
+		prober p(target, source, options.probe_interval);
+		ULONGLONG next_log = GetTickCount64() + PROBE_LOG_INTERVAL;
+		do
+		{
+			window.add(p.probe());
+			if (GetTickCount64() >= next_log)
+			{
+				probe_stats stats;
+				window.stats(stats);
+				wg_log->write(string_printf("probe tunnel=%ls target=%s samples=%u lost=%u rtt_min=%.3f rtt_avg=%.3f rtt_max=%.3f jitter=%.3f interval=%u",
+					ctx->tunnel_name, target_str, stats.samples, stats.lost,
+					(double)stats.rtt_min / 1000.0, (double)stats.rtt_avg / 1000.0, (double)stats.rtt_max / 1000.0, (double)stats.jitter / 1000.0,
+					p.interval()).c_str());
+				next_log += PROBE_LOG_INTERVAL;
+			}
+		} while (WaitForSingleObject(quit, p.interval()) == WAIT_TIMEOUT);
+		return 0;
+	}
+	catch (const exception& e)
+	{
+		log(e);
+		return 1;
+	}
+}
+
+struct tunnel_setup_context {
+	handshake_monitor_context* monitor;
+	thread handshake_monitor_thread;
+	thread peer_history_thread;
+	thread path_prober_thread;
+};
+
+static DWORD WINAPI tunnel_setup(_In_ LPVOID lpThreadParameter)
+{
+	auto ctx = reinterpret_cast<tunnel_setup_context*>(lpThreadParameter);
+	phase_trace trace;
+
+	try
+	{
+		open_tunnel_log(ctx->monitor->tunnel_name);
+		trace.mark("open_tunnel_log");
+
+		// Spawn WireGuard ringlog monitor thread.
+		thread wg_log_monitor_thread(CreateThread(NULL, 0, wg_log_monitor, NULL, 0, NULL));
+		if (!wg_log_monitor_thread)
+			log(win_runtime_error("CreateThread failed. The tunnel log will remain empty."));
+	}
+	catch (const exception& e) { log(e); }
+
+	try
+	{
+		version_t ver;
+		module_version(ver);
+		wg_log->write(string_printf("%ls/eduWGSvcHost v%u.%u.%u.%u, Copyright \xc2\xa9 2022-2024 The Commons Conservancy", client_id, ver[0], ver[1], ver[2], ver[3]).c_str());
+		trace.mark("version");
+	}
+	catch (const exception& e) { log(e); }
+
+	// Bind wireguard.dll once before monitor threads use it.
+	try { driver::init(); }
+	catch (const exception& e) { log(e); }
+	trace.mark("driver_init");
+	ctx->handshake_monitor_thread = CreateThread(NULL, 0, handshake_monitor, ctx->monitor, 0, NULL);
+	if (options.history_interval)
+	{
+		try
+		{
+			// Peer history is shared by all tunnels. It is named "stats.bin" and resides next to "log.bin".
+			WCHAR peer_history_file_path[MAX_PATH];
+			PathCombineW(peer_history_file_path, config_folder_path, L"stats.bin");
+			peer_history.reset(new stats_ring(peer_history_file_path));
+			ctx->peer_history_thread = CreateThread(NULL, 0, peer_history_recorder, ctx->monitor, 0, NULL);
+		}
+		catch (const exception& e) { log(e); }
+	}
+	if (!options.probe_address.empty())
+		ctx->path_prober_thread = CreateThread(NULL, 0, path_prober, ctx->monitor, 0, NULL);
+	trace.mark("start_monitors");
+	log_trace("tunnel_setup", ctx->monitor->tunnel_name, trace);
+	return 0;
+}
+
+static int tunnel(_In_z_ const wchar_t* tunnel_name, _In_opt_z_ const wchar_t* config_file_path)
 {
+	phase_trace trace;
+	handshake_monitor_context monitor_ctx = { tunnel_name, system_time() };
 	validate_tunnel_name(tunnel_name);
+	load_options();
 
 	{
 		// Open WireGuard ringlog.
@@ -624,38 +2655,14 @@ static int tunnel(_In_z_ const wchar_t* tunnel_name)
 		wg_log.reset(new ringlogger(wg_log_file_path, "Tunnel"));
 	}
 
-	{
-		// Open/create a text file for user readable log.
-		WCHAR tunnel_log_file_path[MAX_PATH];
-		PathCombineW(tunnel_log_file_path, config_folder_path, wstring_printf(L"%s.txt", tunnel_name).c_str());
-		winstd::security_attributes sa;
-		if (!ConvertStringSecurityDescriptorToSecurityDescriptor(
-			SDDL_OWNER SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
-			SDDL_GROUP SDDL_DELIMINATOR SDDL_LOCAL_SYSTEM
-			SDDL_DACL SDDL_DELIMINATOR SDDL_PROTECTED SDDL_AUTO_INHERITED
-			SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_LOCAL_SYSTEM SDDL_ACE_END
-			SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_ALL SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_BUILTIN_ADMINISTRATORS SDDL_ACE_END
-			SDDL_ACE_BEGIN SDDL_ACCESS_ALLOWED SDDL_SEPERATOR SDDL_SEPERATOR SDDL_FILE_READ SDDL_STANDARD_DELETE SDDL_SEPERATOR SDDL_SEPERATOR SDDL_SEPERATOR SDDL_BUILTIN_USERS SDDL_ACE_END,
-			SDDL_REVISION_1, sa, NULL))
-			throw win_runtime_error("ConvertStringSecurityDescriptorToSecurityDescriptor failed");
-		tunnel_log = CreateFileW(tunnel_log_file_path, GENERIC_WRITE, FILE_SHARE_DELETE | FILE_SHARE_READ, &sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		if (!tunnel_log)
-			throw win_runtime_error("Creating log file failed");
-		SetEndOfFile(tunnel_log);
-		DWORD written;
-		static const char utf8_bom[] = { '\xef', '\xbb', '\xbf' };
-		if (!WriteFile(tunnel_log, utf8_bom, sizeof(utf8_bom), &written, NULL))
-			throw win_runtime_error("Failed to write to log file");
-	}
-
-	// Spawn WireGuard ringlog monitor thread.
-	thread wg_log_monitor_thread(CreateThread(NULL, 0, wg_log_monitor, NULL, 0, NULL));
-	if (!wg_log_monitor_thread)
-		log(win_runtime_error("CreateThread failed. The tunnel log will remain empty."));
-
-	version_t ver;
-	module_version(ver);
-	wg_log->write(string_printf("%ls/eduWGSvcHost v%u.%u.%u.%u, Copyright \xc2\xa9 2022-2024 The Commons Conservancy", client_id, ver[0], ver[1], ver[2], ver[3]).c_str());
+	trace.mark("open_log");
+
+	// Setup that bringing the adapter up does not depend on runs next to it.
+	tunnel_setup_context setup_ctx = { &monitor_ctx };
+	thread setup_thread(CreateThread(NULL, 0, tunnel_setup, &setup_ctx, 0, NULL));
+	if (!setup_thread)
+		tunnel_setup(&setup_ctx);
+	trace.mark("start_setup");
 
 	// Start the tunnel.
 	library tunnel_lib(LoadLibraryW(L"tunnel.dll"));
@@ -665,10 +2672,25 @@ static int tunnel(_In_z_ const wchar_t* tunnel_name)
 	*(FARPROC*)&WireGuardTunnelService = GetProcAddress(tunnel_lib, "WireGuardTunnelService");
 	if (!WireGuardTunnelService)
 		throw win_runtime_error("Failed to load tunnel.dll entries");
-	WCHAR config_file_path[MAX_PATH];
-	PathCombineW(config_file_path, config_folder_path, wstring_printf(L"%s.conf.dpapi", tunnel_name).c_str());
+	WCHAR default_config_file_path[MAX_PATH];
+	if (!config_file_path)
+	{
+		PathCombineW(default_config_file_path, config_folder_path, wstring_printf(L"%s.conf.dpapi", tunnel_name).c_str());
+		config_file_path = default_config_file_path;
+	}
+	trace.mark("load_tunnel_dll");
+	log_trace("tunnel", tunnel_name, trace);
+
 	int ret = WireGuardTunnelService(config_file_path) ? 0 : 1;
 	SetEvent(quit);
+	if (!!setup_thread)
+		WaitForSingleObject(setup_thread, INFINITE);
+	if (!!setup_ctx.handshake_monitor_thread)
+		WaitForSingleObject(setup_ctx.handshake_monitor_thread, INFINITE);
+	if (!!setup_ctx.peer_history_thread)
+		WaitForSingleObject(setup_ctx.peer_history_thread, INFINITE);
+	if (!!setup_ctx.path_prober_thread)
+		WaitForSingleObject(setup_ctx.path_prober_thread, INFINITE);
 	return ret;
 }
 
@@ -689,7 +2711,7 @@ int APIENTRY wWinMain(HINSTANCE hInst, HINSTANCE hInstPrev, PWSTR cmdline, int c
 		if (wargv == NULL)
 			throw win_runtime_error("CommandLineToArgvW failed");
 		if (wargc < 3)
-			throw invalid_argument("Usage: eduWGSvcHost.exe <client> <Manager|Tunnel> ...");
+			throw invalid_argument("Usage: eduWGSvcHost.exe <client> <Manager|Tunnel|Benchmark|Replay|History|Probe|Keys|Verify> ...");
 		if (_wcsicmp(wargv[1], L"eduVPN") == 0)
 		{
 			client_id = L"eduVPN";
@@ -730,9 +2752,38 @@ int APIENTRY wWinMain(HINSTANCE hInst, HINSTANCE hInstPrev, PWSTR cmdline, int c
 		else if (_wcsicmp(wargv[2], L"Tunnel") == 0)
 		{
 			if (wargc < 4)
-				throw invalid_argument("Usage: eduWGSvcHost.exe <client> Tunnel <tunnel name>");
-			return tunnel(wargv[3]);
+				throw invalid_argument("Usage: eduWGSvcHost.exe <client> Tunnel <tunnel name> [<config path>]");
+			return tunnel(wargv[3], wargc >= 5 ? wargv[4] : NULL);
+		}
+		else if (_wcsicmp(wargv[2], L"Benchmark") == 0)
+			return benchmark(
+				wargc >= 4 ? wcstoul(wargv[3], NULL, 10) : 16,
+				wargc >= 5 ? wcstoul(wargv[4], NULL, 10) : 10,
+				wargc >= 6 ? max(wcstoul(wargv[5], NULL, 10), 1ul) : 1);
+		else if (_wcsicmp(wargv[2], L"Replay") == 0)
+		{
+			if (wargc < 4)
+				throw invalid_argument("Usage: eduWGSvcHost.exe <client> Replay <trace file> [<speed>]");
+			return replay(wargv[3], wargc >= 5 ? max(wcstod(wargv[4], NULL), 0.0) : 1.0);
+		}
+		else if (_wcsicmp(wargv[2], L"Probe") == 0)
+		{
+			if (wargc < 4)
+				throw invalid_argument("Usage: eduWGSvcHost.exe <client> Probe <address> [<count>] [<interval>]");
+			return probe(wargv[3],
+				wargc >= 5 ? wcstoul(wargv[4], NULL, 10) : 10,
+				wargc >= 6 ? max(wcstoul(wargv[5], NULL, 10), 1ul) : 1000);
 		}
+		else if (_wcsicmp(wargv[2], L"Keys") == 0)
+			return key_benchmark(wargc >= 4 ? wcstoul(wargv[3], NULL, 10) : 1000);
+		else if (_wcsicmp(wargv[2], L"History") == 0)
+			return history(
+				wargc >= 4 ? wcstoul(wargv[3], NULL, 10) : 60,
+				wargc >= 5 ? max(wcstoul(wargv[4], NULL, 10), 1ul) : 60);
+		else if (_wcsicmp(wargv[2], L"Verify") == 0)
+			return verify(
+				wargc >= 4 ? wcstoul(wargv[3], NULL, 10) : 10000,
+				wargc >= 5 ? wcstoul(wargv[4], NULL, 10) : 100000);
 		else
 			throw invalid_argument("Unknown service");
 	}
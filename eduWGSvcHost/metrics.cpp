@@ -0,0 +1,239 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "metrics.h"
+#include "srwlock.h"
+#include "varint.h"
+#include <intrin.h>
+#include <memory>
+
+using namespace std;
+
+namespace wg
+{
+	static inline void add(_Inout_ volatile LONGLONG& x, _In_ LONGLONG delta) noexcept
+	{
+		InterlockedExchangeAdd64(&x, delta);
+	}
+
+	static inline LONGLONG load(_In_ volatile LONGLONG& x) noexcept
+	{
+		return InterlockedCompareExchange64(&x, 0, 0);
+	}
+
+	static unsigned int msb(_In_ ULONGLONG value) noexcept
+	{
+		unsigned long i;
+		if (_BitScanReverse(&i, (unsigned long)(value >> 32)))
+			return i + 32;
+		_BitScanReverse(&i, (unsigned long)value);
+		return i;
+	}
+
+	static unsigned int bucket(_In_ ULONGLONG value) noexcept
+	{
+		static const ULONGLONG max_value = (1ull << 40) - 1;
+		if (value > max_value)
+			value = max_value;
+		if (value < (1u << metrics::sub_bucket_bits))
+			return (unsigned int)value;
+		unsigned int e = msb(value);
+		return ((e - metrics::sub_bucket_bits + 1) << metrics::sub_bucket_bits) +
+			(unsigned int)((value >> (e - metrics::sub_bucket_bits)) & ((1u << metrics::sub_bucket_bits) - 1));
+	}
+
+	struct metrics_histogram
+	{
+		volatile LONGLONG count;
+		volatile LONGLONG sum;
+		volatile LONGLONG max;
+		volatile LONGLONG buckets[metrics::bucket_count];
+	};
+
+	struct metrics_shard
+	{
+		volatile LONGLONG counters[(unsigned int)metric_counter::count];
+		volatile LONGLONG requests[metrics::max_codes];
+		volatile LONGLONG request_errors[metrics::max_codes];
+		metrics_histogram histograms[(unsigned int)metric_histogram::count];
+
+		metrics_shard() noexcept
+		{
+			ZeroMemory(this, sizeof(*this));
+		}
+
+		// Adds other shard. Caller is the only writer of this shard.
+		void fold(_In_ metrics_shard& other) noexcept
+		{
+			for (unsigned int i = 0; i < _countof(counters); ++i)
+				wg::add(counters[i], load(other.counters[i]));
+			for (unsigned int i = 0; i < metrics::max_codes; ++i)
+			{
+				wg::add(requests[i], load(other.requests[i]));
+				wg::add(request_errors[i], load(other.request_errors[i]));
+			}
+			for (unsigned int h = 0; h < _countof(histograms); ++h)
+			{
+				auto& dst = histograms[h];
+				auto& src = other.histograms[h];
+				wg::add(dst.count, load(src.count));
+				wg::add(dst.sum, load(src.sum));
+				auto max = load(src.max);
+				if ((ULONGLONG)max > (ULONGLONG)load(dst.max))
+					InterlockedExchange64(&dst.max, max);
+				for (unsigned int i = 0; i < metrics::bucket_count; ++i)
+					wg::add(dst.buckets[i], load(src.buckets[i]));
+			}
+		}
+	};
+
+	class metrics_registry
+	{
+	private:
+		srwlock m_lock;
+		vector<metrics_shard*> m_shards;
+		metrics_shard m_retired;
+
+	public:
+		static metrics_registry& instance()
+		{
+			static metrics_registry registry;
+			return registry;
+		}
+
+		void attach(_In_ metrics_shard* shard)
+		{
+			srwlock::exclusive lock(m_lock);
+			m_shards.push_back(shard);
+		}
+
+		void detach(_In_ metrics_shard* shard) noexcept
+		{
+			srwlock::exclusive lock(m_lock);
+			for (auto s = m_shards.begin(); s != m_shards.end(); ++s)
+				if (*s == shard)
+				{
+					m_shards.erase(s);
+					break;
+				}
+			m_retired.fold(*shard);
+		}
+
+		void merge(_Inout_ metrics_shard& total)
+		{
+			srwlock::shared lock(m_lock);
+			total.fold(m_retired);
+			for (auto s : m_shards)
+				total.fold(*s);
+		}
+	};
+
+	// Shard of the calling thread, registered on first use and retired on thread exit
+	class thread_shard
+	{
+	private:
+		metrics_shard m_shard;
+
+	public:
+		thread_shard()
+		{
+			metrics_registry::instance().attach(&m_shard);
+		}
+
+		~thread_shard()
+		{
+			metrics_registry::instance().detach(&m_shard);
+		}
+
+		thread_shard(const thread_shard&) = delete;
+		thread_shard& operator=(const thread_shard&) = delete;
+
+		metrics_shard& get() noexcept { return m_shard; }
+	};
+
+	static metrics_shard& current_shard()
+	{
+		static thread_local thread_shard shard;
+		return shard.get();
+	}
+
+	void metrics::add(_In_ metric_counter counter, _In_ LONGLONG delta) noexcept
+	{
+		try { wg::add(current_shard().counters[(unsigned int)counter], delta); }
+		catch (...) {} // Metrics are best effort.
+	}
+
+	void metrics::record(_In_ metric_histogram histogram, _In_ ULONGLONG value) noexcept
+	{
+		try
+		{
+			auto& h = current_shard().histograms[(unsigned int)histogram];
+			wg::add(h.count, 1);
+			wg::add(h.sum, (LONGLONG)value);
+			if (value > (ULONGLONG)h.max)
+				InterlockedExchange64(&h.max, (LONGLONG)value);
+			wg::add(h.buckets[bucket(value)], 1);
+		}
+		catch (...) {}
+	}
+
+	void metrics::request(_In_ unsigned int code, _In_ ULONGLONG latency, _In_ bool success) noexcept
+	{
+		if (code >= max_codes)
+			code = max_codes - 1;
+		try
+		{
+			auto& shard = current_shard();
+			wg::add(shard.requests[code], 1);
+			if (!success)
+				wg::add(shard.request_errors[code], 1);
+		}
+		catch (...) {}
+		record(metric_histogram::request_latency, latency);
+	}
+
+	void metrics::snapshot(_Inout_ vector<unsigned char>& data)
+	{
+		unique_ptr<metrics_shard> total(new metrics_shard);
+		metrics_registry::instance().merge(*total);
+
+		varint_write(data, 1u); // Version
+		varint_write(data, sub_bucket_bits);
+		varint_write(data, (unsigned int)_countof(total->counters));
+		for (auto& c : total->counters)
+			varint_write(data, (ULONGLONG)c);
+		unsigned int code_count = max_codes;
+		while (code_count && !total->requests[code_count - 1])
+			--code_count;
+		varint_write(data, code_count);
+		for (unsigned int i = 0; i < code_count; ++i)
+		{
+			varint_write(data, (ULONGLONG)total->requests[i]);
+			varint_write(data, (ULONGLONG)total->request_errors[i]);
+		}
+		varint_write(data, (unsigned int)_countof(total->histograms));
+		for (auto& h : total->histograms)
+		{
+			varint_write(data, (ULONGLONG)h.count);
+			varint_write(data, (ULONGLONG)h.sum);
+			varint_write(data, (ULONGLONG)h.max);
+			unsigned int nonzero = 0;
+			for (auto b : h.buckets)
+				if (b)
+					++nonzero;
+			varint_write(data, nonzero);
+			for (unsigned int i = 0, last = 0; i < bucket_count; ++i)
+				if (h.buckets[i])
+				{
+					varint_write(data, i - last);
+					varint_write(data, (ULONGLONG)h.buckets[i]);
+					last = i;
+				}
+		}
+	}
+}
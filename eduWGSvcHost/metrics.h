@@ -0,0 +1,118 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+#include <vector>
+
+namespace wg
+{
+	enum class metric_counter : unsigned int
+	{
+		client_connections,     // Pipe clients accepted
+		clients_connected,      // Pipe clients currently connected
+		activations,            // Tunnel activations
+		activation_errors,      // Failed tunnel activations
+		deactivations,          // Tunnel deactivations
+		deactivation_errors,    // Failed tunnel deactivations
+		ringlog_writes,         // Lines written to ring log
+		ringlog_lines_followed, // Lines copied from ring log to the log file
+		path_refreshes,         // Tunnel refreshes after resume or network change
+		engine_restarts,        // Engine tunnels restarted by their supervisor
+		count
+	};
+
+	enum class metric_histogram : unsigned int
+	{
+		request_latency,        // Pipe request handling in microseconds
+		activate_latency,       // activate_tunnel() in microseconds
+		deactivate_latency,     // deactivate_tunnel() in microseconds
+		ringlog_follower_lag,   // Age of the oldest line a follower pass copies in microseconds
+		refresh_latency,        // From resume or network change to the next handshake of a tunnel in microseconds
+		count
+	};
+
+	// Process-wide metrics
+	//
+	// Each thread updates its own shard with uncontended interlocked adds. Shards are merged only when a snapshot is taken.
+	// Shards of exiting threads are folded into a retired shard, so totals survive client disconnects.
+	class metrics
+	{
+	public:
+		static const unsigned int max_codes = 32;      // Request codes tracked individually; higher codes share the last slot
+		static const unsigned int sub_bucket_bits = 3; // Histogram buckets per power of two: 1 << sub_bucket_bits
+		static const unsigned int bucket_count = 304;  // Covers values up to 2^40-1
+
+		static void add(_In_ metric_counter counter, _In_ LONGLONG delta = 1) noexcept;
+		static void record(_In_ metric_histogram histogram, _In_ ULONGLONG value) noexcept;
+
+		// Accounts a pipe request by its message code.
+		static void request(_In_ unsigned int code, _In_ ULONGLONG latency, _In_ bool success) noexcept;
+
+		// Appends merged snapshot of all shards in varint encoding:
+		// version, sub_bucket_bits,
+		// counter count, counters[],
+		// code count, (requests, errors)[],
+		// histogram count, (count, sum, max, nonzero bucket count, (bucket index delta, bucket count)[])[]
+		// Bucket i < 2^sub_bucket_bits holds value i; others hold values from (2^sub_bucket_bits + i % 2^sub_bucket_bits) << (i / 2^sub_bucket_bits - 1).
+		static void snapshot(_Inout_ std::vector<unsigned char>& data);
+	};
+
+	// Measures elapsed microseconds
+	class metrics_stopwatch
+	{
+	private:
+		LARGE_INTEGER m_start;
+
+	public:
+		metrics_stopwatch() noexcept
+		{
+			QueryPerformanceCounter(&m_start);
+		}
+
+		ULONGLONG elapsed() const noexcept
+		{
+			LARGE_INTEGER now, frequency;
+			QueryPerformanceCounter(&now);
+			QueryPerformanceFrequency(&frequency);
+			return (ULONGLONG)(now.QuadPart - m_start.QuadPart) * 1000000 / (ULONGLONG)frequency.QuadPart;
+		}
+	};
+
+	// Accounts an operation: counts it, and its failure unless succeeded() was called, and records its latency
+	class metrics_operation
+	{
+	private:
+		metric_counter m_counter;
+		metric_counter m_errors;
+		metric_histogram m_latency;
+		metrics_stopwatch m_watch;
+		bool m_succeeded;
+
+	public:
+		metrics_operation(_In_ metric_counter counter, _In_ metric_counter errors, _In_ metric_histogram latency) noexcept :
+			m_counter(counter),
+			m_errors(errors),
+			m_latency(latency),
+			m_succeeded(false)
+		{}
+
+		~metrics_operation()
+		{
+			metrics::add(m_counter);
+			if (!m_succeeded)
+				metrics::add(m_errors);
+			metrics::record(m_latency, m_watch.elapsed());
+		}
+
+		metrics_operation(const metrics_operation&) = delete;
+		metrics_operation& operator=(const metrics_operation&) = delete;
+
+		void succeeded() noexcept { m_succeeded = true; }
+	};
+}
@@ -0,0 +1,98 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <WS2tcpip.h>
+#include <iphlpapi.h>
+#include <WinStd/Win.h>
+
+namespace wg
+{
+	enum class network_event : unsigned int
+	{
+		resume,         // System resumed from sleep or hibernation
+		network_change, // IP address was added to a physical interface
+	};
+
+	// Source of events after which tunnel paths need to be re-established
+	//
+	// Events are posted from any thread: the service control handler, the IP Helper notification callback, or a test driving the
+	// manager. Events posted before the consumer gets to them are coalesced.
+	class network_events
+	{
+	private:
+		winstd::event m_posted;
+		volatile LONG m_pending; // Bit mask of posted network_event values
+		HANDLE m_notification;
+
+		static VOID NETIOAPI_API_ address_changed(_In_ PVOID CallerContext, _In_opt_ PMIB_UNICASTIPADDRESS_ROW Row, _In_ MIB_NOTIFICATION_TYPE NotificationType)
+		{
+			// Addresses of tunnel adapters come and go with tunnels. Only other interfaces change paths.
+			if (NotificationType != MibAddInstance || !Row || Row->InterfaceLuid.Info.IfType == IF_TYPE_PROP_VIRTUAL)
+				return;
+			reinterpret_cast<network_events*>(CallerContext)->post(network_event::network_change);
+		}
+
+	public:
+		network_events() noexcept :
+			m_posted(CreateEventW(NULL, FALSE, FALSE, NULL)),
+			m_pending(0),
+			m_notification(NULL)
+		{}
+
+		~network_events()
+		{
+			unwatch();
+		}
+
+		network_events(const network_events&) = delete;
+		network_events& operator=(const network_events&) = delete;
+
+		void post(_In_ network_event e) noexcept
+		{
+			InterlockedOr(&m_pending, 1 << (unsigned int)e);
+			SetEvent(m_posted);
+		}
+
+		// Posts network_change on IP address arrival on any non-virtual interface.
+		void watch()
+		{
+			if (m_notification)
+				return;
+			DWORD err = NotifyUnicastIpAddressChange(AF_UNSPEC, address_changed, this, FALSE, &m_notification);
+			if (err != NO_ERROR)
+				throw winstd::win_runtime_error(err, "NotifyUnicastIpAddressChange failed");
+		}
+
+		void unwatch() noexcept
+		{
+			if (m_notification)
+			{
+				CancelMibChangeNotify2(m_notification);
+				m_notification = NULL;
+			}
+		}
+
+		// Auto-reset event signaled on post
+		HANDLE posted() const noexcept
+		{
+			return m_posted;
+		}
+
+		// Returns and clears mask of events posted so far.
+		unsigned int take() noexcept
+		{
+			return (unsigned int)InterlockedExchange(&m_pending, 0);
+		}
+
+		static bool has(_In_ unsigned int mask, _In_ network_event e) noexcept
+		{
+			return (mask & (1 << (unsigned int)e)) != 0;
+		}
+	};
+}
@@ -0,0 +1,307 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "driver.h"
+#include "ifaceview.h"
+#include "srwlock.h"
+#include "varint.h"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace wg
+{
+	struct peer_stats
+	{
+		BYTE public_key[WIREGUARD_KEY_LENGTH];
+		DWORD64 rx_bytes;
+		DWORD64 tx_bytes;
+		DWORD64 last_handshake;
+		SOCKADDR_INET endpoint;
+
+		bool same_endpoint(_In_ const peer_stats& other) const noexcept
+		{
+			if (endpoint.si_family != other.endpoint.si_family)
+				return false;
+			switch (endpoint.si_family)
+			{
+			case AF_INET:
+				return
+					endpoint.Ipv4.sin_port == other.endpoint.Ipv4.sin_port &&
+					endpoint.Ipv4.sin_addr.s_addr == other.endpoint.Ipv4.sin_addr.s_addr;
+			case AF_INET6:
+				return
+					endpoint.Ipv6.sin6_port == other.endpoint.Ipv6.sin6_port &&
+					memcmp(&endpoint.Ipv6.sin6_addr, &other.endpoint.Ipv6.sin6_addr, sizeof(IN6_ADDR)) == 0;
+			}
+			return true;
+		}
+	};
+
+	// Field flags of a peer_stats record on the wire.
+	enum peer_stats_field : unsigned char
+	{
+		peer_stats_public_key = 1 << 0,     // New peer at this index: 32-byte public key follows. Counters are absolute.
+		peer_stats_rx_bytes = 1 << 1,       // Received bytes increment (varint) follows.
+		peer_stats_tx_bytes = 1 << 2,       // Transmitted bytes increment (varint) follows.
+		peer_stats_last_handshake = 1 << 3, // Last handshake FILETIME (8 bytes) follows.
+		peer_stats_endpoint = 1 << 4,       // Address family (2 bytes), port (2 bytes, network order) and address (4 or 16 bytes) follow.
+	};
+
+	// Appends records of peers that changed between prev and next. Returns number of records appended.
+	inline unsigned int encode_peer_stats_delta(_In_ const std::vector<peer_stats>& prev, _In_ const std::vector<peer_stats>& next, _Inout_ std::vector<unsigned char>& data)
+	{
+		unsigned int count = 0;
+		for (size_t i = 0; i < next.size(); ++i)
+		{
+			auto& n = next[i];
+			unsigned char fields;
+			DWORD64 rx_bytes, tx_bytes;
+			if (i >= prev.size() ||
+				memcmp(prev[i].public_key, n.public_key, sizeof(n.public_key)) != 0 ||
+				prev[i].rx_bytes > n.rx_bytes || prev[i].tx_bytes > n.tx_bytes)
+			{
+				// New peer or its counters were reset.
+				fields = peer_stats_public_key | peer_stats_rx_bytes | peer_stats_tx_bytes | peer_stats_last_handshake | peer_stats_endpoint;
+				rx_bytes = n.rx_bytes;
+				tx_bytes = n.tx_bytes;
+			}
+			else
+			{
+				auto& p = prev[i];
+				fields = 0;
+				if ((rx_bytes = n.rx_bytes - p.rx_bytes) != 0)
+					fields |= peer_stats_rx_bytes;
+				if ((tx_bytes = n.tx_bytes - p.tx_bytes) != 0)
+					fields |= peer_stats_tx_bytes;
+				if (n.last_handshake != p.last_handshake)
+					fields |= peer_stats_last_handshake;
+				if (!n.same_endpoint(p))
+					fields |= peer_stats_endpoint;
+				if (!fields)
+					continue;
+			}
+
+			data.push_back(fields);
+			varint_write(data, i);
+			if (fields & peer_stats_public_key)
+				data.insert(data.cend(), n.public_key, n.public_key + sizeof(n.public_key));
+			if (fields & peer_stats_rx_bytes)
+				varint_write(data, rx_bytes);
+			if (fields & peer_stats_tx_bytes)
+				varint_write(data, tx_bytes);
+			if (fields & peer_stats_last_handshake)
+				data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&n.last_handshake), reinterpret_cast<const unsigned char*>(&n.last_handshake + 1));
+			if (fields & peer_stats_endpoint)
+			{
+				data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&n.endpoint.si_family), reinterpret_cast<const unsigned char*>(&n.endpoint.si_family + 1));
+				switch (n.endpoint.si_family)
+				{
+				case AF_INET:
+					data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&n.endpoint.Ipv4.sin_port), reinterpret_cast<const unsigned char*>(&n.endpoint.Ipv4.sin_port + 1));
+					data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&n.endpoint.Ipv4.sin_addr), reinterpret_cast<const unsigned char*>(&n.endpoint.Ipv4.sin_addr + 1));
+					break;
+				case AF_INET6:
+					data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&n.endpoint.Ipv6.sin6_port), reinterpret_cast<const unsigned char*>(&n.endpoint.Ipv6.sin6_port + 1));
+					data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&n.endpoint.Ipv6.sin6_addr), reinterpret_cast<const unsigned char*>(&n.endpoint.Ipv6.sin6_addr + 1));
+					break;
+				}
+			}
+			++count;
+		}
+		return count;
+	}
+
+	// Samples tunnel peer statistics periodically and notifies subscribers. One instance is shared by all clients watching the same tunnel.
+	class peer_stats_sampler
+	{
+	public:
+		// Fills data with tunnel configuration. Returns false when tunnel is not active.
+		typedef std::function<bool(std::vector<unsigned char, winstd::sanitizing_allocator<unsigned char>>& data)> get_configuration_t;
+
+		static const DWORD min_interval = 100;
+		static const DWORD max_interval = 60 * 60 * 1000;
+
+	private:
+		struct subscriber
+		{
+			HANDLE event;
+			DWORD interval;
+		};
+
+		std::wstring m_tunnel_name;
+		get_configuration_t m_get_configuration;
+		srwlock m_lock;
+		std::vector<subscriber> m_subscribers;
+		std::vector<peer_stats> m_sample;
+		std::vector<unsigned char, winstd::sanitizing_allocator<unsigned char>> m_config;
+		volatile bool m_stopping;
+		winstd::event m_wake;
+		winstd::thread m_thread;
+
+	public:
+		peer_stats_sampler(_In_z_ const wchar_t* tunnel_name, _In_ const get_configuration_t& get_configuration) :
+			m_tunnel_name(tunnel_name),
+			m_get_configuration(get_configuration),
+			m_stopping(false)
+		{
+			m_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+			if (!m_wake)
+				throw winstd::win_runtime_error("CreateEvent failed");
+			m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+			if (!m_thread)
+				throw winstd::win_runtime_error("CreateThread failed");
+		}
+
+		virtual ~peer_stats_sampler()
+		{
+			m_stopping = true;
+			SetEvent(m_wake);
+			WaitForSingleObject(m_thread, INFINITE);
+		}
+
+		const std::wstring& tunnel_name() const noexcept
+		{
+			return m_tunnel_name;
+		}
+
+		// Registers an auto-reset event to be signaled after each sample. A fresh sample is taken immediately.
+		void subscribe(_In_ HANDLE event, _In_ DWORD interval)
+		{
+			{
+				srwlock::exclusive lock(m_lock);
+				m_subscribers.push_back({ event, std::min(std::max(interval, min_interval), max_interval) });
+			}
+			SetEvent(m_wake);
+		}
+
+		void unsubscribe(_In_ HANDLE event)
+		{
+			srwlock::exclusive lock(m_lock);
+			m_subscribers.erase(std::remove_if(m_subscribers.begin(), m_subscribers.end(), [event](const subscriber& s) { return s.event == event; }), m_subscribers.end());
+		}
+
+		void snapshot(_Out_ std::vector<peer_stats>& stats)
+		{
+			srwlock::exclusive lock(m_lock);
+			stats = m_sample;
+		}
+
+	private:
+		static DWORD WINAPI thread_proc(_In_ LPVOID lpThreadParameter)
+		{
+			auto sampler = reinterpret_cast<peer_stats_sampler*>(lpThreadParameter);
+			for (;;)
+			{
+				DWORD timeout = INFINITE;
+				{
+					srwlock::exclusive lock(sampler->m_lock);
+					for (auto& s : sampler->m_subscribers)
+						timeout = std::min(timeout, s.interval);
+				}
+				if (WaitForSingleObject(sampler->m_wake, timeout) == WAIT_FAILED)
+					return 1;
+				if (sampler->m_stopping)
+					return 0;
+				try { sampler->sample(); }
+				catch (...) {} // Keep the last sample and retry on next tick.
+			}
+		}
+
+		void sample()
+		{
+			if (!m_get_configuration(m_config))
+				return; // Tunnel is not active.
+
+			interface_view config(m_config);
+			std::vector<peer_stats> stats;
+			stats.reserve(config.size());
+			for (auto peer : config)
+			{
+				stats.emplace_back();
+				auto& s = stats.back();
+				memset(&s, 0, sizeof(s));
+				if (peer->Flags & WIREGUARD_PEER_HAS_PUBLIC_KEY)
+					memcpy(s.public_key, peer->PublicKey, sizeof(s.public_key));
+				s.rx_bytes = peer->RxBytes;
+				s.tx_bytes = peer->TxBytes;
+				s.last_handshake = peer->LastHandshake;
+				if (peer->Flags & WIREGUARD_PEER_HAS_ENDPOINT)
+					s.endpoint = peer->Endpoint;
+			}
+
+			std::vector<HANDLE> events;
+			{
+				srwlock::exclusive lock(m_lock);
+				m_sample.swap(stats);
+				for (auto& s : m_subscribers)
+					events.push_back(s.event);
+			}
+			for (auto e : events)
+				SetEvent(e);
+		}
+	};
+
+	// Subscription of one client to a shared peer_stats_sampler.
+	class peer_stats_subscription
+	{
+	private:
+		std::shared_ptr<peer_stats_sampler> m_sampler;
+		winstd::event m_ready;
+		DWORD m_interval;
+		ULONGLONG m_due;
+		std::vector<peer_stats> m_sent;
+
+	public:
+		peer_stats_subscription(_In_ const std::shared_ptr<peer_stats_sampler>& sampler, _In_ DWORD interval) :
+			m_sampler(sampler),
+			m_interval(std::min(std::max(interval, peer_stats_sampler::min_interval), peer_stats_sampler::max_interval)),
+			m_due(0)
+		{
+			m_ready = CreateEventW(NULL, FALSE, FALSE, NULL);
+			if (!m_ready)
+				throw winstd::win_runtime_error("CreateEvent failed");
+			m_sampler->subscribe(m_ready, m_interval);
+		}
+
+		virtual ~peer_stats_subscription()
+		{
+			m_sampler->unsubscribe(m_ready);
+		}
+
+		HANDLE ready() const noexcept
+		{
+			return m_ready;
+		}
+
+		// Appends changes since the last push, when this subscription's interval elapsed. Returns true if there is anything to push.
+		bool pull(_Inout_ std::vector<unsigned char>& data, _Out_ unsigned int& count)
+		{
+			count = 0;
+			auto now = GetTickCount64();
+			if (now < m_due)
+				return false;
+			std::vector<peer_stats> stats;
+			m_sampler->snapshot(stats);
+			count = encode_peer_stats_delta(m_sent, stats, data);
+			if (!count && stats.size() == m_sent.size())
+				return false;
+			m_sent.swap(stats);
+			m_due = now + m_interval;
+			return true;
+		}
+
+		size_t peer_count() const noexcept
+		{
+			return m_sent.size();
+		}
+	};
+}
@@ -0,0 +1,61 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+#include <WinStd/Common.h>
+#include <string>
+
+namespace wg
+{
+	// Monotonic timing of consecutive phases of an operation
+	class phase_trace
+	{
+	private:
+		LARGE_INTEGER m_frequency;
+		LARGE_INTEGER m_start;
+		LARGE_INTEGER m_last;
+		std::string m_phases;
+
+		double milliseconds(_In_ const LARGE_INTEGER& from, _In_ const LARGE_INTEGER& to) const noexcept
+		{
+			return (double)(to.QuadPart - from.QuadPart) * 1000.0 / (double)m_frequency.QuadPart;
+		}
+
+	public:
+		phase_trace() noexcept
+		{
+			QueryPerformanceFrequency(&m_frequency);
+			QueryPerformanceCounter(&m_start);
+			m_last = m_start;
+		}
+
+		// Marks the end of a phase.
+		void mark(_In_z_ const char* phase)
+		{
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			m_phases += winstd::string_printf("%s=%.3f ", phase, milliseconds(m_last, now));
+			m_last = now;
+		}
+
+		// Returns milliseconds since the trace started.
+		double elapsed() const noexcept
+		{
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			return milliseconds(m_start, now);
+		}
+
+		// Returns "<phase>=<ms> ... total=<ms>".
+		std::string str() const
+		{
+			return m_phases + winstd::string_printf("total=%.3f", elapsed());
+		}
+	};
+}
@@ -0,0 +1,149 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "prefixset.h"
+#include "conf.h"
+
+using namespace std;
+
+namespace wg
+{
+	prefix_trie::prefix_trie()
+	{
+		for (auto& n : m_nodes)
+			n.push_back(node{ { 0, 0 }, no_owner });
+	}
+
+	vector<prefix_trie::node>& prefix_trie::nodes(_In_ ADDRESS_FAMILY family)
+	{
+		return m_nodes[family == AF_INET6 ? 1 : 0];
+	}
+
+	const vector<prefix_trie::node>& prefix_trie::nodes(_In_ ADDRESS_FAMILY family) const
+	{
+		return m_nodes[family == AF_INET6 ? 1 : 0];
+	}
+
+	void prefix_trie::insert(_In_ const WIREGUARD_ALLOWED_IP& prefix, _In_ size_t owner)
+	{
+		auto& v = nodes(prefix.AddressFamily);
+		auto bytes = reinterpret_cast<const BYTE*>(&prefix.Address);
+		unsigned int n = 0;
+		for (unsigned int depth = 0; depth < prefix.Cidr; ++depth)
+		{
+			unsigned int bit = (bytes[depth / 8] >> (7 - depth % 8)) & 1;
+			if (!v[n].child[bit])
+			{
+				v[n].child[bit] = (unsigned int)v.size();
+				v.push_back(node{ { 0, 0 }, no_owner });
+			}
+			n = v[n].child[bit];
+		}
+		v[n].owner = owner;
+	}
+
+	void prefix_trie::merge(_Inout_ vector<node>& v, _In_ unsigned int n, _In_ unsigned int depth)
+	{
+		for (unsigned int bit = 0; bit < 2; ++bit)
+			if (v[n].child[bit])
+				merge(v, v[n].child[bit], depth + 1);
+
+		// Two sibling prefixes of the same owner are one prefix of their parent. They cover all of it, so an owner of the parent
+		// never matches and gives way.
+		if (depth && v[n].child[0] && v[n].child[1])
+		{
+			auto& c0 = v[v[n].child[0]];
+			auto& c1 = v[v[n].child[1]];
+			if (c0.owner != no_owner && c0.owner == c1.owner)
+			{
+				v[n].owner = c0.owner;
+				c0.owner = c1.owner = no_owner;
+			}
+		}
+	}
+
+	void prefix_trie::prune(_Inout_ vector<node>& v, _In_ unsigned int n, _In_ size_t inherited)
+	{
+		// Prefix of the same owner as the enclosing prefix is redundant.
+		if (v[n].owner == inherited)
+			v[n].owner = no_owner;
+		size_t effective = v[n].owner != no_owner ? v[n].owner : inherited;
+		for (unsigned int bit = 0; bit < 2; ++bit)
+		{
+			auto c = v[n].child[bit];
+			if (!c)
+				continue;
+			prune(v, c, effective);
+			if (v[c].owner == no_owner && !v[c].child[0] && !v[c].child[1])
+				v[n].child[bit] = 0;
+		}
+	}
+
+	void prefix_trie::aggregate()
+	{
+		for (auto& v : m_nodes)
+		{
+			merge(v, 0, 0);
+			prune(v, 0, no_owner);
+		}
+	}
+
+	void prefix_trie::collect(_In_ const vector<node>& v, _In_ unsigned int n, _In_ unsigned int depth, _Inout_ WIREGUARD_ALLOWED_IP& prefix, _Inout_ vector<vector<WIREGUARD_ALLOWED_IP>>& owners)
+	{
+		if (v[n].owner != no_owner)
+		{
+			if (owners.size() <= v[n].owner)
+				owners.resize(v[n].owner + 1);
+			prefix.Cidr = (BYTE)depth;
+			owners[v[n].owner].push_back(prefix);
+		}
+		for (unsigned int bit = 0; bit < 2; ++bit)
+		{
+			if (!v[n].child[bit])
+				continue;
+			auto& b = reinterpret_cast<BYTE*>(&prefix.Address)[depth / 8];
+			BYTE mask = (BYTE)(0x80 >> (depth % 8));
+			if (bit)
+				b |= mask;
+			collect(v, v[n].child[bit], depth + 1, prefix, owners);
+			b &= ~mask;
+		}
+	}
+
+	void prefix_trie::collect(_Inout_ vector<vector<WIREGUARD_ALLOWED_IP>>& owners) const
+	{
+		static const ADDRESS_FAMILY families[] = { AF_INET, AF_INET6 };
+		for (auto family : families)
+		{
+			WIREGUARD_ALLOWED_IP prefix = {};
+			prefix.AddressFamily = family;
+			collect(nodes(family), 0, 0, prefix, owners);
+		}
+	}
+
+	void aggregate_allowed_ips(_Inout_ interface_config& config, _Out_ size_t& before, _Out_ size_t& after)
+	{
+		prefix_trie trie;
+		before = 0;
+		for (size_t i = 0; i < config.peers.size(); ++i)
+			for (auto& a : config.peers[i].allowed_ips)
+			{
+				trie.insert(a, i);
+				++before;
+			}
+		trie.aggregate();
+		vector<vector<WIREGUARD_ALLOWED_IP>> owners(config.peers.size());
+		trie.collect(owners);
+		after = 0;
+		for (size_t i = 0; i < config.peers.size(); ++i)
+		{
+			config.peers[i].allowed_ips = move(owners[i]);
+			after += config.peers[i].allowed_ips.size();
+		}
+	}
+}
@@ -0,0 +1,57 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "driver.h"
+#include <vector>
+
+namespace wg
+{
+	// Binary trie of IPv4 and IPv6 prefixes, each owned by a peer
+	class prefix_trie
+	{
+		friend class lpm_table;
+
+	public:
+		static const size_t no_owner = (size_t)-1;
+
+	private:
+		struct node
+		{
+			unsigned int child[2]; // 0 when absent
+			size_t owner;
+		};
+		std::vector<node> m_nodes[2]; // IPv4, IPv6; the first node is the root
+
+		std::vector<node>& nodes(_In_ ADDRESS_FAMILY family);
+		const std::vector<node>& nodes(_In_ ADDRESS_FAMILY family) const;
+		static void merge(_Inout_ std::vector<node>& nodes, _In_ unsigned int n, _In_ unsigned int depth);
+		static void prune(_Inout_ std::vector<node>& nodes, _In_ unsigned int n, _In_ size_t inherited);
+		static void collect(_In_ const std::vector<node>& nodes, _In_ unsigned int n, _In_ unsigned int depth, _Inout_ WIREGUARD_ALLOWED_IP& prefix, _Inout_ std::vector<std::vector<WIREGUARD_ALLOWED_IP>>& owners);
+
+	public:
+		prefix_trie();
+
+		// Assigns prefix to owner. Later assignment of the same prefix wins, as it does in the driver.
+		void insert(_In_ const WIREGUARD_ALLOWED_IP& prefix, _In_ size_t owner);
+
+		// Rewrites the trie to fewer prefixes with the same longest-prefix-match result for every address: sibling prefixes of the
+		// same owner merge into their parent, and prefixes of the same owner as the enclosing one are dropped. The result is not
+		// always minimal: a prefix mostly covered by another owner is not handed to that owner with the rest kept as exceptions.
+		// Prefixes are never merged into a default route, as tunnel service treats those specially.
+		void aggregate();
+
+		// Returns prefixes of each owner. owners receives one vector per owner index.
+		void collect(_Inout_ std::vector<std::vector<WIREGUARD_ALLOWED_IP>>& owners) const;
+	};
+
+	struct interface_config;
+
+	// Replaces allowed IPs of all peers with the aggregated equivalent set. Returns total number of allowed IPs before and after.
+	void aggregate_allowed_ips(_Inout_ interface_config& config, _Out_ size_t& before, _Out_ size_t& after);
+}
@@ -0,0 +1,105 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "probe.h"
+#include <iphlpapi.h>
+#include <IcmpAPI.h>
+
+using namespace std;
+using namespace winstd;
+
+namespace wg
+{
+	static const WORD probe_payload_size = 32;
+
+	prober::prober(_In_ const SOCKADDR_INET& target, _In_ const SOCKADDR_INET& source, _In_ DWORD base_interval) :
+		m_target(target),
+		m_source(source),
+		m_base_interval(base_interval),
+		m_interval(base_interval),
+		m_sequence(0)
+	{
+		m_source.si_family = target.si_family; // Unspecified source is the zero address of the family.
+		m_icmp = target.si_family == AF_INET ? IcmpCreateFile() : Icmp6CreateFile();
+		if (m_icmp == INVALID_HANDLE_VALUE)
+			throw win_runtime_error("Failed to open ICMP handle");
+		QueryPerformanceFrequency(&m_frequency);
+	}
+
+	prober::~prober()
+	{
+		IcmpCloseHandle(m_icmp);
+	}
+
+	DWORD prober::probe() noexcept
+	{
+		BYTE payload[probe_payload_size];
+		memset(payload, 0, sizeof(payload));
+		memcpy(payload, &++m_sequence, sizeof(m_sequence));
+		BYTE reply[sizeof(ICMPV6_ECHO_REPLY) + sizeof(ICMP_ECHO_REPLY) + probe_payload_size + 8];
+
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		bool success;
+		if (m_target.si_family == AF_INET)
+			success =
+				IcmpSendEcho2Ex(m_icmp, NULL, NULL, NULL, m_source.Ipv4.sin_addr.s_addr, m_target.Ipv4.sin_addr.s_addr, payload, sizeof(payload), NULL, reply, sizeof(reply), timeout) &&
+				reinterpret_cast<const ICMP_ECHO_REPLY*>(reply)->Status == IP_SUCCESS;
+		else
+			success =
+				Icmp6SendEcho2(m_icmp, NULL, NULL, NULL, &m_source.Ipv6, &m_target.Ipv6, payload, sizeof(payload), NULL, reply, sizeof(reply), timeout) &&
+				Icmp6ParseReplies(reply, sizeof(reply)) &&
+				reinterpret_cast<const ICMPV6_ECHO_REPLY*>(reply)->Status == IP_SUCCESS;
+		QueryPerformanceCounter(&end);
+
+		if (!success)
+		{
+			m_interval = max<DWORD>(m_interval / 2, max<DWORD>(m_base_interval / 4, 1));
+			return probe_window::lost;
+		}
+		m_interval = min<DWORD>(m_interval + max<DWORD>(m_base_interval / 8, 1), m_base_interval);
+		return (DWORD)min<ULONGLONG>((ULONGLONG)(end.QuadPart - start.QuadPart) * 1000000 / (ULONGLONG)m_frequency.QuadPart, probe_window::lost - 1);
+	}
+
+	bool parse_probe_address(_In_z_ LPCWSTR address, _Out_ SOCKADDR_INET& target) noexcept
+	{
+		memset(&target, 0, sizeof(target));
+		if (InetPtonW(AF_INET, address, &target.Ipv4.sin_addr) == 1)
+		{
+			target.si_family = AF_INET;
+			return true;
+		}
+		if (InetPtonW(AF_INET6, address, &target.Ipv6.sin6_addr) == 1)
+		{
+			target.si_family = AF_INET6;
+			return true;
+		}
+		return false;
+	}
+
+	bool find_interface_address(_In_ const NET_LUID& luid, _In_ ADDRESS_FAMILY family, _Out_ SOCKADDR_INET& address) noexcept
+	{
+		memset(&address, 0, sizeof(address));
+		PMIB_UNICASTIPADDRESS_TABLE table;
+		if (GetUnicastIpAddressTable(family, &table) != NO_ERROR)
+			return false;
+		bool found = false;
+		for (ULONG i = 0; i < table->NumEntries; ++i)
+		{
+			auto& row = table->Table[i];
+			if (row.InterfaceLuid.Value == luid.Value && row.DadState == IpDadStatePreferred)
+			{
+				address = row.Address;
+				found = true;
+				break;
+			}
+		}
+		FreeMibTable(table);
+		return found;
+	}
+}
@@ -0,0 +1,199 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <WS2tcpip.h>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <WinStd/Win.h>
+
+namespace wg
+{
+	// Path quality over the samples in a probe window. Times are in microseconds.
+	struct probe_stats
+	{
+		unsigned int samples;   // Probes in the window
+		unsigned int lost;      // Probes in the window without reply
+		DWORD rtt_min;
+		DWORD rtt_avg;
+		DWORD rtt_max;
+		DWORD jitter;           // Mean absolute difference of consecutive RTTs
+		ULONGLONG total_sent;   // Probes since the prober started
+		ULONGLONG total_lost;
+	};
+
+	// Sliding window of the latest probe results in a memory-mapped file
+	//
+	// The tunnel process writes it, the manager reads it. Writes are bracketed by a sequence number that is odd while a write is in
+	// progress; readers retry until they copy the window between two equal even sequence numbers.
+	class probe_window
+	{
+	private:
+		typedef std::unique_ptr<unsigned char[], winstd::UnmapViewOfFile_delete> file_mapping_view;
+
+	public:
+		static const unsigned int size = 64;
+		static const DWORD lost = (DWORD)-1;
+
+	private:
+		struct layout
+		{
+			unsigned int magic;
+			volatile LONG sequence;
+			ULONGLONG total_sent;
+			ULONGLONG total_lost;
+			DWORD rtt[size];        // Microseconds, or lost; index is total_sent modulo size
+		};
+
+		static unsigned int expected_magic() noexcept
+		{
+			return 0x9b0be5a1;
+		}
+
+		winstd::file m_file;
+		winstd::file_mapping m_mmap;
+		file_mapping_view m_view;
+
+		layout* data() const noexcept
+		{
+			return reinterpret_cast<layout*>(m_view.get());
+		}
+
+	public:
+		// Creates a new window for writing, or opens an existing one for reading.
+		probe_window(_In_z_ LPCWSTR filename, _In_ bool writer)
+		{
+			m_file = CreateFileW(filename, writer ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, writer ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (!m_file)
+				throw winstd::win_runtime_error("Failed to open probe window file");
+			if (writer)
+			{
+				if (SetFilePointer(m_file, sizeof(layout), NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+					throw winstd::win_runtime_error("Failed to seek in probe window file");
+				if (!SetEndOfFile(m_file))
+					throw winstd::win_runtime_error("Failed to set EOF in probe window file");
+			}
+			m_mmap = CreateFileMappingW(m_file, NULL, writer ? PAGE_READWRITE : PAGE_READONLY, 0, sizeof(layout), NULL);
+			if (!m_mmap)
+				throw winstd::win_runtime_error("Failed to create probe window file mapping");
+			m_view.reset((unsigned char*)MapViewOfFile(m_mmap, writer ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, sizeof(layout)));
+			if (!m_view)
+				throw winstd::win_runtime_error("Failed to map view of probe window file mapping");
+			if (writer)
+				data()->magic = expected_magic();
+			else if (data()->magic != expected_magic())
+				throw std::runtime_error("Probe window file is corrupt");
+		}
+
+		// Records result of a probe: RTT in microseconds, or lost.
+		void add(_In_ DWORD rtt) noexcept
+		{
+			auto d = data();
+			InterlockedIncrement(&d->sequence);
+			d->rtt[d->total_sent % size] = rtt;
+			++d->total_sent;
+			if (rtt == lost)
+				++d->total_lost;
+			InterlockedIncrement(&d->sequence);
+		}
+
+		void stats(_Out_ probe_stats& s) const noexcept
+		{
+			auto d = data();
+			layout copy;
+			for (;;)
+			{
+				LONG sequence = d->sequence;
+				if (sequence & 1)
+				{
+					YieldProcessor();
+					continue;
+				}
+				MemoryBarrier();
+				memcpy(&copy, d, sizeof(copy));
+				MemoryBarrier();
+				if (d->sequence == sequence)
+					break;
+			}
+
+			memset(&s, 0, sizeof(s));
+			s.total_sent = copy.total_sent;
+			s.total_lost = copy.total_lost;
+			s.samples = (unsigned int)std::min<ULONGLONG>(copy.total_sent, size);
+			ULONGLONG rtt_sum = 0, jitter_sum = 0;
+			unsigned int received = 0, pairs = 0;
+			DWORD prev = lost;
+			for (ULONGLONG i = copy.total_sent - s.samples; i < copy.total_sent; ++i)
+			{
+				DWORD rtt = copy.rtt[i % size];
+				if (rtt == lost)
+				{
+					++s.lost;
+					continue;
+				}
+				if (!received++ || rtt < s.rtt_min)
+					s.rtt_min = rtt;
+				if (rtt > s.rtt_max)
+					s.rtt_max = rtt;
+				rtt_sum += rtt;
+				if (prev != lost)
+				{
+					jitter_sum += rtt > prev ? rtt - prev : prev - rtt;
+					++pairs;
+				}
+				prev = rtt;
+			}
+			if (received)
+				s.rtt_avg = (DWORD)(rtt_sum / received);
+			if (pairs)
+				s.jitter = (DWORD)(jitter_sum / pairs);
+		}
+	};
+
+	// Sends ICMP echo probes to an address at an adaptive rate
+	//
+	// The rate doubles on loss, down to a quarter of the base interval, to measure a degraded path more closely, and eases back
+	// towards the base interval as replies come in.
+	class prober
+	{
+	private:
+		SOCKADDR_INET m_target;
+		SOCKADDR_INET m_source;
+		HANDLE m_icmp;
+		DWORD m_base_interval;
+		DWORD m_interval;
+		USHORT m_sequence;
+		LARGE_INTEGER m_frequency;
+
+	public:
+		static const DWORD timeout = 1000; // Milliseconds a probe awaits its reply
+
+		// source: address to send probes from, e.g. of the tunnel interface; unspecified address lets the route to target pick it
+		prober(_In_ const SOCKADDR_INET& target, _In_ const SOCKADDR_INET& source, _In_ DWORD base_interval);
+		~prober();
+
+		prober(const prober&) = delete;
+		prober& operator=(const prober&) = delete;
+
+		// Sends a probe and awaits reply. Returns RTT in microseconds, or probe_window::lost.
+		DWORD probe() noexcept;
+
+		// Milliseconds to wait before the next probe
+		DWORD interval() const noexcept
+		{
+			return m_interval;
+		}
+	};
+
+	// Parses numeric IPv4 or IPv6 address.
+	bool parse_probe_address(_In_z_ LPCWSTR address, _Out_ SOCKADDR_INET& target) noexcept;
+
+	// Finds a preferred unicast address of the family on the interface. Returns false when it has none yet.
+	bool find_interface_address(_In_ const NET_LUID& luid, _In_ ADDRESS_FAMILY family, _Out_ SOCKADDR_INET& address) noexcept;
+}
@@ -0,0 +1,134 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "probe.h"
+#include <Windows.h>
+
+#pragma warning(push)
+#pragma warning(disable: 4200) // Nonstandard extensions: This is MSVC-only source code.
+
+// Manager pipe protocol. Clients talk to the manager in messages of at most PIPE_MSG_BUFFER bytes each way unless noted.
+
+#define PIPE_MSG_BUFFER 0x10000
+
+namespace wg
+{
+	enum class message_code
+	{
+		status,
+		activate_tunnel,
+		deactivate_tunnel,
+		get_tunnel_config,
+		tunnel_config,
+		subscribe_peer_stats,
+		peer_stats,
+		activate_tunnels,
+		deactivate_tunnels,
+		update_tunnel,
+		get_tunnel_config_compact,
+		tunnel_config_compact,
+		lookup_peers,
+		peer_indices,
+		negotiate,
+		capabilities,
+		tunnel_config_section,
+		get_metrics,
+		metrics,
+		get_probe_stats,
+		probe_stats,
+	};
+
+	struct message {
+		message_code code;
+	};
+
+	struct message_status : message {
+		bool success;
+		DWORD win32_error;
+		unsigned int message_len;
+		char message[];
+	};
+
+	#define MAX_WG_TUNNEL_NAME 32
+
+	struct message_activate_tunnel : message {
+		char tunnel_name[MAX_WG_TUNNEL_NAME];
+		unsigned int config_len;
+		char config[];
+	};
+
+	struct message_tunnel : message {
+		char tunnel_name[MAX_WG_TUNNEL_NAME];
+	};
+
+	struct message_activate_tunnels : message {
+		unsigned int tunnel_count;
+		unsigned char tunnels[]; // tunnel_count records of: char tunnel_name[MAX_WG_TUNNEL_NAME]; unsigned int config_len; char config[config_len];
+	};
+
+	struct message_deactivate_tunnels : message {
+		unsigned int tunnel_count; // 0 to deactivate all tunnels of this client
+		char tunnel_names[][MAX_WG_TUNNEL_NAME];
+	};
+
+	struct message_config : message {
+		unsigned int config_len;
+		char config[];
+	};
+
+	struct message_subscribe_peer_stats : message {
+		char tunnel_name[MAX_WG_TUNNEL_NAME]; // Empty for the tunnel activated by this client
+		unsigned int interval;                // Milliseconds; 0 to unsubscribe
+	};
+
+	struct message_peer_stats : message {
+		unsigned int peer_count;              // Total number of tunnel peers
+		unsigned int record_count;            // Number of peer_stats records that follow
+		unsigned char records[];
+	};
+
+	// Capabilities negotiated with negotiate request
+	#define CAPABILITY_SHARED_MEMORY 0x00000001 // Large replies without preshared keys are passed in a read-only shared memory section
+	#define CAPABILITIES_SUPPORTED   (CAPABILITY_SHARED_MEMORY)
+
+	// Replies larger than this travel through shared memory when negotiated
+	#define SHARED_MEMORY_THRESHOLD PIPE_MSG_BUFFER
+
+	struct message_negotiate : message {
+		unsigned int capabilities; // Request: capabilities of the client; reply: capabilities in effect for the session
+	};
+
+	struct message_config_section : message {
+		message_code payload_code;  // tunnel_config or tunnel_config_compact
+		unsigned int config_len;
+		unsigned long long section; // Read-only section handle in the client process; the client closes it
+	};
+
+	struct message_lookup_peers : message {
+		char tunnel_name[MAX_WG_TUNNEL_NAME]; // Empty for the tunnel activated by this client
+		unsigned int address_count;
+		unsigned char addresses[];            // address_count records of: ADDRESS_FAMILY family; unsigned char address[16]; IPv4 uses the first 4 bytes
+	};
+
+	struct message_peer_indices : message {
+		unsigned int index_count;
+		DWORD indices[];                      // Index of the peer in tunnel configuration routing each address; (DWORD)-1 when none
+	};
+
+	struct message_metrics : message {
+		unsigned int snapshot_len;
+		unsigned char snapshot[];             // See metrics::snapshot()
+	};
+
+	struct message_probe_stats : message {
+		probe_stats stats;
+	};
+}
+
+#pragma warning(pop)
@@ -0,0 +1,265 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "race.h"
+#include "crypto.h"
+#include "srwlock.h"
+#include <bcrypt.h>
+
+using namespace std;
+using namespace winstd;
+
+namespace wg
+{
+	static const char noise_construction[] = "Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s";
+	static const char wg_identifier[] = "WireGuard v1 zx2c4 Jason@zx2c4.com";
+	static const char wg_label_mac1[] = "mac1----";
+
+	static inline void store32(_Out_writes_bytes_(4) BYTE* p, _In_ DWORD x) noexcept
+	{
+		p[0] = (BYTE)x;
+		p[1] = (BYTE)(x >> 8);
+		p[2] = (BYTE)(x >> 16);
+		p[3] = (BYTE)(x >> 24);
+	}
+
+	static inline DWORD load32(_In_reads_bytes_(4) const BYTE* p) noexcept
+	{
+		return (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+	}
+
+	static void hash(
+		_Out_writes_bytes_(blake2s::hash_size) BYTE* out,
+		_In_reads_bytes_(a_len) const void* a, _In_ size_t a_len,
+		_In_reads_bytes_opt_(b_len) const void* b = NULL, _In_ size_t b_len = 0) noexcept
+	{
+		blake2s h;
+		h.update(a, a_len);
+		if (b_len)
+			h.update(b, b_len);
+		h.final(out);
+	}
+
+	// HKDF with HMAC-BLAKE2s. out1 may alias key.
+	static void kdf(
+		_In_reads_bytes_(blake2s::hash_size) const BYTE* key,
+		_In_reads_bytes_(input_len) const void* input, _In_ size_t input_len,
+		_Out_writes_bytes_(blake2s::hash_size) BYTE* out1,
+		_Out_writes_bytes_opt_(blake2s::hash_size) BYTE* out2) noexcept
+	{
+		BYTE t0[blake2s::hash_size], t[blake2s::hash_size + 1];
+		hmac_blake2s(key, blake2s::hash_size, input, input_len, t0);
+		t[0] = 1;
+		hmac_blake2s(t0, sizeof(t0), t, 1, out1);
+		if (out2)
+		{
+			memcpy(t, out1, blake2s::hash_size);
+			t[blake2s::hash_size] = 2;
+			hmac_blake2s(t0, sizeof(t0), t, sizeof(t), out2);
+		}
+		SecureZeroMemory(t0, sizeof(t0));
+		SecureZeroMemory(t, sizeof(t));
+	}
+
+	void make_handshake_initiation(
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* private_key,
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* public_key,
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* peer_public_key,
+		_In_ DWORD sender_index,
+		_In_reads_bytes_(12) const BYTE* timestamp,
+		_Out_writes_bytes_(handshake_initiation_size) BYTE* msg)
+	{
+		BYTE c[blake2s::hash_size], h[blake2s::hash_size], k[blake2s::hash_size], dh[WIREGUARD_KEY_LENGTH];
+		BYTE ephemeral_private[WIREGUARD_KEY_LENGTH];
+		NTSTATUS status = BCryptGenRandom(NULL, ephemeral_private, sizeof(ephemeral_private), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+		if (!BCRYPT_SUCCESS(status))
+			throw win_runtime_error(RtlNtStatusToDosError(status), "BCryptGenRandom failed");
+
+		hash(c, noise_construction, sizeof(noise_construction) - 1);
+		hash(h, c, sizeof(c), wg_identifier, sizeof(wg_identifier) - 1);
+		hash(h, h, sizeof(h), peer_public_key, WIREGUARD_KEY_LENGTH);
+
+		msg[0] = 1; // Handshake initiation
+		msg[1] = msg[2] = msg[3] = 0;
+		store32(msg + 4, sender_index);
+
+		// Unencrypted ephemeral
+		x25519_base(msg + 8, ephemeral_private);
+		kdf(c, msg + 8, WIREGUARD_KEY_LENGTH, c, NULL);
+		hash(h, h, sizeof(h), msg + 8, WIREGUARD_KEY_LENGTH);
+
+		// Encrypted static
+		x25519(dh, ephemeral_private, peer_public_key);
+		kdf(c, dh, sizeof(dh), c, k);
+		chacha20poly1305_seal(k, 0, public_key, WIREGUARD_KEY_LENGTH, h, sizeof(h), msg + 40);
+		hash(h, h, sizeof(h), msg + 40, WIREGUARD_KEY_LENGTH + 16);
+
+		// Encrypted timestamp
+		x25519(dh, private_key, peer_public_key);
+		kdf(c, dh, sizeof(dh), c, k);
+		chacha20poly1305_seal(k, 0, timestamp, 12, h, sizeof(h), msg + 88);
+
+		// MACs
+		hash(k, wg_label_mac1, sizeof(wg_label_mac1) - 1, peer_public_key, WIREGUARD_KEY_LENGTH);
+		blake2s mac1(16, k, sizeof(k));
+		mac1.update(msg, 116);
+		mac1.final(msg + 116);
+		memset(msg + 132, 0, 16);
+
+		SecureZeroMemory(c, sizeof(c));
+		SecureZeroMemory(h, sizeof(h));
+		SecureZeroMemory(k, sizeof(k));
+		SecureZeroMemory(dh, sizeof(dh));
+		SecureZeroMemory(ephemeral_private, sizeof(ephemeral_private));
+	}
+
+	class udp_socket
+	{
+	private:
+		SOCKET m_s;
+
+	public:
+		// Opens socket bound to the wildcard address. Remains invalid when the family is not available.
+		udp_socket(_In_ ADDRESS_FAMILY family) noexcept
+		{
+			m_s = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+			if (m_s == INVALID_SOCKET)
+				return;
+			SOCKADDR_INET any = {};
+			any.si_family = family;
+			if (bind(m_s, reinterpret_cast<const SOCKADDR*>(&any), family == AF_INET ? sizeof(any.Ipv4) : sizeof(any.Ipv6)) == SOCKET_ERROR)
+			{
+				closesocket(m_s);
+				m_s = INVALID_SOCKET;
+			}
+		}
+
+		~udp_socket()
+		{
+			if (m_s != INVALID_SOCKET)
+				closesocket(m_s);
+		}
+
+		udp_socket(const udp_socket&) = delete;
+		udp_socket& operator=(const udp_socket&) = delete;
+
+		operator SOCKET() const noexcept { return m_s; }
+	};
+
+	static srwlock timestamp_lock;
+	static ULONGLONG last_timestamp = 0; // Seconds since the Unix epoch << 30 | nanoseconds
+
+	// Reserves count consecutive probe timestamps. The first is the start of the previous second, or follows the last one reserved when
+	// a race of the same second came first.
+	static ULONGLONG reserve_timestamps(_In_ size_t count) noexcept
+	{
+		FILETIME ft;
+		GetSystemTimeAsFileTime(&ft);
+		ULONGLONG first = ((((((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime) - 116444736000000000ull) / 10000000) - 1) << 30;
+		srwlock::exclusive lock(timestamp_lock);
+		if (first <= last_timestamp)
+			first = last_timestamp + 1;
+		last_timestamp = first + count - 1;
+		return first;
+	}
+
+	size_t race_endpoints(
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* private_key,
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* public_key,
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* peer_public_key,
+		_In_ const vector<SOCKADDR_INET>& candidates,
+		_In_ DWORD attempt_delay,
+		_In_ DWORD timeout,
+		_Out_ vector<double>& rtt)
+	{
+		rtt.assign(candidates.size(), -1.0);
+		udp_socket ipv4(AF_INET), ipv6(AF_INET6);
+		if (ipv4 == INVALID_SOCKET && ipv6 == INVALID_SOCKET)
+			throw win_runtime_error(WSAGetLastError(), "Failed to open UDP socket");
+
+		DWORD sender_base;
+		NTSTATUS status = BCryptGenRandom(NULL, reinterpret_cast<PUCHAR>(&sender_base), sizeof(sender_base), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+		if (!BCRYPT_SUCCESS(status))
+			throw win_runtime_error(RtlNtStatusToDosError(status), "BCryptGenRandom failed");
+
+		ULONGLONG first_timestamp = reserve_timestamps(candidates.size());
+
+		LARGE_INTEGER frequency, start;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+		auto elapsed = [&]() -> double
+		{
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			return (double)(now.QuadPart - start.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+		};
+
+		vector<double> sent(candidates.size());
+		size_t next = 0, winner = (size_t)-1;
+		while (winner == (size_t)-1)
+		{
+			double now = elapsed();
+			if (next < candidates.size() && now >= (double)next * attempt_delay)
+			{
+				// Later attempts carry later timestamps, or the peer would drop them as replays.
+				BYTE timestamp[12], msg[handshake_initiation_size];
+				ULONGLONG t = first_timestamp + next, tai64 = 0x400000000000000aull + (t >> 30);
+				DWORD nanoseconds = (DWORD)(t & 0x3fffffff);
+				for (int i = 0; i < 8; ++i)
+					timestamp[i] = (BYTE)(tai64 >> (56 - 8 * i));
+				for (int i = 0; i < 4; ++i)
+					timestamp[8 + i] = (BYTE)(nanoseconds >> (24 - 8 * i));
+				make_handshake_initiation(private_key, public_key, peer_public_key, sender_base + (DWORD)next, timestamp, msg);
+				auto& endpoint = candidates[next];
+				SOCKET s = endpoint.si_family == AF_INET ? ipv4 : ipv6;
+				sent[next] = now;
+				if (s != INVALID_SOCKET)
+					sendto(s, reinterpret_cast<const char*>(msg), sizeof(msg), 0, reinterpret_cast<const SOCKADDR*>(&endpoint), endpoint.si_family == AF_INET ? sizeof(endpoint.Ipv4) : sizeof(endpoint.Ipv6));
+				++next;
+				continue;
+			}
+			double deadline = next < candidates.size() ? (double)next * attempt_delay : (double)(next - 1) * attempt_delay + timeout;
+			if (now >= deadline)
+				break;
+
+			fd_set fds;
+			FD_ZERO(&fds);
+			if (ipv4 != INVALID_SOCKET)
+				FD_SET(ipv4, &fds);
+			if (ipv6 != INVALID_SOCKET)
+				FD_SET(ipv6, &fds);
+			long wait = (long)((deadline - now) * 1000.0) + 1;
+			timeval tv = { wait / 1000000, wait % 1000000 };
+			if (select(0, &fds, NULL, NULL, &tv) == SOCKET_ERROR)
+				throw win_runtime_error(WSAGetLastError(), "select failed");
+			now = elapsed();
+			for (SOCKET s : { (SOCKET)ipv4, (SOCKET)ipv6 })
+			{
+				if (s == INVALID_SOCKET || !FD_ISSET(s, &fds))
+					continue;
+				BYTE reply[128];
+				int len = recv(s, reinterpret_cast<char*>(reply), sizeof(reply), 0);
+				DWORD receiver;
+				if (len == 92 && reply[0] == 2) // Handshake response
+					receiver = load32(reply + 8);
+				else if (len == 64 && reply[0] == 3) // Cookie reply
+					receiver = load32(reply + 4);
+				else
+					continue; // Includes ICMP unreachable reported as WSAECONNRESET
+				size_t i = receiver - sender_base;
+				if (i < next && rtt[i] < 0)
+				{
+					rtt[i] = now - sent[i];
+					if (winner == (size_t)-1)
+						winner = i;
+				}
+			}
+		}
+		return winner;
+	}
+}
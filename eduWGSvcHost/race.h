@@ -0,0 +1,48 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "driver.h"
+#include <WS2tcpip.h>
+#include <vector>
+
+namespace wg
+{
+	static const size_t handshake_initiation_size = 148;
+
+	// Builds WireGuard handshake initiation message from the interface to the peer. Cookie MAC (mac2) is left empty.
+	// public_key: interface public key matching private_key
+	// timestamp: TAI64N; must be later than any initiation the peer saw from this interface before
+	void make_handshake_initiation(
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* private_key,
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* public_key,
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* peer_public_key,
+		_In_ DWORD sender_index,
+		_In_reads_bytes_(12) const BYTE* timestamp,
+		_Out_writes_bytes_(handshake_initiation_size) BYTE* msg);
+
+	// Races handshake initiations across endpoint candidates of a peer, Happy Eyeballs style
+	//
+	// Candidates are tried in order, one every attempt_delay milliseconds, until one responds or timeout milliseconds pass after
+	// the last attempt. Handshake and cookie replies both count as responses.
+	// Probe timestamps precede the current second, so the driver's own initiation that follows is never taken for a replay. Each probe
+	// is later than the probes of all races before it in this process, also when the tunnel is activated again within a second.
+	// An initiation the driver sent before the probes carries a later timestamp, and the peer drops the probes as replays. Race before
+	// the interface starts for that reason. The peer still drops probes as replays when the interface handshook with it within the last
+	// second, as on reactivating a tunnel right after its handshake. No candidate responds then, and the race is logged without winner.
+	// rtt receives round-trip time in milliseconds of each candidate; negative when it did not respond before the race ended.
+	// Returns index of the first responder, or -1 when none responded.
+	size_t race_endpoints(
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* private_key,
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* public_key,
+		_In_reads_bytes_(WIREGUARD_KEY_LENGTH) const BYTE* peer_public_key,
+		_In_ const std::vector<SOCKADDR_INET>& candidates,
+		_In_ DWORD attempt_delay,
+		_In_ DWORD timeout,
+		_Out_ std::vector<double>& rtt);
+}
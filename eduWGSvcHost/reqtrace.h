@@ -0,0 +1,133 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "varint.h"
+#include <Windows.h>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <WinStd/Win.h>
+
+namespace wg
+{
+	// Manager pipe requests recorded for replay
+	//
+	// The file starts with magic "eduWGtrc" and varint format version. Records follow, each in varint encoding:
+	// time since trace start in microseconds, connection, latency in microseconds, success, payload size, payload[]
+	// Records of concurrent connections are appended as they complete, so times are only ordered per connection.
+	class request_trace
+	{
+	private:
+		static const unsigned int version = 1;
+
+		winstd::file m_file;
+		LARGE_INTEGER m_frequency;
+		LARGE_INTEGER m_start;
+		volatile LONGLONG m_size;
+		LONGLONG m_max_size;
+
+		static const char* magic() noexcept
+		{
+			return "eduWGtrc";
+		}
+
+	public:
+		struct record
+		{
+			ULONGLONG time;    // Microseconds since trace start
+			unsigned int connection;
+			ULONGLONG latency; // Microseconds
+			bool success;
+			std::vector<unsigned char> payload;
+		};
+
+		// Creates new trace. Records past max_size bytes are dropped.
+		request_trace(_In_z_ LPCWSTR filename, _In_ ULONGLONG max_size) :
+			m_size(0),
+			m_max_size((LONGLONG)max_size)
+		{
+			m_file = CreateFileW(filename, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (!m_file)
+				throw winstd::win_runtime_error("Failed to create request trace file");
+			std::vector<unsigned char> header(magic(), magic() + 8);
+			varint_write(header, version);
+			DWORD written;
+			if (!WriteFile(m_file, header.data(), (DWORD)header.size(), &written, NULL))
+				throw winstd::win_runtime_error("Failed to write request trace file");
+			m_size = (LONGLONG)header.size();
+			QueryPerformanceFrequency(&m_frequency);
+			QueryPerformanceCounter(&m_start);
+		}
+
+		// Returns microseconds since trace start.
+		ULONGLONG now() const noexcept
+		{
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			return (ULONGLONG)(now.QuadPart - m_start.QuadPart) * 1000000 / (ULONGLONG)m_frequency.QuadPart;
+		}
+
+		// Appends a record. Each record is one append, so connections can write concurrently.
+		void write(_In_ ULONGLONG time, _In_ unsigned int connection, _In_ ULONGLONG latency, _In_ bool success, _In_reads_bytes_(size) const void* payload, _In_ size_t size) noexcept
+		{
+			try
+			{
+				std::vector<unsigned char> data;
+				data.reserve(size + 32);
+				varint_write(data, time);
+				varint_write(data, connection);
+				varint_write(data, latency);
+				varint_write(data, success ? 1u : 0u);
+				varint_write(data, size);
+				data.insert(data.end(), reinterpret_cast<const unsigned char*>(payload), reinterpret_cast<const unsigned char*>(payload) + size);
+				if (InterlockedExchangeAdd64(&m_size, (LONGLONG)data.size()) + (LONGLONG)data.size() > m_max_size)
+					return;
+				DWORD written;
+				WriteFile(m_file, data.data(), (DWORD)data.size(), &written, NULL);
+			}
+			catch (...) {}
+		}
+
+		// Reads all records of a trace file.
+		static void read(_In_z_ LPCWSTR filename, _Inout_ std::vector<record>& records)
+		{
+			winstd::file f(CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
+			if (!f)
+				throw winstd::win_runtime_error("Failed to open request trace file");
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(f, &size))
+				throw winstd::win_runtime_error("Failed to get request trace file size");
+			if (size.QuadPart > 0x40000000)
+				throw std::invalid_argument("Request trace file too big");
+			std::vector<unsigned char> data((size_t)size.QuadPart);
+			DWORD bytes_read;
+			if (!data.empty() && (!ReadFile(f, data.data(), (DWORD)data.size(), &bytes_read, NULL) || bytes_read != data.size()))
+				throw winstd::win_runtime_error("Failed to read request trace file");
+			if (data.size() < 8 || memcmp(data.data(), magic(), 8) != 0)
+				throw std::invalid_argument("Not a request trace file");
+			const unsigned char* cursor = data.data() + 8, * end = data.data() + data.size();
+			if (varint_read<unsigned int>(cursor, end) != version)
+				throw std::invalid_argument("Unsupported request trace version");
+			while (cursor < end)
+			{
+				record r;
+				r.time = varint_read<ULONGLONG>(cursor, end);
+				r.connection = varint_read<unsigned int>(cursor, end);
+				r.latency = varint_read<ULONGLONG>(cursor, end);
+				r.success = varint_read<unsigned int>(cursor, end) != 0;
+				auto payload_size = varint_read<size_t>(cursor, end);
+				if ((size_t)(end - cursor) < payload_size)
+					throw std::invalid_argument("Incomplete request trace record");
+				r.payload.assign(cursor, cursor + payload_size);
+				cursor += payload_size;
+				records.push_back(std::move(r));
+			}
+		}
+	};
+}
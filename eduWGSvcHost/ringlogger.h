@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include "metrics.h"
 #include <Windows.h>
 #include <algorithm>
 #include <memory>
@@ -256,6 +257,7 @@ namespace wg
 				throw std::invalid_argument("Log line too big");
 			entry.set_text(winstd::string_printf("[%s] %.*s", m_tag.c_str(), (unsigned int)(line_end - line), line).c_str());
 			entry.set_timestamp(time);
+			metrics::add(metric_counter::ringlog_writes);
 		}
 
 		void write_to(_In_ HANDLE hFile)
@@ -287,6 +289,7 @@ namespace wg
 			auto all = cursor == cursor_all;
 			if (all)
 				i = m_log.next_index();
+			unsigned int followed = 0;
 			for (unsigned int l = 0; l < m_log.line_count(); ++l, ++i)
 			{
 				if (!all && i % m_log.line_count() == m_log.next_index() % m_log.line_count())
@@ -299,6 +302,11 @@ namespace wg
 					break;
 				}
 				cursor = (i + 1) % m_log.line_count();
+				if (!followed++)
+				{
+					auto lag = unix_timestamp::now().ns() - entry.timestamp().ns();
+					metrics::record(metric_histogram::ringlog_follower_lag, lag > 0 ? (ULONGLONG)lag / 1000 : 0);
+				}
 				auto text = entry.to_string();
 				if (text.empty())
 					continue;
@@ -310,6 +318,7 @@ namespace wg
 					throw winstd::win_runtime_error("WriteFile failed");
 			}
 			FlushFileBuffers(hFile);
+			metrics::add(metric_counter::ringlog_lines_followed, followed);
 		}
 	};
 }
\ No newline at end of file
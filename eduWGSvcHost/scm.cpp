@@ -0,0 +1,22 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "scm.h"
+
+decltype(::OpenSCManagerW)* wg::service_manager::OpenSCManagerW = ::OpenSCManagerW;
+decltype(::CloseServiceHandle)* wg::service_manager::CloseServiceHandle = ::CloseServiceHandle;
+decltype(::CreateServiceW)* wg::service_manager::CreateServiceW = ::CreateServiceW;
+decltype(::OpenServiceW)* wg::service_manager::OpenServiceW = ::OpenServiceW;
+decltype(::EnumServicesStatusExW)* wg::service_manager::EnumServicesStatusExW = ::EnumServicesStatusExW;
+decltype(::ChangeServiceConfigW)* wg::service_manager::ChangeServiceConfigW = ::ChangeServiceConfigW;
+decltype(::ChangeServiceConfig2W)* wg::service_manager::ChangeServiceConfig2W = ::ChangeServiceConfig2W;
+decltype(::StartServiceW)* wg::service_manager::StartServiceW = ::StartServiceW;
+decltype(::ControlService)* wg::service_manager::ControlService = ::ControlService;
+decltype(::QueryServiceStatus)* wg::service_manager::QueryServiceStatus = ::QueryServiceStatus;
+decltype(::QueryServiceStatusEx)* wg::service_manager::QueryServiceStatusEx = ::QueryServiceStatusEx;
+decltype(::DeleteService)* wg::service_manager::DeleteService = ::DeleteService;
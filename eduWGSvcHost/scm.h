@@ -0,0 +1,50 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+#include <WinStd/Common.h>
+
+namespace wg
+{
+	// Service Control Manager entries. Bound to advapi32 by default; the fake backend replaces them.
+	class service_manager
+	{
+	public:
+		static decltype(::OpenSCManagerW)* OpenSCManagerW;
+		static decltype(::CloseServiceHandle)* CloseServiceHandle;
+		static decltype(::CreateServiceW)* CreateServiceW;
+		static decltype(::OpenServiceW)* OpenServiceW;
+		static decltype(::EnumServicesStatusExW)* EnumServicesStatusExW;
+		static decltype(::ChangeServiceConfigW)* ChangeServiceConfigW;
+		static decltype(::ChangeServiceConfig2W)* ChangeServiceConfig2W;
+		static decltype(::StartServiceW)* StartServiceW;
+		static decltype(::ControlService)* ControlService;
+		static decltype(::QueryServiceStatus)* QueryServiceStatus;
+		static decltype(::QueryServiceStatusEx)* QueryServiceStatusEx;
+		static decltype(::DeleteService)* DeleteService;
+
+		class handle : public winstd::handle<SC_HANDLE, NULL>
+		{
+			WINSTD_HANDLE_IMPL(handle, SC_HANDLE, NULL)
+
+		public:
+			virtual ~handle()
+			{
+				if (m_h != invalid)
+					free_internal();
+			}
+
+		protected:
+			void free_internal() noexcept override
+			{
+				CloseServiceHandle(m_h);
+			}
+		};
+	};
+}
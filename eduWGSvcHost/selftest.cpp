@@ -0,0 +1,758 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "selftest.h"
+#include "conf.h"
+#include "crypto.h"
+#include "ifaceview.h"
+#include "lpm.h"
+#include "phasetrace.h"
+#include "prefixset.h"
+#include "race.h"
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+
+using namespace std;
+using namespace winstd;
+
+namespace wg
+{
+	static void random_bytes(_Inout_ mt19937& rng, _Out_writes_bytes_(size) void* data, _In_ size_t size)
+	{
+		auto bytes = reinterpret_cast<BYTE*>(data);
+		for (size_t i = 0; i < size; ++i)
+			bytes[i] = (BYTE)rng();
+	}
+
+	// Clears host bits of prefix.
+	static void mask_prefix(_Inout_ WIREGUARD_ALLOWED_IP& prefix) noexcept
+	{
+		auto bytes = reinterpret_cast<BYTE*>(&prefix.Address);
+		for (unsigned int i = 0; i < sizeof(prefix.Address); ++i)
+			bytes[i] &= i * 8 + 8 <= prefix.Cidr ? 0xff : i * 8 < prefix.Cidr ? (BYTE)(0xff << (8 - prefix.Cidr % 8)) : 0;
+	}
+
+	// Returns random prefix anywhere in the address space. One in four is IPv6.
+	static WIREGUARD_ALLOWED_IP random_prefix(_Inout_ mt19937& rng)
+	{
+		WIREGUARD_ALLOWED_IP prefix = {};
+		if (rng() % 4)
+		{
+			prefix.AddressFamily = AF_INET;
+			prefix.Cidr = (BYTE)(rng() % 33);
+			random_bytes(rng, &prefix.Address.V4, sizeof(prefix.Address.V4));
+		}
+		else
+		{
+			prefix.AddressFamily = AF_INET6;
+			prefix.Cidr = (BYTE)(rng() % 129);
+			random_bytes(rng, &prefix.Address.V6, sizeof(prefix.Address.V6));
+		}
+		mask_prefix(prefix);
+		return prefix;
+	}
+
+	template <class T>
+	static void append(_Inout_ vector<unsigned char, sanitizing_allocator<unsigned char>>& data, _In_ const T& value)
+	{
+		data.insert(data.cend(), reinterpret_cast<const unsigned char*>(&value), reinterpret_cast<const unsigned char*>(&value + 1));
+	}
+
+	// Builds driver configuration with every field the compact encoding carries set at random. Fields the encoding drops are zero.
+	static void random_driver_config(_Inout_ mt19937& rng, _In_ unsigned int peers, _In_ unsigned int allowed_ips, _Out_ vector<unsigned char, sanitizing_allocator<unsigned char>>& data)
+	{
+		data.clear();
+		WIREGUARD_INTERFACE iface = {};
+		iface.Flags = WIREGUARD_INTERFACE_HAS_PUBLIC_KEY | WIREGUARD_INTERFACE_HAS_PRIVATE_KEY | WIREGUARD_INTERFACE_HAS_LISTEN_PORT;
+		iface.ListenPort = (WORD)rng();
+		random_bytes(rng, iface.PublicKey, sizeof(iface.PublicKey));
+		random_bytes(rng, iface.PrivateKey, sizeof(iface.PrivateKey));
+		iface.PeersCount = peers;
+		append(data, iface);
+		for (unsigned int i = 0; i < peers; ++i)
+		{
+			WIREGUARD_PEER peer = {};
+			peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE;
+			random_bytes(rng, peer.PublicKey, sizeof(peer.PublicKey));
+			if (i % 3 == 0)
+			{
+				peer.Flags |= WIREGUARD_PEER_HAS_PRESHARED_KEY;
+				random_bytes(rng, peer.PresharedKey, sizeof(peer.PresharedKey));
+			}
+			peer.PersistentKeepalive = (WORD)(rng() % 3600);
+			switch (i % 4)
+			{
+			case 1:
+				peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+				peer.Endpoint.Ipv4.sin_family = AF_INET;
+				random_bytes(rng, &peer.Endpoint.Ipv4.sin_port, sizeof(peer.Endpoint.Ipv4.sin_port));
+				random_bytes(rng, &peer.Endpoint.Ipv4.sin_addr, sizeof(peer.Endpoint.Ipv4.sin_addr));
+				break;
+			case 2:
+				peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+				peer.Endpoint.Ipv6.sin6_family = AF_INET6;
+				random_bytes(rng, &peer.Endpoint.Ipv6.sin6_port, sizeof(peer.Endpoint.Ipv6.sin6_port));
+				random_bytes(rng, &peer.Endpoint.Ipv6.sin6_addr, sizeof(peer.Endpoint.Ipv6.sin6_addr));
+				break;
+			}
+			// Counters span from a single byte to the full varint length.
+			peer.TxBytes = (DWORD64)rng() << (rng() % 33);
+			peer.RxBytes = (DWORD64)rng() << (rng() % 33);
+			random_bytes(rng, &peer.LastHandshake, sizeof(peer.LastHandshake));
+			peer.AllowedIPsCount = (DWORD)((ULONGLONG)allowed_ips * (i + 1) / peers - (ULONGLONG)allowed_ips * i / peers);
+			append(data, peer);
+			for (DWORD j = 0; j < peer.AllowedIPsCount; ++j)
+				append(data, random_prefix(rng));
+		}
+	}
+
+	// Longest-prefix match by trying every prefix length from the longest down. Slow, but simple enough to check the others against.
+	class reference_lpm
+	{
+	private:
+		typedef pair<ULONGLONG, ULONGLONG> key_t;
+
+		struct key_hash
+		{
+			size_t operator()(_In_ const key_t& key) const noexcept
+			{
+				return hash<ULONGLONG>()(key.first * 0x9e3779b97f4a7c15 ^ key.second);
+			}
+		};
+
+		unordered_map<key_t, size_t, key_hash> m_prefixes[2][129]; // IPv4, IPv6; by prefix length
+
+		static key_t key(_In_reads_bytes_(16) const BYTE* address, _In_ unsigned int cidr) noexcept
+		{
+			WIREGUARD_ALLOWED_IP prefix = {};
+			memcpy(&prefix.Address, address, sizeof(prefix.Address));
+			prefix.Cidr = (BYTE)cidr;
+			mask_prefix(prefix);
+			key_t k;
+			memcpy(&k.first, reinterpret_cast<const BYTE*>(&prefix.Address), sizeof(k.first));
+			memcpy(&k.second, reinterpret_cast<const BYTE*>(&prefix.Address) + sizeof(k.first), sizeof(k.second));
+			return k;
+		}
+
+	public:
+		// Assigns prefix to owner. Later assignment of the same prefix wins.
+		void insert(_In_ const WIREGUARD_ALLOWED_IP& prefix, _In_ size_t owner)
+		{
+			m_prefixes[prefix.AddressFamily == AF_INET6 ? 1 : 0][prefix.Cidr][key(reinterpret_cast<const BYTE*>(&prefix.Address), prefix.Cidr)] = owner;
+		}
+
+		// Returns owner of the longest prefix containing address, or prefix_trie::no_owner.
+		size_t lookup(_In_ ADDRESS_FAMILY family, _In_reads_bytes_(16) const BYTE* address) const
+		{
+			auto& prefixes = m_prefixes[family == AF_INET6 ? 1 : 0];
+			for (int cidr = family == AF_INET6 ? 128 : 32; cidr >= 0; --cidr)
+			{
+				if (prefixes[cidr].empty())
+					continue;
+				auto p = prefixes[cidr].find(key(address, cidr));
+				if (p != prefixes[cidr].end())
+					return p->second;
+			}
+			return prefix_trie::no_owner;
+		}
+	};
+
+	struct probe_address
+	{
+		ADDRESS_FAMILY family;
+		BYTE address[16]; // IPv4 uses the first 4 bytes
+	};
+
+	// Builds configuration of peers with prefixes distinct allowed IPs in total. Most prefixes of a peer fall in its own block, so
+	// neighbours merge. Every tenth lands anywhere in the blocks of all peers, nesting within and covering prefixes of others.
+	static void random_interface_config(_Inout_ mt19937& rng, _In_ unsigned int peers, _In_ unsigned int prefixes, _Out_ interface_config& config)
+	{
+		config.peers.clear();
+		config.peers.resize(peers);
+		for (size_t count = 0; count < prefixes; )
+		{
+			for (size_t i = count; i < prefixes; ++i)
+			{
+				DWORD owner = (DWORD)(i % peers), block = rng() % 10 ? owner : rng() % peers;
+				WIREGUARD_ALLOWED_IP prefix = {};
+				auto bytes = reinterpret_cast<BYTE*>(&prefix.Address);
+				if (rng() % 4)
+				{
+					// 10.<block>.0/24
+					prefix.AddressFamily = AF_INET;
+					prefix.Cidr = (BYTE)(block == owner ? 24 + rng() % 9 : 8 + rng() % 25);
+					bytes[0] = 10;
+					bytes[1] = (BYTE)(block >> 8);
+					bytes[2] = (BYTE)block;
+					bytes[3] = (BYTE)rng();
+				}
+				else
+				{
+					// fd00:0:0:<block>::/64
+					prefix.AddressFamily = AF_INET6;
+					prefix.Cidr = (BYTE)(block == owner ? 64 + rng() % 65 : 8 + rng() % 121);
+					bytes[0] = 0xfd;
+					bytes[6] = (BYTE)(block >> 8);
+					bytes[7] = (BYTE)block;
+					random_bytes(rng, bytes + 8, 8);
+				}
+				mask_prefix(prefix);
+				config.peers[owner].allowed_ips.push_back(prefix);
+			}
+
+			// Drop duplicates and draw again for them.
+			count = 0;
+			for (auto& p : config.peers)
+			{
+				sort(p.allowed_ips.begin(), p.allowed_ips.end(), [](const WIREGUARD_ALLOWED_IP& a, const WIREGUARD_ALLOWED_IP& b) { return a < b; });
+				p.allowed_ips.erase(unique(p.allowed_ips.begin(), p.allowed_ips.end(), [](const WIREGUARD_ALLOWED_IP& a, const WIREGUARD_ALLOWED_IP& b) { return a == b; }), p.allowed_ips.end());
+				count += p.allowed_ips.size();
+			}
+		}
+	}
+
+	static void add_probe(_Inout_ vector<probe_address>& probes, _In_ ADDRESS_FAMILY family, _In_reads_bytes_(16) const BYTE* address)
+	{
+		probes.push_back(probe_address{ family });
+		memcpy(probes.back().address, address, sizeof(probes.back().address));
+	}
+
+	// Returns addresses at both edges of each prefix and just outside them, and as many random addresses in the same blocks.
+	static void probe_addresses(_Inout_ mt19937& rng, _In_ const interface_config& config, _Out_ vector<probe_address>& probes)
+	{
+		probes.clear();
+		for (auto& p : config.peers)
+			for (auto& a : p.allowed_ips)
+			{
+				BYTE first[16] = {}, last[16];
+				memcpy(first, &a.Address, a.AddressFamily == AF_INET6 ? 16 : 4);
+				memcpy(last, first, sizeof(last));
+				unsigned int bits = a.AddressFamily == AF_INET6 ? 128 : 32;
+				for (unsigned int bit = a.Cidr; bit < bits; ++bit)
+					last[bit / 8] |= (BYTE)(0x80 >> (bit % 8));
+				add_probe(probes, a.AddressFamily, first);
+				add_probe(probes, a.AddressFamily, last);
+
+				// Address before first and after last, unless they wrap around
+				int i;
+				for (i = bits / 8 - 1; i >= 0 && !first[i]; --i)
+					first[i] = 0xff;
+				if (i >= 0)
+				{
+					--first[i];
+					add_probe(probes, a.AddressFamily, first);
+				}
+				for (i = bits / 8 - 1; i >= 0 && last[i] == 0xff; --i)
+					last[i] = 0;
+				if (i >= 0)
+				{
+					++last[i];
+					add_probe(probes, a.AddressFamily, last);
+				}
+
+				BYTE random[16] = {};
+				memcpy(random, &a.Address, a.AddressFamily == AF_INET6 ? 16 : 4);
+				unsigned int keep = a.AddressFamily == AF_INET6 ? 64 : 16;
+				for (unsigned int bit = keep; bit < bits; ++bit)
+					if (rng() & 1)
+						random[bit / 8] ^= (BYTE)(0x80 >> (bit % 8));
+				add_probe(probes, a.AddressFamily, random);
+			}
+	}
+
+	// Builds driver configuration of allowed IPs of peers. Keys and endpoints are left out.
+	static void driver_config(_In_ const interface_config& config, _Out_ vector<unsigned char, sanitizing_allocator<unsigned char>>& data)
+	{
+		data.clear();
+		WIREGUARD_INTERFACE iface = {};
+		iface.PeersCount = (DWORD)config.peers.size();
+		append(data, iface);
+		for (auto& p : config.peers)
+		{
+			WIREGUARD_PEER peer = {};
+			peer.AllowedIPsCount = (DWORD)p.allowed_ips.size();
+			append(data, peer);
+			for (auto& a : p.allowed_ips)
+				append(data, a);
+		}
+	}
+
+	bool check_compact_config(_In_ unsigned int peers, _In_ unsigned int allowed_ips, _Inout_ string& report)
+	{
+		mt19937 rng(peers);
+		vector<unsigned char, sanitizing_allocator<unsigned char>> config, compact, decoded;
+		random_driver_config(rng, peers, allowed_ips, config);
+		interface_view view(config);
+
+		phase_trace encode;
+		encode_compact_config(view, compact);
+		double encode_time = encode.elapsed();
+
+		phase_trace decode;
+		const unsigned char* cursor = compact.data();
+		decode_compact_config(cursor, compact.data() + compact.size(), decoded);
+		double decode_time = decode.elapsed();
+
+		bool match = cursor == compact.data() + compact.size() && decoded == config;
+		report += string_printf("compact peers=%u allowed_ips=%zu config_bytes=%zu compact_bytes=%zu encode=%.3f decode=%.3f match=%s\n",
+			peers, view.allowed_ips_count(), config.size(), compact.size(), encode_time, decode_time, match ? "yes" : "no");
+		return match;
+	}
+
+	bool check_aggregation(_In_ unsigned int prefixes, _Inout_ string& report)
+	{
+		mt19937 rng(prefixes);
+		interface_config config;
+		random_interface_config(rng, min(max(prefixes / 100, 1u), 0x10000u), prefixes, config);
+		reference_lpm before;
+		for (size_t i = 0; i < config.peers.size(); ++i)
+			for (auto& a : config.peers[i].allowed_ips)
+				before.insert(a, i);
+		vector<probe_address> probes;
+		probe_addresses(rng, config, probes);
+
+		phase_trace aggregate;
+		size_t count_before, count_after;
+		aggregate_allowed_ips(config, count_before, count_after);
+		double aggregate_time = aggregate.elapsed();
+
+		reference_lpm after;
+		for (size_t i = 0; i < config.peers.size(); ++i)
+			for (auto& a : config.peers[i].allowed_ips)
+				after.insert(a, i);
+		size_t mismatches = 0;
+		for (auto& p : probes)
+			if (before.lookup(p.family, p.address) != after.lookup(p.family, p.address))
+				++mismatches;
+		report += string_printf("aggregate prefixes=%zu after=%zu peers=%zu probes=%zu mismatches=%zu aggregate=%.3f\n",
+			count_before, count_after, config.peers.size(), probes.size(), mismatches, aggregate_time);
+		return !mismatches && count_after <= count_before;
+	}
+
+	bool check_lpm(_In_ unsigned int prefixes, _Inout_ string& report)
+	{
+		mt19937 rng(prefixes);
+		interface_config config;
+		random_interface_config(rng, min(max(prefixes / 100, 1u), 0x10000u), prefixes, config);
+		reference_lpm reference;
+		for (size_t i = 0; i < config.peers.size(); ++i)
+			for (auto& a : config.peers[i].allowed_ips)
+				reference.insert(a, i);
+		vector<probe_address> probes;
+		probe_addresses(rng, config, probes);
+		vector<unsigned char, sanitizing_allocator<unsigned char>> data;
+		driver_config(config, data);
+
+		phase_trace build;
+		lpm_table table;
+		table.build(interface_view(data));
+		double build_time = build.elapsed();
+
+		vector<DWORD> found(probes.size());
+		phase_trace lookup;
+		for (size_t i = 0; i < probes.size(); ++i)
+			found[i] = table.lookup(probes[i].family, probes[i].address);
+		double lookup_time = lookup.elapsed();
+
+		size_t mismatches = 0;
+		phase_trace reference_lookup;
+		for (size_t i = 0; i < probes.size(); ++i)
+		{
+			size_t owner = reference.lookup(probes[i].family, probes[i].address);
+			if (found[i] != (owner == prefix_trie::no_owner ? lpm_table::no_peer : (DWORD)owner))
+				++mismatches;
+		}
+		double reference_time = reference_lookup.elapsed();
+
+		double n = (double)max(probes.size(), (size_t)1) / 1000000.0;
+		report += string_printf("lpm prefixes=%u peers=%zu probes=%zu mismatches=%zu build=%.3f lookup_ns=%.1f reference_lookup_ns=%.1f\n",
+			prefixes, config.peers.size(), probes.size(), mismatches, build_time, lookup_time / n, reference_time / n);
+		return !mismatches;
+	}
+
+	static void from_hex(_In_z_ const char* hex, _Out_writes_bytes_(size) BYTE* out, _In_ size_t size) noexcept
+	{
+		auto nibble = [](char c) -> BYTE { return (BYTE)(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10); };
+		for (size_t i = 0; i < size; ++i)
+			out[i] = (BYTE)(nibble(hex[2 * i]) << 4 | nibble(hex[2 * i + 1]));
+	}
+
+	// RFC 7693 Appendix E test sequence
+	static void blake2s_sequence(_Out_writes_bytes_(size) BYTE* out, _In_ size_t size, _In_ DWORD seed) noexcept
+	{
+		DWORD a = 0xdead4bad * seed, b = 1;
+		for (size_t i = 0; i < size; ++i)
+		{
+			DWORD t = a + b;
+			a = b;
+			b = t;
+			out[i] = (BYTE)(t >> 24);
+		}
+	}
+
+	bool check_crypto(_Inout_ string& report)
+	{
+		size_t passed = 0, failed = 0;
+		auto check = [&](_In_z_ const char* name, _In_ bool match)
+		{
+			if (match)
+				++passed;
+			else
+			{
+				++failed;
+				report += string_printf("crypto vector=%s result=mismatch\n", name);
+			}
+		};
+		auto expect = [&](_In_z_ const char* name, _In_reads_bytes_(size) const BYTE* result, _In_z_ const char* hex, _In_ size_t size)
+		{
+			vector<BYTE> expected(size);
+			from_hex(hex, expected.data(), size);
+			check(name, memcmp(result, expected.data(), size) == 0);
+		};
+		BYTE out[blake2s::hash_size], key[32], in[1024];
+
+		// RFC 7693 Appendix A
+		{
+			blake2s h;
+			h.update("abc", 3);
+			h.final(out);
+			expect("blake2s_abc", out, "508c5e8c327c14e2e1a72ba34eeb452f37458b209ed63a294d999b4c86675982", sizeof(out));
+		}
+
+		// RFC 7693 Appendix E: digests of all lengths, keyed and not, over inputs across block boundaries
+		{
+			static const size_t out_lens[] = { 16, 20, 28, 32 }, in_lens[] = { 0, 3, 64, 65, 255, 1024 };
+			blake2s all;
+			for (auto out_len : out_lens)
+				for (auto in_len : in_lens)
+				{
+					blake2s_sequence(in, in_len, (DWORD)in_len);
+					blake2s unkeyed(out_len);
+					unkeyed.update(in, in_len);
+					unkeyed.final(out);
+					all.update(out, out_len);
+					blake2s_sequence(key, out_len, (DWORD)out_len);
+					blake2s keyed(out_len, key, out_len);
+					keyed.update(in, in_len);
+					keyed.final(out);
+					all.update(out, out_len);
+				}
+			all.final(out);
+			expect("blake2s_selftest", out, "6a411f08ce25adcdfb02aba641451cec53c598b24f4fc787fbdc88797f4c1dfe", sizeof(out));
+		}
+
+		// HMAC-BLAKE2s has no published vectors. This one is from Python's hmac and hashlib.blake2s.
+		{
+			static const char message[] = "The quick brown fox jumps over the lazy dog";
+			for (BYTE i = 0; i < 32; ++i)
+				key[i] = i;
+			hmac_blake2s(key, 32, message, sizeof(message) - 1, out);
+			expect("hmac_blake2s", out, "f4660dee21c6a48e2a3d695ceedc26693e37b64b5ac5227476578517ee87fe6d", sizeof(out));
+		}
+
+		// RFC 8439 section 2.8.2
+		{
+			static const char plaintext[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+			BYTE nonce[12], ad[12], sealed[sizeof(plaintext) - 1 + 16];
+			for (BYTE i = 0; i < 32; ++i)
+				key[i] = 0x80 + i;
+			from_hex("070000004041424344454647", nonce, sizeof(nonce));
+			from_hex("50515253c0c1c2c3c4c5c6c7", ad, sizeof(ad));
+			chacha20poly1305_seal_with_nonce(key, nonce, plaintext, sizeof(plaintext) - 1, ad, sizeof(ad), sealed);
+			expect("chacha20poly1305", sealed,
+				"d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d63dbea45e8ca9671282fafb69da92728b"
+				"1a71de0a9e060b2905d6a5b67ecd3b3692ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+				"3ff4def08e4b7a9de576d26586cec64b61161ae10b594f09e26a7e902ecbd0600691", sizeof(sealed));
+
+			// WireGuard nonce is 32 zero bits followed by the little-endian counter.
+			BYTE sealed_counter[sizeof(sealed)];
+			memset(nonce, 0, sizeof(nonce));
+			nonce[4] = 0x2a;
+			chacha20poly1305_seal_with_nonce(key, nonce, plaintext, sizeof(plaintext) - 1, ad, sizeof(ad), sealed);
+			chacha20poly1305_seal(key, 0x2a, plaintext, sizeof(plaintext) - 1, ad, sizeof(ad), sealed_counter);
+			check("chacha20poly1305_counter", memcmp(sealed, sealed_counter, sizeof(sealed)) == 0);
+		}
+
+		// RFC 7748 section 5.2
+		{
+			BYTE scalar[32], point[32];
+			from_hex("a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4", scalar, sizeof(scalar));
+			from_hex("e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c", point, sizeof(point));
+			x25519(out, scalar, point);
+			expect("x25519_1", out, "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552", sizeof(out));
+			from_hex("4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d", scalar, sizeof(scalar));
+			from_hex("e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493", point, sizeof(point));
+			x25519(out, scalar, point);
+			expect("x25519_2", out, "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957", sizeof(out));
+
+			// Iterated: k and u start at 9, then k = X25519(k, u) and u = old k.
+			BYTE k[32] = { 9 }, u[32] = { 9 };
+			for (unsigned int i = 1; i <= 1000; ++i)
+			{
+				x25519(out, k, u);
+				memcpy(u, k, sizeof(u));
+				memcpy(k, out, sizeof(k));
+				if (i == 1)
+					expect("x25519_iterated_1", k, "422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079", sizeof(k));
+			}
+			expect("x25519_iterated_1000", k, "684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51", sizeof(k));
+		}
+
+		// RFC 7748 section 6.1
+		{
+			BYTE alice[32], bob[32], alice_public[32], bob_public[32], shared[32];
+			from_hex("77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a", alice, sizeof(alice));
+			from_hex("5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb", bob, sizeof(bob));
+			x25519_base(alice_public, alice);
+			expect("x25519_base_alice", alice_public, "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a", sizeof(alice_public));
+			x25519_base(bob_public, bob);
+			expect("x25519_base_bob", bob_public, "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f", sizeof(bob_public));
+			x25519(shared, alice, bob_public);
+			expect("x25519_shared_alice", shared, "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742", sizeof(shared));
+			x25519(shared, bob, alice_public);
+			expect("x25519_shared_bob", shared, "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742", sizeof(shared));
+			BYTE scalars[64], batch[64];
+			memcpy(scalars, alice, 32);
+			memcpy(scalars + 32, bob, 32);
+			x25519_base_batch(2, batch, scalars);
+			expect("x25519_base_batch", batch, "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a"
+				"de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f", sizeof(batch));
+		}
+
+		report += string_printf("crypto vectors=%zu failed=%zu\n", passed + failed, failed);
+		return !failed;
+	}
+
+	static const char noise_construction[] = "Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s";
+	static const char wg_identifier[] = "WireGuard v1 zx2c4 Jason@zx2c4.com";
+	static const char wg_label_mac1[] = "mac1----";
+
+	static void hash(
+		_Out_writes_bytes_(blake2s::hash_size) BYTE* out,
+		_In_reads_bytes_(a_len) const void* a, _In_ size_t a_len,
+		_In_reads_bytes_opt_(b_len) const void* b = NULL, _In_ size_t b_len = 0) noexcept
+	{
+		blake2s h;
+		h.update(a, a_len);
+		if (b_len)
+			h.update(b, b_len);
+		h.final(out);
+	}
+
+	// HKDF with HMAC-BLAKE2s. out1 may alias key.
+	static void kdf(
+		_In_reads_bytes_(blake2s::hash_size) const BYTE* key,
+		_In_reads_bytes_(input_len) const void* input, _In_ size_t input_len,
+		_Out_writes_bytes_(blake2s::hash_size) BYTE* out1,
+		_Out_writes_bytes_opt_(blake2s::hash_size) BYTE* out2 = NULL,
+		_Out_writes_bytes_opt_(blake2s::hash_size) BYTE* out3 = NULL) noexcept
+	{
+		BYTE t0[blake2s::hash_size], t[blake2s::hash_size + 1];
+		hmac_blake2s(key, blake2s::hash_size, input, input_len, t0);
+		t[0] = 1;
+		hmac_blake2s(t0, sizeof(t0), t, 1, out1);
+		BYTE* outs[] = { out1, out2, out3 };
+		for (BYTE i = 1; i < _countof(outs) && outs[i]; ++i)
+		{
+			memcpy(t, outs[i - 1], blake2s::hash_size);
+			t[blake2s::hash_size] = i + 1;
+			hmac_blake2s(t0, sizeof(t0), t, sizeof(t), outs[i]);
+		}
+		SecureZeroMemory(t0, sizeof(t0));
+		SecureZeroMemory(t, sizeof(t));
+	}
+
+	// Decrypts message sealed with counter 0. Sealing the ciphertext removes the key stream again; sealing the plaintext so recovered
+	// must then reproduce the message, tag included.
+	static bool open(
+		_In_reads_bytes_(32) const BYTE* key,
+		_In_reads_bytes_(size + 16) const BYTE* sealed, _In_ size_t size,
+		_In_reads_bytes_(ad_len) const void* ad, _In_ size_t ad_len,
+		_Out_writes_bytes_(size) BYTE* out)
+	{
+		vector<BYTE, sanitizing_allocator<BYTE>> buf(size + 16);
+		chacha20poly1305_seal(key, 0, sealed, size, ad, ad_len, buf.data());
+		memcpy(out, buf.data(), size);
+		chacha20poly1305_seal(key, 0, out, size, ad, ad_len, buf.data());
+		return memcmp(buf.data(), sealed, size + 16) == 0;
+	}
+
+	static inline void store32(_Out_writes_bytes_(4) BYTE* p, _In_ DWORD x) noexcept
+	{
+		p[0] = (BYTE)x;
+		p[1] = (BYTE)(x >> 8);
+		p[2] = (BYTE)(x >> 16);
+		p[3] = (BYTE)(x >> 24);
+	}
+
+	struct loopback_responder
+	{
+		SOCKET s;
+		BYTE private_key[WIREGUARD_KEY_LENGTH];
+		BYTE public_key[WIREGUARD_KEY_LENGTH];
+		BYTE peer_public_key[WIREGUARD_KEY_LENGTH]; // The one initiator accepted
+		BYTE last_timestamp[12];                    // Latest TAI64N accepted; initiations must be later
+		size_t accepted;
+		size_t rejected;                            // Malformed, bad MAC, or unknown initiator
+		size_t replays;
+	};
+
+	// Consumes handshake initiations as a WireGuard peer does and answers each valid one with handshake response. Stops on an empty
+	// datagram.
+	static DWORD WINAPI loopback_respond(_In_ LPVOID lpThreadParameter)
+	{
+		auto r = reinterpret_cast<loopback_responder*>(lpThreadParameter);
+		for (;;)
+		{
+			BYTE msg[handshake_initiation_size];
+			SOCKADDR_INET from = {};
+			int from_len = sizeof(from);
+			int len = recvfrom(r->s, reinterpret_cast<char*>(msg), sizeof(msg), 0, reinterpret_cast<SOCKADDR*>(&from), &from_len);
+			if (len < 0 && WSAGetLastError() == WSAECONNRESET)
+				continue; // ICMP unreachable of an earlier response
+			if (len <= 0)
+				return 0;
+			if (len != sizeof(msg) || msg[0] != 1)
+			{
+				++r->rejected;
+				continue;
+			}
+
+			BYTE c[blake2s::hash_size], h[blake2s::hash_size], k[blake2s::hash_size], dh[WIREGUARD_KEY_LENGTH];
+			BYTE initiator_static[WIREGUARD_KEY_LENGTH], timestamp[12], mac[16];
+			hash(k, wg_label_mac1, sizeof(wg_label_mac1) - 1, r->public_key, WIREGUARD_KEY_LENGTH);
+			blake2s mac1(16, k, sizeof(k));
+			mac1.update(msg, 116);
+			mac1.final(mac);
+			if (memcmp(mac, msg + 116, sizeof(mac)) != 0)
+			{
+				++r->rejected;
+				continue;
+			}
+			hash(c, noise_construction, sizeof(noise_construction) - 1);
+			hash(h, c, sizeof(c), wg_identifier, sizeof(wg_identifier) - 1);
+			hash(h, h, sizeof(h), r->public_key, WIREGUARD_KEY_LENGTH);
+			kdf(c, msg + 8, WIREGUARD_KEY_LENGTH, c);
+			hash(h, h, sizeof(h), msg + 8, WIREGUARD_KEY_LENGTH);
+			x25519(dh, r->private_key, msg + 8);
+			kdf(c, dh, sizeof(dh), c, k);
+			if (!open(k, msg + 40, WIREGUARD_KEY_LENGTH, h, sizeof(h), initiator_static) ||
+				memcmp(initiator_static, r->peer_public_key, WIREGUARD_KEY_LENGTH) != 0)
+			{
+				++r->rejected;
+				continue;
+			}
+			hash(h, h, sizeof(h), msg + 40, WIREGUARD_KEY_LENGTH + 16);
+			x25519(dh, r->private_key, initiator_static);
+			kdf(c, dh, sizeof(dh), c, k);
+			if (!open(k, msg + 88, sizeof(timestamp), h, sizeof(h), timestamp))
+			{
+				++r->rejected;
+				continue;
+			}
+			hash(h, h, sizeof(h), msg + 88, sizeof(timestamp) + 16);
+			if (memcmp(timestamp, r->last_timestamp, sizeof(timestamp)) <= 0)
+			{
+				++r->replays;
+				continue;
+			}
+			memcpy(r->last_timestamp, timestamp, sizeof(timestamp));
+			++r->accepted;
+
+			// Ephemeral key needs no secrecy here. Hash of the initiation makes it differ per response.
+			BYTE response[92] = { 2 }, ephemeral_private[WIREGUARD_KEY_LENGTH], psk[WIREGUARD_KEY_LENGTH] = {}, t[blake2s::hash_size];
+			hash(ephemeral_private, msg, sizeof(msg));
+			store32(response + 4, (DWORD)r->accepted);
+			memcpy(response + 8, msg + 4, 4);
+			x25519_base(response + 12, ephemeral_private);
+			kdf(c, response + 12, WIREGUARD_KEY_LENGTH, c);
+			hash(h, h, sizeof(h), response + 12, WIREGUARD_KEY_LENGTH);
+			x25519(dh, ephemeral_private, msg + 8);
+			kdf(c, dh, sizeof(dh), c);
+			x25519(dh, ephemeral_private, initiator_static);
+			kdf(c, dh, sizeof(dh), c);
+			kdf(c, psk, sizeof(psk), c, t, k);
+			hash(h, h, sizeof(h), t, sizeof(t));
+			chacha20poly1305_seal(k, 0, NULL, 0, h, sizeof(h), response + 44);
+			hash(k, wg_label_mac1, sizeof(wg_label_mac1) - 1, initiator_static, WIREGUARD_KEY_LENGTH);
+			blake2s response_mac1(16, k, sizeof(k));
+			response_mac1.update(response, 60);
+			response_mac1.final(response + 60);
+			sendto(r->s, reinterpret_cast<const char*>(response), sizeof(response), 0, reinterpret_cast<const SOCKADDR*>(&from), from_len);
+		}
+	}
+
+	bool check_handshake(_Inout_ string& report)
+	{
+		mt19937 rng(handshake_initiation_size);
+		BYTE private_key[WIREGUARD_KEY_LENGTH], public_key[WIREGUARD_KEY_LENGTH];
+		random_bytes(rng, private_key, sizeof(private_key));
+		x25519_base(public_key, private_key);
+		loopback_responder r = {};
+		random_bytes(rng, r.private_key, sizeof(r.private_key));
+		x25519_base(r.public_key, r.private_key);
+		memcpy(r.peer_public_key, public_key, sizeof(r.peer_public_key));
+
+		// The first candidate is the port of a socket closed right after binding. Nobody answers there.
+		vector<SOCKADDR_INET> candidates(2);
+		for (size_t i = 0; i < candidates.size(); ++i)
+		{
+			auto& candidate = candidates[i];
+			candidate.Ipv4.sin_family = AF_INET;
+			candidate.Ipv4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+			if (s == INVALID_SOCKET)
+				throw win_runtime_error(WSAGetLastError(), "Failed to open UDP socket");
+			int name_len = sizeof(candidate.Ipv4);
+			if (bind(s, reinterpret_cast<const SOCKADDR*>(&candidate.Ipv4), sizeof(candidate.Ipv4)) == SOCKET_ERROR ||
+				getsockname(s, reinterpret_cast<SOCKADDR*>(&candidate.Ipv4), &name_len) == SOCKET_ERROR)
+			{
+				int error = WSAGetLastError();
+				closesocket(s);
+				throw win_runtime_error(error, "Failed to bind UDP socket");
+			}
+			if (i)
+				r.s = s;
+			else
+				closesocket(s);
+		}
+		thread responder(CreateThread(NULL, 0, loopback_respond, &r, 0, NULL));
+		if (!responder)
+		{
+			closesocket(r.s);
+			throw win_runtime_error("CreateThread failed");
+		}
+		auto stop = [&]()
+		{
+			sendto(r.s, "", 0, 0, reinterpret_cast<const SOCKADDR*>(&candidates[1].Ipv4), sizeof(candidates[1].Ipv4));
+			WaitForSingleObject(responder, INFINITE);
+			closesocket(r.s);
+		};
+
+		// Two races back to back, as when the tunnel is activated again within a second
+		size_t winner[2];
+		vector<double> rtt[2];
+		try
+		{
+			for (size_t i = 0; i < _countof(winner); ++i)
+				winner[i] = race_endpoints(private_key, public_key, r.public_key, candidates, 50, 1000, rtt[i]);
+		}
+		catch (...)
+		{
+			stop();
+			throw;
+		}
+		stop();
+
+		bool success = winner[0] == 1 && winner[1] == 1 && r.accepted == 2 && !r.rejected && !r.replays;
+		report += string_printf("handshake races=2 accepted=%zu rejected=%zu replays=%zu rtt=%.3f,%.3f result=%s\n",
+			r.accepted, r.rejected, r.replays, winner[0] == 1 ? rtt[0][1] : -1.0, winner[1] == 1 ? rtt[1][1] : -1.0, success ? "pass" : "fail");
+		return success;
+	}
+}
@@ -0,0 +1,37 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+#include <string>
+
+namespace wg
+{
+	// Checks of configuration transforms on random input of production size. Each appends a line of results and timings in
+	// milliseconds to report and returns true when the transform was exact.
+
+	// Encodes random driver configuration of peers, with allowed IPs spread evenly among them, to compact encoding and back. Passes
+	// when the result equals the input.
+	bool check_compact_config(_In_ unsigned int peers, _In_ unsigned int allowed_ips, _Inout_ std::string& report);
+
+	// Aggregates random allowed IPs of peers, mostly neighbours of the same peer, many nested in those of other peers. Passes when
+	// every address at and around each prefix still routes to the same peer, as found by plain longest-prefix match.
+	bool check_aggregation(_In_ unsigned int prefixes, _Inout_ std::string& report);
+
+	// Builds lookup table of the same allowed IPs as check_aggregation() does before aggregating them. Passes when every address at and
+	// around each prefix routes to the peer plain longest-prefix match finds. Reports nanoseconds per lookup of both.
+	bool check_lpm(_In_ unsigned int prefixes, _Inout_ std::string& report);
+
+	// Checks BLAKE2s (RFC 7693), HMAC-BLAKE2s, ChaCha20-Poly1305 (RFC 8439) and X25519 (RFC 7748) against published test vectors.
+	bool check_crypto(_Inout_ std::string& report);
+
+	// Races endpoint probes twice in a row against a loopback responder that consumes handshake initiations as a WireGuard peer does.
+	// Passes when the responder accepts both initiations and the race picks its answers over a silent candidate. Winsock must be
+	// started.
+	bool check_handshake(_Inout_ std::string& report);
+}
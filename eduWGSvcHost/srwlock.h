@@ -0,0 +1,62 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+
+namespace wg
+{
+	class srwlock
+	{
+	private:
+		SRWLOCK m_lock;
+
+	public:
+		srwlock() noexcept
+		{
+			InitializeSRWLock(&m_lock);
+		}
+
+		srwlock(const srwlock&) = delete;
+		srwlock& operator=(const srwlock&) = delete;
+
+		class exclusive
+		{
+		private:
+			srwlock& m_owner;
+
+		public:
+			exclusive(_Inout_ srwlock& owner) noexcept : m_owner(owner)
+			{
+				AcquireSRWLockExclusive(&m_owner.m_lock);
+			}
+
+			virtual ~exclusive()
+			{
+				ReleaseSRWLockExclusive(&m_owner.m_lock);
+			}
+		};
+
+		class shared
+		{
+		private:
+			srwlock& m_owner;
+
+		public:
+			shared(_Inout_ srwlock& owner) noexcept : m_owner(owner)
+			{
+				AcquireSRWLockShared(&m_owner.m_lock);
+			}
+
+			virtual ~shared()
+			{
+				ReleaseSRWLockShared(&m_owner.m_lock);
+			}
+		};
+	};
+}
@@ -0,0 +1,141 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+#include <WinStd/Win.h>
+
+namespace wg
+{
+	// Per-peer traffic history in a memory-mapped ring file shared by all tunnel processes
+	//
+	// Samples are fixed size and stored in columns. Range queries scan the time column only and touch other columns for matching samples.
+	class stats_ring
+	{
+	private:
+		typedef std::unique_ptr<unsigned char[], winstd::UnmapViewOfFile_delete> file_mapping_view;
+
+		static const unsigned int max_samples = 0x10000;
+		static const int offset_magic = 0;
+		static const int offset_next_index = 4;
+		static const int offset_time = 8;
+		static const int offset_tunnel = offset_time + max_samples * 8;
+		static const int offset_peer = offset_tunnel + max_samples * 8;
+		static const int offset_rx_bytes = offset_peer + max_samples * 8;
+		static const int offset_tx_bytes = offset_rx_bytes + max_samples * 8;
+		static const int offset_handshake_age = offset_tx_bytes + max_samples * 8;
+		static const int bytes = offset_handshake_age + max_samples * 4;
+
+		static unsigned int expected_magic() noexcept
+		{
+			return 0x5eedbabf;
+		}
+
+		template <class T>
+		T* column(_In_ int offset) const noexcept
+		{
+			return reinterpret_cast<T*>(&m_view[offset]);
+		}
+
+		winstd::file m_file;
+		winstd::file_mapping m_mmap;
+		file_mapping_view m_view;
+
+	public:
+		static const DWORD no_handshake = (DWORD)-1;
+
+		struct point
+		{
+			ULONGLONG tunnel;        // First 8 bytes of interface public key
+			ULONGLONG peer;          // First 8 bytes of peer public key
+			ULONGLONG time;          // Last sample in the step in 100ns intervals since 1601-01-01 UTC
+			ULONGLONG rx_bytes;
+			ULONGLONG tx_bytes;
+			DWORD handshake_age;     // Largest age in the step in seconds; no_handshake when none
+		};
+
+		stats_ring(_In_z_ LPCTSTR filename)
+		{
+			m_file = CreateFile(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (!m_file)
+				throw winstd::win_runtime_error("Failed to open stats ring file");
+			if (SetFilePointer(m_file, bytes, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+				throw winstd::win_runtime_error("Failed to seek in stats ring file");
+			if (!SetEndOfFile(m_file))
+				throw winstd::win_runtime_error("Failed to set EOF in stats ring file");
+			m_mmap = CreateFileMapping(m_file, NULL, PAGE_READWRITE, 0, 0, NULL);
+			if (!m_mmap)
+				throw winstd::win_runtime_error("Failed to create stats ring file mapping");
+			m_view.reset((unsigned char*)MapViewOfFile(m_mmap, FILE_MAP_ALL_ACCESS, 0, 0, bytes));
+			if (!m_view)
+				throw winstd::win_runtime_error("Failed to map view of stats ring file mapping");
+			if (*column<unsigned int>(offset_magic) != expected_magic())
+			{
+				memset(&m_view[0], 0, bytes);
+				*column<unsigned int>(offset_magic) = expected_magic();
+			}
+		}
+
+		// Appends a sample of a peer of the tunnel with the interface public key. time is in 100ns intervals since 1601-01-01 UTC.
+		void write(_In_ ULONGLONG time, _In_reads_bytes_(8) const BYTE* tunnel, _In_reads_bytes_(8) const BYTE* peer, _In_ ULONGLONG rx_bytes, _In_ ULONGLONG tx_bytes, _In_ DWORD handshake_age) noexcept
+		{
+			unsigned int i = ((unsigned int)InterlockedIncrement(column<LONG volatile>(offset_next_index)) - 1) % max_samples;
+			auto t = column<LONGLONG volatile>(offset_time);
+			InterlockedExchange64(&t[i], 0);
+			memcpy(&column<ULONGLONG>(offset_tunnel)[i], tunnel, sizeof(ULONGLONG));
+			memcpy(&column<ULONGLONG>(offset_peer)[i], peer, sizeof(ULONGLONG));
+			column<ULONGLONG>(offset_rx_bytes)[i] = rx_bytes;
+			column<ULONGLONG>(offset_tx_bytes)[i] = tx_bytes;
+			column<DWORD>(offset_handshake_age)[i] = handshake_age;
+			InterlockedExchange64(&t[i], (LONGLONG)time); // Readers skip samples until time is set.
+		}
+
+		// Returns samples from [from, to) downsampled to one point per tunnel, peer and step, ordered by tunnel, peer and time.
+		void query(_In_ ULONGLONG from, _In_ ULONGLONG to, _In_ ULONGLONG step, _Inout_ std::vector<point>& points) const
+		{
+			if (!step)
+				throw std::invalid_argument("Step must not be zero");
+			std::map<std::tuple<ULONGLONG, ULONGLONG, ULONGLONG>, point> steps;
+			auto t = column<const volatile ULONGLONG>(offset_time);
+			for (unsigned int i = 0; i < max_samples; ++i)
+			{
+				ULONGLONG time = t[i];
+				if (!time || time < from || time >= to)
+					continue;
+				point s;
+				s.tunnel = column<const volatile ULONGLONG>(offset_tunnel)[i];
+				s.peer = column<const volatile ULONGLONG>(offset_peer)[i];
+				s.rx_bytes = column<const volatile ULONGLONG>(offset_rx_bytes)[i];
+				s.tx_bytes = column<const volatile ULONGLONG>(offset_tx_bytes)[i];
+				s.handshake_age = column<const volatile DWORD>(offset_handshake_age)[i];
+				MemoryBarrier();
+				if (t[i] != time)
+					continue; // A writer took the slot while it was being copied.
+				auto& p = steps[std::make_tuple(s.tunnel, s.peer, (time - from) / step)];
+				if (!p.time || s.handshake_age > p.handshake_age)
+					p.handshake_age = s.handshake_age;
+				if (time > p.time)
+				{
+					p.tunnel = s.tunnel;
+					p.peer = s.peer;
+					p.time = time;
+					p.rx_bytes = s.rx_bytes;
+					p.tx_bytes = s.tx_bytes;
+				}
+			}
+			points.reserve(points.size() + steps.size());
+			for (auto& s : steps)
+				points.push_back(s.second);
+		}
+	};
+}
@@ -0,0 +1,49 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "netevents.h"
+#include <Windows.h>
+#include <stdexcept>
+#include <string>
+#include <WinStd/Win.h>
+
+// Process state of eduWGSvcHost.exe main.cpp shares with the command line tools
+
+// Manager and tunnel options from HKLM\SYSTEM\CurrentControlSet\Services\eduWGManager$<client>\Parameters
+struct manager_options {
+	bool aggregate_allowed_ips = true;
+	DWORD watchdog_interval = 5000;  // Milliseconds between handshake watchdog samples; 0 disables the watchdog
+	DWORD handshake_timeout = 135;   // Seconds; REKEY_AFTER_TIME + REKEY_TIMEOUT + margin
+	DWORD history_interval = 60000;  // Milliseconds between peer history samples; 0 disables peer history
+	DWORD endpoint_race_timeout = 1000; // Milliseconds to await endpoint probe responses after the last attempt; 0 disables endpoint racing
+	DWORD reattach_grace = 0;        // Milliseconds a restarted manager keeps running tunnels for their clients to claim; 0 disables re-attaching
+	bool refresh_paths = true;       // Re-resolve endpoints and re-handshake all tunnels on resume and network change
+	bool record_requests = false;    // Record pipe requests to "requests.trace" in the config folder for replay
+	std::wstring probe_address;      // In-tunnel IPv4 or IPv6 address to probe for RTT and loss; empty disables probing; tunnels not routing it skip probing
+	DWORD probe_interval = 1000;     // Milliseconds between probes on a healthy path
+	bool tunnel_engine = false;      // Run tunnels on manager threads with wireguard.dll instead of one tunnel service each
+};
+
+extern manager_options options;
+extern WCHAR config_folder_path[MAX_PATH];
+extern LPCWSTR client_id;
+extern winstd::event quit;
+extern wg::network_events path_events;
+
+// Reads options of the client from registry.
+void load_options();
+
+// Reports exception to Event Log.
+void log(_In_ const std::exception& e);
+
+// Returns current time as FILETIME ticks.
+ULONGLONG system_time() noexcept;
+
+// Serves manager pipe until quit is set.
+void manager_run(_In_z_ const wchar_t* pipe_name);
@@ -0,0 +1,603 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#define _WINSOCKAPI_ // Prevent inclusion of winsock.h in windows.h.
+#include "tools.h"
+#include "crypto.h"
+#include "driver.h"
+#include "fake.h"
+#include "ifaceview.h"
+#include "keys.h"
+#include "phasetrace.h"
+#include "probe.h"
+#include "protocol.h"
+#include "reqtrace.h"
+#include "selftest.h"
+#include "statsring.h"
+#include "svchost.h"
+#include <bcrypt.h>
+#include <Shlwapi.h>
+#include <WinStd/Win.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+using namespace std;
+using namespace winstd;
+using namespace wg;
+
+void print_report(_In_ const string& report)
+{
+	HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+	file console;
+	if ((!out || out == INVALID_HANDLE_VALUE) && AttachConsole(ATTACH_PARENT_PROCESS))
+	{
+		console = CreateFileW(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+		out = console;
+	}
+	DWORD written;
+	if (out && out != INVALID_HANDLE_VALUE)
+		WriteFile(out, report.data(), (DWORD)report.size(), &written, NULL);
+}
+
+struct benchmark_client_context {
+	const wchar_t* pipe_name;
+	unsigned int index;
+	unsigned int rounds;
+	unsigned int peers;
+	size_t config_bytes;       // Size of driver configuration last received
+	vector<double> samples[8]; // activate_cold, activate_warm, handshake, get_tunnel_config, resume, update, reactivate, deactivate
+	exception_ptr error;
+};
+
+// The first activation of a tunnel name registers its service; later ones reuse the registration.
+static const char* const benchmark_operations[] = { "activate_cold", "activate_warm", "handshake", "get_tunnel_config", "resume", "update", "reactivate", "deactivate" };
+
+// Sends request and reads response message. Status failures are thrown.
+static void benchmark_request(_In_ HANDLE pipe, _In_ const vector<unsigned char>& request, _Inout_ vector<unsigned char, sanitizing_allocator<unsigned char>>& response)
+{
+	DWORD bytes;
+	if (!WriteFile(pipe, request.data(), (DWORD)request.size(), &bytes, NULL))
+		throw win_runtime_error("Failed to write to pipe");
+	response.resize(PIPE_MSG_BUFFER);
+	size_t size = 0;
+	for (;;)
+	{
+		if (ReadFile(pipe, response.data() + size, (DWORD)(response.size() - size), &bytes, NULL))
+		{
+			size += bytes;
+			break;
+		}
+		if (GetLastError() != ERROR_MORE_DATA)
+			throw win_runtime_error("Failed to read from pipe");
+		size += bytes;
+		response.resize(response.size() * 2);
+	}
+	response.resize(size);
+	if (size < sizeof(message))
+		throw runtime_error("Invalid response");
+	auto status = reinterpret_cast<const message_status*>(response.data());
+	if (status->code == message_code::status && size >= sizeof(message_status) && !status->success)
+		throw runtime_error(string(status->message, min<size_t>(status->message_len, size - sizeof(message_status))));
+}
+
+// Connects to manager pipe in message mode. Retries while the manager is starting.
+static file benchmark_connect(_In_z_ const wchar_t* pipe_name)
+{
+	file pipe;
+	for (int i = 0; ; ++i)
+	{
+		pipe = CreateFileW(pipe_name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+		if (!!pipe)
+			break;
+		if (i >= 100 || (GetLastError() != ERROR_PIPE_BUSY && GetLastError() != ERROR_FILE_NOT_FOUND))
+			throw win_runtime_error("Failed to connect to manager");
+		Sleep(10);
+	}
+	DWORD mode = PIPE_READMODE_MESSAGE;
+	if (!SetNamedPipeHandleState(pipe, &mode, NULL, NULL))
+		throw win_runtime_error("SetNamedPipeHandleState failed");
+	return pipe;
+}
+
+// Activates a tunnel, waits for its handshake, simulates resume from sleep and waits for the next handshake, moves the peer to
+// another endpoint in place and by reactivation waiting for the handshake after each, then deactivates the tunnel, rounds times.
+static DWORD WINAPI benchmark_client(_In_ LPVOID lpThreadParameter)
+{
+	auto ctx = reinterpret_cast<benchmark_client_context*>(lpThreadParameter);
+	try
+	{
+		file pipe(benchmark_connect(ctx->pipe_name));
+		vector<unsigned char, sanitizing_allocator<unsigned char>> response;
+		{
+			vector<unsigned char> negotiate(sizeof(message_negotiate), 0);
+			auto msg_negotiate = reinterpret_cast<message_negotiate*>(negotiate.data());
+			msg_negotiate->code = message_code::negotiate;
+			msg_negotiate->capabilities = CAPABILITY_SHARED_MEMORY;
+			benchmark_request(pipe, negotiate, response);
+		}
+
+		BYTE key[WIREGUARD_KEY_LENGTH];
+		char private_key[64], public_key[64];
+		DWORD key_len;
+		memset(key, 0x40 + (ctx->index & 0x3f), sizeof(key));
+		key_len = _countof(private_key);
+		CryptBinaryToStringA(key, sizeof(key), CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, private_key, &key_len);
+		memset(key, 0x80 + (ctx->index & 0x3f), sizeof(key));
+		key[31] &= 0x7f; // Public keys must be canonical.
+		key_len = _countof(public_key);
+		CryptBinaryToStringA(key, sizeof(key), CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, public_key, &key_len);
+		string config = string_printf(
+			"[Interface]\nPrivateKey = %s\nAddress = 10.%u.%u.2/32\n"
+			"[Peer]\nPublicKey = %s\nAllowedIPs = 10.%u.%u.0/24\nEndpoint = 192.0.2.1:51820\nPersistentKeepalive = 25\n",
+			private_key, (ctx->index >> 8) & 0xff, ctx->index & 0xff,
+			public_key, (ctx->index >> 8) & 0xff, ctx->index & 0xff);
+		for (unsigned int i = 1; i < ctx->peers; ++i)
+		{
+			// Additional peers inflate the configuration.
+			memset(key, 0xc0 + (ctx->index & 0x3f), sizeof(key));
+			memcpy(key, &i, sizeof(i));
+			key[31] &= 0x7f;
+			key_len = _countof(public_key);
+			CryptBinaryToStringA(key, sizeof(key), CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, public_key, &key_len);
+			config += string_printf("[Peer]\nPublicKey = %s\nAllowedIPs = 172.%u.%u.%u/32\n", public_key, 16 + ((i >> 16) & 0xf), (i >> 8) & 0xff, i & 0xff);
+		}
+		string tunnel_name = string_printf("Benchmark%u", ctx->index);
+
+		vector<unsigned char> activate(sizeof(message_activate_tunnel) + config.size(), 0);
+		auto msg_activate = reinterpret_cast<message_activate_tunnel*>(activate.data());
+		msg_activate->code = message_code::activate_tunnel;
+		strncpy_s(msg_activate->tunnel_name, tunnel_name.c_str(), _TRUNCATE);
+		msg_activate->config_len = (unsigned int)config.size();
+		memcpy(msg_activate->config, config.data(), config.size());
+
+		// Same configuration with the peer moved to another endpoint
+		string updated_config(config);
+		updated_config.replace(updated_config.find("192.0.2.1:"), 9, "192.0.2.2");
+		vector<unsigned char> update(sizeof(message_activate_tunnel) + updated_config.size(), 0);
+		auto msg_update = reinterpret_cast<message_activate_tunnel*>(update.data());
+		msg_update->code = message_code::update_tunnel;
+		strncpy_s(msg_update->tunnel_name, tunnel_name.c_str(), _TRUNCATE);
+		msg_update->config_len = (unsigned int)updated_config.size();
+		memcpy(msg_update->config, updated_config.data(), updated_config.size());
+
+		vector<unsigned char> tunnel(sizeof(message_tunnel), 0);
+		auto msg_tunnel = reinterpret_cast<message_tunnel*>(tunnel.data());
+		strncpy_s(msg_tunnel->tunnel_name, tunnel_name.c_str(), _TRUNCATE);
+
+		for (unsigned int r = 0; r < ctx->rounds; ++r)
+		{
+			phase_trace trace;
+			benchmark_request(pipe, activate, response);
+			ctx->samples[r ? 1 : 0].push_back(trace.elapsed());
+
+			// Returns the last handshake of the first peer.
+			auto last_handshake = [&]() -> ULONGLONG
+			{
+				msg_tunnel->code = message_code::get_tunnel_config;
+				phase_trace query;
+				benchmark_request(pipe, tunnel, response);
+				ctx->samples[3].push_back(query.elapsed());
+				ULONGLONG last;
+				auto msg_cfg = reinterpret_cast<const message_config*>(response.data());
+				if (msg_cfg->code == message_code::tunnel_config_section && response.size() >= sizeof(message_config_section))
+				{
+					auto msg_section = reinterpret_cast<const message_config_section*>(response.data());
+					file_mapping section((HANDLE)(ULONG_PTR)msg_section->section);
+					auto data = MapViewOfFile(section, FILE_MAP_READ, 0, 0, msg_section->config_len);
+					if (!data)
+						throw win_runtime_error("MapViewOfFile failed");
+					interface_view view(data, msg_section->config_len);
+					last = view.size() ? (*view.begin())->LastHandshake : 0;
+					ctx->config_bytes = msg_section->config_len;
+					UnmapViewOfFile(data);
+				}
+				else if (msg_cfg->code == message_code::tunnel_config && response.size() >= sizeof(message_config) + msg_cfg->config_len)
+				{
+					interface_view view(msg_cfg->config, msg_cfg->config_len);
+					last = view.size() ? (*view.begin())->LastHandshake : 0;
+					ctx->config_bytes = msg_cfg->config_len;
+				}
+				else
+					throw runtime_error("Invalid response");
+				return last;
+			};
+
+			while (!last_handshake())
+				if (trace.elapsed() > 10000.0)
+					throw runtime_error("Handshake timeout");
+			ctx->samples[2].push_back(trace.elapsed());
+
+			if (options.refresh_paths)
+			{
+				phase_trace resume;
+				auto since = system_time();
+				path_events.post(network_event::resume);
+				while (last_handshake() <= since)
+					if (resume.elapsed() > 10000.0)
+						throw runtime_error("Handshake timeout after resume");
+				ctx->samples[4].push_back(resume.elapsed());
+			}
+
+			// Reconnect time after an endpoint change: applied in place, then by restarting the tunnel as before update_tunnel.
+			{
+				phase_trace reconnect;
+				auto since = system_time();
+				benchmark_request(pipe, update, response);
+				while (last_handshake() <= since)
+					if (reconnect.elapsed() > 10000.0)
+						throw runtime_error("Handshake timeout after update");
+				ctx->samples[5].push_back(reconnect.elapsed());
+			}
+			{
+				phase_trace reconnect;
+				auto since = system_time();
+				benchmark_request(pipe, activate, response);
+				while (last_handshake() <= since)
+					if (reconnect.elapsed() > 10000.0)
+						throw runtime_error("Handshake timeout after reactivation");
+				ctx->samples[6].push_back(reconnect.elapsed());
+			}
+
+			msg_tunnel->code = message_code::deactivate_tunnel;
+			phase_trace deactivate;
+			benchmark_request(pipe, tunnel, response);
+			ctx->samples[7].push_back(deactivate.elapsed());
+		}
+	}
+	catch (...)
+	{
+		ctx->error = current_exception();
+	}
+	return 0;
+}
+
+static DWORD WINAPI benchmark_manager(_In_ LPVOID lpThreadParameter)
+{
+	try { manager_run(reinterpret_cast<const wchar_t*>(lpThreadParameter)); }
+	catch (const exception& e)
+	{
+		log(e);
+		return 1;
+	}
+	return 0;
+}
+
+int benchmark(_In_ unsigned int client_count, _In_ unsigned int rounds, _In_ unsigned int peers)
+{
+	fake_backend::install(50, 100);
+	load_options();
+	wstring pipe_name = wstring_printf(L"\\\\.\\pipe\\eduWGManager$%s$Benchmark%u", client_id, GetCurrentProcessId());
+	thread manager_thread(CreateThread(NULL, 0, benchmark_manager, const_cast<wchar_t*>(pipe_name.c_str()), 0, NULL));
+	if (!manager_thread)
+		throw win_runtime_error("CreateThread failed");
+
+	phase_trace trace;
+	vector<benchmark_client_context> clients(client_count);
+	vector<thread> client_threads;
+	client_threads.reserve(client_count);
+	for (unsigned int i = 0; i < client_count; ++i)
+	{
+		clients[i].pipe_name = pipe_name.c_str();
+		clients[i].index = i;
+		clients[i].rounds = rounds;
+		clients[i].peers = peers;
+		clients[i].config_bytes = 0;
+		client_threads.emplace_back(CreateThread(NULL, 0, benchmark_client, &clients[i], 0, NULL));
+		if (!client_threads.back())
+			throw win_runtime_error("CreateThread failed");
+	}
+	for (auto& t : client_threads)
+		WaitForSingleObject(t, INFINITE);
+	double elapsed = trace.elapsed();
+
+	string report = string_printf("tunnels=%s clients=%u rounds=%u peers=%u config_bytes=%zu elapsed=%.3f\n",
+		options.tunnel_engine ? "engine" : "service", client_count, rounds, peers, clients.empty() ? 0 : clients[0].config_bytes, elapsed);
+	for (size_t op = 0; op < _countof(benchmark_operations); ++op)
+	{
+		vector<double> samples;
+		for (auto& c : clients)
+			samples.insert(samples.end(), c.samples[op].cbegin(), c.samples[op].cend());
+		if (samples.empty())
+			continue;
+		sort(samples.begin(), samples.end());
+		report += string_printf("%s count=%zu p50=%.3f p99=%.3f max=%.3f\n",
+			benchmark_operations[op], samples.size(),
+			samples[samples.size() / 2], samples[samples.size() * 99 / 100], samples.back());
+	}
+	int ret = 0;
+	for (auto& c : clients)
+	{
+		if (!c.error)
+			continue;
+		try { rethrow_exception(c.error); }
+		catch (const exception& e) { report += string_printf("client=%u error=%s\n", c.index, e.what()); }
+		ret = 1;
+	}
+	SetEvent(quit);
+	WaitForSingleObject(manager_thread, INFINITE);
+
+	print_report(report);
+	return ret;
+}
+
+struct replay_connection_context {
+	const wchar_t* pipe_name;
+	const vector<request_trace::record>* records;
+	vector<size_t> requests;                             // Indices of records of this connection in time order
+	double speed;                                        // Trace time divided by speed gives replay time; 0 replays without delays
+	const phase_trace* clock;                            // Replay start
+	vector<pair<message_code, double>> samples;          // Latency in milliseconds
+	size_t errors;                                       // Requests the manager failed
+	size_t skipped;                                      // Requests not replayed
+	exception_ptr error;
+};
+
+// Sends requests of one recorded connection at their recorded times.
+static DWORD WINAPI replay_connection(_In_ LPVOID lpThreadParameter)
+{
+	auto ctx = reinterpret_cast<replay_connection_context*>(lpThreadParameter);
+	try
+	{
+		file pipe(benchmark_connect(ctx->pipe_name));
+		vector<unsigned char> request;
+		vector<unsigned char, sanitizing_allocator<unsigned char>> response;
+		for (auto i : ctx->requests)
+		{
+			auto& r = (*ctx->records)[i];
+			if (r.payload.size() < sizeof(message))
+			{
+				++ctx->skipped;
+				continue;
+			}
+			auto code = reinterpret_cast<const message*>(r.payload.data())->code;
+			if (code == message_code::subscribe_peer_stats)
+			{
+				// Pushed statistics would interleave with responses.
+				++ctx->skipped;
+				continue;
+			}
+			if (ctx->speed > 0)
+			{
+				double due = (double)r.time / 1000.0 / ctx->speed - ctx->clock->elapsed();
+				if (due >= 1.0 && WaitForSingleObject(quit, (DWORD)due) != WAIT_TIMEOUT)
+					break;
+			}
+			request.assign(r.payload.cbegin(), r.payload.cend());
+			phase_trace trace;
+			try { benchmark_request(pipe, request, response); }
+			catch (const win_runtime_error&) { throw; }
+			catch (const runtime_error&) { ++ctx->errors; }
+			ctx->samples.push_back(make_pair(code, trace.elapsed()));
+			auto msg_section = reinterpret_cast<const message_config_section*>(response.data());
+			if (response.size() >= sizeof(message_config_section) && msg_section->code == message_code::tunnel_config_section)
+				CloseHandle((HANDLE)(ULONG_PTR)msg_section->section); // Release the section the manager shared.
+		}
+	}
+	catch (...)
+	{
+		ctx->error = current_exception();
+	}
+	return 0;
+}
+
+int replay(_In_z_ const wchar_t* trace_file_path, _In_ double speed)
+{
+	vector<request_trace::record> records;
+	request_trace::read(trace_file_path, records);
+	map<unsigned int, replay_connection_context> connections;
+	for (size_t i = 0; i < records.size(); ++i)
+		connections[records[i].connection].requests.push_back(i);
+
+	fake_backend::install(50, 100);
+	load_options();
+	wstring pipe_name = wstring_printf(L"\\\\.\\pipe\\eduWGManager$%s$Replay%u", client_id, GetCurrentProcessId());
+	thread manager_thread(CreateThread(NULL, 0, benchmark_manager, const_cast<wchar_t*>(pipe_name.c_str()), 0, NULL));
+	if (!manager_thread)
+		throw win_runtime_error("CreateThread failed");
+
+	phase_trace clock;
+	vector<thread> connection_threads;
+	for (auto& c : connections)
+	{
+		auto& ctx = c.second;
+		sort(ctx.requests.begin(), ctx.requests.end(), [&records](size_t a, size_t b) { return records[a].time < records[b].time; });
+		ctx.pipe_name = pipe_name.c_str();
+		ctx.records = &records;
+		ctx.speed = speed;
+		ctx.clock = &clock;
+		ctx.errors = ctx.skipped = 0;
+		connection_threads.emplace_back(CreateThread(NULL, 0, replay_connection, &ctx, 0, NULL));
+		if (!connection_threads.back())
+			throw win_runtime_error("CreateThread failed");
+	}
+	for (auto& t : connection_threads)
+		WaitForSingleObject(t, INFINITE);
+	double elapsed = clock.elapsed();
+	SetEvent(quit);
+	WaitForSingleObject(manager_thread, INFINITE);
+
+	size_t errors = 0, skipped = 0;
+	map<message_code, vector<double>> replayed, recorded;
+	for (auto& c : connections)
+	{
+		for (auto& s : c.second.samples)
+			replayed[s.first].push_back(s.second);
+		errors += c.second.errors;
+		skipped += c.second.skipped;
+	}
+	for (auto& r : records)
+		if (r.payload.size() >= sizeof(message))
+			recorded[reinterpret_cast<const message*>(r.payload.data())->code].push_back((double)r.latency / 1000.0);
+
+	string report = string_printf("records=%zu connections=%zu speed=%g errors=%zu skipped=%zu elapsed=%.3f\n", records.size(), connections.size(), speed, errors, skipped, elapsed);
+	for (auto& r : replayed)
+	{
+		auto& samples = r.second;
+		sort(samples.begin(), samples.end());
+		auto& before = recorded[r.first];
+		sort(before.begin(), before.end());
+		report += string_printf("code=%u count=%zu p50=%.3f p99=%.3f max=%.3f recorded_p50=%.3f recorded_p99=%.3f\n",
+			(unsigned int)r.first, samples.size(),
+			samples[samples.size() / 2], samples[samples.size() * 99 / 100], samples.back(),
+			before.empty() ? 0.0 : before[before.size() / 2], before.empty() ? 0.0 : before[before.size() * 99 / 100]);
+	}
+	int ret = 0;
+	for (auto& c : connections)
+	{
+		if (!c.second.error)
+			continue;
+		try { rethrow_exception(c.second.error); }
+		catch (const exception& e) { report += string_printf("connection=%u error=%s\n", c.first, e.what()); }
+		ret = 1;
+	}
+	print_report(report);
+	return ret;
+}
+
+int probe(_In_z_ const wchar_t* address, _In_ unsigned int count, _In_ DWORD interval)
+{
+	SOCKADDR_INET target;
+	if (!parse_probe_address(address, target))
+		throw invalid_argument("Invalid probe address");
+	WCHAR temp_path[MAX_PATH], path[MAX_PATH];
+	if (!GetTempPathW(_countof(temp_path), temp_path) || !GetTempFileNameW(temp_path, L"prb", 0, path))
+		throw win_runtime_error("Failed to get temporary file name");
+	probe_stats stats;
+	string report;
+	{
+		probe_window window(path, true);
+		SOCKADDR_INET source = {};
+		prober p(target, source, interval);
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			if (i && WaitForSingleObject(quit, p.interval()) != WAIT_TIMEOUT)
+				break;
+			DWORD rtt = p.probe();
+			window.add(rtt);
+			report += rtt == probe_window::lost ?
+				string_printf("probe=%u rtt=lost\n", i) :
+				string_printf("probe=%u rtt=%.3f\n", i, (double)rtt / 1000.0);
+		}
+		window.stats(stats);
+	}
+	DeleteFileW(path);
+	report += string_printf("samples=%u lost=%u rtt_min=%.3f rtt_avg=%.3f rtt_max=%.3f jitter=%.3f total_sent=%llu total_lost=%llu\n",
+		stats.samples, stats.lost,
+		(double)stats.rtt_min / 1000.0, (double)stats.rtt_avg / 1000.0, (double)stats.rtt_max / 1000.0, (double)stats.jitter / 1000.0,
+		stats.total_sent, stats.total_lost);
+
+	print_report(report);
+	return stats.lost < stats.samples ? 0 : 1;
+}
+
+int key_benchmark(_In_ unsigned int count)
+{
+	vector<BYTE, sanitizing_allocator<BYTE>> private_keys((size_t)count * WIREGUARD_KEY_LENGTH), keys(private_keys.size());
+	vector<BYTE> public_keys(private_keys.size());
+	NTSTATUS status = BCryptGenRandom(NULL, private_keys.data(), (ULONG)private_keys.size(), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+	if (!BCRYPT_SUCCESS(status))
+		throw win_runtime_error(RtlNtStatusToDosError(status), "BCryptGenRandom failed");
+	static const size_t encoded_len = 44;
+	vector<char, sanitizing_allocator<char>> encoded((size_t)count * encoded_len + 1);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		DWORD str_len = (DWORD)encoded_len + 1;
+		if (!CryptBinaryToStringA(&private_keys[(size_t)i * WIREGUARD_KEY_LENGTH], WIREGUARD_KEY_LENGTH, CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, &encoded[i * encoded_len], &str_len))
+			throw win_runtime_error("CryptBinaryToString failed");
+	}
+
+	phase_trace decode;
+	for (unsigned int i = 0; i < count; ++i)
+		decode_key(&encoded[i * encoded_len], encoded_len, &keys[(size_t)i * WIREGUARD_KEY_LENGTH]);
+	double decode_time = decode.elapsed();
+
+	phase_trace derive;
+	for (unsigned int i = 0; i < count; ++i)
+		x25519_base(&public_keys[(size_t)i * WIREGUARD_KEY_LENGTH], &keys[(size_t)i * WIREGUARD_KEY_LENGTH]);
+	double derive_time = derive.elapsed();
+
+	vector<BYTE> public_keys_batch(public_keys.size());
+	phase_trace derive_batch;
+	x25519_base_batch(count, public_keys_batch.data(), keys.data());
+	double derive_batch_time = derive_batch.elapsed();
+
+	phase_trace validate;
+	size_t first_invalid = validate_public_keys(count, public_keys.data());
+	double validate_time = validate.elapsed();
+
+	bool match = private_keys == keys && public_keys == public_keys_batch && first_invalid == count;
+	double n = (double)max(count, 1u) / 1000.0;
+	string report = string_printf("keys=%u decode=%.3f derive=%.3f derive_batch=%.3f validate=%.3f match=%s\n",
+		count, decode_time / n, derive_time / n, derive_batch_time / n, validate_time / n, match ? "yes" : "no");
+
+	print_report(report);
+	return match ? 0 : 1;
+}
+
+int history(_In_ unsigned int minutes, _In_ unsigned int step)
+{
+	WCHAR peer_history_file_path[MAX_PATH];
+	PathCombineW(peer_history_file_path, config_folder_path, L"stats.bin");
+	stats_ring ring(peer_history_file_path);
+	auto now = system_time();
+	vector<stats_ring::point> points;
+	ring.query(now - (ULONGLONG)minutes * 600000000, now + 1, (ULONGLONG)step * 10000000, points);
+
+	string report = "time,tunnel,peer,rx_bytes,tx_bytes,rx_rate,tx_rate,handshake_age\n";
+	for (size_t i = 0; i < points.size(); ++i)
+	{
+		auto& p = points[i];
+		FILETIME ft = { (DWORD)p.time, (DWORD)(p.time >> 32) };
+		SYSTEMTIME st_utc, st_local;
+		if (!FileTimeToSystemTime(&ft, &st_utc))
+			throw win_runtime_error("FileTimeToSystemTime failed");
+		if (!SystemTimeToTzSpecificLocalTime(NULL, &st_utc, &st_local))
+			throw win_runtime_error("SystemTimeToTzSpecificLocalTime failed");
+		report += string_printf("%04u-%02u-%02u %02u:%02u:%02u,%016llx,%016llx,%llu,%llu,",
+			st_local.wYear, st_local.wMonth, st_local.wDay, st_local.wHour, st_local.wMinute, st_local.wSecond,
+			_byteswap_uint64(p.tunnel), _byteswap_uint64(p.peer), p.rx_bytes, p.tx_bytes);
+
+		// Rates in bytes per second since the previous point of the peer. Counters restart with the tunnel.
+		auto prev = i ? &points[i - 1] : NULL;
+		if (prev && prev->tunnel == p.tunnel && prev->peer == p.peer && p.rx_bytes >= prev->rx_bytes && p.tx_bytes >= prev->tx_bytes)
+		{
+			double seconds = (double)(p.time - prev->time) / 10000000.0;
+			report += string_printf("%.0f,%.0f,", (double)(p.rx_bytes - prev->rx_bytes) / seconds, (double)(p.tx_bytes - prev->tx_bytes) / seconds);
+		}
+		else
+			report += ",,";
+		if (p.handshake_age != stats_ring::no_handshake)
+			report += string_printf("%u", p.handshake_age);
+		report += "\n";
+	}
+
+	print_report(report);
+	return 0;
+}
+
+int verify(_In_ unsigned int peers, _In_ unsigned int prefixes)
+{
+	string report;
+	bool success = check_compact_config(peers, prefixes, report);
+	success = check_aggregation(prefixes, report) && success;
+	success = check_lpm(prefixes, report) && success;
+	success = check_crypto(report) && success;
+	WSADATA wsa_data;
+	int wsa_err = WSAStartup(MAKEWORD(2, 2), &wsa_data);
+	if (wsa_err)
+		throw win_runtime_error(wsa_err, "WSAStartup failed");
+	try { success = check_handshake(report) && success; }
+	catch (const exception& e)
+	{
+		report += string_printf("handshake error=%s\n", e.what());
+		success = false;
+	}
+	WSACleanup();
+	print_report(report);
+	return success ? 0 : 1;
+}
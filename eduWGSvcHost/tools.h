@@ -0,0 +1,40 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <Windows.h>
+#include <string>
+
+// Command line tools of eduWGSvcHost.exe. Each returns the process exit code and prints its report to stdout.
+
+// Writes report to stdout, or console of the parent process when this GUI process has no stdout.
+void print_report(_In_ const std::string& report);
+
+// Drives the manager request path against the fake driver and SCM with concurrent clients. Prints latency percentiles. Activation is
+// reported cold, when it registers the tunnel service in the first round, and warm, when later rounds reuse the registration.
+int benchmark(_In_ unsigned int client_count, _In_ unsigned int rounds, _In_ unsigned int peers);
+
+// Replays request trace against the manager with the fake driver and SCM. Prints latency percentiles per request code next to the
+// ones recorded.
+int replay(_In_z_ const wchar_t* trace_file_path, _In_ double speed);
+
+// Runs the tunnel prober against an address outside of any tunnel, e.g. the loopback responder at 127.0.0.1 or ::1. Prints each
+// probe result and the window statistics the manager would report.
+int probe(_In_z_ const wchar_t* address, _In_ unsigned int count, _In_ DWORD interval);
+
+// Times key decoding, public key validation, and public key derivation one by one and batched on random keys. Prints microseconds
+// per key.
+int key_benchmark(_In_ unsigned int count);
+
+// Prints peer history of the last minutes downsampled to steps of seconds as CSV.
+int history(_In_ unsigned int minutes, _In_ unsigned int step);
+
+// Checks configuration transforms on random configurations of production size, crypto primitives against published test vectors,
+// and an endpoint race against a loopback responder. Prints results and timings of each check. Compact encoding spreads the prefixes
+// as allowed IPs among the peers.
+int verify(_In_ unsigned int peers, _In_ unsigned int prefixes);
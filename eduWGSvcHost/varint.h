@@ -0,0 +1,44 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include <stdexcept>
+#include <vector>
+
+namespace wg
+{
+	// Appends unsigned integer in LEB128 encoding.
+	template <class T, class _Alloc>
+	inline void varint_write(_Inout_ std::vector<unsigned char, _Alloc>& data, _In_ T value)
+	{
+		while (value >= 0x80)
+		{
+			data.push_back((unsigned char)(value | 0x80));
+			value >>= 7;
+		}
+		data.push_back((unsigned char)value);
+	}
+
+	// Reads unsigned integer in LEB128 encoding.
+	template <class T>
+	inline T varint_read(_Inout_ const unsigned char*& cursor, _In_ const unsigned char* end)
+	{
+		T value = 0;
+		for (unsigned int shift = 0; ; shift += 7)
+		{
+			if (cursor >= end)
+				throw std::invalid_argument("Incomplete varint");
+			if (shift >= sizeof(T) * 8)
+				throw std::invalid_argument("Varint overflow");
+			unsigned char b = *(cursor++);
+			value |= (T)(b & 0x7f) << shift;
+			if (!(b & 0x80))
+				return value;
+		}
+	}
+}
@@ -0,0 +1,89 @@
+/*
+	eduVPN - VPN for education and research
+
+	Copyright: 2022-2024 The Commons Conservancy
+	SPDX-License-Identifier: GPL-3.0+
+*/
+
+#pragma once
+
+#include "ifaceview.h"
+#include <utility>
+#include <vector>
+
+namespace wg
+{
+	// Detects peers whose handshake is overdue while traffic is being sent to them
+	class handshake_watchdog
+	{
+	private:
+		struct peer_state
+		{
+			BYTE public_key[WIREGUARD_KEY_LENGTH];
+			ULONGLONG tx_bytes;
+			ULONGLONG rx_bytes;
+			ULONGLONG recovery_started; // 0 when no recovery is in progress
+		};
+		std::vector<peer_state> m_peers;
+		ULONGLONG m_timeout;
+		ULONGLONG m_start;
+
+	public:
+		// timeout: Handshake age in 100ns intervals after which a peer sending traffic is considered stale
+		// start: Tunnel start time in 100ns intervals since 1601-01-01 UTC
+		handshake_watchdog(_In_ ULONGLONG timeout, _In_ ULONGLONG start) :
+			m_timeout(timeout),
+			m_start(start)
+		{}
+
+		// Compares configuration to the previous sample.
+		// stale receives index and peer that need a re-handshake; recovery of each is awaited for another timeout before retrying.
+		// recovered receives index of peers that completed a handshake after recovery, with recovery latency in milliseconds.
+		void sample(
+			_In_ const interface_view& config,
+			_In_ ULONGLONG now,
+			_Inout_ std::vector<std::pair<size_t, const WIREGUARD_PEER*>>& stale,
+			_Inout_ std::vector<std::pair<size_t, double>>& recovered)
+		{
+			stale.clear();
+			recovered.clear();
+			size_t i = 0;
+			for (auto p = config.begin(), p_end = config.end(); p != p_end; ++p, ++i)
+			{
+				auto peer = *p;
+				auto s = m_peers.begin();
+				while (s != m_peers.end() && memcmp(s->public_key, peer->PublicKey, WIREGUARD_KEY_LENGTH) != 0)
+					++s;
+				if (s == m_peers.end())
+				{
+					peer_state state;
+					memcpy(state.public_key, peer->PublicKey, WIREGUARD_KEY_LENGTH);
+					state.tx_bytes = peer->TxBytes;
+					state.rx_bytes = peer->RxBytes;
+					state.recovery_started = 0;
+					m_peers.push_back(state);
+					continue;
+				}
+
+				bool sending = peer->TxBytes > s->tx_bytes;
+				bool receiving = peer->RxBytes > s->rx_bytes;
+				s->tx_bytes = peer->TxBytes;
+				s->rx_bytes = peer->RxBytes;
+
+				if (s->recovery_started && peer->LastHandshake > s->recovery_started)
+				{
+					recovered.push_back(std::make_pair(i, (double)(peer->LastHandshake - s->recovery_started) / 10000.0));
+					s->recovery_started = 0;
+					continue;
+				}
+				ULONGLONG last = peer->LastHandshake ? peer->LastHandshake : m_start;
+				if (sending && !receiving && now > last + m_timeout &&
+					(!s->recovery_started || now > s->recovery_started + m_timeout))
+				{
+					stale.push_back(std::make_pair(i, &*peer));
+					s->recovery_started = now;
+				}
+			}
+		}
+	};
+}
@@ -17,5 +17,21 @@ namespace eduWireGuard.ManagerService
         DeactivateTunnel,
         GetTunnelConfig,
         TunnelConfig,
+        SubscribePeerStats,
+        PeerStats,
+        ActivateTunnels,
+        DeactivateTunnels,
+        UpdateTunnel,
+        GetTunnelConfigCompact,
+        TunnelConfigCompact,
+        LookupPeers,
+        PeerIndices,
+        Negotiate,
+        Capabilities,
+        TunnelConfigSection,
+        GetMetrics,
+        Metrics,
+        GetProbeStats,
+        ProbeStats,
     }
 }